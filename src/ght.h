@@ -23,6 +23,7 @@ typedef void* GhtTreePtr;
 typedef void* GhtNodeListPtr;
 typedef void* GhtNodePtr;
 typedef void* GhtAttributePtr;
+typedef void* GhtStreamWriterPtr;
 typedef GhtConfig* GhtConfigPtr;
 
 
@@ -41,6 +42,10 @@ void ght_set_handlers(GhtAllocator allocator, GhtReallocator reallocator,
                       GhtDeallocator deallocator, GhtMessageHandler error_handler,
                       GhtMessageHandler info_handler, GhtMessageHandler warn_handler);
 
+/** Replace the memory handlers only, must happen before anything is allocated */
+void ght_set_memory_handlers(GhtAllocator allocator, GhtReallocator reallocator,
+                             GhtDeallocator deallocator);
+
 /***********************************************************************
 *   NODE
 */
@@ -51,13 +56,28 @@ GhtErr ght_node_new_from_hash(const GhtHash *hash, GhtNodePtr *node);
 /** Create a new code from a coordinate */
 GhtErr ght_node_new_from_coordinate(const GhtCoordinate *coord, unsigned int resolution, GhtNodePtr *node);
 
+/** Create a new node from a coordinate hashed within a frame, which the tree it goes in must share */
+GhtErr ght_node_new_from_coordinate_frame(const GhtCoordinate *coord, const GhtArea *frame, unsigned int resolution, GhtNodePtr *node);
+
+/** Create a new node with z interleaved into the hash over the vertical range, for trees with the same frame and range; z must be the node's "Z" value, since Z filters prune by the hashed z */
+GhtErr ght_node_new_from_coordinate_3d(const GhtCoordinate *coord, double z, const GhtArea *frame, const GhtRange *vertical, unsigned int resolution, GhtNodePtr *node);
+
+/** Free a node, its attributes and its children */
+GhtErr ght_node_free(GhtNodePtr node);
+
 /** Get the coordinates represented by the node */
 GhtErr ght_node_get_coordinate(const GhtNodePtr node, GhtCoordinate *coord);
 
+/** Get the coordinates represented by the node within a frame */
+GhtErr ght_node_get_coordinate_frame(const GhtNodePtr node, const GhtArea *frame, GhtCoordinate *coord);
+
+/** Get the coordinates and z represented by a node with a 3D hash */
+GhtErr ght_node_get_coordinate_3d(const GhtNodePtr node, const GhtArea *frame, const GhtRange *vertical, GhtCoordinate *coord, double *z);
+
 /** Add a new attribute to the node */
 GhtErr ght_node_add_attribute(GhtNodePtr node, GhtAttributePtr attribute);
 
-/** Get the attribute list handing off the node */
+/** Copy the node attributes out into a new attribute list, free it with ght_attribute_free */
 GhtErr ght_node_get_attributes(const GhtNodePtr node, GhtAttributePtr *attr);
 
 // TODO get Z average
@@ -113,6 +133,15 @@ GhtErr ght_attribute_get_dimension(const GhtAttributePtr attr, const GhtDimensio
 /** Return the scaled and offset version of the packed attribute value */
 GhtErr ght_attribute_get_value(const GhtAttributePtr attr, double *val);
 
+/** Convert count packed storage values of one dimension into scaled and offset doubles */
+GhtErr ght_attribute_decode_values(const GhtDimensionPtr dim, const unsigned char *bytes, size_t count, double *vals);
+
+/** Convert count doubles into packed storage values of one dimension */
+GhtErr ght_attribute_encode_values(const GhtDimensionPtr dim, const double *vals, size_t count, unsigned char *bytes);
+
+/** Free an attribute and all linked siblings */
+GhtErr ght_attribute_free(GhtAttributePtr attr);
+
 /***********************************************************************
 *   DIMENSION
 */
@@ -129,6 +158,18 @@ GhtErr ght_dimension_get_type(const GhtDimensionPtr dim, GhtType *type);
 /** What's the index of this dimension? */
 GhtErr ght_dimension_get_index(const GhtDimensionPtr dim, int *index);
 
+/** Largest error allowed when compacting this dimension, 0 for exact compaction */
+GhtErr ght_dimension_set_tolerance(GhtDimensionPtr dim, double tolerance);
+
+/** What's the compaction tolerance of this dimension? */
+GhtErr ght_dimension_get_tolerance(const GhtDimensionPtr dim, double *tolerance);
+
+/** Pack an integer dimension into a bit width on disk, 0 for full width, before it joins a schema */
+GhtErr ght_dimension_set_bits(GhtDimensionPtr dim, int bits);
+
+/** What's the packed bit width of this dimension? 0 for full width */
+GhtErr ght_dimension_get_bits(const GhtDimensionPtr dim, int *bits);
+
 
 /***********************************************************************
 *   SCHEMA
@@ -158,6 +199,15 @@ GhtErr ght_schema_get_dimension_by_name(const GhtSchemaPtr schema, const char *n
 /** Free an existing schema */
 GhtErr ght_schema_free(GhtSchemaPtr schema);
 
+/** Shared, immutable schema for this XML document, parsed only on first sight */
+GhtErr ght_schema_registry_get_xml(const char *xml_str, GhtSchemaPtr *schema);
+
+/** Shared, immutable schema for this binary schema form, parsed only on first sight */
+GhtErr ght_schema_registry_get_binary(const unsigned char *bytes, size_t bytes_size, GhtSchemaPtr *schema);
+
+/** Free every registered schema, no references handed out may be used afterwards */
+GhtErr ght_schema_registry_clear(void);
+
 
 /***********************************************************************
 *   TREE
@@ -175,13 +225,19 @@ GhtErr ght_tree_free(GhtTreePtr tree);
 /** Add a GhtNode to a GhtTreePtr */
 GhtErr ght_tree_insert_node(GhtTreePtr tree, GhtNodePtr node);
 
+/** Join trees built from disjoint hash prefixes into one, taking over their nodes and freeing the parts */
+GhtErr ght_tree_join(const GhtSchemaPtr schema, GhtTreePtr *parts, int num_parts, GhtTreePtr *tree);
+
+/** Keep a bitmap on every node of which small integer values of the dimension occur below it, so equal and in filters skip subtrees */
+GhtErr ght_tree_build_presence(GhtTreePtr tree, const char *dimname);
+
 /** Write a GhtTree to memory or file */
 GhtErr ght_tree_write(const GhtTreePtr tree, GhtWriterPtr writer);
 
 /** Read the top level hash key off the GhtTreePtr */
 GhtErr ght_tree_get_hash(const GhtTreePtr tree, GhtHash **hash);
 
-/** Read the schema from the GhtTree */
+/** Read the schema from the GhtTree, an embedded schema is shared through the schema registry */
 GhtErr ght_tree_get_schema(const GhtTreePtr tree, GhtSchemaPtr *schema);
 
 /** Read the point cound from the GhtTree */
@@ -190,6 +246,18 @@ GhtErr ght_tree_get_numpoints(const GhtTreePtr tree, int *numpoints);
 /** Calculate the spatial extent of a GhtTree */
 GhtErr ght_tree_get_extent(const GhtTreePtr tree, GhtArea *area);
 
+/** Hash within this extent, in any coordinate system, instead of global longitude/latitude, before nodes go in */
+GhtErr ght_tree_set_frame(GhtTreePtr tree, const GhtArea *frame);
+
+/** Extent the tree's hashes subdivide */
+GhtErr ght_tree_get_frame(const GhtTreePtr tree, GhtArea *frame);
+
+/** Interleave z over this range into the hashes, so points stacked at one x/y get leaves of their own and Z filters prune; nodes must hash the z they store as "Z" */
+GhtErr ght_tree_set_vertical(GhtTreePtr tree, const GhtRange *vertical);
+
+/** Z range the tree's hashes subdivide, empty for 2D hashes */
+GhtErr ght_tree_get_vertical(const GhtTreePtr tree, GhtRange *vertical);
+
 /** Allocate new tree with only nodes that meet the filter condition */
 GhtErr ght_tree_filter_greater_than(const GhtTreePtr tree, const char *dimname, double value, GhtTreePtr *tree_filtered);
 
@@ -202,15 +270,27 @@ GhtErr ght_tree_filter_between(const GhtTreePtr tree, const char *dimname, doubl
 /** Allocate new tree with only nodes that meet the filter condition */
 GhtErr ght_tree_filter_equal(const GhtTreePtr tree, const char *dimname, double value, GhtTreePtr *tree_filtered);
 
+/** Allocate new tree with only nodes equal to one of the values, like a run of ght_tree_filter_equal */
+GhtErr ght_tree_filter_in(const GhtTreePtr tree, const char *dimname, const double *values, int num_values, GhtTreePtr *tree_filtered);
+
+/** Allocate new tree with only nodes that meet the filter, dim is a handle resolved once from the tree schema, value2 is only used by GHT_BETWEEN */
+GhtErr ght_tree_filter_by_dimension(const GhtTreePtr tree, const GhtDimensionPtr dim, GhtFilterMode mode, double value1, double value2, GhtTreePtr *tree_filtered);
+
 /** Compact all the attributes from 'Z' onwards */
 GhtErr ght_tree_compact_attributes(GhtTreePtr tree);
 
+/** Compact all the attributes from 'Z' onwards, filling in one stats entry per schema dimension */
+GhtErr ght_tree_compact_attributes_with_stats(GhtTreePtr tree, GhtCompactStats *stats);
+
 /** Write a GhtTree to memory or file */
 GhtErr ght_tree_write(const GhtTreePtr tree, GhtWriterPtr writer);
 
 /** Write a GhtTree to memory of file */
 GhtErr ght_tree_read(GhtReaderPtr reader, GhtTreePtr *tree);
 
+/** Read a GhtTree keeping only the attributes of dimensions in the mask (bit n for dimension index n) */
+GhtErr ght_tree_read_dimensions(GhtReaderPtr reader, uint64_t dimmask, GhtTreePtr *tree);
+
 /** Set up a tree configuration with defaults */
 GhtErr ght_config_init(GhtConfigPtr config);
 
@@ -223,6 +303,25 @@ GhtErr ght_tree_get_root(const GhtTreePtr tree, GhtNodePtr *root);
 // TODO Calculate Z average
 GhtErr ght_tree_calculate_z_average(const GhtTreePtr tree);
 
+/***********************************************************************
+*   STREAM WRITER
+*/
+
+/** Start writing a tree from nodes added in hash order, config may be NULL for defaults, compact as ght_tree_compact_attributes, GHT_FORMAT_GROUPED keeps memory use flat */
+GhtErr ght_stream_writer_new(const GhtSchemaPtr schema, const GhtConfigPtr config, int compact, GhtWriterPtr writer, GhtStreamWriterPtr *stream);
+
+/** Add a leaf node with a full hash, no earlier in hash order than the last, the stream takes over the node */
+GhtErr ght_stream_writer_add_node(GhtStreamWriterPtr stream, GhtNodePtr node);
+
+/** Write out everything still open, the same bytes ght_tree_write gives for a tree of the same nodes */
+GhtErr ght_stream_writer_finish(GhtStreamWriterPtr stream);
+
+/** How many points went into the stream? */
+GhtErr ght_stream_writer_get_numpoints(const GhtStreamWriterPtr stream, uint64_t *numpoints);
+
+/** Free the stream writer, the writer stays open */
+GhtErr ght_stream_writer_free(GhtStreamWriterPtr stream);
+
 /***********************************************************************
 *   WRITER
 */
@@ -248,10 +347,10 @@ GhtErr ght_writer_free(GhtWriterPtr writer);
 *   READER
 */
 
-/** Create a new file-based reader */
+/** Create a new file-based reader, schema may be NULL for files with an embedded schema */
 GhtErr ght_reader_new_file(const char *filename, const GhtSchemaPtr schema, GhtReaderPtr *reader);
 
-/** Create a new memory-based reader */
+/** Create a new memory-based reader, schema may be NULL for blobs with an embedded schema */
 GhtErr ght_reader_new_mem(const unsigned char *bytes_start, size_t bytes_size, const GhtSchemaPtr schema, GhtReaderPtr *reader);
 
 /** Close filehandle if necessary and free all memory along with reader */
@@ -262,6 +361,11 @@ GhtErr ght_reader_free(GhtReaderPtr reader);
 void ght_init(void);
 GhtErr ght_schema_from_xml_str(const char *xmlstr, GhtSchemaPtr *schema);
 
+/** Report through the message handlers set with ght_set_handlers */
+void ght_error(const char *fmt, ...);
+void ght_info(const char *fmt, ...);
+void ght_warn(const char *fmt, ...);
+
 
 
 
@@ -106,210 +106,153 @@ ght_attribute_get_by_dimension(const GhtAttribute *attr, const GhtDimension *dim
     return GHT_OK;
 }
 
-/** Convert a real value double into a value suitable for storage */
-static GhtErr
-ght_attribute_double_to_storage(const GhtDimension *dim, double *val)
+/*
+ * Batch conversion between packed storage values of one dimension and
+ * doubles. Each type gets its own kernel, so the type switch happens once
+ * per batch and the inner loops are simple enough for the compiler to
+ * vectorize. Scale and offset run as separate passes, and each pass is
+ * skipped when it is a no-op. That is the order and the set of
+ * operations the single-value path always used, so results are
+ * bit-for-bit the same.
+ */
+
+#define GHT_DECODE_KERNEL(fname, ctype) \
+static void fname(const uint8_t *bytes, size_t count, double *vals) \
+{ \
+    size_t i; \
+    for ( i = 0; i < count; i++ ) \
+    { \
+        ctype v; \
+        memcpy(&v, bytes + i * sizeof(ctype), sizeof(ctype)); \
+        vals[i] = v; \
+    } \
+}
+
+#define GHT_ENCODE_KERNEL(fname, ctype) \
+static void fname(const double *vals, size_t count, uint8_t *bytes) \
+{ \
+    size_t i; \
+    for ( i = 0; i < count; i++ ) \
+    { \
+        ctype v = vals[i]; \
+        memcpy(bytes + i * sizeof(ctype), &v, sizeof(ctype)); \
+    } \
+}
+
+GHT_DECODE_KERNEL(ght_decode_int8, int8_t)
+GHT_DECODE_KERNEL(ght_decode_uint8, uint8_t)
+GHT_DECODE_KERNEL(ght_decode_int16, int16_t)
+GHT_DECODE_KERNEL(ght_decode_uint16, uint16_t)
+GHT_DECODE_KERNEL(ght_decode_int32, int32_t)
+GHT_DECODE_KERNEL(ght_decode_uint32, uint32_t)
+GHT_DECODE_KERNEL(ght_decode_int64, int64_t)
+GHT_DECODE_KERNEL(ght_decode_uint64, uint64_t)
+GHT_DECODE_KERNEL(ght_decode_double, double)
+GHT_DECODE_KERNEL(ght_decode_float, float)
+
+GHT_ENCODE_KERNEL(ght_encode_int8, int8_t)
+GHT_ENCODE_KERNEL(ght_encode_uint8, uint8_t)
+GHT_ENCODE_KERNEL(ght_encode_int16, int16_t)
+GHT_ENCODE_KERNEL(ght_encode_uint16, uint16_t)
+GHT_ENCODE_KERNEL(ght_encode_int32, int32_t)
+GHT_ENCODE_KERNEL(ght_encode_uint32, uint32_t)
+GHT_ENCODE_KERNEL(ght_encode_int64, int64_t)
+GHT_ENCODE_KERNEL(ght_encode_uint64, uint64_t)
+GHT_ENCODE_KERNEL(ght_encode_double, double)
+GHT_ENCODE_KERNEL(ght_encode_float, float)
+
+typedef void (*GhtDecodeKernel)(const uint8_t *bytes, size_t count, double *vals);
+typedef void (*GhtEncodeKernel)(const double *vals, size_t count, uint8_t *bytes);
+
+/* Indexed by GhtType */
+static const GhtDecodeKernel GhtDecodeKernels[] = {
+    NULL, ght_decode_int8, ght_decode_uint8, ght_decode_int16,
+    ght_decode_uint16, ght_decode_int32, ght_decode_uint32, ght_decode_int64,
+    ght_decode_uint64, ght_decode_double, ght_decode_float };
+
+static const GhtEncodeKernel GhtEncodeKernels[] = {
+    NULL, ght_encode_int8, ght_encode_uint8, ght_encode_int16,
+    ght_encode_uint16, ght_encode_int32, ght_encode_uint32, ght_encode_int64,
+    ght_encode_uint64, ght_encode_double, ght_encode_float };
+
+GhtErr ght_attribute_decode_values(const GhtDimension *dim, const uint8_t *bytes, size_t count, double *vals)
 {
-    if ( dim->offset )
+    const GhtType type = dim->type;
+    const double scale = dim->scale;
+    const double offset = dim->offset;
+    size_t i;
+
+    if ( type <= GHT_UNKNOWN || type >= GHT_NUM_TYPES )
     {
-        *val -= dim->offset;
+        ght_error("%s: unknown attribute type %d", __func__, type);
+        return GHT_ERROR;
+    }
+
+    GhtDecodeKernels[type](bytes, count, vals);
+    if ( scale != 1 )
+    {
+        for ( i = 0; i < count; i++ )
+            vals[i] *= scale;
     }
-    if ( dim->scale != 1 )
+    if ( offset )
     {
-        *val /= dim->scale;
+        for ( i = 0; i < count; i++ )
+            vals[i] += offset;
     }
     return GHT_OK;
 }
 
-/** Convert a real value double into a value suitable for storage */
-static GhtErr
-ght_attribute_storage_to_double(const GhtDimension *dim, double *val)
+GhtErr ght_attribute_encode_values(const GhtDimension *dim, const double *vals, size_t count, uint8_t *bytes)
 {
-    if ( dim->scale != 1 )
+    const GhtType type = dim->type;
+    const double scale = dim->scale;
+    const double offset = dim->offset;
+    double buf[256];
+
+    if ( type <= GHT_UNKNOWN || type >= GHT_NUM_TYPES )
     {
-        *val *= dim->scale;
+        ght_error("%s: unknown attribute type %d", __func__, type);
+        return GHT_ERROR;
     }
-    if ( dim->offset )
+
+    if ( scale == 1 && ! offset )
     {
-        *val += dim->offset;
+        GhtEncodeKernels[type](vals, count, bytes);
+        return GHT_OK;
     }
-    return GHT_OK;
-}
 
-GhtErr ght_attribute_get_value(const GhtAttribute *attr, double *val)
-{
-    const GhtType type = attr->dim->type;
-    size_t size = GhtTypeSizes[type];
-    switch(type)
+    /* Transform a block at a time on the stack, the input is left alone */
+    while ( count )
     {
-        case GHT_UNKNOWN:
-        {
-            ght_error("%s: unknown attribute type", __func__);
-            return GHT_ERROR;
-        }
-        case GHT_INT8:
-        {
-            int8_t v;
-            memcpy(&v, attr->val, size);
-            *val = v;
-            break;
-        }
-        case GHT_UINT8:
-        {
-            uint8_t v;
-            memcpy(&v, attr->val, size);
-            *val = v;
-            break;
-        }
-        case GHT_INT16:
-        {
-            int16_t v;
-            memcpy(&v, attr->val, size);
-            *val = v;
-            break;
-        }
-        case GHT_UINT16:
-        {
-            uint16_t v;
-            memcpy(&v, attr->val, size);
-            *val = v;
-            break;
-        }
-        case GHT_INT32:
+        size_t i, n = count < 256 ? count : 256;
+        for ( i = 0; i < n; i++ )
+            buf[i] = vals[i];
+        if ( offset )
         {
-            int32_t v;
-            memcpy(&v, attr->val, size);
-            *val = v;
-            break;
+            for ( i = 0; i < n; i++ )
+                buf[i] -= offset;
         }
-        case GHT_UINT32:
+        if ( scale != 1 )
         {
-            uint32_t v;
-            memcpy(&v, attr->val, size);
-            *val = v;
-            break;
-        }
-        case GHT_INT64:
-        {
-            int64_t v;
-            memcpy(&v, attr->val, size);
-            *val = v;
-            break;
-        }
-        case GHT_UINT64:
-        {
-            uint64_t v;
-            memcpy(&v, attr->val, size);
-            *val = v;
-            break;
-        }
-        case GHT_DOUBLE:
-        {
-            double v;
-            memcpy(&v, attr->val, size);
-            *val = v;
-            break;
-        }
-        case GHT_FLOAT:
-        {
-            float v;
-            memcpy(&v, attr->val, size);
-            *val = v;
-            break;
-        }
-        default:
-        {
-            ght_error("%s: unknown attribute type %d", __func__, type);
-            return GHT_ERROR;
+            for ( i = 0; i < n; i++ )
+                buf[i] /= scale;
         }
+        GhtEncodeKernels[type](buf, n, bytes);
+        vals += n;
+        bytes += n * GhtTypeSizes[type];
+        count -= n;
     }
-    GHT_TRY(ght_attribute_storage_to_double(attr->dim, val));
-    return GHT_OK;    
+    return GHT_OK;
 }
 
+GhtErr ght_attribute_get_value(const GhtAttribute *attr, double *val)
+{
+    return ght_attribute_decode_values(attr->dim, (const uint8_t*)attr->val, 1, val);
+}
 
 GhtErr ght_attribute_set_value(GhtAttribute *attr, double val)
 {
-    const GhtType type = attr->dim->type;
-    size_t size = GhtTypeSizes[type];
-    double dv = val;
-    
-    GHT_TRY(ght_attribute_double_to_storage(attr->dim, &dv));
-    
-    switch(type)
-    {
-        case GHT_UNKNOWN:
-        {
-            ght_error("%s: unknown attribute type %d", __func__, type);
-            return GHT_ERROR;
-        }
-        case GHT_INT8:
-        {
-            int8_t v = dv;
-            memcpy(attr->val, &v, size);
-            return GHT_OK;
-        }
-        case GHT_UINT8:
-        {
-            uint8_t v = dv;
-            memcpy(attr->val, &v, size);
-            return GHT_OK;
-        }
-        case GHT_INT16:
-        {
-            int16_t v = dv;
-            memcpy(attr->val, &v, size);
-            return GHT_OK;
-        }
-        case GHT_UINT16:
-        {
-            uint16_t v = dv;
-            memcpy(attr->val, &v, size);
-            return GHT_OK;
-        }
-        case GHT_INT32:
-        {
-            int32_t v = dv;
-            memcpy(attr->val, &v, size);
-            return GHT_OK;
-        }
-        case GHT_UINT32:
-        {
-            uint32_t v = dv;
-            memcpy(attr->val, &v, size);
-            return GHT_OK;
-        }
-        case GHT_INT64:
-        {
-            int64_t v = dv;
-            memcpy(attr->val, &v, size);
-            return GHT_OK;
-        }
-        case GHT_UINT64:
-        {
-            uint64_t v = dv;
-            memcpy(attr->val, &v, size);
-            return GHT_OK;
-        }
-        case GHT_DOUBLE:
-        {
-            double v = dv;
-            memcpy(attr->val, &v, size);
-            return GHT_OK;
-        }
-        case GHT_FLOAT:
-        {
-            float v = dv;
-            memcpy(attr->val, &v, size);
-            return GHT_OK;
-        }
-        default:
-        {
-            ght_error("%s: unknown attribute type %d", __func__, type);
-            return GHT_ERROR;
-        }
-    }
-    return GHT_OK;
+    return ght_attribute_encode_values(attr->dim, &val, 1, (uint8_t*)attr->val);
 }
 
 GhtErr ght_attribute_to_string(const GhtAttribute *attr, stringbuffer_t *sb)
@@ -457,4 +400,645 @@ ght_attribute_union(GhtAttribute *attr1, GhtAttribute *attr2, GhtAttribute **att
         a2 = a2->next;
     }
     return GHT_OK;
-}
\ No newline at end of file
+}
+
+/******************************************************************************/
+/* GhtAttributeSet */
+
+/* Attribute count flag, a packed group follows the byte aligned attributes */
+#define GHT_ATTRIBUTES_PACKED 0x80
+
+/** Bytes of packed storage used by a set of dimensions */
+static size_t
+ght_attributeset_mask_size(const GhtSchema *schema, uint64_t mask)
+{
+    return        ght_popcount(mask & schema->sizemask[0])
+           + (ght_popcount(mask & schema->sizemask[1]) << 1)
+           + (ght_popcount(mask & schema->sizemask[2]) << 2)
+           + (ght_popcount(mask & schema->sizemask[3]) << 3);
+}
+
+/** Offset into the packed values of the dimension at a given position */
+static size_t
+ght_attributeset_offset(const GhtAttributeSet *set, int position)
+{
+    uint64_t below = set->mask & ((UINT64_C(1) << position) - 1);
+    return ght_attributeset_mask_size(set->schema, below);
+}
+
+GhtErr
+ght_attributeset_new(const GhtSchema *schema, uint64_t mask, GhtAttributeSet **set)
+{
+    GhtAttributeSet *s;
+    size_t size;
+
+    /* Nothing to hold, no set */
+    if ( ! mask )
+    {
+        *set = NULL;
+        return GHT_OK;
+    }
+    size = ght_attributeset_mask_size(schema, mask);
+    s = ght_malloc(sizeof(GhtAttributeSet) + size);
+    if ( ! s ) return GHT_ERROR;
+    memset(s->vals, 0, size);
+    s->schema = schema;
+    s->mask = mask;
+    s->size = size;
+    *set = s;
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_free(GhtAttributeSet *set)
+{
+    /* No-op on null */
+    if ( set )
+        ght_free(set);
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_clone(const GhtAttributeSet *set, GhtAttributeSet **set_out)
+{
+    size_t sz;
+    if ( ! set )
+    {
+        *set_out = NULL;
+        return GHT_OK;
+    }
+    sz = sizeof(GhtAttributeSet) + set->size;
+    *set_out = ght_malloc(sz);
+    if ( ! *set_out ) return GHT_ERROR;
+    memcpy(*set_out, set, sz);
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_get(const GhtAttributeSet *set, const GhtDimension *dim, GhtAttribute *found)
+{
+    if ( ! set ) return GHT_ERROR;
+    if ( ! (set->mask & (UINT64_C(1) << dim->position)) ) return GHT_ERROR;
+
+    memset(found, 0, sizeof(GhtAttribute));
+    found->dim = set->schema->dims[dim->position];
+    memcpy(found->val, set->vals + ght_attributeset_offset(set, dim->position), GhtTypeSizes[dim->type]);
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_get_bytes(const GhtAttributeSet *set, const GhtDimension *dim, const uint8_t **bytes)
+{
+    if ( ! set ) return GHT_ERROR;
+    if ( ! (set->mask & (UINT64_C(1) << dim->position)) ) return GHT_ERROR;
+    *bytes = set->vals + ght_attributeset_offset(set, dim->position);
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_set(GhtAttributeSet **set, const GhtDimension *dim, const void *val)
+{
+    GhtAttributeSet *s = *set;
+    const uint64_t bit = UINT64_C(1) << dim->position;
+    size_t valsize = GhtTypeSizes[dim->type];
+    size_t offset;
+
+    if ( ! dim->schema )
+    {
+        ght_error("%s: dimension '%s' is not part of a schema", __func__, dim->name);
+        return GHT_ERROR;
+    }
+    if ( dim->type == GHT_UNKNOWN )
+    {
+        ght_error("%s: dimension '%s' has no storage type", __func__, dim->name);
+        return GHT_ERROR;
+    }
+    if ( dim->bits )
+    {
+        uint64_t raw;
+        GHT_TRY(ght_attribute_to_bits(dim, val, &raw));
+    }
+
+    /* First value, allocate a set just big enough */
+    if ( ! s )
+    {
+        s = ght_malloc(sizeof(GhtAttributeSet) + valsize);
+        if ( ! s ) return GHT_ERROR;
+        s->schema = dim->schema;
+        s->mask = bit;
+        s->size = valsize;
+        memcpy(s->vals, val, valsize);
+        *set = s;
+        return GHT_OK;
+    }
+
+    offset = ght_attributeset_offset(s, dim->position);
+
+    /* Replace an existing value in place */
+    if ( s->mask & bit )
+    {
+        memcpy(s->vals + offset, val, valsize);
+        return GHT_OK;
+    }
+
+    /* Grow the set and open a gap for the new value */
+    s = ght_realloc(s, sizeof(GhtAttributeSet) + s->size + valsize);
+    if ( ! s ) return GHT_ERROR;
+    memmove(s->vals + offset + valsize, s->vals + offset, s->size - offset);
+    memcpy(s->vals + offset, val, valsize);
+    s->mask |= bit;
+    s->size += valsize;
+    *set = s;
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_delete(GhtAttributeSet **set, const GhtDimension *dim)
+{
+    GhtAttributeSet *s = *set;
+    const uint64_t bit = UINT64_C(1) << dim->position;
+    size_t valsize = GhtTypeSizes[dim->type];
+    size_t offset;
+
+    if ( ! s || ! (s->mask & bit) )
+        return GHT_ERROR;
+
+    /* Last value, the set goes away */
+    if ( s->mask == bit )
+    {
+        ght_free(s);
+        *set = NULL;
+        return GHT_OK;
+    }
+
+    /* Close the gap, the allocation is left as is */
+    offset = ght_attributeset_offset(s, dim->position);
+    memmove(s->vals + offset, s->vals + offset + valsize, s->size - offset - valsize);
+    s->mask &= ~bit;
+    s->size -= valsize;
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_union(const GhtAttributeSet *set1, const GhtAttributeSet *set2, GhtAttributeSet **set)
+{
+    const GhtSchema *schema;
+    GhtAttributeSet *s;
+    uint64_t mask;
+    size_t off1 = 0, off2 = 0, off = 0;
+    int i;
+
+    /* Only one side (or none), just copy it */
+    if ( ! set1 || ! set2 )
+        return ght_attributeset_clone(set1 ? set1 : set2, set);
+
+    schema = set1->schema;
+    mask = set1->mask | set2->mask;
+    s = ght_malloc(sizeof(GhtAttributeSet) + ght_attributeset_mask_size(schema, mask));
+    if ( ! s ) return GHT_ERROR;
+    s->schema = schema;
+    s->mask = mask;
+
+    /* Walk both sets in dimension order, merging the values */
+    for ( i = 0; i < GHT_MAX_DIMENSIONS && (mask >> i); i++ )
+    {
+        const uint64_t bit = UINT64_C(1) << i;
+        size_t valsize;
+
+        if ( ! (mask & bit) ) continue;
+        valsize = GhtTypeSizes[schema->dims[i]->type];
+
+        if ( set1->mask & bit )
+            memcpy(s->vals + off, set1->vals + off1, valsize);
+        else
+            memcpy(s->vals + off, set2->vals + off2, valsize);
+
+        if ( set1->mask & bit ) off1 += valsize;
+        if ( set2->mask & bit ) off2 += valsize;
+        off += valsize;
+    }
+    s->size = off;
+    *set = s;
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_to_attributes(const GhtAttributeSet *set, GhtAttribute **attr)
+{
+    GhtAttribute *head = NULL;
+    GhtAttribute **tail = &head;
+    size_t off = 0;
+    int i;
+
+    for ( i = 0; set && i < GHT_MAX_DIMENSIONS && (set->mask >> i); i++ )
+    {
+        const GhtDimension *dim = set->schema->dims[i];
+        GhtAttribute *a;
+
+        if ( ! (set->mask & (UINT64_C(1) << i)) ) continue;
+        GHT_TRY(ght_attribute_new_from_bytes(dim, (uint8_t*)(set->vals + off), &a));
+        off += GhtTypeSizes[dim->type];
+        *tail = a;
+        tail = &(a->next);
+    }
+    *attr = head;
+    return GHT_OK;
+}
+
+/*
+ * Dimensions with a bit width travel after the byte aligned ones as one
+ * group: a varint of which packed dimensions are present, counted in schema
+ * order, then their values back to back, least significant bit first and
+ * padded out to a byte. The attribute count byte carries
+ * GHT_ATTRIBUTES_PACKED when a group follows.
+ */
+static GhtErr
+ght_attributeset_write_packed(const GhtAttributeSet *set, GhtWriter *writer)
+{
+    const GhtSchema *schema = set->schema;
+    uint8_t buffer[GHT_MAX_DIMENSIONS * 8];
+    size_t bitpos = 0;
+    uint64_t present = 0;
+    int i, n = 0;
+
+    memset(buffer, 0, sizeof(buffer));
+    for ( i = 0; i < GHT_MAX_DIMENSIONS && (schema->packmask >> i); i++ )
+    {
+        const uint64_t bit = UINT64_C(1) << i;
+        if ( ! (schema->packmask & bit) ) continue;
+        if ( set->mask & bit )
+        {
+            const GhtDimension *dim = schema->dims[i];
+            uint64_t raw;
+            GHT_TRY(ght_attribute_to_bits(dim, set->vals + ght_attributeset_offset(set, i), &raw));
+            ght_bits_put(buffer, &bitpos, raw, dim->bits);
+            present |= UINT64_C(1) << n;
+        }
+        n++;
+    }
+    GHT_TRY(ght_write_varint(writer, present));
+    return ght_write(writer, buffer, (bitpos + 7) >> 3);
+}
+
+static GhtErr
+ght_attributeset_read_packed(GhtReader *reader, GhtAttributeSet **set)
+{
+    const GhtSchema *schema = reader->schema;
+    uint8_t buffer[GHT_MAX_DIMENSIONS * 8];
+    char val[GHT_ATTRIBUTE_MAX_SIZE];
+    size_t bitpos = 0, nbits = 0;
+    uint64_t present;
+    int i, n;
+
+    /* Size the group from the presence bits before reading it */
+    GHT_TRY(ght_read_varint(reader, &present));
+    for ( i = 0, n = 0; i < GHT_MAX_DIMENSIONS && (schema->packmask >> i); i++ )
+    {
+        if ( ! (schema->packmask & (UINT64_C(1) << i)) ) continue;
+        if ( present & (UINT64_C(1) << n) )
+            nbits += schema->dims[i]->bits;
+        n++;
+    }
+    if ( n < 64 && (present >> n) )
+    {
+        ght_error("%s: packed attributes for dimensions not in schema %p", __func__, schema);
+        return GHT_ERROR;
+    }
+    GHT_TRY(ght_read(reader, buffer, (nbits + 7) >> 3));
+
+    for ( i = 0, n = 0; i < GHT_MAX_DIMENSIONS && (schema->packmask >> i); i++ )
+    {
+        const uint64_t bit = UINT64_C(1) << i;
+        const GhtDimension *dim = schema->dims[i];
+        uint64_t raw;
+
+        if ( ! (schema->packmask & bit) ) continue;
+        if ( present & (UINT64_C(1) << n++) )
+        {
+            raw = ght_bits_get(buffer, &bitpos, dim->bits);
+            if ( ! (reader->dimmask & bit) ) continue;
+            GHT_TRY(ght_attribute_from_bits(dim, raw, val));
+            GHT_TRY(ght_attributeset_set(set, dim, val));
+        }
+    }
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_write(const GhtAttributeSet *set, GhtWriter *writer)
+{
+    uint8_t attrcount = 0;
+    uint8_t buffer[1 + GHT_MAX_DIMENSIONS * (1 + GHT_ATTRIBUTE_MAX_SIZE)];
+    uint8_t *ptr = buffer + 1;
+    size_t off = 0;
+    int i;
+
+    for ( i = 0; set && i < GHT_MAX_DIMENSIONS && (set->mask >> i); i++ )
+    {
+        size_t valsize;
+        if ( ! (set->mask & (UINT64_C(1) << i)) ) continue;
+        valsize = GhtTypeSizes[set->schema->dims[i]->type];
+
+        /* Dimension position number, then the value */
+        if ( ! (set->schema->packmask & (UINT64_C(1) << i)) )
+        {
+            *ptr++ = (uint8_t)i;
+            memcpy(ptr, set->vals + off, valsize);
+            ptr += valsize;
+            attrcount++;
+        }
+        off += valsize;
+    }
+    if ( set && (set->mask & set->schema->packmask) )
+        attrcount |= GHT_ATTRIBUTES_PACKED;
+    buffer[0] = attrcount;
+
+    GHT_TRY(ght_write(writer, buffer, ptr - buffer));
+    if ( attrcount & GHT_ATTRIBUTES_PACKED )
+        return ght_attributeset_write_packed(set, writer);
+    return GHT_OK;
+}
+
+static GhtErr
+ght_attributeset_read_values(GhtReader *reader, GhtAttributeSet **set)
+{
+    uint8_t attrcount, packed;
+    uint8_t dimnum;
+    char val[GHT_ATTRIBUTE_MAX_SIZE];
+    const GhtSchema *schema = reader->schema;
+
+    *set = NULL;
+    GHT_TRY(ght_read(reader, &attrcount, 1));
+    packed = attrcount & GHT_ATTRIBUTES_PACKED;
+    attrcount &= ~GHT_ATTRIBUTES_PACKED;
+    while ( attrcount-- )
+    {
+        const GhtDimension *dim;
+        GHT_TRY(ght_read(reader, &dimnum, 1));
+        if ( dimnum >= schema->num_dims )
+        {
+            ght_error("%s: attribute dimension %d does not exist in schema %p", __func__, dimnum, schema);
+            return GHT_ERROR;
+        }
+        dim = schema->dims[dimnum];
+        /* Not wanted, step over the value */
+        if ( ! (reader->dimmask & (UINT64_C(1) << dimnum)) )
+        {
+            GHT_TRY(ght_reader_skip(reader, GhtTypeSizes[dim->type]));
+            continue;
+        }
+        GHT_TRY(ght_read(reader, val, GhtTypeSizes[dim->type]));
+        GHT_TRY(ght_attributeset_set(set, dim, val));
+    }
+    if ( packed )
+        return ght_attributeset_read_packed(reader, set);
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_read(GhtReader *reader, GhtAttributeSet **set)
+{
+    /* Don't leave what was read so far behind on a bad record */
+    if ( ght_attributeset_read_values(reader, set) != GHT_OK )
+    {
+        ght_attributeset_free(*set);
+        *set = NULL;
+        return GHT_ERROR;
+    }
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_to_string(const GhtAttributeSet *set, stringbuffer_t *sb)
+{
+    GhtAttribute attr;
+    int i, first = 1;
+
+    for ( i = 0; set && i < GHT_MAX_DIMENSIONS && (set->mask >> i); i++ )
+    {
+        if ( ght_attributeset_get(set, set->schema->dims[i], &attr) != GHT_OK )
+            continue;
+        if ( ! first ) ght_stringbuffer_append(sb, ":");
+        GHT_TRY(ght_attribute_to_string(&attr, sb));
+        first = 0;
+    }
+    return GHT_OK;
+}
+
+/* Floats with magnitude past 2^53 do not convert to int64 exactly */
+#define GHT_QUANTIZE_LIMIT 9007199254740992.0
+
+GhtErr
+ght_attribute_quantize(const GhtDimension *dim, const void *val, uint64_t *q)
+{
+    switch(dim->type)
+    {
+        case GHT_INT8:   { int8_t v;   memcpy(&v, val, sizeof(v)); *q = (uint64_t)(int64_t)v; return GHT_OK; }
+        case GHT_UINT8:  { uint8_t v;  memcpy(&v, val, sizeof(v)); *q = v; return GHT_OK; }
+        case GHT_INT16:  { int16_t v;  memcpy(&v, val, sizeof(v)); *q = (uint64_t)(int64_t)v; return GHT_OK; }
+        case GHT_UINT16: { uint16_t v; memcpy(&v, val, sizeof(v)); *q = v; return GHT_OK; }
+        case GHT_INT32:  { int32_t v;  memcpy(&v, val, sizeof(v)); *q = (uint64_t)(int64_t)v; return GHT_OK; }
+        case GHT_UINT32: { uint32_t v; memcpy(&v, val, sizeof(v)); *q = v; return GHT_OK; }
+        case GHT_INT64:
+        case GHT_UINT64: { memcpy(q, val, sizeof(uint64_t)); return GHT_OK; }
+        case GHT_DOUBLE:
+        case GHT_FLOAT:
+        {
+            double v;
+            uint8_t check[GHT_ATTRIBUTE_MAX_SIZE];
+            if ( dim->type == GHT_DOUBLE )
+                memcpy(&v, val, sizeof(double));
+            else
+            {
+                float f;
+                memcpy(&f, val, sizeof(float));
+                v = f;
+            }
+            /* Only integral values survive the trip, NaN fails the range test */
+            if ( ! (v > -GHT_QUANTIZE_LIMIT && v < GHT_QUANTIZE_LIMIT) )
+                return GHT_ERROR;
+            *q = (uint64_t)(int64_t)v;
+            ght_attribute_dequantize(dim, *q, check);
+            if ( memcmp(check, val, GhtTypeSizes[dim->type]) != 0 )
+                return GHT_ERROR;
+            return GHT_OK;
+        }
+        default:
+            return GHT_ERROR;
+    }
+}
+
+GhtErr
+ght_attribute_dequantize(const GhtDimension *dim, uint64_t q, void *val)
+{
+    switch(dim->type)
+    {
+        case GHT_INT8:   { int8_t v = (int8_t)q;     memcpy(val, &v, sizeof(v)); return GHT_OK; }
+        case GHT_UINT8:  { uint8_t v = (uint8_t)q;   memcpy(val, &v, sizeof(v)); return GHT_OK; }
+        case GHT_INT16:  { int16_t v = (int16_t)q;   memcpy(val, &v, sizeof(v)); return GHT_OK; }
+        case GHT_UINT16: { uint16_t v = (uint16_t)q; memcpy(val, &v, sizeof(v)); return GHT_OK; }
+        case GHT_INT32:  { int32_t v = (int32_t)q;   memcpy(val, &v, sizeof(v)); return GHT_OK; }
+        case GHT_UINT32: { uint32_t v = (uint32_t)q; memcpy(val, &v, sizeof(v)); return GHT_OK; }
+        case GHT_INT64:
+        case GHT_UINT64: { memcpy(val, &q, sizeof(uint64_t)); return GHT_OK; }
+        case GHT_DOUBLE: { double v = (double)(int64_t)q; memcpy(val, &v, sizeof(v)); return GHT_OK; }
+        case GHT_FLOAT:  { float v = (float)(int64_t)q;   memcpy(val, &v, sizeof(v)); return GHT_OK; }
+        default:
+        {
+            ght_error("%s: unknown attribute type %d", __func__, dim->type);
+            return GHT_ERROR;
+        }
+    }
+}
+
+/** Two's complement storage, packed bits sign extend */
+static int
+ght_type_is_signed(GhtType type)
+{
+    return type == GHT_INT8 || type == GHT_INT16 || type == GHT_INT32 || type == GHT_INT64;
+}
+
+GhtErr
+ght_attribute_to_bits(const GhtDimension *dim, const void *val, uint64_t *raw)
+{
+    const int bits = dim->bits;
+    uint64_t q;
+
+    GHT_TRY(ght_attribute_quantize(dim, val, &q));
+    if ( ght_type_is_signed(dim->type) )
+    {
+        const int64_t v = (int64_t)q;
+        const int64_t limit = INT64_C(1) << (bits - 1);
+        if ( v < -limit || v >= limit )
+        {
+            ght_error("%s: stored value %lld does not fit the %d bits of dimension '%s'",
+                      __func__, (long long)v, bits, dim->name);
+            return GHT_ERROR;
+        }
+    }
+    else if ( q >> bits )
+    {
+        ght_error("%s: stored value %llu does not fit the %d bits of dimension '%s'",
+                  __func__, (unsigned long long)q, bits, dim->name);
+        return GHT_ERROR;
+    }
+    *raw = q & ((UINT64_C(1) << bits) - 1);
+    return GHT_OK;
+}
+
+GhtErr
+ght_attribute_from_bits(const GhtDimension *dim, uint64_t raw, void *val)
+{
+    const int bits = dim->bits;
+    if ( ght_type_is_signed(dim->type) && (raw >> (bits - 1)) )
+        raw |= ~((UINT64_C(1) << bits) - 1);
+    return ght_attribute_dequantize(dim, raw, val);
+}
+
+GhtErr
+ght_attributeset_write_residual(const GhtAttributeSet *set, uint64_t resmask,
+                                const uint64_t *base, GhtWriter *writer)
+{
+    uint8_t attrcount = set ? ght_popcount(set->mask & ~(set->schema->packmask)) : 0;
+    size_t off = 0;
+    int i;
+
+    if ( set && (set->mask & set->schema->packmask) )
+        attrcount |= GHT_ATTRIBUTES_PACKED;
+    GHT_TRY(ght_write(writer, &attrcount, 1));
+    for ( i = 0; set && i < GHT_MAX_DIMENSIONS && (set->mask >> i); i++ )
+    {
+        const uint64_t bit = UINT64_C(1) << i;
+        const GhtDimension *dim;
+        uint8_t position = (uint8_t)i;
+        size_t valsize;
+
+        if ( ! (set->mask & bit) ) continue;
+        dim = set->schema->dims[i];
+        valsize = GhtTypeSizes[dim->type];
+
+        /* Goes out in the packed group */
+        if ( set->schema->packmask & bit )
+        {
+            off += valsize;
+            continue;
+        }
+
+        GHT_TRY(ght_write(writer, &position, 1));
+        if ( resmask & bit )
+        {
+            uint64_t q;
+            GHT_TRY(ght_attribute_quantize(dim, set->vals + off, &q));
+            GHT_TRY(ght_write_varint(writer, ght_zigzag_encode(q - base[i])));
+        }
+        else
+        {
+            GHT_TRY(ght_write(writer, set->vals + off, valsize));
+        }
+        off += valsize;
+    }
+    if ( attrcount & GHT_ATTRIBUTES_PACKED )
+        return ght_attributeset_write_packed(set, writer);
+    return GHT_OK;
+}
+
+static GhtErr
+ght_attributeset_read_residual_values(GhtReader *reader, uint64_t resmask,
+                                      const uint64_t *base, GhtAttributeSet **set)
+{
+    uint8_t attrcount, packed;
+    uint8_t dimnum;
+    char val[GHT_ATTRIBUTE_MAX_SIZE];
+    const GhtSchema *schema = reader->schema;
+
+    *set = NULL;
+    GHT_TRY(ght_read(reader, &attrcount, 1));
+    packed = attrcount & GHT_ATTRIBUTES_PACKED;
+    attrcount &= ~GHT_ATTRIBUTES_PACKED;
+    while ( attrcount-- )
+    {
+        const GhtDimension *dim;
+        GHT_TRY(ght_read(reader, &dimnum, 1));
+        if ( dimnum >= schema->num_dims )
+        {
+            ght_error("%s: attribute dimension %d does not exist in schema %p", __func__, dimnum, schema);
+            return GHT_ERROR;
+        }
+        dim = schema->dims[dimnum];
+        if ( resmask & (UINT64_C(1) << dimnum) )
+        {
+            uint64_t r;
+            GHT_TRY(ght_read_varint(reader, &r));
+            if ( ! (reader->dimmask & (UINT64_C(1) << dimnum)) )
+                continue;
+            GHT_TRY(ght_attribute_dequantize(dim, base[dimnum] + ght_zigzag_decode(r), val));
+        }
+        else
+        {
+            /* Not wanted, step over the value */
+            if ( ! (reader->dimmask & (UINT64_C(1) << dimnum)) )
+            {
+                GHT_TRY(ght_reader_skip(reader, GhtTypeSizes[dim->type]));
+                continue;
+            }
+            GHT_TRY(ght_read(reader, val, GhtTypeSizes[dim->type]));
+        }
+        GHT_TRY(ght_attributeset_set(set, dim, val));
+    }
+    if ( packed )
+        return ght_attributeset_read_packed(reader, set);
+    return GHT_OK;
+}
+
+GhtErr
+ght_attributeset_read_residual(GhtReader *reader, uint64_t resmask,
+                               const uint64_t *base, GhtAttributeSet **set)
+{
+    if ( ght_attributeset_read_residual_values(reader, resmask, base, set) != GHT_OK )
+    {
+        ght_attributeset_free(*set);
+        *set = NULL;
+        return GHT_ERROR;
+    }
+    return GHT_OK;
+}
@@ -0,0 +1,670 @@
+/******************************************************************************
+*  LibGHT, software to manage point clouds.
+*  LibGHT is free and open source software provided by the Government of Canada
+*  Copyright (c) 2012 Natural Resources Canada
+*
+*  Nouri Sabo <nsabo@NRCan.gc.ca>, Natural Resources Canada
+*  Paul Ramsey <pramsey@opengeo.org>, OpenGeo
+*
+******************************************************************************/
+
+/*
+ * Columnar node tree layout. Instead of interleaving everything per node,
+ * the pre-order walk of the tree is split into streams:
+ *
+ *   varint  number of nodes
+ *   stream  topology, varint child count per node
+ *   stream  hashes, length byte and characters per node
+ *   stream  flags, one byte per node
+ *   stream  masks, varint attribute presence mask per node
+ *   uint8   number of dimension columns, then for each column
+ *     uint8   dimension position
+ *     uint8   column encoding (GHT_COLUMN_*)
+ *     stream  values of the nodes that carry the dimension, in node order
+ *
+ * Every stream is prefixed with its varint byte length, so a reader can
+ * pass over a column without decoding it.
+ *
+ * A column with few distinct values may be dictionary encoded instead: a
+ * varint table size, the distinct storage values, then one code per node
+ * packed into just enough bits to index the table. The writer picks it
+ * whenever it comes out smaller than the plain encoding.
+ */
+
+#include "ght_internal.h"
+
+/* Column encodings */
+#define GHT_COLUMN_RAW    0  /* fixed width storage values */
+#define GHT_COLUMN_DELTA  1  /* zig-zag varint difference from the previous value */
+#define GHT_COLUMN_BITS   2  /* dimension bit width per value, least significant bit first */
+#define GHT_COLUMN_DICT   3  /* value table, then packed codes into it */
+
+#define GHT_DICT_MAX   256  /* distinct values a dictionary column can hold */
+#define GHT_DICT_SLOTS 512  /* open addressed lookup, twice GHT_DICT_MAX */
+
+typedef struct
+{
+    int size;               /* distinct values, past GHT_DICT_MAX once given up */
+    uint64_t count;         /* values in the column */
+    uint64_t values[GHT_DICT_MAX];
+    uint16_t slots[GHT_DICT_SLOTS]; /* code + 1, 0 is empty */
+    GhtWriter *codes;       /* one byte code per value */
+} GhtColumnDict;
+
+typedef struct
+{
+    const GhtSchema *schema;
+    uint64_t deltamask;
+    uint64_t colmask;
+    uint64_t num_nodes;
+    GhtWriter *topology;
+    GhtWriter *hashes;
+    GhtWriter *flags;
+    GhtWriter *masks;
+    GhtWriter *columns[GHT_MAX_DIMENSIONS];
+    uint64_t prev[GHT_MAX_DIMENSIONS];
+    uint16_t pending[GHT_MAX_DIMENSIONS]; /* bits not yet a whole byte, packed columns */
+    uint8_t npending[GHT_MAX_DIMENSIONS];
+    GhtColumnDict *dicts[GHT_MAX_DIMENSIONS];
+} GhtColumnWriter;
+
+typedef struct
+{
+    uint8_t *bytes;
+    GhtReader *reader;
+} GhtColumnStream;
+
+typedef struct
+{
+    const GhtSchema *schema;
+    uint64_t dimmask;
+    uint64_t num_nodes;
+    uint64_t next;
+    uint64_t colmask;  /* columns read into memory */
+    uint64_t seenmask; /* columns met in the input, read or skipped */
+    uint32_t *childcounts;
+    uint64_t *masks;
+    uint8_t *flags;
+    GhtColumnStream hashes;
+    uint8_t *columns[GHT_MAX_DIMENSIONS];
+    size_t cursors[GHT_MAX_DIMENSIONS];
+} GhtColumnReader;
+
+
+/** Add a value to a packed column, whole bytes go out as they fill */
+static GhtErr
+ght_columnar_put_bits(GhtColumnWriter *cw, int i, uint64_t raw, int nbits)
+{
+    while ( nbits > 0 )
+    {
+        int take = nbits < 8 ? nbits : 8;
+        cw->pending[i] |= (uint16_t)((raw & ((1u << take) - 1)) << cw->npending[i]);
+        cw->npending[i] += take;
+        raw >>= take;
+        nbits -= take;
+        if ( cw->npending[i] >= 8 )
+        {
+            uint8_t byte = cw->pending[i] & 0xFF;
+            GHT_TRY(ght_write(cw->columns[i], &byte, 1));
+            cw->pending[i] >>= 8;
+            cw->npending[i] -= 8;
+        }
+    }
+    return GHT_OK;
+}
+
+/** Copy a memory writer into the output with its length in front */
+static GhtErr
+ght_columnar_write_stream(GhtWriter *writer, GhtWriter *stream)
+{
+    size_t size;
+    GHT_TRY(ght_writer_get_size(stream, &size));
+    GHT_TRY(ght_write_varint(writer, size));
+    if ( size )
+        GHT_TRY(ght_write(writer, bytebuffer_getbytes(stream->bytebuffer), size));
+    return GHT_OK;
+}
+
+/** Bits needed for codes into a table of this size */
+static int
+ght_columnar_code_bits(int size)
+{
+    int bits = 0;
+    while ( (1 << bits) < size )
+        bits++;
+    return bits;
+}
+
+/** Track the dictionary code of the value, giving up past GHT_DICT_MAX distinct values */
+static GhtErr
+ght_columnar_dict_add(GhtColumnDict *d, const uint8_t *val, size_t valsize)
+{
+    uint64_t key = 0;
+    unsigned int slot;
+    uint8_t code;
+
+    if ( d->size > GHT_DICT_MAX )
+        return GHT_OK;
+
+    memcpy(&key, val, valsize);
+    slot = (unsigned int)((key * UINT64_C(0x9E3779B97F4A7C15)) >> 55);
+    while ( d->slots[slot] && d->values[d->slots[slot] - 1] != key )
+        slot = (slot + 1) & (GHT_DICT_SLOTS - 1);
+
+    if ( ! d->slots[slot] )
+    {
+        if ( d->size == GHT_DICT_MAX )
+        {
+            d->size++;
+            return GHT_OK;
+        }
+        d->values[d->size] = key;
+        d->slots[slot] = ++(d->size);
+    }
+    code = d->slots[slot] - 1;
+    d->count++;
+    return ght_write(d->codes, &code, 1);
+}
+
+/** Write the column as a dictionary, if that beats its plain encoding */
+static GhtErr
+ght_columnar_write_dict(GhtColumnWriter *cw, int i, GhtWriter *writer, int *written)
+{
+    const GhtColumnDict *d = cw->dicts[i];
+    size_t valsize = GhtTypeSizes[cw->schema->dims[i]->type];
+    size_t plainsize, dictsize, codebytes;
+    const uint8_t *codes;
+    uint8_t *packed;
+    uint8_t position = i, encoding = GHT_COLUMN_DICT;
+    GhtWriter *stream;
+    size_t bitpos = 0;
+    uint64_t n;
+    int k, nbits;
+    GhtErr err = GHT_OK;
+
+    *written = 0;
+    if ( ! d || d->size > GHT_DICT_MAX )
+        return GHT_OK;
+
+    nbits = ght_columnar_code_bits(d->size);
+    codebytes = (d->count * nbits + 7) >> 3;
+    dictsize = 2 + d->size * valsize + codebytes;
+    GHT_TRY(ght_writer_get_size(cw->columns[i], &plainsize));
+    if ( dictsize >= plainsize )
+        return GHT_OK;
+
+    GHT_TRY(ght_writer_new_mem(&stream));
+    packed = ght_malloc(codebytes + 1);
+    memset(packed, 0, codebytes + 1);
+    codes = bytebuffer_getbytes(d->codes->bytebuffer);
+    for ( n = 0; n < d->count; n++ )
+        ght_bits_put(packed, &bitpos, codes[n], nbits);
+
+    err = ght_write_varint(stream, d->size);
+    for ( k = 0; k < d->size && err == GHT_OK; k++ )
+        err = ght_write(stream, &(d->values[k]), valsize);
+    if ( err == GHT_OK && codebytes )
+        err = ght_write(stream, packed, codebytes);
+    if ( err == GHT_OK ) err = ght_write(writer, &position, 1);
+    if ( err == GHT_OK ) err = ght_write(writer, &encoding, 1);
+    if ( err == GHT_OK ) err = ght_columnar_write_stream(writer, stream);
+
+    ght_free(packed);
+    ght_writer_free(stream);
+    *written = 1;
+    return err;
+}
+
+static GhtErr
+ght_columnar_collect(GhtColumnWriter *cw, const GhtNode *node)
+{
+    int i;
+    uint64_t mask = node->attributes ? node->attributes->mask : 0;
+    int childcount = node->children ? node->children->num_nodes : 0;
+    size_t off = 0;
+
+    cw->num_nodes++;
+    GHT_TRY(ght_write_varint(cw->topology, childcount));
+    GHT_TRY(ght_hash_write(node->hash, cw->hashes));
+    GHT_TRY(ght_write(cw->flags, &(node->ghtFlag), 1));
+    GHT_TRY(ght_write_varint(cw->masks, mask));
+
+    for ( i = 0; i < GHT_MAX_DIMENSIONS && (mask >> i); i++ )
+    {
+        const uint64_t bit = UINT64_C(1) << i;
+        const GhtDimension *dim;
+        size_t valsize;
+
+        if ( ! (mask & bit) ) continue;
+        dim = cw->schema->dims[i];
+        valsize = GhtTypeSizes[dim->type];
+
+        if ( ! cw->columns[i] )
+        {
+            GHT_TRY(ght_writer_new_mem(&(cw->columns[i])));
+            cw->colmask |= bit;
+            if ( ! dim->bits )
+            {
+                cw->dicts[i] = ght_malloc(sizeof(GhtColumnDict));
+                memset(cw->dicts[i], 0, sizeof(GhtColumnDict));
+                GHT_TRY(ght_writer_new_mem(&(cw->dicts[i]->codes)));
+            }
+        }
+        if ( cw->dicts[i] )
+            GHT_TRY(ght_columnar_dict_add(cw->dicts[i], (uint8_t*)node->attributes->vals + off, valsize));
+
+        if ( dim->bits )
+        {
+            uint64_t raw;
+            GHT_TRY(ght_attribute_to_bits(dim, node->attributes->vals + off, &raw));
+            GHT_TRY(ght_columnar_put_bits(cw, i, raw, dim->bits));
+        }
+        else if ( cw->deltamask & bit )
+        {
+            uint64_t q;
+            GHT_TRY(ght_attribute_quantize(dim, node->attributes->vals + off, &q));
+            GHT_TRY(ght_write_varint(cw->columns[i], ght_zigzag_encode(q - cw->prev[i])));
+            cw->prev[i] = q;
+        }
+        else
+        {
+            GHT_TRY(ght_write(cw->columns[i], node->attributes->vals + off, valsize));
+        }
+        off += valsize;
+    }
+
+    for ( i = 0; i < childcount; i++ )
+    {
+        GHT_TRY(ght_columnar_collect(cw, node->children->nodes[i]));
+    }
+    return GHT_OK;
+}
+
+static GhtErr
+ght_columnar_write(GhtColumnWriter *cw, const GhtNode *node, GhtWriter *writer)
+{
+    int i;
+    uint8_t numcols;
+
+    GHT_TRY(ght_columnar_collect(cw, node));
+
+    GHT_TRY(ght_write_varint(writer, cw->num_nodes));
+    GHT_TRY(ght_columnar_write_stream(writer, cw->topology));
+    GHT_TRY(ght_columnar_write_stream(writer, cw->hashes));
+    GHT_TRY(ght_columnar_write_stream(writer, cw->flags));
+    GHT_TRY(ght_columnar_write_stream(writer, cw->masks));
+
+    numcols = ght_popcount(cw->colmask);
+    GHT_TRY(ght_write(writer, &numcols, 1));
+    for ( i = 0; i < GHT_MAX_DIMENSIONS && (cw->colmask >> i); i++ )
+    {
+        uint8_t position = i;
+        uint8_t encoding;
+        int written;
+
+        if ( ! cw->columns[i] ) continue;
+        GHT_TRY(ght_columnar_write_dict(cw, i, writer, &written));
+        if ( written ) continue;
+        if ( cw->schema->packmask & (UINT64_C(1) << i) )
+        {
+            /* Pad out the last partial byte */
+            encoding = GHT_COLUMN_BITS;
+            if ( cw->npending[i] )
+            {
+                uint8_t byte = cw->pending[i] & 0xFF;
+                GHT_TRY(ght_write(cw->columns[i], &byte, 1));
+            }
+        }
+        else
+        {
+            encoding = (cw->deltamask & (UINT64_C(1) << i)) ? GHT_COLUMN_DELTA : GHT_COLUMN_RAW;
+        }
+        GHT_TRY(ght_write(writer, &position, 1));
+        GHT_TRY(ght_write(writer, &encoding, 1));
+        GHT_TRY(ght_columnar_write_stream(writer, cw->columns[i]));
+    }
+    return GHT_OK;
+}
+
+GhtErr
+ght_node_write_columnar(const GhtNode *node, const GhtSchema *schema, uint8_t format, GhtWriter *writer)
+{
+    int i;
+    GhtErr err;
+    GhtColumnWriter cw;
+
+    memset(&cw, 0, sizeof(GhtColumnWriter));
+    cw.schema = schema;
+
+    /* Residual option, delta code the columns that quantize */
+    if ( format & GHT_FORMAT_RESIDUAL )
+        GHT_TRY(ght_node_get_residual_mask(node, schema, &(cw.deltamask)));
+
+    GHT_TRY(ght_writer_new_mem(&(cw.topology)));
+    GHT_TRY(ght_writer_new_mem(&(cw.hashes)));
+    GHT_TRY(ght_writer_new_mem(&(cw.flags)));
+    GHT_TRY(ght_writer_new_mem(&(cw.masks)));
+
+    err = ght_columnar_write(&cw, node, writer);
+
+    ght_writer_free(cw.topology);
+    ght_writer_free(cw.hashes);
+    ght_writer_free(cw.flags);
+    ght_writer_free(cw.masks);
+    for ( i = 0; i < GHT_MAX_DIMENSIONS; i++ )
+    {
+        if ( cw.columns[i] )
+            ght_writer_free(cw.columns[i]);
+        if ( cw.dicts[i] )
+        {
+            ght_writer_free(cw.dicts[i]->codes);
+            ght_free(cw.dicts[i]);
+        }
+    }
+    return err;
+}
+
+/** Pull a length-prefixed stream into memory and open a reader on it */
+static GhtErr
+ght_columnar_read_stream(GhtReader *reader, GhtColumnStream *stream)
+{
+    uint64_t size;
+    size_t remaining;
+    GHT_TRY(ght_read_varint(reader, &size));
+    GHT_TRY(ght_reader_remaining(reader, &remaining));
+    if ( size > remaining )
+    {
+        ght_error("%s: stream of %llu bytes runs past the end of the input", __func__, (unsigned long long)size);
+        return GHT_ERROR;
+    }
+    stream->bytes = ght_malloc(size ? size : 1);
+    if ( ! stream->bytes ) return GHT_ERROR;
+    GHT_TRY(ght_read(reader, stream->bytes, size));
+    return ght_reader_new_mem(stream->bytes, size, reader->schema, &(stream->reader));
+}
+
+static void
+ght_columnar_stream_free(GhtColumnStream *stream)
+{
+    if ( stream->reader ) ght_reader_free(stream->reader);
+    if ( stream->bytes ) ght_free(stream->bytes);
+    stream->reader = NULL;
+    stream->bytes = NULL;
+}
+
+static GhtErr
+ght_columnar_read_column(GhtColumnReader *cr, GhtReader *reader)
+{
+    uint8_t position, encoding;
+    uint64_t i, count = 0;
+    uint64_t bit, prev = 0;
+    const GhtDimension *dim;
+    size_t valsize;
+    uint8_t *ptr;
+    GhtColumnStream stream = { NULL, NULL };
+    GhtErr err = GHT_OK;
+
+    GHT_TRY(ght_read(reader, &position, 1));
+    GHT_TRY(ght_read(reader, &encoding, 1));
+    if ( position >= cr->schema->num_dims || encoding > GHT_COLUMN_DICT ||
+         (encoding == GHT_COLUMN_BITS) != ((cr->schema->packmask >> position) & 1) )
+    {
+        ght_error("%s: invalid column for dimension %d, encoding %d", __func__, position, encoding);
+        return GHT_ERROR;
+    }
+    dim = cr->schema->dims[position];
+    valsize = GhtTypeSizes[dim->type];
+    bit = UINT64_C(1) << position;
+    if ( cr->seenmask & bit )
+    {
+        ght_error("%s: more than one column for dimension %d", __func__, position);
+        return GHT_ERROR;
+    }
+    cr->seenmask |= bit;
+
+    /* Not wanted, step over the whole column */
+    if ( ! (cr->dimmask & bit) )
+    {
+        uint64_t size;
+        GHT_TRY(ght_read_varint(reader, &size));
+        return ght_reader_skip(reader, size);
+    }
+
+    /* One value for every node that carries the dimension */
+    for ( i = 0; i < cr->num_nodes; i++ )
+    {
+        if ( cr->masks[i] & bit ) count++;
+    }
+
+    GHT_TRY(ght_columnar_read_stream(reader, &stream));
+    ptr = cr->columns[position] = ght_malloc(count * valsize + 1);
+    cr->colmask |= bit;
+
+    if ( encoding == GHT_COLUMN_RAW )
+    {
+        err = ght_read(stream.reader, ptr, count * valsize);
+    }
+    else if ( encoding == GHT_COLUMN_BITS )
+    {
+        size_t bitpos = 0, nbytes = (count * dim->bits + 7) >> 3;
+        uint8_t *packed = ght_malloc(nbytes + 1);
+        err = ght_read(stream.reader, packed, nbytes);
+        for ( i = 0; i < count && err == GHT_OK; i++ )
+        {
+            err = ght_attribute_from_bits(dim, ght_bits_get(packed, &bitpos, dim->bits), ptr);
+            ptr += valsize;
+        }
+        ght_free(packed);
+    }
+    else if ( encoding == GHT_COLUMN_DICT )
+    {
+        uint64_t size;
+        uint8_t *table = NULL, *packed = NULL;
+        size_t bitpos = 0, nbytes = 0;
+        int nbits = 0;
+
+        err = ght_read_varint(stream.reader, &size);
+        if ( err == GHT_OK && (size < 1 || size > GHT_DICT_MAX) )
+        {
+            ght_error("%s: invalid dictionary size %llu", __func__, (unsigned long long)size);
+            err = GHT_ERROR;
+        }
+        if ( err == GHT_OK )
+        {
+            nbits = ght_columnar_code_bits((int)size);
+            nbytes = (count * nbits + 7) >> 3;
+            table = ght_malloc(size * valsize);
+            packed = ght_malloc(nbytes + 1);
+            err = ght_read(stream.reader, table, size * valsize);
+        }
+        if ( err == GHT_OK && nbytes )
+            err = ght_read(stream.reader, packed, nbytes);
+        for ( i = 0; i < count && err == GHT_OK; i++ )
+        {
+            uint64_t code = nbits ? ght_bits_get(packed, &bitpos, nbits) : 0;
+            if ( code >= size )
+            {
+                ght_error("%s: dictionary code %llu out of range", __func__, (unsigned long long)code);
+                err = GHT_ERROR;
+                break;
+            }
+            memcpy(ptr, table + code * valsize, valsize);
+            ptr += valsize;
+        }
+        if ( table ) ght_free(table);
+        if ( packed ) ght_free(packed);
+    }
+    else
+    {
+        for ( i = 0; i < count && err == GHT_OK; i++ )
+        {
+            uint64_t r;
+            err = ght_read_varint(stream.reader, &r);
+            if ( err != GHT_OK ) break;
+            prev += ght_zigzag_decode(r);
+            err = ght_attribute_dequantize(dim, prev, ptr);
+            ptr += valsize;
+        }
+    }
+    ght_columnar_stream_free(&stream);
+    return err;
+}
+
+static GhtErr
+ght_columnar_build(GhtColumnReader *cr, GhtNode **node)
+{
+    int i;
+    uint32_t c;
+    uint64_t n = cr->next++;
+    uint64_t mask;
+    GhtHash *hash = NULL;
+    GhtNode *nd;
+    size_t off = 0;
+
+    if ( n >= cr->num_nodes )
+    {
+        ght_error("%s: topology refers to more than %llu nodes", __func__, (unsigned long long)cr->num_nodes);
+        return GHT_ERROR;
+    }
+
+    GHT_TRY(ght_hash_read(cr->hashes.reader, &hash));
+    if ( hash )
+    {
+        GhtErr err = ght_node_new_from_hash(hash, &nd);
+        ght_free(hash);
+        GHT_TRY(err);
+    }
+    else
+    {
+        GHT_TRY(ght_node_new(&nd));
+    }
+    *node = nd;
+    nd->ghtFlag = cr->flags[n];
+
+    /* Values come off the front of each column in node order */
+    mask = cr->masks[n] & cr->dimmask;
+    if ( mask & ~(cr->colmask) )
+    {
+        ght_error("%s: node %llu has attributes with no column", __func__, (unsigned long long)n);
+        return GHT_ERROR;
+    }
+    GHT_TRY(ght_attributeset_new(cr->schema, mask, &(nd->attributes)));
+    for ( i = 0; i < GHT_MAX_DIMENSIONS && (mask >> i); i++ )
+    {
+        size_t valsize;
+        if ( ! (mask & (UINT64_C(1) << i)) ) continue;
+        valsize = GhtTypeSizes[cr->schema->dims[i]->type];
+        memcpy(nd->attributes->vals + off, cr->columns[i] + cr->cursors[i], valsize);
+        cr->cursors[i] += valsize;
+        off += valsize;
+    }
+
+    if ( cr->childcounts[n] )
+    {
+        GHT_TRY(ght_nodelist_new(cr->childcounts[n], &(nd->children)));
+        for ( c = 0; c < cr->childcounts[n]; c++ )
+        {
+            GhtNode *child = NULL;
+            GHT_TRY(ght_columnar_build(cr, &child));
+            GHT_TRY(ght_node_add_child(nd, child));
+        }
+    }
+    return GHT_OK;
+}
+
+static GhtErr
+ght_columnar_read(GhtColumnReader *cr, GhtReader *reader, GhtNode **node)
+{
+    uint64_t i;
+    uint8_t numcols;
+    size_t remaining;
+    GhtColumnStream stream = { NULL, NULL };
+    GhtErr err = GHT_OK;
+
+    GHT_TRY(ght_read_varint(reader, &(cr->num_nodes)));
+    if ( ! cr->num_nodes )
+    {
+        ght_error("%s: empty node tree", __func__);
+        return GHT_ERROR;
+    }
+    /* Every node takes at least a byte in each of the topology, hash,
+     * flag and mask streams, so a count the input can't hold is bad */
+    GHT_TRY(ght_reader_remaining(reader, &remaining));
+    if ( cr->num_nodes > remaining / 4 )
+    {
+        ght_error("%s: %llu nodes cannot fit in %zu bytes", __func__, (unsigned long long)cr->num_nodes, remaining);
+        return GHT_ERROR;
+    }
+    cr->childcounts = ght_malloc(cr->num_nodes * sizeof(uint32_t));
+    cr->masks = ght_malloc(cr->num_nodes * sizeof(uint64_t));
+    cr->flags = ght_malloc(cr->num_nodes);
+
+    /* Topology */
+    GHT_TRY(ght_columnar_read_stream(reader, &stream));
+    for ( i = 0; i < cr->num_nodes && err == GHT_OK; i++ )
+    {
+        uint64_t v;
+        err = ght_read_varint(stream.reader, &v);
+        if ( err == GHT_OK && v >= cr->num_nodes )
+        {
+            ght_error("%s: node %llu has more children than the tree has nodes", __func__, (unsigned long long)i);
+            err = GHT_ERROR;
+        }
+        cr->childcounts[i] = (uint32_t)v;
+    }
+    ght_columnar_stream_free(&stream);
+    GHT_TRY(err);
+
+    /* Hashes are read as the nodes are built */
+    GHT_TRY(ght_columnar_read_stream(reader, &(cr->hashes)));
+
+    /* Flags */
+    GHT_TRY(ght_columnar_read_stream(reader, &stream));
+    err = ght_read(stream.reader, cr->flags, cr->num_nodes);
+    ght_columnar_stream_free(&stream);
+    GHT_TRY(err);
+
+    /* Attribute masks */
+    GHT_TRY(ght_columnar_read_stream(reader, &stream));
+    for ( i = 0; i < cr->num_nodes && err == GHT_OK; i++ )
+    {
+        err = ght_read_varint(stream.reader, &(cr->masks[i]));
+    }
+    ght_columnar_stream_free(&stream);
+    GHT_TRY(err);
+
+    /* Dimension columns */
+    GHT_TRY(ght_read(reader, &numcols, 1));
+    for ( i = 0; i < numcols; i++ )
+    {
+        GHT_TRY(ght_columnar_read_column(cr, reader));
+    }
+
+    return ght_columnar_build(cr, node);
+}
+
+GhtErr
+ght_node_read_columnar(GhtReader *reader, GhtNode **node)
+{
+    int i;
+    GhtErr err;
+    GhtColumnReader cr;
+
+    memset(&cr, 0, sizeof(GhtColumnReader));
+    cr.schema = reader->schema;
+    cr.dimmask = reader->dimmask;
+    *node = NULL;
+
+    err = ght_columnar_read(&cr, reader, node);
+
+    if ( cr.childcounts ) ght_free(cr.childcounts);
+    if ( cr.masks ) ght_free(cr.masks);
+    if ( cr.flags ) ght_free(cr.flags);
+    ght_columnar_stream_free(&(cr.hashes));
+    for ( i = 0; i < GHT_MAX_DIMENSIONS; i++ )
+    {
+        if ( cr.columns[i] )
+            ght_free(cr.columns[i]);
+    }
+    return err;
+}
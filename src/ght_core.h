@@ -8,8 +8,23 @@
 *
 ******************************************************************************/
 
+#include <stdint.h>
+
 #define GHT_MAX_HASH_LENGTH    18
-#define GHT_FORMAT_VERSION      1
+#define GHT_FORMAT_VERSION      2
+
+/* Trees written with no format options keep the original layout */
+#define GHT_FORMAT_VERSION_BASIC 1
+
+/* Format options, set in GhtConfig.format */
+#define GHT_FORMAT_RESIDUAL     0x01  /* integer values as varint residuals from ancestor base values */
+#define GHT_FORMAT_COLUMNAR     0x02  /* topology, hashes and each dimension in separate streams */
+#define GHT_FORMAT_COMPRESSED   0x04  /* body in independently deflated blocks, needs zlib */
+#define GHT_FORMAT_SCHEMA       0x08  /* binary schema in the header, no XML needed to read */
+#define GHT_FORMAT_PRESENCE     0x10  /* tree keeps value presence bitmaps for a dimension, set on write */
+#define GHT_FORMAT_GROUPED      0x20  /* children written after everything below them, so trees can be streamed out */
+#define GHT_FORMAT_FRAME        0x40  /* hashes subdivide the frame in the header, not the globe, set on write */
+#define GHT_FORMAT_VERTICAL     0x80  /* hashes interleave z over the range in the header, set on write */
 
 
 /***********************************************************************
@@ -36,6 +51,11 @@ typedef enum
     GHT_DOUBLE  = 9,  GHT_FLOAT  = 10
 } GhtType;
 
+typedef enum
+{
+    GHT_GREATER_THAN, GHT_LESS_THAN, GHT_BETWEEN, GHT_EQUAL, GHT_IN
+} GhtFilterMode;
+
 #define GHT_TRY(functioncall) { if ( (functioncall) == GHT_ERROR ) { return GHT_ERROR; } }
 
 typedef struct
@@ -62,8 +82,18 @@ typedef struct
     unsigned char  max_hash_length;
     unsigned char  version;
     unsigned char  endian;
+    unsigned char  format;  /* GHT_FORMAT_* options for writing */
+    GhtArea        frame;   /* extent hashes subdivide, in any coordinate system, longitude/latitude by default */
+    GhtRange       vertical; /* z range hashed along with x and y, empty for 2D hashes */
 } GhtConfig;
 
+typedef struct
+{
+    unsigned int moved;    /* nodes a value was pulled up to */
+    unsigned int removed;  /* child copies deleted */
+    double max_error;      /* bound on the difference from any original value */
+} GhtCompactStats;
+
 /* So we can alias char* to GhtHash* */
 typedef char GhtHash;
 
@@ -79,8 +79,103 @@ ght_hash_clone(const GhtHash *hash, GhtHash **hash_new)
     return GHT_OK;
 }
 
+static const GhtArea GHT_GLOBAL_FRAME = { { -180, 180 }, { -90, 90 } };
+
+void
+ght_frame_set_global(GhtArea *frame)
+{
+    *frame = GHT_GLOBAL_FRAME;
+}
+
+int
+ght_frame_is_global(const GhtArea *frame)
+{
+    /* A zeroed frame was never set */
+    if ( frame->x.min == frame->x.max && frame->y.min == frame->y.max )
+        return 1;
+    return ! memcmp(frame, &GHT_GLOBAL_FRAME, sizeof(GhtArea));
+}
+
+int
+ght_frame_same(const GhtArea *a, const GhtArea *b)
+{
+    if ( ght_frame_is_global(a) || ght_frame_is_global(b) )
+        return ght_frame_is_global(a) && ght_frame_is_global(b);
+    return ! memcmp(a, b, sizeof(GhtArea));
+}
+
+GhtErr
+ght_frame_write(const GhtArea *frame, GhtWriter *writer)
+{
+    GHT_TRY(ght_write(writer, &(frame->x.min), sizeof(double)));
+    GHT_TRY(ght_write(writer, &(frame->x.max), sizeof(double)));
+    GHT_TRY(ght_write(writer, &(frame->y.min), sizeof(double)));
+    GHT_TRY(ght_write(writer, &(frame->y.max), sizeof(double)));
+    return GHT_OK;
+}
+
+GhtErr
+ght_frame_read(GhtReader *reader, GhtArea *frame)
+{
+    GHT_TRY(ght_read(reader, &(frame->x.min), sizeof(double)));
+    GHT_TRY(ght_read(reader, &(frame->x.max), sizeof(double)));
+    GHT_TRY(ght_read(reader, &(frame->y.min), sizeof(double)));
+    GHT_TRY(ght_read(reader, &(frame->y.max), sizeof(double)));
+    /* Negated so NaNs fail too */
+    if ( ! (frame->x.min < frame->x.max && frame->y.min < frame->y.max) )
+    {
+        ght_error("%s: frame (%g %g, %g %g) has no area", __func__,
+                  frame->x.min, frame->y.min, frame->x.max, frame->y.max);
+        return GHT_ERROR;
+    }
+    return GHT_OK;
+}
+
+int
+ght_vertical_is_set(const GhtRange *vertical)
+{
+    return vertical->min < vertical->max;
+}
+
+GhtErr
+ght_vertical_write(const GhtRange *vertical, GhtWriter *writer)
+{
+    GHT_TRY(ght_write(writer, &(vertical->min), sizeof(double)));
+    GHT_TRY(ght_write(writer, &(vertical->max), sizeof(double)));
+    return GHT_OK;
+}
+
+GhtErr
+ght_vertical_read(GhtReader *reader, GhtRange *vertical)
+{
+    GHT_TRY(ght_read(reader, &(vertical->min), sizeof(double)));
+    GHT_TRY(ght_read(reader, &(vertical->max), sizeof(double)));
+    if ( ! ght_vertical_is_set(vertical) )
+    {
+        ght_error("%s: vertical range (%g %g) is empty", __func__, vertical->min, vertical->max);
+        return GHT_ERROR;
+    }
+    return GHT_OK;
+}
+
+/* Bits of a hash character, -1 if it is not one */
+static int
+ght_hash_char_bits(unsigned char c)
+{
+    c = toupper(c);
+    if ( c < 0x30 || c - 0x30 > 43 )
+        return -1;
+    return BASE32_DECODE_TABLE[c - 0x30];
+}
+
 GhtErr
 ght_hash_from_coordinate(const GhtCoordinate *coord, unsigned int resolution, GhtHash **hash)
+{
+    return ght_hash_from_coordinate_frame(coord, &GHT_GLOBAL_FRAME, resolution, hash);
+}
+
+GhtErr
+ght_hash_from_coordinate_frame(const GhtCoordinate *coord, const GhtArea *frame, unsigned int resolution, GhtHash **hash)
 {
     int i;
     GhtHash *geohash;
@@ -88,17 +183,24 @@ ght_hash_from_coordinate(const GhtCoordinate *coord, unsigned int resolution, Gh
     double lon = coord->x;
     double lat = coord->y;
     double mid;
-    GhtRange lat_range = {  -90,  90 };
-    GhtRange lon_range = { -180, 180 };
+    GhtRange lat_range = frame->y;
+    GhtRange lon_range = frame->x;
 
     double val1, val2, val_tmp;
     GhtRange *range1, *range2, *range_tmp;
 
     assert(resolution <= MAX_HASH_LENGTH);
 
-    if ( lat < -90 || lat > 90 || lon < -180 || lon > 180 )
+    if ( ght_frame_is_global(frame) )
+    {
+        lat_range = GHT_GLOBAL_FRAME.y;
+        lon_range = GHT_GLOBAL_FRAME.x;
+    }
+
+    if ( ! (lat >= lat_range.min && lat <= lat_range.max && lon >= lon_range.min && lon <= lon_range.max) )
     {
-        ght_error("%s: coordinate values (%g, %g) out of range (-180/180,-90/90)", __func__, lon, lat);
+        ght_error("%s: coordinate values (%g, %g) out of range (%g/%g,%g/%g)", __func__, lon, lat,
+                  lon_range.min, lon_range.max, lat_range.min, lat_range.max);
         return GHT_ERROR;
     }
 
@@ -139,9 +241,15 @@ ght_hash_from_coordinate(const GhtCoordinate *coord, unsigned int resolution, Gh
 
 GhtErr
 ght_coordinate_from_hash(const GhtHash *hash, GhtCoordinate *coord)
+{
+    return ght_coordinate_from_hash_frame(hash, &GHT_GLOBAL_FRAME, coord);
+}
+
+GhtErr
+ght_coordinate_from_hash_frame(const GhtHash *hash, const GhtArea *frame, GhtCoordinate *coord)
 {
     GhtArea area;
-    GHT_TRY(ght_area_from_hash(hash, &area));
+    GHT_TRY(ght_area_from_hash_frame(hash, frame, &area));
     coord->x = (area.x.min + area.x.max)/2.0;
     coord->y = (area.y.min + area.y.max)/2.0;
     return GHT_OK;
@@ -149,17 +257,20 @@ ght_coordinate_from_hash(const GhtHash *hash, GhtCoordinate *coord)
 
 GhtErr
 ght_area_from_hash(const GhtHash *hash, GhtArea *area)
+{
+    return ght_area_from_hash_frame(hash, &GHT_GLOBAL_FRAME, area);
+}
+
+GhtErr
+ght_area_from_hash_frame(const GhtHash *hash, const GhtArea *frame, GhtArea *area)
 {
 
     const char *p;
-    unsigned char c;
-    char bits;
+    int bits;
     GhtRange *range1, *range2, *range_tmp;
 
-    area->y.max =   90; /* latitude max */
-    area->y.min =  -90; /* latitude min */
-    area->x.max =  180; /* longitude max */
-    area->x.min = -180; /* longitude min */
+    /* Start from the whole frame, longitude and latitude by default */
+    *area = ght_frame_is_global(frame) ? GHT_GLOBAL_FRAME : *frame;
 
     range1 = &(area->x);
     range2 = &(area->y);
@@ -168,17 +279,7 @@ ght_area_from_hash(const GhtHash *hash, GhtArea *area)
 
     while (*p != '\0')
     {
-        c = toupper(*p++);
-        if (c < 0x30)
-        {
-            return GHT_ERROR;
-        }
-        c -= 0x30;
-        if (c > 43)
-        {
-            return GHT_ERROR;
-        }
-        bits = BASE32_DECODE_TABLE[c];
+        bits = ght_hash_char_bits(*p++);
         if (bits == -1)
         {
             return GHT_ERROR;
@@ -197,6 +298,107 @@ ght_area_from_hash(const GhtHash *hash, GhtArea *area)
     return GHT_OK;
 }
 
+/*
+ * In 3D the bits go round x, y and z in turn, carrying on from one
+ * character to the next, so each 5-bit character splits a cell in up
+ * to 32 and points stacked at one x/y still get hashes of their own.
+ */
+GhtErr
+ght_hash_from_coordinate_3d(const GhtCoordinate *coord, double z, const GhtArea *frame,
+                            const GhtRange *vertical, unsigned int resolution, GhtHash **hash)
+{
+    unsigned int i;
+    int b, d = 0;
+    unsigned char bits;
+    double mid;
+    double vals[3];
+    GhtRange ranges[3];
+    GhtHash *geohash;
+
+    assert(resolution <= MAX_HASH_LENGTH);
+
+    if ( ght_frame_is_global(frame) )
+        frame = &GHT_GLOBAL_FRAME;
+    ranges[0] = frame->x;
+    ranges[1] = frame->y;
+    ranges[2] = *vertical;
+    vals[0] = coord->x;
+    vals[1] = coord->y;
+    vals[2] = z;
+
+    for ( d = 0; d < 3; d++ )
+    {
+        if ( ! (vals[d] >= ranges[d].min && vals[d] <= ranges[d].max) )
+        {
+            ght_error("%s: coordinate values (%g, %g, %g) out of range (%g/%g,%g/%g,%g/%g)", __func__,
+                      vals[0], vals[1], vals[2], ranges[0].min, ranges[0].max,
+                      ranges[1].min, ranges[1].max, ranges[2].min, ranges[2].max);
+            return GHT_ERROR;
+        }
+    }
+
+    geohash = ght_malloc(resolution+1);
+    if ( geohash == NULL )
+        return GHT_ERROR;
+
+    d = 0;
+    for ( i = 0; i < resolution; i++ )
+    {
+        bits = 0;
+        for ( b = 4; b >= 0; b-- )
+        {
+            SET_BIT(bits, mid, &ranges[d], vals[d], b);
+            if ( ++d == 3 ) d = 0;
+        }
+        geohash[i] = BASE32_ENCODE_TABLE[bits];
+    }
+
+    geohash[resolution] = '\0';
+    *hash = geohash;
+    return GHT_OK;
+}
+
+GhtErr
+ght_volume_from_hash(const GhtHash *hash, const GhtArea *frame, const GhtRange *vertical,
+                     GhtArea *area, GhtRange *zrange)
+{
+    const char *p;
+    int b, d = 0, bits;
+    GhtRange *ranges[3];
+
+    *area = ght_frame_is_global(frame) ? GHT_GLOBAL_FRAME : *frame;
+    *zrange = *vertical;
+    ranges[0] = &(area->x);
+    ranges[1] = &(area->y);
+    ranges[2] = zrange;
+
+    for ( p = hash; *p; p++ )
+    {
+        bits = ght_hash_char_bits(*p);
+        if ( bits == -1 )
+            return GHT_ERROR;
+        for ( b = 4; b >= 0; b-- )
+        {
+            REFINE_RANGE(ranges[d], bits, 1 << b);
+            if ( ++d == 3 ) d = 0;
+        }
+    }
+    return GHT_OK;
+}
+
+GhtErr
+ght_coordinate_from_hash_3d(const GhtHash *hash, const GhtArea *frame, const GhtRange *vertical,
+                            GhtCoordinate *coord, double *z)
+{
+    GhtArea area;
+    GhtRange zrange;
+    GHT_TRY(ght_volume_from_hash(hash, frame, vertical, &area, &zrange));
+    coord->x = (area.x.min + area.x.max)/2.0;
+    coord->y = (area.y.min + area.y.max)/2.0;
+    *z = (zrange.min + zrange.max)/2.0;
+    return GHT_OK;
+}
+
 int
 ght_hash_common_length(const GhtHash *a, const GhtHash *b, int max_len)
 {
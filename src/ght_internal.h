@@ -33,10 +33,28 @@
 
 #define GHT_NUM_TYPES 11
 #define GHT_EPSILON 10e-8
+#define GHT_MAX(a, b) ((a) > (b) ? (a) : (b))
 
 /* Up to double/int64 */
 #define GHT_ATTRIBUTE_MAX_SIZE  8
 
+/* Uncompressed size of each independently compressed block */
+#define GHT_BLOCK_SIZE 65536
+
+/* Most threads used to inflate a compressed body up front */
+#define GHT_INFLATE_THREADS 4
+
+/* One bit per dimension in the node attribute presence mask */
+#define GHT_MAX_DIMENSIONS 64
+#define GHT_SCHEMA_INDEX_SIZE 128 /* power of two, at least twice GHT_MAX_DIMENSIONS */
+
+/* Values a GHT_IN filter can test against */
+#define GHT_FILTER_MAX_IN 64
+
+/* Node presence bitmaps: bit v for storage values 0 to 61, then these */
+#define GHT_PRESENCE_OTHER   (UINT64_C(1) << 62)  /* any other storage value */
+#define GHT_PRESENCE_MISSING (UINT64_C(1) << 63)  /* a leaf with no value on its path */
+
 typedef enum {
 	GHT_DUPES_NO = 0, GHT_DUPES_YES = 1
 } GhtDuplicates;
@@ -49,10 +67,6 @@ typedef enum {
 	GHT_NONE, GHT_GLOBAL, GHT_SAME, GHT_CHILD, GHT_SPLIT
 } GhtHashMatch;
 
-typedef enum {
-	GHT_GREATER_THAN, GHT_LESS_THAN, GHT_BETWEEN, GHT_EQUAL
-} GhtFilterMode;
-
 static char *GhtTypeStrings[] = { "unknown", "int8_t", "uint8_t", "int16_t",
 		"uint16_t", "int32_t", "uint32_t", "int64_t", "uint64_t", "double",
 		"float" };
@@ -65,6 +79,8 @@ sizeof(int64_t), sizeof(uint64_t), /* GHT_INT64,  GHT_UINT64 */
 sizeof(double), sizeof(float) /* GHT_DOUBLE, GHT_FLOAT */
 };
 
+struct GhtSchema_t;
+
 typedef struct {
 	int position;
 	char *name;
@@ -72,12 +88,19 @@ typedef struct {
 	GhtType type;
 	double scale;
 	double offset;
+	double tolerance; /* allowed compaction error, 0 for exact */
+	uint8_t bits; /* bit-packed width on disk, 0 for the full storage width */
+	const struct GhtSchema_t *schema; /* set when added to a schema */
 } GhtDimension;
 
-typedef struct {
+typedef struct GhtSchema_t {
 	int num_dims;
 	int max_dims;
 	GhtDimension **dims;
+	uint64_t sizemask[4]; /* dimensions with 1, 2, 4 and 8 byte storage */
+	uint64_t packmask; /* dimensions with a bit width, packed together on disk */
+	uint8_t nameindex[GHT_SCHEMA_INDEX_SIZE]; /* open addressed name hash, position + 1, 0 is empty */
+	int interned; /* owned by the schema registry, never modified or freed by callers */
 } GhtSchema;
 
 typedef struct {
@@ -88,6 +111,17 @@ typedef struct {
 	bytebuffer_t *bytebuffer;
 } GhtWriter;
 
+/* Compressed blocks behind a memory reader, inflated into raw on demand */
+typedef struct {
+	uint64_t num_blocks;
+	uint64_t block_size;
+	uint64_t raw_size;
+	uint8_t *raw;
+	uint8_t *comp;      /* the compressed blocks back to back */
+	uint64_t *offsets;  /* start of each block in comp, and the end */
+	uint8_t *inflated;  /* one flag per block */
+} GhtBlocks;
+
 typedef struct {
 	GhtIoType type;
 	FILE *file;
@@ -96,14 +130,28 @@ typedef struct {
 	const uint8_t *bytes_current;
 	size_t bytes_size;
 	const GhtSchema *schema;
+	uint64_t dimmask; /* dimensions to read, others are skipped */
 	uint8_t endian;
 	uint8_t version;
+	GhtBlocks *blocks; /* compressed input, owned by the reader */
 } GhtReader;
 
-typedef struct {
+typedef struct GhtFilter_t {
 	GhtRange range;
 	GhtFilterMode mode;
 	const GhtDimension *dim;
+	const double *values; /* GHT_IN only */
+	int num_values;
+	/* Filled in by ght_filter_compile: an inclusive range in the storage domain */
+	int (*match)(const struct GhtFilter_t *filter, const uint8_t *bytes);
+	int64_t lo, hi;   /* signed integer storage */
+	uint64_t ulo, uhi; /* unsigned integer storage */
+	double dlo, dhi;  /* floating storage, or decoded values */
+	uint64_t inset[GHT_FILTER_MAX_IN]; /* GHT_IN storage values, zero extended, or decoded double bits */
+	int num_in;
+	uint64_t presence; /* presence bits a subtree needs to be visited, 0 to visit everything */
+	const GhtArea *frame;     /* with vertical, for Z filters on 3D hashes */
+	const GhtRange *vertical; /* subtrees whose z cells miss the range are skipped, NULL to visit everything */
 } GhtFilter;
 
 typedef struct GhtAttribute_t {
@@ -112,6 +160,18 @@ typedef struct GhtAttribute_t {
 	char val[GHT_ATTRIBUTE_MAX_SIZE];
 } GhtAttribute;
 
+/*
+ * Packed attributes of a single node. Bit n of the mask is set when
+ * schema dimension n has a value, and the values are stored back to
+ * back in dimension order, each GhtTypeSizes[type] bytes wide.
+ */
+typedef struct {
+	const GhtSchema *schema;
+	uint64_t mask;
+	uint16_t size;
+	uint8_t vals[];
+} GhtAttributeSet;
+
 typedef struct {
 	double min;
 	double max;
@@ -129,8 +189,9 @@ typedef struct {
 	uint8_t ghtFlag;  // TODO flag representé par 8 bits, c'est à dire 8 espaces pour des valuers
 
 	struct GhtNodeList_t *children;
-	GhtAttribute *attributes;
+	GhtAttributeSet *attributes;
 	double z_avg;   // TODO test pour la valeur Z moyenne
+	uint64_t presence; /* values of the tree's presence dimension at or below, GHT_PRESENCE_* */
 } GhtNode;
 
 typedef struct GhtNodeList_t {
@@ -144,8 +205,102 @@ typedef struct {
 	GhtNode *root;
 	int num_nodes;
 	GhtConfig config;
+	const GhtDimension *presence_dim; /* dimension with node presence bitmaps, or NULL */
 } GhtTree;
 
+/* Serialized subtree of a node the stream writer has closed */
+typedef struct {
+	int childcount;
+	GhtWriter *body; /* the children, serialized for the original layout, NULL otherwise */
+	double err[GHT_MAX_DIMENSIONS]; /* compaction error on the node's values */
+} GhtStreamClosed;
+
+/* Node on the stream writer's path to the last point */
+typedef struct {
+	GhtNode *node; /* children hold only their own hash and attributes */
+	int end; /* length of the full hash down to the end of this node */
+	GhtStreamClosed *closed; /* one per child of node */
+	int max_closed;
+} GhtStreamLevel;
+
+typedef struct {
+	const GhtSchema *schema;
+	GhtConfig config;
+	GhtWriter *writer;
+	uint64_t dimmask; /* dimensions compacted as levels close, 0 for none */
+	GhtHash last[GHT_MAX_HASH_LENGTH+1]; /* full hash of the last node added */
+	GhtStreamLevel levels[GHT_MAX_HASH_LENGTH+1];
+	int num_levels;
+	uint64_t num_points;
+} GhtStreamWriter;
+
+/** Map signed residuals onto unsigned so small magnitudes stay small */
+static inline uint64_t
+ght_zigzag_encode(uint64_t v)
+{
+	return (v << 1) ^ (uint64_t)(-(int64_t)(v >> 63));
+}
+
+/** Reverse of ght_zigzag_encode */
+static inline uint64_t
+ght_zigzag_decode(uint64_t v)
+{
+	return (v >> 1) ^ (uint64_t)(-(int64_t)(v & 1));
+}
+
+/** Presence bitmap bit of a zero extended storage value */
+static inline uint64_t
+ght_presence_bit(uint64_t v)
+{
+	return v < 62 ? (UINT64_C(1) << v) : GHT_PRESENCE_OTHER;
+}
+
+/** Count the set bits in a dimension mask */
+static inline int
+ght_popcount(uint64_t v)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(v);
+#else
+	v = v - ((v >> 1) & UINT64_C(0x5555555555555555));
+	v = (v & UINT64_C(0x3333333333333333)) + ((v >> 2) & UINT64_C(0x3333333333333333));
+	v = (v + (v >> 4)) & UINT64_C(0x0F0F0F0F0F0F0F0F);
+	return (int)((v * UINT64_C(0x0101010101010101)) >> 56);
+#endif
+}
+
+/** Append the low nbits of v to a zeroed buffer at *bitpos, least significant bit first */
+static inline void
+ght_bits_put(uint8_t *buf, size_t *bitpos, uint64_t v, int nbits)
+{
+	while ( nbits > 0 )
+	{
+		int shift = *bitpos & 7;
+		int take = (8 - shift) < nbits ? (8 - shift) : nbits;
+		buf[*bitpos >> 3] |= (uint8_t)((v & ((1u << take) - 1)) << shift);
+		v >>= take;
+		nbits -= take;
+		*bitpos += take;
+	}
+}
+
+/** Read nbits from the buffer at *bitpos, reverse of ght_bits_put */
+static inline uint64_t
+ght_bits_get(const uint8_t *buf, size_t *bitpos, int nbits)
+{
+	uint64_t v = 0;
+	int got = 0;
+	while ( got < nbits )
+	{
+		int shift = *bitpos & 7;
+		int take = (8 - shift) < (nbits - got) ? (8 - shift) : (nbits - got);
+		v |= (uint64_t)((buf[*bitpos >> 3] >> shift) & ((1u << take) - 1)) << got;
+		got += take;
+		*bitpos += take;
+	}
+	return v;
+}
+
 /** Initialize memory/message handling with defaults (malloc/free/printf) */
 void ght_init(void);
 
@@ -182,12 +337,58 @@ int ght_hash_common_length(const GhtHash *a, const GhtHash *b, int max_len);
 GhtErr ght_hash_from_coordinate(const GhtCoordinate *coord,
 		unsigned int resolution, GhtHash **hash);
 
+/** Generate hash subdividing frame rather than the globe */
+GhtErr ght_hash_from_coordinate_frame(const GhtCoordinate *coord, const GhtArea *frame,
+		unsigned int resolution, GhtHash **hash);
+
 /** Generate area, since hash of finite resolution bounds an area */
 GhtErr ght_area_from_hash(const GhtHash *hash, GhtArea *area);
 
+/** Generate area of a hash within frame */
+GhtErr ght_area_from_hash_frame(const GhtHash *hash, const GhtArea *frame, GhtArea *area);
+
 /** Generate coordinate, as the mid-point of the GhtArea defined by a hash */
 GhtErr ght_coordinate_from_hash(const GhtHash *hash, GhtCoordinate *coord);
 
+/** Generate coordinate, as the mid-point of the area of a hash within frame */
+GhtErr ght_coordinate_from_hash_frame(const GhtHash *hash, const GhtArea *frame, GhtCoordinate *coord);
+
+/** Set frame to the whole globe in longitude and latitude */
+void ght_frame_set_global(GhtArea *frame);
+
+/** Is frame the whole globe, or never set? */
+int ght_frame_is_global(const GhtArea *frame);
+
+/** Do two frames hash coordinates the same way? */
+int ght_frame_same(const GhtArea *a, const GhtArea *b);
+
+/** Write the frame bounds */
+GhtErr ght_frame_write(const GhtArea *frame, GhtWriter *writer);
+
+/** Read the frame bounds, which must enclose some area */
+GhtErr ght_frame_read(GhtReader *reader, GhtArea *frame);
+
+/** Generate hash interleaving z over the vertical range with x and y over the frame */
+GhtErr ght_hash_from_coordinate_3d(const GhtCoordinate *coord, double z, const GhtArea *frame,
+		const GhtRange *vertical, unsigned int resolution, GhtHash **hash);
+
+/** Generate area and z range of a 3D hash */
+GhtErr ght_volume_from_hash(const GhtHash *hash, const GhtArea *frame, const GhtRange *vertical,
+		GhtArea *area, GhtRange *zrange);
+
+/** Generate coordinate and z, as the mid-point of the volume of a 3D hash */
+GhtErr ght_coordinate_from_hash_3d(const GhtHash *hash, const GhtArea *frame, const GhtRange *vertical,
+		GhtCoordinate *coord, double *z);
+
+/** Does the vertical range make hashes 3D? */
+int ght_vertical_is_set(const GhtRange *vertical);
+
+/** Write the vertical range */
+GhtErr ght_vertical_write(const GhtRange *vertical, GhtWriter *writer);
+
+/** Read the vertical range, which must not be empty */
+GhtErr ght_vertical_read(GhtReader *reader, GhtRange *vertical);
+
 /** Release hash memory */
 GhtErr ght_hash_free(GhtHash *hash);
 
@@ -227,9 +428,20 @@ GhtErr ght_node_set_hash(GhtNode *node, GhtHash *hash);
 /** Get the coordinates represented by the node */
 GhtErr ght_node_get_coordinate(const GhtNode *node, GhtCoordinate *coord);
 
-/** Get the attribute list handing off the node */
+/** Get the coordinates represented by the node within a frame */
+GhtErr ght_node_get_coordinate_frame(const GhtNode *node, const GhtArea *frame, GhtCoordinate *coord);
+
+/** Get the coordinates and z represented by a node with a 3D hash */
+GhtErr ght_node_get_coordinate_3d(const GhtNode *node, const GhtArea *frame, const GhtRange *vertical,
+		GhtCoordinate *coord, double *z);
+
+/** Copy the node attributes out into a new GhtAttribute list, caller frees */
 GhtErr ght_node_get_attributes(const GhtNode *node, GhtAttribute **attr);
 
+/** Copy out the node attribute for a dimension, GHT_ERROR if there is none */
+GhtErr ght_node_get_attribute(const GhtNode *node, const GhtDimension *dim,
+		GhtAttribute *found);
+
 
 
 /** TODO Verification de la valeur de FLAG ght */
@@ -239,9 +451,22 @@ GhtErr ght_node_get_ghtFlag(const GhtNode *node);
 /** Create a new node from a hash */
 GhtErr ght_node_new_from_hash(GhtHash *hash, GhtNode **node);
 
+/** Allocate an empty node, with no hash */
+GhtErr ght_node_new(GhtNode **node);
+
+/** Append a child to the node's child list */
+GhtErr ght_node_add_child(GhtNode *parent, GhtNode *child);
+
 /** Create a new code from a coordinate */
 GhtErr ght_node_new_from_coordinate(const GhtCoordinate *coord, unsigned int resolution, GhtNode **node);
 
+/** Create a new node from a coordinate hashed within a frame */
+GhtErr ght_node_new_from_coordinate_frame(const GhtCoordinate *coord, const GhtArea *frame, unsigned int resolution, GhtNode **node);
+
+/** Create a new node with a 3D hash, z interleaved over the vertical range */
+GhtErr ght_node_new_from_coordinate_3d(const GhtCoordinate *coord, double z, const GhtArea *frame,
+		const GhtRange *vertical, unsigned int resolution, GhtNode **node);
+
 /** Fill a stringbuffer with a printout of the node tree */
 GhtErr ght_node_to_string(GhtNode *node, stringbuffer_t *sb, int level);
 
@@ -254,25 +479,53 @@ GhtErr ght_node_count_attributes(const GhtNode *node, uint8_t *count);
 /** Delete an attribute from the node (frees the attribute) */
 GhtErr ght_node_delete_attribute(GhtNode *node, const GhtDimension *dim);
 
-/** Add a new attribute to the node */
+/** Add a new attribute (and any linked siblings) to the node, frees the attribute */
 GhtErr ght_node_add_attribute(GhtNode *node, GhtAttribute *attribute);
 
 /** Move attributes to the highest level in the tree at which they apply to all children */
 GhtErr ght_node_compact_attribute(GhtNode *node, const GhtDimension *dim,
 		GhtAttribute *attr);
 
+/** Compact all the dimensions in the mask in a single pass over the tree, stats may be NULL */
+GhtErr ght_node_compact_attributes(GhtNode *node, uint64_t dimmask, GhtCompactStats *stats);
+
+/** Compact the candidate dimensions of the node's children onto it, err is the children's error on entry and the node's on return */
+GhtErr ght_node_compact_attributes_level(GhtNode *node, uint64_t candidates,
+		double *err, GhtCompactStats *stats);
+
 /** Recursively build a GhtNodeList from a tree of GhtNode */
 GhtErr ght_node_to_nodelist(const GhtNode *node, GhtNodeList *nodelist,
-		GhtAttribute *attr, GhtHash *hash);
+		const GhtAttributeSet *attr, GhtHash *hash);
 
 /** Recursively calculate the extent GhtArea of a tree of GhtNode */
 GhtErr ght_node_get_extent(const GhtNode *node, const GhtHash *hash,
-		GhtArea *area);
+		const GhtArea *frame, const GhtRange *vertical, GhtArea *area);
+
+/** Translate the filter thresholds into the storage domain of its dimension, once per query */
+GhtErr ght_filter_compile(GhtFilter *filter);
+
+/** Presence bits of the values a compiled filter can keep, 0 when it cannot prune on them */
+uint64_t ght_filter_presence_mask(const GhtFilter *filter);
+
+/** Recompute the presence bitmaps of dim for the node and everything below */
+GhtErr ght_node_build_presence(GhtNode *node, const GhtDimension *dim);
 
 /** Recursively filter out sub-elements of the tree that don't pass the filter, returns a freshly allocated tree that corresponds to the filter */
 GhtErr ght_node_filter_by_attribute(const GhtNode *node,
 		const GhtFilter *filter, GhtNode **filtered_node);
 
+/** Write a node's hash, attributes, flag and child count, without the children */
+GhtErr ght_node_write_header(const GhtNode *node, uint8_t childcount, GhtWriter *writer);
+
+/** Write a node's header for the grouped layout, with a varint child count */
+GhtErr ght_node_write_grouped_header(const GhtNode *node, uint64_t childcount, GhtWriter *writer);
+
+/** Write a node tree in the grouped layout, each node's children after everything below them */
+GhtErr ght_node_write_grouped(const GhtNode *node, GhtWriter *writer);
+
+/** Read a node tree written by ght_node_write_grouped */
+GhtErr ght_node_read_grouped(GhtReader *reader, GhtNode **node);
+
 /** Write a byte representation of a node tree */
 GhtErr ght_node_write(const GhtNode *node, GhtWriter *writer);
 
@@ -285,6 +538,28 @@ GhtErr ght_node_get_hash(const GhtNode *node, GhtHash **hash);
 /** Write a byte representation of a node tree */
 GhtErr ght_node_read(GhtReader *reader, GhtNode **node);
 
+/** Which dimensions of the tree can be written as integer residuals */
+GhtErr ght_node_get_residual_mask(const GhtNode *node, const GhtSchema *schema,
+		uint64_t *resmask);
+
+/** Write a node tree with the dimensions in resmask as residuals from ancestor base values */
+GhtErr ght_node_write_residual(const GhtNode *node, const GhtSchema *schema,
+		uint64_t resmask, GhtWriter *writer);
+
+/** Read a node tree written by ght_node_write_residual */
+GhtErr ght_node_read_residual(GhtReader *reader, uint64_t resmask, GhtNode **node);
+
+/** Write a node tree as separate topology, hash, flag, mask and per-dimension streams */
+GhtErr ght_node_write_columnar(const GhtNode *node, const GhtSchema *schema,
+		uint8_t format, GhtWriter *writer);
+
+/** Read a node tree written by ght_node_write_columnar */
+GhtErr ght_node_read_columnar(GhtReader *reader, GhtNode **node);
+
+/** Recursively calculate the average Z of the leaves under each node */
+GhtErr ght_node_calculate_z(GhtNode *node, const GhtAttributeSet *attr,
+		const GhtDimension *zdim);
+
 /** Create an empty nodelist */
 GhtErr ght_nodelist_new(int capacity, GhtNodeList **nodelist);
 
@@ -317,13 +592,19 @@ GhtErr ght_tree_free(GhtTree *tree);
 /** Add a GhtNode to a GhtTree */
 GhtErr ght_tree_insert_node(GhtTree *tree, GhtNode *node);
 
+/** Join trees whose roots share no hash with each other into one, taking over their nodes and freeing the parts */
+GhtErr ght_tree_join(const GhtSchema *schema, GhtTree **parts, int num_parts, GhtTree **tree);
+
+/** Keep a bitmap on every node of the integer values of the dimension below it, for equal and in filters to prune with */
+GhtErr ght_tree_build_presence(GhtTree *tree, const char *dimname);
+
 /** Write a GhtTree to memory or file */
 GhtErr ght_tree_write(const GhtTree *tree, GhtWriter *writer);
 
 /** Read the top level hash key off the GhtTree */
 GhtErr ght_tree_get_hash(const GhtTree *tree, GhtHash **hash);
 
-/** Read the schema from the GhtTree */
+/** Read the schema from the GhtTree, an embedded schema is shared through the schema registry */
 GhtErr ght_tree_get_schema(const GhtTree *tree, const GhtSchema **schema);
 
 /** Read the point count from the GhtTree */
@@ -332,18 +613,40 @@ GhtErr ght_tree_get_numpoints(const GhtTree *tree, int *numpoints);
 /** Compact all the attributes from 'Z' onwards */
 GhtErr ght_tree_compact_attributes(GhtTree *tree);
 
+/** Compact all the attributes from 'Z' onwards, filling in one stats entry per schema dimension */
+GhtErr ght_tree_compact_attributes_with_stats(GhtTree *tree, GhtCompactStats *stats);
+
 /** Write a GhtTree to memory or file */
 GhtErr ght_tree_write(const GhtTree *tree, GhtWriter *writer);
 
 /** Write a GhtTree to memory of file */
 GhtErr ght_tree_read(GhtReader *reader, GhtTree **tree);
 
+/** Read a GhtTree keeping only the attributes of dimensions in the mask */
+GhtErr ght_tree_read_dimensions(GhtReader *reader, uint64_t dimmask, GhtTree **tree);
+
 /** Take in a tree and output a populated GhtNodeList, creates complete copy of data */
 GhtErr ght_tree_to_nodelist(const GhtTree *tree, GhtNodeList *nodelist);
 
 /** Calculate the spatial extent of a GhtTree */
 GhtErr ght_tree_get_extent(const GhtTree *tree, GhtArea *area);
 
+/** Hash within this extent instead of global longitude/latitude, must be set before nodes go in */
+GhtErr ght_tree_set_frame(GhtTree *tree, const GhtArea *frame);
+
+/** Extent the tree's hashes subdivide */
+GhtErr ght_tree_get_frame(const GhtTree *tree, GhtArea *frame);
+
+/** Interleave z over this range into the hashes, must be set before nodes go in */
+GhtErr ght_tree_set_vertical(GhtTree *tree, const GhtRange *vertical);
+
+/** Z range the tree's hashes subdivide, empty for 2D hashes */
+GhtErr ght_tree_get_vertical(const GhtTree *tree, GhtRange *vertical);
+
+/** Allocate new tree with only nodes that meet the filter, dim is a handle resolved once from the tree schema */
+GhtErr ght_tree_filter_by_dimension(const GhtTree *tree, const GhtDimension *dim,
+		GhtFilterMode mode, double value1, double value2, GhtTree **tree_filtered);
+
 /** Allocate new tree with only nodes that meet the filter condition */
 GhtErr ght_tree_filter_greater_than(const GhtTree *tree, const char *dimname,
 		double value, GhtTree **tree_filtered);
@@ -360,6 +663,26 @@ GhtErr ght_tree_filter_between(const GhtTree *tree, const char *dimname,
 GhtErr ght_tree_filter_equal(const GhtTree *tree, const char *dimname,
 		double value, GhtTree **tree_filtered);
 
+/** Allocate new tree with only nodes equal to one of the values, at most GHT_FILTER_MAX_IN of them */
+GhtErr ght_tree_filter_in(const GhtTree *tree, const char *dimname,
+		const double *values, int num_values, GhtTree **tree_filtered);
+
+/** Start a stream of nodes in hash order written as a tree, the header goes out straight away */
+GhtErr ght_stream_writer_new(const GhtSchema *schema, const GhtConfig *config, int compact,
+		GhtWriter *writer, GhtStreamWriter **stream);
+
+/** Add a leaf node, taking it over, its hash must not sort before the last one */
+GhtErr ght_stream_writer_add_node(GhtStreamWriter *stream, GhtNode *node);
+
+/** Write out the nodes still open, after which the output is complete */
+GhtErr ght_stream_writer_finish(GhtStreamWriter *stream);
+
+/** How many points went into the stream? */
+GhtErr ght_stream_writer_get_numpoints(const GhtStreamWriter *stream, uint64_t *numpoints);
+
+/** Free the stream writer, not the writer it was writing to */
+GhtErr ght_stream_writer_free(GhtStreamWriter *stream);
+
 /** Allocate a new attribute and fill in the value from a double */
 GhtErr ght_attribute_new_from_double(const GhtDimension *dim, double val,
 		GhtAttribute **attr);
@@ -392,6 +715,14 @@ GhtErr ght_attribute_get_by_dimension(const GhtAttribute *attr,
 /** Set the packed attribute value */
 GhtErr ght_attribute_set_value(GhtAttribute *attr, double val);
 
+/** Convert count packed storage values of one dimension into scaled and offset doubles */
+GhtErr ght_attribute_decode_values(const GhtDimension *dim, const uint8_t *bytes,
+		size_t count, double *vals);
+
+/** Convert count doubles into packed storage values of one dimension */
+GhtErr ght_attribute_encode_values(const GhtDimension *dim, const double *vals,
+		size_t count, uint8_t *bytes);
+
 /** Write an appropriately formatted value into the stringbuffer_t */
 GhtErr ght_attribute_to_string(const GhtAttribute *attr, stringbuffer_t *sb);
 
@@ -409,12 +740,77 @@ GhtErr ght_attribute_write(const GhtAttribute *attr, GhtWriter *writer);
 /** Read attribute from byte representation */
 GhtErr ght_attribute_read(GhtReader *reader, GhtAttribute **attr);
 
+/** Allocate a zeroed set sized for the dimensions in the mask (NULL for an empty mask) */
+GhtErr ght_attributeset_new(const GhtSchema *schema, uint64_t mask,
+		GhtAttributeSet **set);
+
+/** Free a packed attribute set */
+GhtErr ght_attributeset_free(GhtAttributeSet *set);
+
+/** Copy a packed attribute set (NULL in, NULL out) */
+GhtErr ght_attributeset_clone(const GhtAttributeSet *set, GhtAttributeSet **set_out);
+
+/** Copy out the attribute for a dimension, GHT_ERROR if the set has none */
+GhtErr ght_attributeset_get(const GhtAttributeSet *set, const GhtDimension *dim,
+		GhtAttribute *found);
+
+/** Point at the packed storage bytes of a dimension in the set, without copying */
+GhtErr ght_attributeset_get_bytes(const GhtAttributeSet *set, const GhtDimension *dim,
+		const uint8_t **bytes);
+
+/** Add or replace the packed value for a dimension, (re)allocating the set as needed */
+GhtErr ght_attributeset_set(GhtAttributeSet **set, const GhtDimension *dim,
+		const void *val);
+
+/** Remove the value for a dimension, frees the set once it is empty */
+GhtErr ght_attributeset_delete(GhtAttributeSet **set, const GhtDimension *dim);
+
+/** Merge two sets, values in set1 win where both have a dimension */
+GhtErr ght_attributeset_union(const GhtAttributeSet *set1,
+		const GhtAttributeSet *set2, GhtAttributeSet **set);
+
+/** Copy the set out into a new GhtAttribute list */
+GhtErr ght_attributeset_to_attributes(const GhtAttributeSet *set,
+		GhtAttribute **attr);
+
+/** Write the attribute count and (dimension, value) pairs of the set */
+GhtErr ght_attributeset_write(const GhtAttributeSet *set, GhtWriter *writer);
+
+/** Read the attribute count and (dimension, value) pairs into a new set */
+GhtErr ght_attributeset_read(GhtReader *reader, GhtAttributeSet **set);
+
+/** Write the set with dimensions in resmask as zig-zag varint residuals from base */
+GhtErr ght_attributeset_write_residual(const GhtAttributeSet *set,
+		uint64_t resmask, const uint64_t *base, GhtWriter *writer);
+
+/** Read a set written by ght_attributeset_write_residual */
+GhtErr ght_attributeset_read_residual(GhtReader *reader, uint64_t resmask,
+		const uint64_t *base, GhtAttributeSet **set);
+
+/** Integer form of a stored value, GHT_ERROR for a non-integral float */
+GhtErr ght_attribute_quantize(const GhtDimension *dim, const void *val, uint64_t *q);
+
+/** Stored value from its integer form */
+GhtErr ght_attribute_dequantize(const GhtDimension *dim, uint64_t q, void *val);
+
+/** Low bits of a value of a packed dimension, GHT_ERROR if it does not fit its width */
+GhtErr ght_attribute_to_bits(const GhtDimension *dim, const void *val, uint64_t *raw);
+
+/** Storage value of a packed dimension from its bits, sign extending signed types */
+GhtErr ght_attribute_from_bits(const GhtDimension *dim, uint64_t raw, void *val);
+
+/** Append the set as "name=value:name=value" to the stringbuffer_t */
+GhtErr ght_attributeset_to_string(const GhtAttributeSet *set, stringbuffer_t *sb);
+
 /** Give a type string (eg "uint16_t"), return the GhtType number */
 GhtErr ght_type_from_str(const char *str, GhtType *type);
 
 /** Create an empty dimension */
 GhtErr ght_dimension_new(GhtDimension **dim);
 
+/** Free a dimension and its strings */
+GhtErr ght_dimension_free(GhtDimension *dim);
+
 /** Create a populated dimension */
 GhtErr ght_dimension_new_from_parameters(const char *name, const char *desc,
 		GhtType type, double scale, double offset, GhtDimension **dim);
@@ -431,6 +827,18 @@ GhtErr ght_dimension_set_offset(GhtDimension *dim, double offset);
 /** Set the scale on a GhtDimension */
 GhtErr ght_dimension_set_scale(GhtDimension *dim, double scale);
 
+/** Set the largest error allowed when compacting the dimension */
+GhtErr ght_dimension_set_tolerance(GhtDimension *dim, double tolerance);
+
+/** Read the compaction tolerance of the dimension */
+GhtErr ght_dimension_get_tolerance(const GhtDimension *dim, double *tolerance);
+
+/** Pack an integer dimension into a bit width on disk, 0 for full width, before it joins a schema */
+GhtErr ght_dimension_set_bits(GhtDimension *dim, int bits);
+
+/** Read the packed bit width of the dimension, 0 for full width */
+GhtErr ght_dimension_get_bits(const GhtDimension *dim, int *bits);
+
 /** Set the scale on a GhtDimension */
 GhtErr ght_dimension_set_type(GhtDimension *dim, GhtType type);
 
@@ -480,6 +888,24 @@ GhtErr ght_schema_get_num_dimensions(const GhtSchema *schema,
 /** Create a schema from an XML document */
 GhtErr ght_schema_from_xml_str(const char *xmlstr, GhtSchema **schema);
 
+/** Write the compact binary form of a schema (names, types, scales, offsets) */
+GhtErr ght_schema_write(const GhtSchema *schema, GhtWriter *writer);
+
+/** Read a schema written by ght_schema_write */
+GhtErr ght_schema_read(GhtReader *reader, GhtSchema **schema);
+
+/** Shared, immutable schema for this XML document, parsed only on first sight */
+GhtErr ght_schema_registry_get_xml(const char *xml_str, const GhtSchema **schema);
+
+/** Shared, immutable schema for this ght_schema_write form, parsed only on first sight */
+GhtErr ght_schema_registry_get_binary(const uint8_t *bytes, size_t bytes_size, const GhtSchema **schema);
+
+/** Hand a schema over to the registry, which keeps it or frees it for an equal one already there */
+GhtErr ght_schema_registry_add(GhtSchema *schema, const GhtSchema **interned);
+
+/** Free every registered schema, no references handed out may be used afterwards */
+GhtErr ght_schema_registry_clear(void);
+
 /** Turn a schema into an XML document */
 GhtErr ght_schema_to_xml_str(const GhtSchema *schema, char **xml_str,
 		size_t *xml_str_size);
@@ -522,6 +948,29 @@ GhtErr ght_reader_free(GhtReader *reader);
 /** Read bytes in from a reader */
 GhtErr ght_read(GhtReader *reader, void *bytes, size_t read_size);
 
+/** Move past bytes without reading them */
+GhtErr ght_reader_skip(GhtReader *reader, size_t skip_size);
+
+/** How many bytes are left to read? */
+GhtErr ght_reader_remaining(GhtReader *reader, size_t *remaining);
+
+/** Write bytes as a table of block sizes followed by independently compressed blocks */
+GhtErr ght_write_compressed(GhtWriter *writer, const uint8_t *bytes, size_t size);
+
+/**
+* Read the blocks written by ght_write_compressed and open a memory reader
+* on their contents. Lazy readers inflate a block the first time it is read
+* from, so skipped ranges stay compressed; otherwise every block is inflated
+* up front, in parallel where threads are available.
+*/
+GhtErr ght_reader_new_compressed(GhtReader *reader, int lazy, GhtReader **body);
+
+/** Write an unsigned LEB128 varint */
+GhtErr ght_write_varint(GhtWriter *writer, uint64_t val);
+
+/** Read an unsigned LEB128 varint */
+GhtErr ght_read_varint(GhtReader *reader, uint64_t *val);
+
 /** Set up a tree configuration with defaults */
 GhtErr ght_config_init(GhtConfig *config);
 
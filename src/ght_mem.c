@@ -118,6 +118,14 @@ void ght_set_handlers(GhtAllocator allocator, GhtReallocator reallocator,
     );
 }
 
+void ght_set_memory_handlers(GhtAllocator allocator, GhtReallocator reallocator,
+                             GhtDeallocator deallocator)
+{
+    ght_context.alloc = allocator;
+    ght_context.realloc = reallocator;
+    ght_context.free = deallocator;
+}
+
 void ght_set_allocator(GhtAllocator allocator)
 {
     ght_context.alloc = allocator;
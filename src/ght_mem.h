@@ -23,4 +23,9 @@ void   ght_set_allocator(GhtAllocator allocator);
 /** Set the free handler */
 void   ght_set_deallocator(GhtDeallocator deallocator);
 
+/** Set the memory and message handlers together */
+void   ght_set_handlers(GhtAllocator allocator, GhtReallocator reallocator,
+                        GhtDeallocator deallocator, GhtMessageHandler error_handler,
+                        GhtMessageHandler info_handler, GhtMessageHandler warn_handler);
+
 #endif /* _GHT_MEM_H */
\ No newline at end of file
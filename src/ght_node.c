@@ -10,6 +10,8 @@
 
 #include "ght_internal.h"
 #include <float.h>
+#include <math.h>
+#include <limits.h>
 
 /******************************************************************************
  *  GhtNodeList
@@ -144,7 +146,7 @@ ght_node_z_avg(const GhtNode *node)
 }
 
 
-static GhtErr
+GhtErr
 ght_node_new(GhtNode **node)
 {
 	GhtNode *n = ght_malloc(sizeof(GhtNode));
@@ -175,13 +177,18 @@ ght_node_get_attributes(const GhtNode *node, GhtAttribute **attr)
 {
 	if ( node->attributes )
 	{
-		*attr = node->attributes;
-		return GHT_OK;
+		return ght_attributeset_to_attributes(node->attributes, attr);
 	}
 	*attr = NULL;
 	return GHT_ERROR;
 }
 
+GhtErr
+ght_node_get_attribute(const GhtNode *node, const GhtDimension *dim, GhtAttribute *found)
+{
+	return ght_attributeset_get(node->attributes, dim, found);
+}
+
 
 
 
@@ -212,6 +219,26 @@ ght_node_get_coordinate(const GhtNode *node, GhtCoordinate *coord)
 	return ght_coordinate_from_hash(node->hash, coord);
 }
 
+GhtErr
+ght_node_get_coordinate_frame(const GhtNode *node, const GhtArea *frame, GhtCoordinate *coord)
+{
+	if ( ! node->hash )
+	{
+		return GHT_ERROR;
+	}
+	return ght_coordinate_from_hash_frame(node->hash, frame, coord);
+}
+
+GhtErr
+ght_node_get_coordinate_3d(const GhtNode *node, const GhtArea *frame, const GhtRange *vertical, GhtCoordinate *coord, double *z)
+{
+	if ( ! node->hash )
+	{
+		return GHT_ERROR;
+	}
+	return ght_coordinate_from_hash_3d(node->hash, frame, vertical, coord, z);
+}
+
 
 /* TODO  Verification de la valuer ghtFlag */
 // static uint8_t ght_node_get_ghtFlag (const GhtNode *node)
@@ -245,7 +272,33 @@ ght_node_new_from_coordinate(const GhtCoordinate *coord, unsigned int resolution
 	return GHT_OK;
 }
 
-static GhtErr
+/** Create new node, hashing the coordinate within frame */
+GhtErr
+ght_node_new_from_coordinate_frame(const GhtCoordinate *coord, const GhtArea *frame, unsigned int resolution, GhtNode **node)
+{
+	GhtHash *hash;
+	assert(node != NULL);
+	assert(coord != NULL);
+	GHT_TRY(ght_hash_from_coordinate_frame(coord, frame, resolution, &hash));
+	GHT_TRY(ght_node_new(node));
+	GHT_TRY(ght_node_set_hash(*node, hash));
+	return GHT_OK;
+}
+
+/** Create new node, interleaving z over the vertical range into the hash */
+GhtErr
+ght_node_new_from_coordinate_3d(const GhtCoordinate *coord, double z, const GhtArea *frame, const GhtRange *vertical, unsigned int resolution, GhtNode **node)
+{
+	GhtHash *hash;
+	assert(node != NULL);
+	assert(coord != NULL);
+	GHT_TRY(ght_hash_from_coordinate_3d(coord, z, frame, vertical, resolution, &hash));
+	GHT_TRY(ght_node_new(node));
+	GHT_TRY(ght_node_set_hash(*node, hash));
+	return GHT_OK;
+}
+
+GhtErr
 ght_node_add_child(GhtNode *parent, GhtNode *child)
 {
 	if ( ! parent->children )
@@ -258,8 +311,6 @@ ght_node_add_child(GhtNode *parent, GhtNode *child)
 static GhtErr
 ght_node_transfer_attributes(GhtNode *node_from, GhtNode *node_to)
 {
-	size_t sz;
-
 	/* Nothing to transfer */
 	if ( ! node_from->attributes )
 		return GHT_OK;
@@ -303,6 +354,7 @@ ght_node_insert_node(GhtNode *node, GhtNode *node_to_insert, GhtDuplicates dupli
 	if ( matchtype == GHT_CHILD || matchtype == GHT_GLOBAL )
 	{
 		int i;
+		node->presence |= node_to_insert->presence;
 		ght_node_set_hash(node_to_insert, ght_strdup(node_to_insert_leaf));
 		for ( i = 0; i < ght_node_num_children(node); i++ )
 		{
@@ -329,7 +381,9 @@ ght_node_insert_node(GhtNode *node, GhtNode *node_to_insert, GhtDuplicates dupli
 				GHT_TRY(ght_node_new(&parent_leaf));
 				GHT_TRY(ght_node_transfer_attributes(node, parent_leaf));
 				GHT_TRY(ght_node_add_child(node, parent_leaf));
+				parent_leaf->presence = node->presence;
 			}
+			node->presence |= node_to_insert->presence;
 
 			/* Add the new node under the parent, stripping the hash */
 			ght_free(node_to_insert->hash);
@@ -354,6 +408,8 @@ ght_node_insert_node(GhtNode *node, GhtNode *node_to_insert, GhtDuplicates dupli
 		GHT_TRY(ght_node_new_from_hash(node_leaf, &another_node_to_insert));
 		/* Move attributes to the new child */
 		GHT_TRY(ght_node_transfer_attributes(node, another_node_to_insert));
+		another_node_to_insert->presence = node->presence;
+		node->presence |= node_to_insert->presence;
 
 		/* Any children of the parent need to move down the tree with the unique part of the hash */
 		if ( node->children )
@@ -393,14 +449,8 @@ ght_node_to_string(GhtNode *node, stringbuffer_t *sb, int level)
 	/* Print attributes */
 	if ( node->attributes )
 	{
-		GhtAttribute *attr = node->attributes;
 		ght_stringbuffer_append(sb, "  ");
-		while ( attr )
-		{
-			ght_attribute_to_string(attr, sb);
-			if ( attr->next ) ght_stringbuffer_append(sb, ":");
-			attr = attr->next;
-		}
+		GHT_TRY(ght_attributeset_to_string(node->attributes, sb));
 	}
 	ght_stringbuffer_append(sb, "\n");
 
@@ -442,7 +492,7 @@ ght_node_free(GhtNode *node)
 	assert(node != NULL);
 
 	if ( node->attributes )
-		GHT_TRY(ght_attribute_free(node->attributes));
+		GHT_TRY(ght_attributeset_free(node->attributes));
 
 	if ( node->children )
 		GHT_TRY(ght_nodelist_free_deep(node->children));
@@ -458,187 +508,275 @@ ght_node_free(GhtNode *node)
 GhtErr
 ght_node_add_attribute(GhtNode *node, GhtAttribute *attribute)
 {
-	GhtAttribute *attr = node->attributes;
-
-	/* First one! */
-	if ( ! node->attributes )
-	{
-		node->attributes = attribute;
-		return GHT_OK;
-	}
+	GhtAttribute *attr = attribute;
 
-	while ( attr->next )
+	/* Pack the values into the node, the attributes are consumed */
+	while ( attr )
 	{
+		if ( ght_attributeset_set(&(node->attributes), attr->dim, attr->val) != GHT_OK )
+		{
+			ght_attribute_free(attribute);
+			return GHT_ERROR;
+		}
 		attr = attr->next;
 	}
-
-	attr->next = attribute;
-	return GHT_OK;
+	return ght_attribute_free(attribute);
 }
 
 GhtErr
 ght_node_count_attributes(const GhtNode *node, uint8_t *count)
 {
-	uint8_t c = 0;
-	GhtAttribute *attr = node->attributes;
-	while ( attr )
-	{
-		c++;
-		attr = attr->next;
-	}
-	*count = c;
+	*count = node->attributes ? ght_popcount(node->attributes->mask) : 0;
 	return GHT_OK;
 }
 
 GhtErr
 ght_node_delete_attribute(GhtNode *node, const GhtDimension *dim)
 {
-	GhtAttribute *attr = node->attributes;
-	GhtAttribute *attr_prev;
-
 	/* No attributes, noop */
-	if ( ! attr )
+	if ( ! node->attributes )
 		return GHT_OK;
 
-	/* Roll forward until we find a match */
-	while( attr->dim != dim )
+	return ght_attributeset_delete(&(node->attributes), dim);
+}
+
+/*
+ * Do all the children of the node carry the same value in this dimension?
+ * Identical storage bytes are the common case and need no conversion,
+ * otherwise the values are compared as doubles. Without a tolerance they
+ * must agree within GHT_EPSILON, with one the error of the mid-range value
+ * on top of the error already in the children (childerr) must stay within
+ * it. The shared value is copied into val and its error into err.
+ */
+static int
+ght_node_children_share_value(const GhtNode *node, const GhtDimension *dim,
+		double childerr, uint8_t *val, double *err)
+{
+	int i;
+	size_t size = GhtTypeSizes[dim->type];
+	int identical = 1;
+	double minval = DBL_MAX;
+	double maxval = -1 * DBL_MAX;
+	double stored, e;
+	GhtAttribute first, attr;
+
+	if ( ght_node_get_attribute(node->children->nodes[0], dim, &first) != GHT_OK )
+		return 0;
+
+	for ( i = 1; i < node->children->num_nodes; i++ )
 	{
-		if ( attr->next )
+		if ( ght_node_get_attribute(node->children->nodes[i], dim, &attr) != GHT_OK )
+			return 0;
+		if ( memcmp(first.val, attr.val, size) != 0 )
 		{
-			attr_prev = attr;
-			attr = attr->next;
-		}
-		/* No attributes matches dimension */
-		else
-		{
-			return GHT_ERROR;
+			identical = 0;
+			break;
 		}
 	}
 
-	/* Handle first attribute in list specially */
-	if ( attr == node->attributes )
+	if ( identical )
 	{
-		if ( attr->next )
-			node->attributes = attr->next;
-		else
-			node->attributes = NULL;
+		memcpy(val, first.val, size);
+		*err = childerr;
+		return 1;
 	}
-	else
+
+	/* Storage differs, see if the values are close enough */
+	for ( i = 0; i < node->children->num_nodes; i++ )
 	{
-		attr_prev->next = attr->next;
+		double d;
+		ght_node_get_attribute(node->children->nodes[i], dim, &attr);
+		if ( ght_attribute_get_value(&attr, &d) != GHT_OK )
+			return 0;
+		(d < minval) ? (minval = d) : 0;
+		(d > maxval) ? (maxval = d) : 0;
 	}
 
-	ght_free(attr);
-	return GHT_OK;
+	if ( dim->tolerance > 0 )
+	{
+		if ( (maxval-minval)/2.0 + childerr > dim->tolerance )
+			return 0;
+	}
+	else if ( (maxval-minval) >= GHT_EPSILON )
+	{
+		return 0;
+	}
+
+	/* Measure the error on the stored value, integer types round */
+	if ( ght_attribute_set_value(&first, (minval+maxval)/2.0) != GHT_OK ||
+	     ght_attribute_get_value(&first, &stored) != GHT_OK )
+		return 0;
+	e = childerr + GHT_MAX(maxval - stored, stored - minval);
+	if ( dim->tolerance > 0 && e > dim->tolerance )
+		return 0;
+
+	memcpy(val, first.val, size);
+	*err = e;
+	return 1;
 }
 
-/* 
- * Recursive compaction routine. Pulls attribute up to the highest node such that
- * all children share the attribute value.
+/*
+ * One level of compaction. Pulls every candidate dimension all the
+ * children share a value in up onto the node, deleting the child copies.
+ * On entry err holds, per dimension, the largest error already in the
+ * children, on return the error on the values now on the node.
  */
-static GhtErr
-ght_node_compact_attribute_with_delta(GhtNode *node, 
-		const GhtDimension *dim,
-		double delta,
-		GhtAttribute *compacted_attribute)
+GhtErr
+ght_node_compact_attributes_level(GhtNode *node, uint64_t candidates,
+		double *err, GhtCompactStats *stats)
 {
-	int i;
+	int i, j;
+	const GhtSchema *schema;
+	GhtAttributeSet *merged;
+	/* Stack space for the values moving up, at most one per dimension */
+	uint64_t moved_buf[1 + (sizeof(GhtAttributeSet) + GHT_MAX_DIMENSIONS * GHT_ATTRIBUTE_MAX_SIZE) / sizeof(uint64_t)];
+	GhtAttributeSet *moved = (GhtAttributeSet*)moved_buf;
+
+	if ( ! candidates )
+		return GHT_OK;
 
-	/* This is an internal node, see if all the children share a value in this dimension */
-	if ( node->children && node->children->num_nodes > 0 )
+	schema = node->children->nodes[0]->attributes->schema;
+	moved->schema = schema;
+	moved->mask = 0;
+	moved->size = 0;
+
+	for ( i = 0; i < GHT_MAX_DIMENSIONS && (candidates >> i); i++ )
 	{
-		double minval = DBL_MAX;
-		double maxval = -1 * DBL_MAX;
-		double totval = 0.0;
-		int node_count = 0;
+		const uint64_t bit = UINT64_C(1) << i;
+		const GhtDimension *dim = schema->dims[i];
 
-		/* Figure out the range of values for this dimension in child nodes */
-		for ( i = 0; i < node->children->num_nodes; i++ )
+		if ( ! (candidates & bit) )
+			continue;
+
+		if ( ght_node_children_share_value(node, dim, err[i], moved->vals + moved->size, &(err[i])) )
 		{
-			GhtAttribute attr;
-			GhtErr err;
-			err = ght_node_compact_attribute_with_delta(node->children->nodes[i], dim, delta, &attr);
-			if ( err == GHT_OK )
-			{
-				double d;
-				GHT_TRY(ght_attribute_get_value(&attr, &d));
-				(d < minval) ? (minval = d) : 0;
-				(d > maxval) ? (maxval = d) : 0;
-				totval += d;
-				node_count++;
-			}
-			else
+			moved->mask |= bit;
+			moved->size += GhtTypeSizes[dim->type];
+			if ( stats )
 			{
-				continue;
+				stats[i].moved++;
+				stats[i].removed += node->children->num_nodes;
+				stats[i].max_error = GHT_MAX(stats[i].max_error, err[i]);
 			}
 		}
+	}
+
+	/* Only values now held on this node carry error upwards */
+	for ( i = 0; i < GHT_MAX_DIMENSIONS; i++ )
+	{
+		if ( ! (moved->mask & (UINT64_C(1) << i)) )
+			err[i] = 0;
+	}
 
-		/* If the range is narrow, and we got values from all our children, compact them */
-		if ( (maxval-minval) < delta && node_count == node->children->num_nodes )
+	if ( ! moved->mask )
+		return GHT_OK;
+
+	/* Shared values no longer needed on the children */
+	for ( i = 0; i < node->children->num_nodes; i++ )
+	{
+		GhtNode *child = node->children->nodes[i];
+		for ( j = 0; j < GHT_MAX_DIMENSIONS && (moved->mask >> j); j++ )
 		{
-			double val = (minval+maxval)/2.0;
-			GhtAttribute *myattr;
-			for ( i = 0; i < node->children->num_nodes; i++ )
-			{
-				ght_node_delete_attribute(node->children->nodes[i], dim);
-			}
-			ght_attribute_new_from_double(dim, val, &myattr);
-			memcpy(compacted_attribute, myattr, sizeof(GhtAttribute));
-			ght_node_add_attribute(node, myattr);
-			return GHT_OK;
+			if ( moved->mask & (UINT64_C(1) << j) )
+				GHT_TRY(ght_attributeset_delete(&(child->attributes), schema->dims[j]));
 		}
-		return GHT_ERROR;
 	}
-	/* This is a leaf node, send the attribute value up to the caller */
-	else
+
+	/* Moved values win over anything the node already had */
+	GHT_TRY(ght_attributeset_union(moved, node->attributes, &merged));
+	ght_attributeset_free(node->attributes);
+	node->attributes = merged;
+	return GHT_OK;
+}
+
+/*
+ * Recursive compaction routine. In one bottom-up pass, pulls every
+ * attribute in the dimension mask up to the highest node such that all
+ * children share the attribute value. Child copies are deleted in place.
+ * On return err holds, per dimension, the largest difference between the
+ * values now on the node and the original values they replaced.
+ */
+static GhtErr
+ght_node_compact_attributes_recursive(GhtNode *node, uint64_t dimmask,
+		double *err, GhtCompactStats *stats)
+{
+	int i, j;
+	uint64_t candidates = dimmask;
+	double childerr[GHT_MAX_DIMENSIONS];
+
+	memset(err, 0, GHT_MAX_DIMENSIONS * sizeof(double));
+
+	/* Leaf nodes just hold on to their values */
+	if ( ght_node_is_leaf(node) )
+		return GHT_OK;
+
+	/* Children first, then only dimensions every child carries are candidates */
+	for ( i = 0; i < node->children->num_nodes; i++ )
 	{
-		if ( ! node->attributes ) return GHT_ERROR;
-		return ght_attribute_get_by_dimension(node->attributes, dim, compacted_attribute);
+		GhtNode *child = node->children->nodes[i];
+		GHT_TRY(ght_node_compact_attributes_recursive(child, dimmask, childerr, stats));
+		candidates &= child->attributes ? child->attributes->mask : 0;
+		for ( j = 0; j < GHT_MAX_DIMENSIONS && (candidates >> j); j++ )
+			err[j] = GHT_MAX(err[j], childerr[j]);
 	}
+
+	return ght_node_compact_attributes_level(node, candidates, err, stats);
+}
+
+GhtErr
+ght_node_compact_attributes(GhtNode *node, uint64_t dimmask, GhtCompactStats *stats)
+{
+	double err[GHT_MAX_DIMENSIONS];
+	return ght_node_compact_attributes_recursive(node, dimmask, err, stats);
 }
 
 GhtErr
 ght_node_compact_attribute(GhtNode *node, const GhtDimension *dim, GhtAttribute *attr)
 {
-	return ght_node_compact_attribute_with_delta(node, dim, 10e-8, attr);
+	GHT_TRY(ght_node_compact_attributes(node, UINT64_C(1) << dim->position, NULL));
+	return ght_node_get_attribute(node, dim, attr);
 }
 
 /**
- * Recursive node serialization:
+ * Node serialization, everything but the children:
  * - length of GhtHash
  * - GhtHash (no null terminator)
  * - number of GhtAttributes
  * - GhtAttribute[]
+ * - ghtFlag
  * - number of child GhtNodes
- * - GhtNode[]
  */
-GhtErr 
-ght_node_write(const GhtNode *node, GhtWriter *writer)
+GhtErr
+ght_node_write_header(const GhtNode *node, uint8_t childcount, GhtWriter *writer)
 {
-	uint8_t attrcount = 0;
-	uint8_t childcount = 0;
-	GhtAttribute *attr = node->attributes;
-
 	/* Write the hash */
 	GHT_TRY(ght_hash_write(node->hash, writer));
 
 	/* Write the attributes */
-	GHT_TRY(ght_node_count_attributes(node, &attrcount));
-	ght_write(writer, &attrcount, 1);
-	while( attr )
-	{
-		ght_attribute_write(attr, writer);
-		attr = attr->next;
-	}
+	GHT_TRY(ght_attributeset_write(node->attributes, writer));
 	/* Write the flagGHT */
 	// ght_write(GhtWriter *writer, const void *bytes, size_t bytesize)
 	ght_write(writer, &node->ghtFlag, 1);
 
+	ght_write(writer, &childcount, 1);
+	return GHT_OK;
+}
+
+/**
+ * Recursive node serialization:
+ * - node header, see ght_node_write_header
+ * - GhtNode[]
+ */
+GhtErr 
+ght_node_write(const GhtNode *node, GhtWriter *writer)
+{
+	uint8_t childcount = 0;
+
 	/* Write the children */
 	if ( node->children )
 		childcount = node->children->num_nodes;
 
-	ght_write(writer, &childcount, 1);
+	GHT_TRY(ght_node_write_header(node, childcount, writer));
 	if ( childcount )
 	{
 		int i;
@@ -653,17 +791,14 @@ ght_node_write(const GhtNode *node, GhtWriter *writer)
 /** 
  * Recursive node deserialization
  */
-GhtErr 
-ght_node_read(GhtReader *reader, GhtNode **node)
+/* Hash, attributes and flag, everything ght_node_write_header puts before the child count */
+static GhtErr
+ght_node_read_header(GhtReader *reader, GhtNode **node)
 {
-	int i;
-	uint8_t attrcount;
-	uint8_t childcount;
 	uint8_t ghtFlag = 0; //TODO pour l'instant
 
 	GhtHash *hash = NULL;
 	GhtNode *n = NULL;
-	GhtAttribute *attr = NULL;
 
 	/* Read the hash string */
 	ght_hash_read(reader, &hash);
@@ -677,18 +812,28 @@ ght_node_read(GhtReader *reader, GhtNode **node)
 	}
 
 	/* Read the attributes */
-	ght_read(reader, &attrcount, 1);
-	while ( attrcount )
+	if ( ght_attributeset_read(reader, &(n->attributes)) != GHT_OK )
 	{
-		GHT_TRY(ght_attribute_read(reader, &attr));
-		GHT_TRY(ght_node_add_attribute(n, attr));
-		attrcount--;
+		ght_node_free(n);
+		return GHT_ERROR;
 	}
 
 	/* Read the flagGHT */
 
 	ght_read(reader, &ghtFlag, 1);
 
+	*node = n;
+	return GHT_OK;
+}
+
+GhtErr 
+ght_node_read(GhtReader *reader, GhtNode **node)
+{
+	int i;
+	uint8_t childcount;
+	GhtNode *n = NULL;
+
+	GHT_TRY(ght_node_read_header(reader, &n));
 
 	/* Read the children */
 	ght_read(reader, &childcount, 1);
@@ -711,13 +856,358 @@ ght_node_read(GhtReader *reader, GhtNode **node)
 	return GHT_OK;
 }
 
+GhtErr
+ght_node_write_grouped_header(const GhtNode *node, uint64_t childcount, GhtWriter *writer)
+{
+	GHT_TRY(ght_hash_write(node->hash, writer));
+	GHT_TRY(ght_attributeset_write(node->attributes, writer));
+	GHT_TRY(ght_write(writer, &node->ghtFlag, 1));
+	return ght_write_varint(writer, childcount);
+}
+
+/* Groups for everything below the node, the node's own children last */
+static GhtErr
+ght_node_write_groups(const GhtNode *node, GhtWriter *writer)
+{
+	int i, n = ght_node_num_children(node);
+
+	if ( ! n )
+		return GHT_OK;
+	for ( i = 0; i < n; i++ )
+		GHT_TRY(ght_node_write_groups(node->children->nodes[i], writer));
+
+	GHT_TRY(ght_write_varint(writer, n));
+	for ( i = 0; i < n; i++ )
+	{
+		const GhtNode *child = node->children->nodes[i];
+		GHT_TRY(ght_node_write_grouped_header(child, ght_node_num_children(child), writer));
+	}
+	return GHT_OK;
+}
+
+/**
+ * Grouped node serialization, children before their parents:
+ * - for each node with children, after the groups of everything below
+ *   it, a group of its children: the count, then each child's header
+ *   with a varint child count
+ * - a group of one, the root
+ * - a zero count
+ * A node's children are known when it closes, so a writer can put out
+ * each group then, without holding the tree or going back to it.
+ */
+GhtErr
+ght_node_write_grouped(const GhtNode *node, GhtWriter *writer)
+{
+	GHT_TRY(ght_node_write_groups(node, writer));
+	GHT_TRY(ght_write_varint(writer, 1));
+	GHT_TRY(ght_node_write_grouped_header(node, ght_node_num_children(node), writer));
+	return ght_write_varint(writer, 0);
+}
+
+/*
+ * The groups of children for the nodes of a group are the most recent
+ * ones read, in the same order, so finished groups wait on a stack
+ * until the group holding their parents comes along.
+ */
+GhtErr
+ght_node_read_grouped(GhtReader *reader, GhtNode **node)
+{
+	GhtNodeList **stack = NULL;
+	uint64_t *childcounts = NULL;
+	int num_stack = 0, max_stack = 0;
+	GhtErr err = GHT_OK;
+	uint64_t count, i;
+
+	while ( err == GHT_OK )
+	{
+		GhtNodeList *group;
+		int base, waiting = 0;
+
+		err = ght_read_varint(reader, &count);
+		if ( err != GHT_OK || ! count )
+			break;
+		if ( count > INT_MAX )
+		{
+			ght_error("%s: group of %llu nodes is too large", __func__, (unsigned long long)count);
+			err = GHT_ERROR;
+			break;
+		}
+
+		err = ght_nodelist_new(count, &group);
+		if ( err != GHT_OK )
+			break;
+		childcounts = ght_realloc(childcounts, count * sizeof(uint64_t));
+		for ( i = 0; i < count && err == GHT_OK; i++ )
+		{
+			GhtNode *n;
+			err = ght_node_read_header(reader, &n);
+			if ( err == GHT_OK )
+				err = ght_read_varint(reader, &(childcounts[i]));
+			if ( err == GHT_OK )
+				err = ght_nodelist_add_node(group, n);
+			if ( err == GHT_OK && childcounts[i] )
+				waiting++;
+		}
+
+		/* Hand the waiting groups to their parents, oldest first */
+		base = num_stack - waiting;
+		if ( err == GHT_OK && base < 0 )
+		{
+			ght_error("%s: %d nodes need children that were not written", __func__, waiting);
+			err = GHT_ERROR;
+		}
+		for ( i = 0; i < count && err == GHT_OK; i++ )
+		{
+			GhtNode *n = group->nodes[i];
+			if ( ! childcounts[i] )
+				continue;
+			/* A node list never holds a negative count */
+			if ( (uint64_t)stack[base]->num_nodes != childcounts[i] )
+			{
+				ght_error("%s: node expects %llu children, found %d", __func__,
+				          (unsigned long long)childcounts[i], stack[base]->num_nodes);
+				err = GHT_ERROR;
+				break;
+			}
+			n->children = stack[base];
+			stack[base++] = NULL;
+		}
+		if ( err != GHT_OK )
+		{
+			ght_nodelist_free_deep(group);
+			break;
+		}
+		num_stack -= waiting;
+
+		if ( num_stack == max_stack )
+		{
+			max_stack = max_stack ? 2 * max_stack : 32;
+			stack = ght_realloc(stack, max_stack * sizeof(GhtNodeList*));
+		}
+		stack[num_stack++] = group;
+	}
+
+	if ( err == GHT_OK && (num_stack != 1 || stack[0]->num_nodes != 1) )
+	{
+		ght_error("%s: tree does not end with a single root", __func__);
+		err = GHT_ERROR;
+	}
+	if ( err == GHT_OK )
+	{
+		*node = stack[0]->nodes[0];
+		ght_nodelist_free_shallow(stack[0]);
+		num_stack = 0;
+	}
+
+	while ( num_stack > 0 )
+	{
+		if ( stack[--num_stack] )
+			ght_nodelist_free_deep(stack[num_stack]);
+	}
+	if ( stack )
+		ght_free(stack);
+	if ( childcounts )
+		ght_free(childcounts);
+	return err;
+}
+
+static void
+ght_node_residual_mask_recursive(const GhtNode *node, const GhtSchema *schema,
+		uint64_t floatmask, uint64_t *resmask)
+{
+	int i;
+	GhtAttribute attr;
+	uint64_t q;
+
+	/* Floats drop out as soon as one value is not integral */
+	for ( i = 0; node->attributes && i < schema->num_dims; i++ )
+	{
+		const uint64_t bit = UINT64_C(1) << i;
+		if ( ! (node->attributes->mask & floatmask & *resmask & bit) )
+			continue;
+		ght_attributeset_get(node->attributes, schema->dims[i], &attr);
+		if ( ght_attribute_quantize(schema->dims[i], attr.val, &q) != GHT_OK )
+			*resmask &= ~bit;
+	}
+
+	for ( i = 0; node->children && i < node->children->num_nodes; i++ )
+	{
+		ght_node_residual_mask_recursive(node->children->nodes[i], schema, floatmask, resmask);
+	}
+}
+
+GhtErr
+ght_node_get_residual_mask(const GhtNode *node, const GhtSchema *schema, uint64_t *resmask)
+{
+	int i;
+	uint64_t floatmask = 0;
+
+	*resmask = 0;
+	for ( i = 0; i < schema->num_dims; i++ )
+	{
+		*resmask |= UINT64_C(1) << i;
+		if ( schema->dims[i]->type == GHT_DOUBLE || schema->dims[i]->type == GHT_FLOAT )
+			floatmask |= UINT64_C(1) << i;
+	}
+	if ( node && floatmask )
+		ght_node_residual_mask_recursive(node, schema, floatmask, resmask);
+	/* Packed dimensions are already as small as they get */
+	*resmask &= ~(schema->packmask);
+	return GHT_OK;
+}
+
+/*
+ * Predict the values under a node from the first value found down
+ * its first-child chain. Cheap, and close for spatially clustered data.
+ */
+static int
+ght_node_first_value(const GhtNode *node, const GhtDimension *dim, uint64_t *q)
+{
+	GhtAttribute attr;
+	while ( node )
+	{
+		if ( ght_node_get_attribute(node, dim, &attr) == GHT_OK )
+			return ght_attribute_quantize(dim, attr.val, q) == GHT_OK;
+		if ( ! node->children || node->children->num_nodes == 0 )
+			return 0;
+		node = node->children->nodes[0];
+	}
+	return 0;
+}
+
+/*
+ * Residual node layout: hash, attributes as residuals from the inherited
+ * base, flag, child count and then, for interior nodes only, the base
+ * updates for this subtree as (position, residual) pairs.
+ */
+static GhtErr
+ght_node_write_residual_recursive(const GhtNode *node, const GhtSchema *schema,
+		uint64_t resmask, const uint64_t *base, GhtWriter *writer)
+{
+	int i;
+	uint8_t childcount = 0;
+	uint8_t updatecount = 0;
+	uint64_t newbase[GHT_MAX_DIMENSIONS];
+	uint8_t positions[GHT_MAX_DIMENSIONS];
+
+	GHT_TRY(ght_hash_write(node->hash, writer));
+	GHT_TRY(ght_attributeset_write_residual(node->attributes, resmask, base, writer));
+	GHT_TRY(ght_write(writer, &node->ghtFlag, 1));
+
+	if ( node->children )
+		childcount = node->children->num_nodes;
+	GHT_TRY(ght_write(writer, &childcount, 1));
+	if ( ! childcount )
+		return GHT_OK;
+
+	/* Base values for the subtree, only written where they change */
+	memcpy(newbase, base, sizeof(newbase));
+	for ( i = 0; i < schema->num_dims; i++ )
+	{
+		uint64_t q;
+		const uint64_t bit = UINT64_C(1) << i;
+		if ( ! (resmask & bit) || (node->attributes && (node->attributes->mask & bit)) )
+			continue;
+		if ( ght_node_first_value(node->children->nodes[0], schema->dims[i], &q) && q != base[i] )
+		{
+			newbase[i] = q;
+			positions[updatecount++] = (uint8_t)i;
+		}
+	}
+	GHT_TRY(ght_write(writer, &updatecount, 1));
+	for ( i = 0; i < updatecount; i++ )
+	{
+		const int d = positions[i];
+		GHT_TRY(ght_write(writer, &positions[i], 1));
+		GHT_TRY(ght_write_varint(writer, ght_zigzag_encode(newbase[d] - base[d])));
+	}
+
+	for ( i = 0; i < childcount; i++ )
+	{
+		GHT_TRY(ght_node_write_residual_recursive(node->children->nodes[i], schema, resmask, newbase, writer));
+	}
+	return GHT_OK;
+}
+
+GhtErr
+ght_node_write_residual(const GhtNode *node, const GhtSchema *schema,
+		uint64_t resmask, GhtWriter *writer)
+{
+	uint64_t base[GHT_MAX_DIMENSIONS];
+	memset(base, 0, sizeof(base));
+	return ght_node_write_residual_recursive(node, schema, resmask, base, writer);
+}
+
+static GhtErr
+ght_node_read_residual_recursive(GhtReader *reader, uint64_t resmask,
+		const uint64_t *base, GhtNode **node)
+{
+	int i;
+	uint8_t childcount, updatecount;
+	uint64_t newbase[GHT_MAX_DIMENSIONS];
+	GhtHash *hash = NULL;
+	GhtNode *n = NULL;
+
+	GHT_TRY(ght_hash_read(reader, &hash));
+	if ( hash )
+	{
+		GhtErr err = ght_node_new_from_hash(hash, &n);
+		ght_free(hash);
+		GHT_TRY(err);
+	}
+	else
+	{
+		GHT_TRY(ght_node_new(&n));
+	}
+	*node = n;
+
+	GHT_TRY(ght_attributeset_read_residual(reader, resmask, base, &(n->attributes)));
+	GHT_TRY(ght_read(reader, &(n->ghtFlag), 1));
+	GHT_TRY(ght_read(reader, &childcount, 1));
+	if ( ! childcount )
+		return GHT_OK;
+
+	memcpy(newbase, base, sizeof(newbase));
+	GHT_TRY(ght_read(reader, &updatecount, 1));
+	for ( i = 0; i < updatecount; i++ )
+	{
+		uint8_t d;
+		uint64_t r;
+		GHT_TRY(ght_read(reader, &d, 1));
+		GHT_TRY(ght_read_varint(reader, &r));
+		if ( d >= GHT_MAX_DIMENSIONS )
+		{
+			ght_error("%s: base update for invalid dimension %d", __func__, d);
+			return GHT_ERROR;
+		}
+		newbase[d] = base[d] + ght_zigzag_decode(r);
+	}
+
+	GHT_TRY(ght_nodelist_new(childcount, &(n->children)));
+	for ( i = 0; i < childcount; i++ )
+	{
+		GhtNode *nc = NULL;
+		GHT_TRY(ght_node_read_residual_recursive(reader, resmask, newbase, &nc));
+		GHT_TRY(ght_node_add_child(n, nc));
+	}
+	return GHT_OK;
+}
+
+GhtErr
+ght_node_read_residual(GhtReader *reader, uint64_t resmask, GhtNode **node)
+{
+	uint64_t base[GHT_MAX_DIMENSIONS];
+	memset(base, 0, sizeof(base));
+	return ght_node_read_residual_recursive(reader, resmask, base, node);
+}
+
 /* Recursively build a nodelist from a tree of GhtNodes */
 GhtErr
-ght_node_to_nodelist(const GhtNode *node, GhtNodeList *nodelist, GhtAttribute *attr, GhtHash *hash)
+ght_node_to_nodelist(const GhtNode *node, GhtNodeList *nodelist, const GhtAttributeSet *attr, GhtHash *hash)
 {
 	static int hash_array_len = GHT_MAX_HASH_LENGTH + 1;
 	GhtHash h[hash_array_len];
-	GhtAttribute *a;
+	GhtAttributeSet *a;
 
 	/* Add our part of the hash to the incoming part */
 	memset(h, 0, hash_array_len);
@@ -728,7 +1218,7 @@ ght_node_to_nodelist(const GhtNode *node, GhtNodeList *nodelist, GhtAttribute *a
 	}
 
 	/* Make a copy of all the incoming attributes */
-	GHT_TRY(ght_attribute_union(node->attributes, attr, &a));
+	GHT_TRY(ght_attributeset_union(node->attributes, attr, &a));
 
 	/* Recurse down to leaf nodes, copying attributes and passing them down */
 	if ( node->children && node->children->num_nodes > 0 )
@@ -738,14 +1228,14 @@ ght_node_to_nodelist(const GhtNode *node, GhtNodeList *nodelist, GhtAttribute *a
 		{
 			GHT_TRY(ght_node_to_nodelist(node->children->nodes[i], nodelist, a, h));
 		}
-		ght_attribute_free(a);
+		ght_attributeset_free(a);
 	}
 	/* This is a leaf node, create a new node and add to list */
 	else
 	{
 		GhtNode *n;
 		GHT_TRY(ght_node_new_from_hash(h, &n));
-		GHT_TRY(ght_node_add_attribute(n, a));
+		n->attributes = a;
 		GHT_TRY(ght_nodelist_add_node(nodelist, n));
 	}
 
@@ -755,7 +1245,7 @@ ght_node_to_nodelist(const GhtNode *node, GhtNodeList *nodelist, GhtAttribute *a
 
 /* Recursively build a nodelist from a tree of GhtNodes */
 GhtErr
-ght_node_get_extent(const GhtNode *node, const GhtHash *hash, GhtArea *area)
+ght_node_get_extent(const GhtNode *node, const GhtHash *hash, const GhtArea *frame, const GhtRange *vertical, GhtArea *area)
 {
 	static int hash_array_len = GHT_MAX_HASH_LENGTH + 1;
 	GhtHash h[hash_array_len];
@@ -774,13 +1264,21 @@ ght_node_get_extent(const GhtNode *node, const GhtHash *hash, GhtArea *area)
 		{
 			if ( node->children->nodes[i] && node->children->nodes[i]->hash )
 			{
-				ght_node_get_extent(node->children->nodes[i], h, area);
+				ght_node_get_extent(node->children->nodes[i], h, frame, vertical, area);
 			}
 		}
 	}
 	else
 	{
-		ght_coordinate_from_hash(h, &coord);
+		if ( vertical )
+		{
+			double z;
+			ght_coordinate_from_hash_3d(h, frame, vertical, &coord, &z);
+		}
+		else
+		{
+			ght_coordinate_from_hash_frame(h, frame, &coord);
+		}
 		if ( coord.x < area->x.min ) area->x.min = coord.x;
 		if ( coord.x > area->x.max ) area->x.max = coord.x;
 		if ( coord.y < area->y.min ) area->y.min = coord.y;
@@ -790,14 +1288,439 @@ ght_node_get_extent(const GhtNode *node, const GhtHash *hash, GhtArea *area)
 	return GHT_OK;
 }
 
-GhtErr 
-ght_node_filter_by_attribute(const GhtNode *node, const GhtFilter *filter, GhtNode **filtered_node)
+/******************************************************************************
+ *  GhtFilter
+ ******************************************************************************/
+
+/*
+ * A filter is compiled once per query into an inclusive range over the packed
+ * storage values of its dimension, so the tree walk compares raw integers or
+ * floats and never decodes. For scaled integer storage the bounds come from
+ * a search around the inverse-scaled threshold using the same arithmetic as
+ * ght_attribute_get_value, so greater, less and between keep exactly the
+ * nodes a comparison of decoded doubles would. GHT_EQUAL on a scaled integer
+ * dimension matches the storage value the query would be stored as instead,
+ * because the decoded double of a scaled value rarely equals the literal
+ * asked for. GHT_IN compiles each of its values as a GHT_EQUAL and keeps
+ * the resulting storage values in a small set.
+ */
+
+#define GHT_FILTER_MATCH(fname, ctype, lofield, hifield) \
+static int fname(const GhtFilter *filter, const uint8_t *bytes) \
+{ \
+	ctype v; \
+	memcpy(&v, bytes, sizeof(ctype)); \
+	return v >= filter->lofield && v <= filter->hifield; \
+}
+
+GHT_FILTER_MATCH(ght_filter_match_int8, int8_t, lo, hi)
+GHT_FILTER_MATCH(ght_filter_match_uint8, uint8_t, ulo, uhi)
+GHT_FILTER_MATCH(ght_filter_match_int16, int16_t, lo, hi)
+GHT_FILTER_MATCH(ght_filter_match_uint16, uint16_t, ulo, uhi)
+GHT_FILTER_MATCH(ght_filter_match_int32, int32_t, lo, hi)
+GHT_FILTER_MATCH(ght_filter_match_uint32, uint32_t, ulo, uhi)
+GHT_FILTER_MATCH(ght_filter_match_int64, int64_t, lo, hi)
+GHT_FILTER_MATCH(ght_filter_match_uint64, uint64_t, ulo, uhi)
+GHT_FILTER_MATCH(ght_filter_match_double, double, dlo, dhi)
+GHT_FILTER_MATCH(ght_filter_match_float, float, dlo, dhi)
+
+/** Storage that cannot be compared directly, decode and test the real value */
+static int
+ght_filter_match_decoded(const GhtFilter *filter, const uint8_t *bytes)
+{
+	double v;
+	ght_attribute_decode_values(filter->dim, bytes, 1, &v);
+	return v >= filter->dlo && v <= filter->dhi;
+}
+
+static int
+ght_filter_match_none(const GhtFilter *filter, const uint8_t *bytes)
+{
+	(void)filter;
+	(void)bytes;
+	return 0;
+}
+
+/** Integer storage in the GHT_IN set, compared zero extended */
+static int
+ght_filter_match_in(const GhtFilter *filter, const uint8_t *bytes)
+{
+	uint64_t v = 0;
+	int i;
+	memcpy(&v, bytes, GhtTypeSizes[filter->dim->type]);
+	for ( i = 0; i < filter->num_in; i++ )
+	{
+		if ( filter->inset[i] == v )
+			return 1;
+	}
+	return 0;
+}
+
+/** Decoded value in the GHT_IN set */
+static int
+ght_filter_match_in_decoded(const GhtFilter *filter, const uint8_t *bytes)
+{
+	double v, w;
+	int i;
+	ght_attribute_decode_values(filter->dim, bytes, 1, &v);
+	for ( i = 0; i < filter->num_in; i++ )
+	{
+		memcpy(&w, &(filter->inset[i]), sizeof(double));
+		if ( v == w )
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Largest storage value in [tmin, tmax] that decodes below x (or to x, when
+ * not strict), *found is 0 when there is none. The start point is exact or
+ * off by one almost everywhere; past 2^53 decoded values plateau and the
+ * walk is still bounded by the double spacing.
+ */
+#define GHT_FILTER_FLOOR(fname, itype) \
+static itype fname(const GhtDimension *dim, double x, int strict, itype tmin, itype tmax, int *found) \
+{ \
+	double t = x, v; \
+	itype c; \
+	if ( dim->offset ) t -= dim->offset; \
+	if ( dim->scale != 1 ) t /= dim->scale; \
+	if ( t < (double)tmin ) c = tmin; \
+	else if ( t >= (double)tmax ) c = tmax; \
+	else c = (itype)floor(t); \
+	for ( ;; ) \
+	{ \
+		v = c; \
+		if ( dim->scale != 1 ) v *= dim->scale; \
+		if ( dim->offset ) v += dim->offset; \
+		if ( (strict ? v < x : v <= x) || c == tmin ) break; \
+		c--; \
+	} \
+	if ( ! (strict ? v < x : v <= x) ) \
+	{ \
+		*found = 0; \
+		return tmin; \
+	} \
+	while ( c < tmax ) \
+	{ \
+		v = (itype)(c + 1); \
+		if ( dim->scale != 1 ) v *= dim->scale; \
+		if ( dim->offset ) v += dim->offset; \
+		if ( ! (strict ? v < x : v <= x) ) break; \
+		c++; \
+	} \
+	*found = 1; \
+	return c; \
+}
+
+/*
+ * Inclusive storage range [*lo, *hi] for the filter, returns 0 when no
+ * storage value can pass.
+ */
+#define GHT_FILTER_RANGE(fname, floorfn, itype) \
+static int fname(const GhtFilter *filter, itype tmin, itype tmax, itype *lo, itype *hi) \
+{ \
+	const GhtDimension *dim = filter->dim; \
+	double min = filter->range.min, max = filter->range.max; \
+	int found; \
+	itype c; \
+	if ( filter->mode == GHT_EQUAL && dim->scale != 1 ) \
+	{ \
+		/* The storage value the query itself would be stored as */ \
+		double t = min; \
+		if ( dim->offset ) t -= dim->offset; \
+		t /= dim->scale; \
+		if ( ! (t >= (double)tmin && t < (double)tmax + 1.0) ) return 0; \
+		*lo = *hi = (itype)t; \
+		return 1; \
+	} \
+	*lo = tmin; \
+	*hi = tmax; \
+	if ( filter->mode != GHT_LESS_THAN ) \
+	{ \
+		/* Values above min (strictly, for greater than) */ \
+		c = floorfn(dim, min, filter->mode != GHT_GREATER_THAN, tmin, tmax, &found); \
+		if ( found ) \
+		{ \
+			if ( c == tmax ) return 0; \
+			*lo = c + 1; \
+		} \
+	} \
+	if ( filter->mode != GHT_GREATER_THAN ) \
+	{ \
+		/* Values below max (strictly, for less than) */ \
+		c = floorfn(dim, max, filter->mode == GHT_LESS_THAN, tmin, tmax, &found); \
+		if ( ! found ) return 0; \
+		*hi = c; \
+	} \
+	return *lo <= *hi; \
+}
+
+GHT_FILTER_FLOOR(ght_filter_floor_signed, int64_t)
+GHT_FILTER_FLOOR(ght_filter_floor_unsigned, uint64_t)
+GHT_FILTER_RANGE(ght_filter_range_signed, ght_filter_floor_signed, int64_t)
+GHT_FILTER_RANGE(ght_filter_range_unsigned, ght_filter_floor_unsigned, uint64_t)
+
+/** Range of real values for storage that is compared as doubles */
+static int
+ght_filter_range_double(GhtFilter *filter)
+{
+	filter->dlo = -INFINITY;
+	filter->dhi = INFINITY;
+	switch ( filter->mode )
+	{
+	case GHT_GREATER_THAN:
+		if ( filter->range.min == INFINITY ) return 0;
+		filter->dlo = nextafter(filter->range.min, INFINITY);
+		break;
+	case GHT_LESS_THAN:
+		if ( filter->range.max == -INFINITY ) return 0;
+		filter->dhi = nextafter(filter->range.max, -INFINITY);
+		break;
+	case GHT_BETWEEN:
+		filter->dlo = filter->range.min;
+		filter->dhi = filter->range.max;
+		break;
+	case GHT_EQUAL:
+		filter->dlo = filter->dhi = filter->range.min;
+		break;
+	case GHT_IN:
+		/* Compiled value by value as GHT_EQUAL, never a single range */
+		return 0;
+	}
+	/* NaN thresholds keep nothing, like the comparisons they replace */
+	return filter->dlo <= filter->dhi;
+}
+
+/** Storage value of a compiled integer GHT_EQUAL, zero extended like ght_filter_match_in reads it */
+#define GHT_FILTER_KEY(ctype, field) { ctype v = (ctype)eq->field; memcpy(&key, &v, sizeof(ctype)); break; }
+
+static uint64_t
+ght_filter_storage_key(const GhtFilter *eq)
+{
+	uint64_t key = 0;
+	switch ( eq->dim->type )
+	{
+	case GHT_INT8: GHT_FILTER_KEY(int8_t, lo)
+	case GHT_UINT8: GHT_FILTER_KEY(uint8_t, ulo)
+	case GHT_INT16: GHT_FILTER_KEY(int16_t, lo)
+	case GHT_UINT16: GHT_FILTER_KEY(uint16_t, ulo)
+	case GHT_INT32: GHT_FILTER_KEY(int32_t, lo)
+	case GHT_UINT32: GHT_FILTER_KEY(uint32_t, ulo)
+	case GHT_INT64: GHT_FILTER_KEY(int64_t, lo)
+	default: GHT_FILTER_KEY(uint64_t, ulo)
+	}
+	return key;
+}
+
+static GhtErr
+ght_filter_compile_in(GhtFilter *filter)
+{
+	int i;
+
+	if ( filter->num_values < 1 || filter->num_values > GHT_FILTER_MAX_IN || ! filter->values )
+	{
+		ght_error("%s: GHT_IN takes 1 to %d values, got %d", __func__, GHT_FILTER_MAX_IN, filter->num_values);
+		return GHT_ERROR;
+	}
+
+	filter->num_in = 0;
+	filter->match = ght_filter_match_in;
+	for ( i = 0; i < filter->num_values; i++ )
+	{
+		GhtFilter eq;
+		memset(&eq, 0, sizeof(GhtFilter));
+		eq.mode = GHT_EQUAL;
+		eq.dim = filter->dim;
+		eq.range.min = eq.range.max = filter->values[i];
+		GHT_TRY(ght_filter_compile(&eq));
+
+		if ( eq.match == ght_filter_match_none )
+			continue;
+		if ( eq.match == ght_filter_match_decoded || eq.match == ght_filter_match_double ||
+		     eq.match == ght_filter_match_float )
+		{
+			filter->match = ght_filter_match_in_decoded;
+			memcpy(&(filter->inset[filter->num_in++]), &(eq.dlo), sizeof(double));
+		}
+		else
+		{
+			filter->inset[filter->num_in++] = ght_filter_storage_key(&eq);
+		}
+	}
+	if ( ! filter->num_in )
+		filter->match = ght_filter_match_none;
+	return GHT_OK;
+}
+
+GhtErr
+ght_filter_compile(GhtFilter *filter)
 {
+	const GhtDimension *dim = filter->dim;
+	int ok;
+
+	if ( filter->mode < GHT_GREATER_THAN || filter->mode > GHT_IN )
+	{
+		ght_error("%s: invalid GhtFilterMode (%d)", __func__, filter->mode);
+		return GHT_ERROR;
+	}
+	if ( filter->mode == GHT_IN )
+		return ght_filter_compile_in(filter);
+
+	/* Descending or degenerate scales, and NaN thresholds, compare decoded values */
+	if ( ! (dim->scale > 0) || isnan(filter->range.min) || isnan(filter->range.max) ||
+	     dim->type == GHT_DOUBLE || dim->type == GHT_FLOAT )
+	{
+		ok = ght_filter_range_double(filter);
+		if ( dim->scale == 1 && ! dim->offset && dim->type == GHT_DOUBLE )
+			filter->match = ght_filter_match_double;
+		else if ( dim->scale == 1 && ! dim->offset && dim->type == GHT_FLOAT )
+			filter->match = ght_filter_match_float;
+		else
+			filter->match = ght_filter_match_decoded;
+		if ( ! ok )
+			filter->match = ght_filter_match_none;
+		return GHT_OK;
+	}
+
+	switch ( dim->type )
+	{
+	case GHT_INT8:
+		ok = ght_filter_range_signed(filter, INT8_MIN, INT8_MAX, &filter->lo, &filter->hi);
+		filter->match = ght_filter_match_int8;
+		break;
+	case GHT_UINT8:
+		ok = ght_filter_range_unsigned(filter, 0, UINT8_MAX, &filter->ulo, &filter->uhi);
+		filter->match = ght_filter_match_uint8;
+		break;
+	case GHT_INT16:
+		ok = ght_filter_range_signed(filter, INT16_MIN, INT16_MAX, &filter->lo, &filter->hi);
+		filter->match = ght_filter_match_int16;
+		break;
+	case GHT_UINT16:
+		ok = ght_filter_range_unsigned(filter, 0, UINT16_MAX, &filter->ulo, &filter->uhi);
+		filter->match = ght_filter_match_uint16;
+		break;
+	case GHT_INT32:
+		ok = ght_filter_range_signed(filter, INT32_MIN, INT32_MAX, &filter->lo, &filter->hi);
+		filter->match = ght_filter_match_int32;
+		break;
+	case GHT_UINT32:
+		ok = ght_filter_range_unsigned(filter, 0, UINT32_MAX, &filter->ulo, &filter->uhi);
+		filter->match = ght_filter_match_uint32;
+		break;
+	case GHT_INT64:
+		ok = ght_filter_range_signed(filter, INT64_MIN, INT64_MAX, &filter->lo, &filter->hi);
+		filter->match = ght_filter_match_int64;
+		break;
+	case GHT_UINT64:
+		ok = ght_filter_range_unsigned(filter, 0, UINT64_MAX, &filter->ulo, &filter->uhi);
+		filter->match = ght_filter_match_uint64;
+		break;
+	default:
+		ght_error("%s: dimension '%s' has no storage type", __func__, dim->name);
+		return GHT_ERROR;
+	}
+	if ( ! ok )
+		filter->match = ght_filter_match_none;
+	return GHT_OK;
+}
+
+uint64_t
+ght_filter_presence_mask(const GhtFilter *filter)
+{
+	/* Leaves with no value on their path always pass */
+	uint64_t bits = GHT_PRESENCE_MISSING;
 	int i;
-	double val;
-	int keep = 1;
-	GhtAttribute *attr;
+
+	if ( filter->match == ght_filter_match_none )
+		return bits;
+	/* Integer storage, compiled down to a single value */
+	if ( filter->mode == GHT_EQUAL && filter->lo == filter->hi && filter->ulo == filter->uhi &&
+	     filter->match != ght_filter_match_decoded && filter->match != ght_filter_match_double &&
+	     filter->match != ght_filter_match_float )
+		return bits | ght_presence_bit(ght_filter_storage_key(filter));
+	if ( filter->mode == GHT_IN && filter->match == ght_filter_match_in )
+	{
+		for ( i = 0; i < filter->num_in; i++ )
+			bits |= ght_presence_bit(filter->inset[i]);
+		return bits;
+	}
+	return 0;
+}
+
+/*
+ * A node with its own value of the dimension has just that bit, since the
+ * filter tests it directly before going further. Otherwise it has the bits
+ * of its children, and a bare leaf has GHT_PRESENCE_MISSING. Insertion only
+ * ever adds bits, so the maps stay a superset of what is below.
+ */
+GhtErr
+ght_node_build_presence(GhtNode *node, const GhtDimension *dim)
+{
+	int i;
+	const uint8_t *bytes;
+	uint64_t own = 0;
+
+	if ( ght_attributeset_get_bytes(node->attributes, dim, &bytes) == GHT_OK )
+	{
+		memcpy(&own, bytes, GhtTypeSizes[dim->type]);
+		own = ght_presence_bit(own);
+	}
+	node->presence = own;
+
+	for ( i = 0; i < ght_node_num_children(node); i++ )
+	{
+		GhtNode *child = node->children->nodes[i];
+		GHT_TRY(ght_node_build_presence(child, dim));
+		if ( ! own )
+			node->presence |= child->presence;
+	}
+	if ( ! node->presence )
+		node->presence = GHT_PRESENCE_MISSING;
+	return GHT_OK;
+}
+
+/*
+ * In a 3D tree every point was hashed with its z, so a subtree whose cell
+ * lies wholly outside a Z filter can go without looking at its values.
+ * That z is taken to be the one in the "Z" attribute; callers hashing
+ * some other z are told so on ght_node_new_from_coordinate_3d.
+ * Stored values can sit a storage step, or the compaction tolerance,
+ * away from the z that was hashed, hence the slack.
+ */
+static int
+ght_filter_misses_cell(const GhtFilter *filter, const GhtHash *hash)
+{
+	GhtArea area;
+	GhtRange z;
+	double slack = fabs(filter->dim->scale) + filter->dim->tolerance;
+
+	if ( ght_volume_from_hash(hash, filter->frame, filter->vertical, &area, &z) != GHT_OK )
+		return 0;
+
+	switch ( filter->mode )
+	{
+	case GHT_GREATER_THAN:
+		return z.max + slack < filter->range.min;
+	case GHT_LESS_THAN:
+		return z.min - slack > filter->range.max;
+	case GHT_BETWEEN:
+	case GHT_EQUAL:
+		return z.max + slack < filter->range.min || z.min - slack > filter->range.max;
+	default:
+		return 0;
+	}
+}
+
+static GhtErr
+ght_node_filter(const GhtNode *node, const GhtFilter *filter, const GhtHash *hash, GhtNode **filtered_node)
+{
+	int i;
+	int keep = 1, own = 0;
+	const uint8_t *bytes;
 	GhtNode *node_copy = NULL;
+	GhtHash h[GHT_MAX_HASH_LENGTH + 1] = "";
 
 	/* Our default position is nothing is getting returned */
 	*filtered_node = NULL;
@@ -806,36 +1729,11 @@ ght_node_filter_by_attribute(const GhtNode *node, const GhtFilter *filter, GhtNo
 	if ( ! node )
 		return GHT_OK;
 
-	attr = node->attributes;
-	while ( attr )
+	/* Only filter on the attribute of interest */
+	if ( ght_attributeset_get_bytes(node->attributes, filter->dim, &bytes) == GHT_OK )
 	{
-		/* Only filter on the attribute of interest */
-		if ( attr->dim != filter->dim )
-		{
-			attr = attr->next;
-		}
-		else
-		{
-			GHT_TRY(ght_attribute_get_value(attr, &val));
-			switch ( filter->mode )
-			{
-			case GHT_GREATER_THAN:
-				keep = (val > filter->range.min);
-				break;
-			case GHT_LESS_THAN:
-				keep = (val < filter->range.max);
-				break;
-			case GHT_BETWEEN:
-				keep = ((val <= filter->range.max) && (val >= filter->range.min));
-				break;
-			case GHT_EQUAL:
-				keep = (val == filter->range.min);
-				break;
-			default:
-				ght_error("%s: invalid GhtFilterMode (%d)", __func__, filter->mode);
-			}
-			break;
-		}
+		keep = filter->match(filter, bytes);
+		own = 1;
 	}
 
 	/* We found a relevant attribute, and it failed the filter test. */
@@ -845,13 +1743,27 @@ ght_node_filter_by_attribute(const GhtNode *node, const GhtFilter *filter, GhtNo
 		return GHT_OK;
 	}
 
+	/* Nothing below holds a value the filter wants */
+	if ( filter->presence && node->children && ! (node->presence & filter->presence) )
+	{
+		return GHT_OK;
+	}
+
+	/* Nothing below was hashed with a z the filter wants */
+	if ( filter->vertical )
+	{
+		snprintf(h, sizeof(h), "%s%s", hash, node->hash ? node->hash : "");
+		if ( ! own && ght_filter_misses_cell(filter, h) )
+			return GHT_OK;
+	}
+
 	/* Also take copies of any children that pass the filter */
 	if ( node->children )
 	{
 		for ( i = 0; i < node->children->num_nodes; i++ )
 		{
 			GhtNode *child_copy;
-			GHT_TRY(ght_node_filter_by_attribute(node->children->nodes[i], filter, &child_copy));
+			GHT_TRY(ght_node_filter(node->children->nodes[i], filter, h, &child_copy));
 			/* Child survived the filtering */
 			if ( child_copy )
 			{
@@ -859,7 +1771,7 @@ ght_node_filter_by_attribute(const GhtNode *node, const GhtFilter *filter, GhtNo
 				{
 					GHT_TRY(ght_node_new(&node_copy));
 					GHT_TRY(ght_hash_clone(node->hash, &(node_copy->hash)));
-					GHT_TRY(ght_attribute_clone(node->attributes, &(node_copy->attributes)));
+					GHT_TRY(ght_attributeset_clone(node->attributes, &(node_copy->attributes)));
 				}
 				GHT_TRY(ght_node_add_child(node_copy, child_copy));
 			}
@@ -869,7 +1781,7 @@ ght_node_filter_by_attribute(const GhtNode *node, const GhtFilter *filter, GhtNo
 	{
 		GHT_TRY(ght_node_new(&node_copy));
 		GHT_TRY(ght_hash_clone(node->hash, &(node_copy->hash)));
-		GHT_TRY(ght_attribute_clone(node->attributes, &(node_copy->attributes)));
+		GHT_TRY(ght_attributeset_clone(node->attributes, &(node_copy->attributes)));
 	}
 
 	/* Done, return the structure */
@@ -877,6 +1789,19 @@ ght_node_filter_by_attribute(const GhtNode *node, const GhtFilter *filter, GhtNo
 	return GHT_OK;
 }
 
+GhtErr 
+ght_node_filter_by_attribute(const GhtNode *node, const GhtFilter *filter, GhtNode **filtered_node)
+{
+	/* Uncompiled filter from a caller, compile a copy and walk with that */
+	if ( ! filter->match )
+	{
+		GhtFilter compiled = *filter;
+		GHT_TRY(ght_filter_compile(&compiled));
+		return ght_node_filter(node, &compiled, "", filtered_node);
+	}
+	return ght_node_filter(node, filter, "", filtered_node);
+}
+
 
 // Patrick - get hash from node
 GhtErr
@@ -901,16 +1826,16 @@ ght_node_set_z_avg(GhtNode *node, double z_avg)
 /* TODO Recursively calculate Z average for a tree of GhtNodes */
 //return ght_node_calculate_z(tree->root);
 GhtErr
-ght_node_calculate_z(const GhtNode *node, GhtAttribute *attr, GhtSchema *schema)
+ght_node_calculate_z(GhtNode *node, const GhtAttributeSet *attr, const GhtDimension *zdim)
 {
 	static int hash_array_len = GHT_MAX_HASH_LENGTH + 1;
 	GhtHash h[hash_array_len];
-	GhtAttribute *a;
+	GhtAttributeSet *a;
 
 	// TODO Vérifier l'access au hash de chaque noeud
 
 	/* Make a copy of all the incoming attributes */
-	GHT_TRY(ght_attribute_union(node->attributes, attr, &a));
+	GHT_TRY(ght_attributeset_union(node->attributes, attr, &a));
 
 	/* Recurse down to leaf nodes, copying attributes and passing them down */
 	if ( node->children && node->children->num_nodes > 0 )
@@ -918,7 +1843,7 @@ ght_node_calculate_z(const GhtNode *node, GhtAttribute *attr, GhtSchema *schema)
 		int i;
 		for ( i = 0; i < node->children->num_nodes; i++ )
 		{
-			GHT_TRY(ght_node_calculate_z(node->children->nodes[i], a, schema ));
+			GHT_TRY(ght_node_calculate_z(node->children->nodes[i], a, zdim ));
 		}
 		double acc = 0; int k;
 		for ( k = 0; k < node->children->num_nodes; k++ )
@@ -928,7 +1853,7 @@ ght_node_calculate_z(const GhtNode *node, GhtAttribute *attr, GhtSchema *schema)
 
 		GHT_TRY(ght_node_set_z_avg( node, acc / node->children->num_nodes ));
 
-		ght_attribute_free(a);
+		ght_attributeset_free(a);
 	}
 	/* This is a leaf node, create a new node and add to list */
 	else
@@ -940,26 +1865,9 @@ ght_node_calculate_z(const GhtNode *node, GhtAttribute *attr, GhtSchema *schema)
 		// TODO On a besoin d'une fonction plus géneral
 		// Pour l'instant on va le tester avec la dimension "elevation" = Z
 
-		GhtDimension *dim;
 		GhtAttribute found;
 
-		/*
-	    int num_dims;
-	    GHT_TRY( ght_schema_get_num_dimensions( schema, &num_dims) );
-	    printf ("> num dimension %i \n ", num_dims);
-		*/
-
-		//GhtErr ght_schema_get_dimension_by_name(const GhtSchema *schema, const char *name, GhtDimension **dim)
-		GHT_TRY( ght_schema_get_dimension_by_name(schema, "Z", &dim) );
-
-		/*
-		const char *name_dim ;
-		ght_dimension_get_name(dim,&name_dim);
-		printf("> Name of dimension: ");
-		puts(name_dim);
-		*/
-		//GhtErr ght_attribute_get_by_dimension(const GhtAttribute *attr, const GhtDimension *dim, GhtAttribute *found)
-		GHT_TRY( ght_attribute_get_by_dimension(a, dim, &found) );
+		GHT_TRY( ght_attributeset_get(a, zdim, &found) );
 
 		//GhtErr ght_attribute_get_value(const GhtAttribute *attr, double *val)
 		GHT_TRY( ght_attribute_get_value(&found, &valeur) );
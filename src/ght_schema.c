@@ -13,6 +13,9 @@
 #include <libxml/xpathInternals.h>
 #include "ght_internal.h"
 #include <math.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 /******************************************************************************
 *  GhtDimension
@@ -48,6 +51,8 @@ GhtErr ght_dimension_clone(const GhtDimension *dim, GhtDimension **newdim)
         d->name = ght_strdup(dim->name);
     if ( dim->description )
         d->description = ght_strdup(dim->description);
+    d->schema = NULL;
+    *newdim = d;
     return GHT_OK;        
 }
 
@@ -75,6 +80,45 @@ GhtErr ght_dimension_set_scale(GhtDimension *dim, double scale)
     return GHT_OK;
 }
 
+GhtErr ght_dimension_set_tolerance(GhtDimension *dim, double tolerance)
+{
+    if ( tolerance < 0 )
+    {
+        ght_error("%s: negative tolerance %g", __func__, tolerance);
+        return GHT_ERROR;
+    }
+    dim->tolerance = tolerance;
+    return GHT_OK;
+}
+
+GhtErr ght_dimension_get_tolerance(const GhtDimension *dim, double *tolerance)
+{
+    *tolerance = dim->tolerance;
+    return GHT_OK;
+}
+
+GhtErr ght_dimension_set_bits(GhtDimension *dim, int bits)
+{
+    if ( dim->schema )
+    {
+        ght_error("%s: dimension '%s' is already part of a schema", __func__, dim->name);
+        return GHT_ERROR;
+    }
+    if ( bits < 0 || bits > 63 )
+    {
+        ght_error("%s: invalid bit width %d", __func__, bits);
+        return GHT_ERROR;
+    }
+    dim->bits = bits;
+    return GHT_OK;
+}
+
+GhtErr ght_dimension_get_bits(const GhtDimension *dim, int *bits)
+{
+    *bits = dim->bits;
+    return GHT_OK;
+}
+
 GhtErr ght_dimension_set_type(GhtDimension *dim, GhtType type)
 {
     dim->type = type;
@@ -138,6 +182,8 @@ GhtErr ght_dimension_same(const GhtDimension *dim1, const GhtDimension *dim2, in
     if ( dim1->position == dim2->position &&
          strcmp(dim1->name, dim2->name) == 0 &&
          dim1->type == dim2->type &&
+         dim1->bits == dim2->bits &&
+         fabs(dim1->tolerance - dim2->tolerance) < GHT_EPSILON &&
          fabs(dim1->scale - dim2->scale) < GHT_EPSILON &&
          fabs(dim1->offset - dim2->offset) < GHT_EPSILON )
     {
@@ -154,6 +200,12 @@ GhtErr ght_dimension_same(const GhtDimension *dim1, const GhtDimension *dim2, in
 GhtErr ght_schema_same(const GhtSchema *s1, const GhtSchema *s2, int *same)
 {
     int i;
+    /* Registry schemas are shared, so the common case is one pointer */
+    if ( s1 == s2 )
+    {
+        *same = 1;
+        return GHT_OK;
+    }
     *same = 0;
     if ( s1->num_dims != s2->num_dims )
     {
@@ -168,19 +220,36 @@ GhtErr ght_schema_same(const GhtSchema *s1, const GhtSchema *s2, int *same)
     return GHT_OK;
 }
 
+/** Case-insensitive FNV-1a, names match with strcasecmp */
+static unsigned int ght_schema_name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while ( *name )
+    {
+        hash ^= (uint8_t)tolower((unsigned char)*name++);
+        hash *= 16777619u;
+    }
+    return hash & (GHT_SCHEMA_INDEX_SIZE - 1);
+}
+
+/*
+ * Linear probing keeps dimensions of the same hash in insertion order, so
+ * the first added of two names that differ only by case still wins, as it
+ * did with the old linear scan.
+ */
 GhtErr ght_schema_get_dimension_by_name(const GhtSchema *schema, const char *name, GhtDimension **dim)
 {
-    int i;
+    unsigned int slot;
     assert(name);
     assert(schema);
     *dim = NULL;
     
-    for ( i = 0; i < schema->num_dims; i++ )
+    for ( slot = ght_schema_name_hash(name); schema->nameindex[slot]; slot = (slot + 1) & (GHT_SCHEMA_INDEX_SIZE - 1) )
     {
-        const char *sname = schema->dims[i]->name;
-        if ( sname && strcasecmp(name, sname) == 0 )
+        GhtDimension *d = schema->dims[schema->nameindex[slot] - 1];
+        if ( strcasecmp(name, d->name) == 0 )
         {
-            *dim = schema->dims[i];
+            *dim = d;
             return GHT_OK;
         }
     }
@@ -218,6 +287,9 @@ GhtErr ght_schema_free(GhtSchema *schema)
 {
     int i;
     assert(schema);
+    /* Registry schemas are shared, they go away in ght_schema_registry_clear */
+    if ( schema->interned )
+        return GHT_OK;
     for ( i = 0; i < schema->num_dims; i++ )
     {
         if ( schema->dims[i] )
@@ -235,6 +307,20 @@ GhtErr ght_schema_get_num_dimensions(const GhtSchema *schema, unsigned int *num_
     return GHT_OK;
 }
 
+/** Record the storage width of the dimension, used to find packed attribute offsets */
+static void ght_schema_add_sizemask(GhtSchema *schema, const GhtDimension *dim)
+{
+    const uint64_t bit = UINT64_C(1) << dim->position;
+    switch ( dim->type == GHT_UNKNOWN ? 0 : GhtTypeSizes[dim->type] )
+    {
+        case 1: schema->sizemask[0] |= bit; break;
+        case 2: schema->sizemask[1] |= bit; break;
+        case 4: schema->sizemask[2] |= bit; break;
+        case 8: schema->sizemask[3] |= bit; break;
+        default: break; /* No storage, cannot carry attributes */
+    }
+}
+
 GhtErr ght_schema_add_dimension(GhtSchema *schema, GhtDimension *dim)
 {
     int i;
@@ -244,6 +330,26 @@ GhtErr ght_schema_add_dimension(GhtSchema *schema, GhtDimension *dim)
     
     if ( ! dim->name ) return GHT_ERROR;
     
+    if ( schema->interned )
+    {
+        ght_error("%s: cannot add a dimension to a shared registry schema", __func__);
+        return GHT_ERROR;
+    }
+
+    /* Only integers pack, and only into fewer bits than they have */
+    if ( dim->bits && ( dim->type == GHT_UNKNOWN || dim->type == GHT_DOUBLE || dim->type == GHT_FLOAT ||
+                        dim->bits >= 8 * GhtTypeSizes[dim->type] ) )
+    {
+        ght_error("%s: dimension '%s' of type %s cannot pack into %d bits", __func__, dim->name, GhtTypeStrings[dim->type], dim->bits);
+        return GHT_ERROR;
+    }
+
+    if ( schema->num_dims >= GHT_MAX_DIMENSIONS )
+    {
+        ght_error("%s: schemas are limited to %d dimensions", __func__, GHT_MAX_DIMENSIONS);
+        return GHT_ERROR;
+    }
+
     for ( i = 0; i < schema->num_dims; i++ )
     {
         if ( strcmp(dim->name, schema->dims[i]->name) == 0 )
@@ -260,8 +366,17 @@ GhtErr ght_schema_add_dimension(GhtSchema *schema, GhtDimension *dim)
     }
     
     dim->position = schema->num_dims;
+    dim->schema = schema;
     schema->dims[schema->num_dims] = dim;
     schema->num_dims++;
+    ght_schema_add_sizemask(schema, dim);
+    if ( dim->bits )
+        schema->packmask |= UINT64_C(1) << dim->position;
+
+    /* The index has room for twice the dimension limit, so a slot is always free */
+    for ( i = ght_schema_name_hash(dim->name); schema->nameindex[i]; i = (i + 1) & (GHT_SCHEMA_INDEX_SIZE - 1) )
+        ;
+    schema->nameindex[i] = dim->position + 1;
     
     return GHT_OK;
 }
@@ -278,7 +393,8 @@ static GhtErr ght_dimension_from_xml(xmlNodePtr node, GhtDimension **dimension)
     
     for ( child = node->children; child; child = child->next )
     {
-        if ( child->type == XML_ELEMENT_NODE )
+        /* Empty elements like <pc:description/> carry nothing */
+        if ( child->type == XML_ELEMENT_NODE && child->children )
         { 
 			char *content = (char*)(child->children->content);
             if ( TAG_IS("name") )
@@ -303,6 +419,14 @@ static GhtErr ght_dimension_from_xml(xmlNodePtr node, GhtDimension **dimension)
             {
                 GHT_TRY(ght_dimension_set_offset(dim, atof(content)));
             }
+            else if ( TAG_IS("bits") )
+            {
+                GHT_TRY(ght_dimension_set_bits(dim, atoi(content)));
+            }
+            else if ( TAG_IS("tolerance") )
+            {
+                GHT_TRY(ght_dimension_set_tolerance(dim, atof(content)));
+            }
             else
             {
                 /* Unhandled <tag> */
@@ -415,13 +539,16 @@ GhtErr ght_schema_clone(const GhtSchema *schema, GhtSchema **newschema)
 {
     int i;
     GhtSchema *s = ght_malloc(sizeof(GhtSchema));
-    s->num_dims = schema->num_dims;
-    s->max_dims = schema->num_dims;
-    s->dims = ght_malloc(s->num_dims * sizeof(GhtDimension*));
+    memcpy(s, schema, sizeof(GhtSchema));
+    s->interned = 0;
+    s->max_dims = schema->num_dims ? schema->num_dims : 1;
+    s->dims = ght_malloc(s->max_dims * sizeof(GhtDimension*));
     for ( i = 0; i < s->num_dims; i++ )
     {
-        ght_dimension_clone(schema->dims[i], &(s->dims[i]));
+        GHT_TRY(ght_dimension_clone(schema->dims[i], &(s->dims[i])));
+        s->dims[i]->schema = s;
     }
+    *newschema = s;
     return GHT_OK;
 }
 
@@ -450,6 +577,10 @@ GhtErr ght_schema_to_xml_str(const GhtSchema *schema, char **xml_str, size_t *xm
         }
         ght_stringbuffer_aprintf(sb, "<pc:interpretation>%s</pc:interpretation>\n", GhtTypeStrings[dim->type]);
         ght_stringbuffer_aprintf(sb, "<pc:size>%zu</pc:size>\n", GhtTypeSizes[dim->type]);
+        if ( dim->bits )
+        {
+            ght_stringbuffer_aprintf(sb, "<pc:bits>%d</pc:bits>\n", dim->bits);
+        }
         if ( dim->scale != 1 )
         {
             ght_stringbuffer_aprintf(sb, "<pc:scale>%g</pc:scale>\n", dim->scale);
@@ -458,6 +589,10 @@ GhtErr ght_schema_to_xml_str(const GhtSchema *schema, char **xml_str, size_t *xm
         {
             ght_stringbuffer_aprintf(sb, "<pc:offset>%g</pc:offset>\n", dim->offset);
         }
+        if ( dim->tolerance != 0 )
+        {
+            ght_stringbuffer_aprintf(sb, "<pc:tolerance>%g</pc:tolerance>\n", dim->tolerance);
+        }
         ght_stringbuffer_append(sb, "<pc:active>true</pc:active>\n");
         ght_stringbuffer_append(sb, "</pc:dimension>\n");
     }
@@ -533,3 +668,340 @@ GhtErr ght_schema_to_xml_file(const GhtSchema *schema, const char *filename)
 }
 
 
+
+/** Length prefixed string, zero length for NULL */
+static GhtErr ght_schema_write_string(GhtWriter *writer, const char *str)
+{
+    size_t len = str ? strlen(str) : 0;
+    GHT_TRY(ght_write_varint(writer, len));
+    if ( len )
+        GHT_TRY(ght_write(writer, str, len));
+    return GHT_OK;
+}
+
+static GhtErr ght_schema_read_string(GhtReader *reader, char **str)
+{
+    uint64_t len;
+    char *s;
+    GHT_TRY(ght_read_varint(reader, &len));
+    if ( len > 65535 )
+    {
+        ght_error("%s: schema string of %llu bytes", __func__, (unsigned long long)len);
+        return GHT_ERROR;
+    }
+    s = ght_malloc(len + 1);
+    if ( len && ght_read(reader, s, len) != GHT_OK )
+    {
+        ght_free(s);
+        return GHT_ERROR;
+    }
+    s[len] = '\0';
+    *str = s;
+    return GHT_OK;
+}
+
+/*
+ * Binary schema: dimension count, then per dimension its name and
+ * description as length prefixed strings, type byte, scale and offset.
+ * A packed dimension sets the high bit of its type byte and follows the
+ * offset with its bit width. A lossy dimension sets the next bit and
+ * follows that with its compaction tolerance.
+ */
+#define GHT_SCHEMA_TYPE_BITS 0x80
+#define GHT_SCHEMA_TYPE_TOLERANCE 0x40
+
+GhtErr ght_schema_write(const GhtSchema *schema, GhtWriter *writer)
+{
+    int i;
+    GHT_TRY(ght_write_varint(writer, schema->num_dims));
+    for ( i = 0; i < schema->num_dims; i++ )
+    {
+        const GhtDimension *dim = schema->dims[i];
+        uint8_t type = dim->type | (dim->bits ? GHT_SCHEMA_TYPE_BITS : 0) |
+                       (dim->tolerance > 0 ? GHT_SCHEMA_TYPE_TOLERANCE : 0);
+        GHT_TRY(ght_schema_write_string(writer, dim->name));
+        GHT_TRY(ght_schema_write_string(writer, dim->description));
+        GHT_TRY(ght_write(writer, &type, 1));
+        GHT_TRY(ght_write(writer, &(dim->scale), sizeof(double)));
+        GHT_TRY(ght_write(writer, &(dim->offset), sizeof(double)));
+        if ( dim->bits )
+            GHT_TRY(ght_write(writer, &(dim->bits), 1));
+        if ( dim->tolerance > 0 )
+            GHT_TRY(ght_write(writer, &(dim->tolerance), sizeof(double)));
+    }
+    return GHT_OK;
+}
+
+GhtErr ght_schema_read(GhtReader *reader, GhtSchema **schema)
+{
+    uint64_t i, num_dims;
+    GhtSchema *s;
+
+    GHT_TRY(ght_read_varint(reader, &num_dims));
+    if ( num_dims > GHT_MAX_DIMENSIONS )
+    {
+        ght_error("%s: schema has %llu dimensions, maximum is %d", __func__, (unsigned long long)num_dims, GHT_MAX_DIMENSIONS);
+        return GHT_ERROR;
+    }
+
+    GHT_TRY(ght_schema_new(&s));
+    for ( i = 0; i < num_dims; i++ )
+    {
+        GhtDimension *dim;
+        uint8_t type;
+        GhtErr err;
+
+        GHT_TRY(ght_dimension_new(&dim));
+        err = ght_schema_read_string(reader, &(dim->name));
+        if ( err == GHT_OK ) err = ght_schema_read_string(reader, &(dim->description));
+        if ( err == GHT_OK ) err = ght_read(reader, &type, 1);
+        if ( err == GHT_OK ) err = ght_read(reader, &(dim->scale), sizeof(double));
+        if ( err == GHT_OK ) err = ght_read(reader, &(dim->offset), sizeof(double));
+        if ( err == GHT_OK && (type & GHT_SCHEMA_TYPE_BITS) )
+        {
+            err = ght_read(reader, &(dim->bits), 1);
+            type &= ~GHT_SCHEMA_TYPE_BITS;
+        }
+        if ( err == GHT_OK && (type & GHT_SCHEMA_TYPE_TOLERANCE) )
+        {
+            err = ght_read(reader, &(dim->tolerance), sizeof(double));
+            type &= ~GHT_SCHEMA_TYPE_TOLERANCE;
+            if ( err == GHT_OK && ! (dim->tolerance > 0) )
+            {
+                ght_error("%s: dimension '%s' has invalid tolerance %g", __func__, dim->name, dim->tolerance);
+                err = GHT_ERROR;
+            }
+        }
+        if ( err == GHT_OK && (type == GHT_UNKNOWN || type >= GHT_NUM_TYPES) )
+        {
+            ght_error("%s: dimension '%s' has invalid type %d", __func__, dim->name, type);
+            err = GHT_ERROR;
+        }
+        dim->type = type;
+        if ( err == GHT_OK ) err = ght_schema_add_dimension(s, dim);
+        if ( err != GHT_OK )
+        {
+            ght_dimension_free(dim);
+            ght_schema_free(s);
+            return GHT_ERROR;
+        }
+    }
+    *schema = s;
+    return GHT_OK;
+}
+
+/******************************************************************************
+*  GhtSchema registry
+******************************************************************************/
+
+/*
+ * Blobs that come out of a database each carry (or point at) their schema,
+ * but almost all of them share a handful of schemas. The registry keys
+ * parsed schemas on the exact bytes of their XML or binary form, so each
+ * distinct form is parsed once per process and every later lookup is a
+ * hash and a memcmp. Registered schemas are immutable and shared, which
+ * lets ght_schema_same short-circuit on pointer equality.
+ */
+
+#define GHT_REGISTRY_BUCKETS 64
+
+typedef enum {
+    GHT_REGISTRY_XML,
+    GHT_REGISTRY_BINARY
+} GhtRegistryKeyType;
+
+typedef struct GhtRegistryEntry_t {
+    uint64_t hash;
+    GhtRegistryKeyType keytype;
+    size_t keysize;
+    uint8_t *key;
+    GhtSchema *schema;
+    struct GhtRegistryEntry_t *next;
+} GhtRegistryEntry;
+
+static GhtRegistryEntry *ght_registry[GHT_REGISTRY_BUCKETS];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t ght_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+#define GHT_REGISTRY_LOCK() pthread_mutex_lock(&ght_registry_lock)
+#define GHT_REGISTRY_UNLOCK() pthread_mutex_unlock(&ght_registry_lock)
+#else
+#define GHT_REGISTRY_LOCK()
+#define GHT_REGISTRY_UNLOCK()
+#endif
+
+/** 64-bit FNV-1a over the key bytes */
+static uint64_t ght_registry_hash(const uint8_t *key, size_t keysize)
+{
+    uint64_t hash = UINT64_C(14695981039346656037);
+    size_t i;
+    for ( i = 0; i < keysize; i++ )
+    {
+        hash ^= key[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+static GhtErr ght_schema_from_binary(const uint8_t *bytes, size_t bytes_size, GhtSchema **schema)
+{
+    GhtReader *reader;
+    GhtErr err;
+    GHT_TRY(ght_reader_new_mem(bytes, bytes_size, NULL, &reader));
+    err = ght_schema_read(reader, schema);
+    ght_reader_free(reader);
+    return err;
+}
+
+/** Registered schema for a key, NULL if there is none, call with the lock held */
+static GhtSchema *ght_schema_registry_find(GhtRegistryKeyType keytype, uint64_t hash, const uint8_t *key, size_t keysize)
+{
+    GhtRegistryEntry *entry;
+    for ( entry = ght_registry[hash % GHT_REGISTRY_BUCKETS]; entry; entry = entry->next )
+    {
+        if ( entry->hash == hash && entry->keytype == keytype &&
+             entry->keysize == keysize && memcmp(entry->key, key, keysize) == 0 )
+        {
+            return entry->schema;
+        }
+    }
+    return NULL;
+}
+
+/** Register a schema under a key, call with the lock held */
+static void ght_schema_registry_insert(GhtRegistryKeyType keytype, uint64_t hash, const uint8_t *key, size_t keysize, GhtSchema *s)
+{
+    GhtRegistryEntry **bucket = &(ght_registry[hash % GHT_REGISTRY_BUCKETS]);
+    GhtRegistryEntry *entry = ght_malloc(sizeof(GhtRegistryEntry));
+    s->interned = 1;
+    entry->hash = hash;
+    entry->keytype = keytype;
+    entry->keysize = keysize;
+    entry->key = ght_malloc(keysize);
+    memcpy(entry->key, key, keysize);
+    entry->schema = s;
+    entry->next = *bucket;
+    *bucket = entry;
+}
+
+/*
+ * Find the schema for a key, parsing and registering it on a miss. The
+ * lock is held across the parse: misses are rare, and it keeps the
+ * libxml2 parser setup and teardown from overlapping between threads.
+ */
+static GhtErr ght_schema_registry_get(GhtRegistryKeyType keytype, const uint8_t *key, size_t keysize, const GhtSchema **schema)
+{
+    uint64_t hash = ght_registry_hash(key, keysize);
+    GhtSchema *s = NULL;
+    GhtErr err;
+
+    assert(schema);
+    GHT_REGISTRY_LOCK();
+    s = ght_schema_registry_find(keytype, hash, key, keysize);
+    if ( s )
+    {
+        *schema = s;
+        GHT_REGISTRY_UNLOCK();
+        return GHT_OK;
+    }
+
+    if ( keytype == GHT_REGISTRY_XML )
+        err = ght_schema_from_xml_str((const char*)key, &s);
+    else
+        err = ght_schema_from_binary(key, keysize, &s);
+
+    if ( err != GHT_OK )
+    {
+        GHT_REGISTRY_UNLOCK();
+        return err;
+    }
+
+    ght_schema_registry_insert(keytype, hash, key, keysize, s);
+    *schema = s;
+
+    GHT_REGISTRY_UNLOCK();
+    return GHT_OK;
+}
+
+GhtErr ght_schema_registry_get_xml(const char *xml_str, const GhtSchema **schema)
+{
+    assert(xml_str);
+    /* Keep the terminator in the key, the XML parser wants a string */
+    return ght_schema_registry_get(GHT_REGISTRY_XML, (const uint8_t*)xml_str, strlen(xml_str) + 1, schema);
+}
+
+GhtErr ght_schema_registry_get_binary(const uint8_t *bytes, size_t bytes_size, const GhtSchema **schema)
+{
+    assert(bytes);
+    return ght_schema_registry_get(GHT_REGISTRY_BINARY, bytes, bytes_size, schema);
+}
+
+GhtErr ght_schema_registry_add(GhtSchema *schema, const GhtSchema **interned)
+{
+    GhtWriter *writer;
+    uint8_t *key;
+    size_t keysize;
+    uint64_t hash;
+    GhtSchema *s;
+    GhtErr err;
+
+    assert(schema && interned);
+    if ( schema->interned )
+    {
+        *interned = schema;
+        return GHT_OK;
+    }
+
+    /* Keyed on the binary form, like ght_schema_registry_get_binary */
+    GHT_TRY(ght_writer_new_mem(&writer));
+    err = ght_schema_write(schema, writer);
+    if ( err != GHT_OK )
+    {
+        ght_writer_free(writer);
+        return err;
+    }
+    ght_writer_get_size(writer, &keysize);
+    key = ght_malloc(keysize);
+    ght_writer_get_bytes(writer, key);
+    ght_writer_free(writer);
+    hash = ght_registry_hash(key, keysize);
+
+    GHT_REGISTRY_LOCK();
+    s = ght_schema_registry_find(GHT_REGISTRY_BINARY, hash, key, keysize);
+    if ( s )
+    {
+        ght_schema_free(schema);
+    }
+    else
+    {
+        ght_schema_registry_insert(GHT_REGISTRY_BINARY, hash, key, keysize, schema);
+        s = schema;
+    }
+    GHT_REGISTRY_UNLOCK();
+
+    ght_free(key);
+    *interned = s;
+    return GHT_OK;
+}
+
+GhtErr ght_schema_registry_clear(void)
+{
+    int i;
+    GHT_REGISTRY_LOCK();
+    for ( i = 0; i < GHT_REGISTRY_BUCKETS; i++ )
+    {
+        GhtRegistryEntry *entry = ght_registry[i];
+        while ( entry )
+        {
+            GhtRegistryEntry *next = entry->next;
+            entry->schema->interned = 0;
+            ght_schema_free(entry->schema);
+            ght_free(entry->key);
+            ght_free(entry);
+            entry = next;
+        }
+        ght_registry[i] = NULL;
+    }
+    GHT_REGISTRY_UNLOCK();
+    return GHT_OK;
+}
@@ -10,6 +10,17 @@
 
 #include "ght_internal.h"
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+static GhtErr ght_blocks_inflate(GhtBlocks *blocks, size_t start, size_t size);
+static void ght_blocks_free(GhtBlocks *blocks);
+
 /** Supplement to c file functions, from ght_util.c */
 int fexists(const char *filename);
 
@@ -172,6 +183,7 @@ ght_reader_new_file(const char *filename, const GhtSchema *schema, GhtReader **r
     r->type = GHT_IO_FILE;
     r->filename = ght_strdup(filename);
     r->schema = schema;
+    r->dimmask = ~UINT64_C(0);
     *reader = r;
     return GHT_OK;
 }
@@ -187,6 +199,7 @@ ght_reader_new_mem(const uint8_t *bytes_start, size_t bytes_size, const GhtSchem
     r->bytes_current = bytes_start;
     r->bytes_size = bytes_size;
     r->schema = schema;
+    r->dimmask = ~UINT64_C(0);
     *reader = r;
     return GHT_OK;
 }
@@ -201,6 +214,8 @@ ght_reader_free(GhtReader *reader)
         if ( reader->filename )
             ght_free(reader->filename);
     }
+    if ( reader->blocks )
+        ght_blocks_free(reader->blocks);
     ght_free(reader);
     return GHT_OK;    
 }
@@ -216,6 +231,8 @@ ght_read(GhtReader *reader, void *bytes, size_t read_size)
             ght_error("%s: attempting to read past the end of the byte buffer", __func__);
             return GHT_ERROR;
         }
+        if ( reader->blocks )
+            GHT_TRY(ght_blocks_inflate(reader->blocks, reader->bytes_current - reader->bytes_start, read_size));
         memcpy(bytes, reader->bytes_current, read_size);
         reader->bytes_current += read_size;
         return GHT_OK;
@@ -247,3 +264,329 @@ ght_read(GhtReader *reader, void *bytes, size_t read_size)
     }    
 }
 
+GhtErr
+ght_reader_skip(GhtReader *reader, size_t skip_size)
+{
+    assert(reader);
+    if ( reader->type == GHT_IO_MEM )
+    {
+        if ( reader->bytes_current - reader->bytes_start + skip_size > reader->bytes_size )
+        {
+            ght_error("%s: attempting to skip past the end of the byte buffer", __func__);
+            return GHT_ERROR;
+        }
+        reader->bytes_current += skip_size;
+        return GHT_OK;
+    }
+    else if (reader->type == GHT_IO_FILE )
+    {
+        if ( fseek(reader->file, skip_size, SEEK_CUR) != 0 )
+        {
+            ght_error("%s: unable to seek in %s", __func__, reader->filename);
+            return GHT_ERROR;
+        }
+        return GHT_OK;
+    }
+    else
+    {
+        ght_error("%s: unknown reader type %d", __func__, reader->type);
+        return GHT_ERROR;
+    }
+}
+
+GhtErr
+ght_reader_remaining(GhtReader *reader, size_t *remaining)
+{
+    assert(reader);
+    if ( reader->type == GHT_IO_MEM )
+    {
+        *remaining = reader->bytes_size - (reader->bytes_current - reader->bytes_start);
+        return GHT_OK;
+    }
+    else if (reader->type == GHT_IO_FILE )
+    {
+        long pos = ftell(reader->file);
+        long end;
+        if ( pos < 0 || fseek(reader->file, 0, SEEK_END) != 0 )
+        {
+            ght_error("%s: unable to seek in %s", __func__, reader->filename);
+            return GHT_ERROR;
+        }
+        end = ftell(reader->file);
+        if ( end < 0 || fseek(reader->file, pos, SEEK_SET) != 0 )
+        {
+            ght_error("%s: unable to seek in %s", __func__, reader->filename);
+            return GHT_ERROR;
+        }
+        *remaining = end > pos ? (size_t)(end - pos) : 0;
+        return GHT_OK;
+    }
+    else
+    {
+        ght_error("%s: unknown reader type %d", __func__, reader->type);
+        return GHT_ERROR;
+    }
+}
+
+GhtErr
+ght_write_varint(GhtWriter *writer, uint64_t val)
+{
+    uint8_t buf[10];
+    size_t n = 0;
+    while ( val >= 0x80 )
+    {
+        buf[n++] = (uint8_t)(val | 0x80);
+        val >>= 7;
+    }
+    buf[n++] = (uint8_t)val;
+    return ght_write(writer, buf, n);
+}
+
+GhtErr
+ght_read_varint(GhtReader *reader, uint64_t *val)
+{
+    uint8_t byte;
+    int shift = 0;
+    uint64_t v = 0;
+    do
+    {
+        if ( shift > 63 )
+        {
+            ght_error("%s: varint longer than 64 bits", __func__);
+            return GHT_ERROR;
+        }
+        GHT_TRY(ght_read(reader, &byte, 1));
+        v |= (uint64_t)(byte & 0x7F) << shift;
+        shift += 7;
+    }
+    while ( byte & 0x80 );
+    *val = v;
+    return GHT_OK;
+}
+
+/*
+ * Compressed container: total size, block size and block count, then the
+ * compressed size of every block, then the blocks. Each block deflates on
+ * its own, so blocks can be inflated independently and their offsets are
+ * known before any data is read.
+ */
+GhtErr
+ght_write_compressed(GhtWriter *writer, const uint8_t *bytes, size_t size)
+{
+#ifdef HAVE_ZLIB
+    size_t i;
+    size_t nblocks = (size + GHT_BLOCK_SIZE - 1) / GHT_BLOCK_SIZE;
+    uLongf bound = compressBound(GHT_BLOCK_SIZE);
+    uint8_t *block;
+    bytebuffer_t *data;
+    GhtErr err = GHT_OK;
+
+    GHT_TRY(ght_write_varint(writer, size));
+    GHT_TRY(ght_write_varint(writer, GHT_BLOCK_SIZE));
+    GHT_TRY(ght_write_varint(writer, nblocks));
+
+    block = ght_malloc(bound);
+    data = bytebuffer_create();
+    for ( i = 0; i < nblocks && err == GHT_OK; i++ )
+    {
+        size_t rawsize = (i == nblocks - 1) ? size - i * GHT_BLOCK_SIZE : GHT_BLOCK_SIZE;
+        uLongf compsize = bound;
+        if ( compress2(block, &compsize, bytes + i * GHT_BLOCK_SIZE, rawsize, Z_DEFAULT_COMPRESSION) != Z_OK )
+        {
+            ght_error("%s: unable to compress block %zu", __func__, i);
+            err = GHT_ERROR;
+            break;
+        }
+        err = ght_write_varint(writer, compsize);
+        bytebuffer_append(data, block, compsize);
+    }
+
+    if ( err == GHT_OK )
+        err = ght_write(writer, bytebuffer_getbytes(data), bytebuffer_getsize(data));
+
+    bytebuffer_destroy(data);
+    ght_free(block);
+    return err;
+#else
+    ght_error("%s: compressed output requires libght built with zlib", __func__);
+    return GHT_ERROR;
+#endif
+}
+
+static void
+ght_blocks_free(GhtBlocks *blocks)
+{
+    if ( blocks->raw ) ght_free(blocks->raw);
+    if ( blocks->comp ) ght_free(blocks->comp);
+    if ( blocks->offsets ) ght_free(blocks->offsets);
+    if ( blocks->inflated ) ght_free(blocks->inflated);
+    ght_free(blocks);
+}
+
+#ifdef HAVE_ZLIB
+/** Inflate one block into place, without reporting, so threads can call it */
+static int
+ght_blocks_inflate_one(GhtBlocks *blocks, uint64_t i)
+{
+    uLongf expected = (i == blocks->num_blocks - 1) ? blocks->raw_size - i * blocks->block_size : blocks->block_size;
+    uLongf destsize = expected;
+    if ( uncompress(blocks->raw + i * blocks->block_size, &destsize,
+                    blocks->comp + blocks->offsets[i], blocks->offsets[i+1] - blocks->offsets[i]) != Z_OK ||
+         destsize != expected )
+    {
+        return 0;
+    }
+    blocks->inflated[i] = 1;
+    return 1;
+}
+#endif
+
+/** Make sure the blocks holding a range of raw bytes are inflated */
+static GhtErr
+ght_blocks_inflate(GhtBlocks *blocks, size_t start, size_t size)
+{
+#ifdef HAVE_ZLIB
+    uint64_t i;
+    if ( ! size ) return GHT_OK;
+    for ( i = start / blocks->block_size; i <= (start + size - 1) / blocks->block_size; i++ )
+    {
+        if ( ! blocks->inflated[i] && ! ght_blocks_inflate_one(blocks, i) )
+        {
+            ght_error("%s: unable to inflate block %llu", __func__, (unsigned long long)i);
+            return GHT_ERROR;
+        }
+    }
+    return GHT_OK;
+#else
+    ght_error("%s: compressed input requires libght built with zlib", __func__);
+    return GHT_ERROR;
+#endif
+}
+
+#if defined(HAVE_ZLIB) && defined(HAVE_PTHREAD)
+typedef struct
+{
+    GhtBlocks *blocks;
+    uint64_t first;
+    uint64_t step;
+} GhtInflateJob;
+
+static void *
+ght_blocks_inflate_job(void *arg)
+{
+    GhtInflateJob *job = (GhtInflateJob*)arg;
+    uint64_t i;
+    for ( i = job->first; i < job->blocks->num_blocks; i += job->step )
+    {
+        if ( ! ght_blocks_inflate_one(job->blocks, i) )
+            break;
+    }
+    return NULL;
+}
+#endif
+
+/** Inflate every block, spreading them over a few threads when there are several */
+static GhtErr
+ght_blocks_inflate_all(GhtBlocks *blocks)
+{
+#if defined(HAVE_ZLIB) && defined(HAVE_PTHREAD)
+    pthread_t threads[GHT_INFLATE_THREADS];
+    GhtInflateJob jobs[GHT_INFLATE_THREADS];
+    int i, nthreads = blocks->num_blocks < GHT_INFLATE_THREADS ? (int)blocks->num_blocks : GHT_INFLATE_THREADS;
+    int started = 0;
+
+    if ( nthreads > 1 )
+    {
+        for ( i = 0; i < nthreads; i++ )
+        {
+            jobs[i].blocks = blocks;
+            jobs[i].first = i;
+            jobs[i].step = nthreads;
+            if ( pthread_create(&(threads[i]), NULL, ght_blocks_inflate_job, &(jobs[i])) != 0 )
+                break;
+            started++;
+        }
+        for ( i = 0; i < started; i++ )
+            pthread_join(threads[i], NULL);
+    }
+#endif
+    /* Whatever the threads left, and the reporting of any bad block */
+    return ght_blocks_inflate(blocks, 0, blocks->raw_size);
+}
+
+GhtErr
+ght_reader_new_compressed(GhtReader *reader, int lazy, GhtReader **body)
+{
+#ifdef HAVE_ZLIB
+    uint64_t i, rawsize, blocksize, nblocks;
+    size_t remaining;
+    GhtBlocks *blocks;
+    GhtErr err = GHT_OK;
+
+    GHT_TRY(ght_read_varint(reader, &rawsize));
+    GHT_TRY(ght_read_varint(reader, &blocksize));
+    GHT_TRY(ght_read_varint(reader, &nblocks));
+    GHT_TRY(ght_reader_remaining(reader, &remaining));
+    /* Every block takes at least a byte in the size table and one of data */
+    if ( ! blocksize || nblocks != (rawsize + blocksize - 1) / blocksize || nblocks > remaining / 2 )
+    {
+        ght_error("%s: invalid block table, %llu bytes in %llu blocks", __func__,
+                  (unsigned long long)rawsize, (unsigned long long)nblocks);
+        return GHT_ERROR;
+    }
+
+    blocks = ght_malloc(sizeof(GhtBlocks));
+    memset(blocks, 0, sizeof(GhtBlocks));
+    blocks->num_blocks = nblocks;
+    blocks->block_size = blocksize;
+    blocks->raw_size = rawsize;
+    blocks->offsets = ght_malloc((nblocks + 1) * sizeof(uint64_t));
+    blocks->offsets[0] = 0;
+    for ( i = 0; i < nblocks && err == GHT_OK; i++ )
+    {
+        uint64_t compsize;
+        err = ght_read_varint(reader, &compsize);
+        blocks->offsets[i+1] = blocks->offsets[i] + compsize;
+        if ( err == GHT_OK && (compsize > remaining || blocks->offsets[i+1] > remaining) )
+        {
+            ght_error("%s: compressed blocks run past the end of the input", __func__);
+            err = GHT_ERROR;
+        }
+    }
+
+    /* Deflate expands at most about a thousand times, so a larger raw
+     * size can only be damage and is refused before it is allocated */
+    if ( err == GHT_OK && rawsize / 1032 > blocks->offsets[nblocks] )
+    {
+        ght_error("%s: %llu bytes cannot inflate from %llu", __func__,
+                  (unsigned long long)rawsize, (unsigned long long)blocks->offsets[nblocks]);
+        err = GHT_ERROR;
+    }
+    if ( err == GHT_OK )
+    {
+        blocks->comp = ght_malloc(blocks->offsets[nblocks] ? blocks->offsets[nblocks] : 1);
+        err = ght_read(reader, blocks->comp, blocks->offsets[nblocks]);
+    }
+    if ( err == GHT_OK )
+    {
+        blocks->raw = ght_malloc(rawsize ? rawsize : 1);
+        blocks->inflated = ght_malloc(nblocks ? nblocks : 1);
+        memset(blocks->inflated, 0, nblocks ? nblocks : 1);
+        if ( ! lazy )
+            err = ght_blocks_inflate_all(blocks);
+    }
+    if ( err != GHT_OK )
+    {
+        ght_blocks_free(blocks);
+        return err;
+    }
+
+    ght_reader_new_mem(blocks->raw, rawsize, reader->schema, body);
+    (*body)->dimmask = reader->dimmask;
+    (*body)->blocks = blocks;
+    return GHT_OK;
+#else
+    ght_error("%s: compressed input requires libght built with zlib", __func__);
+    return GHT_ERROR;
+#endif
+}
@@ -0,0 +1,434 @@
+/******************************************************************************
+*  LibGHT, software to manage point clouds.
+*  LibGHT is free and open source software provided by the Government of Canada
+*  Copyright (c) 2012 Natural Resources Canada
+*
+*  Nouri Sabo <nsabo@NRCan.gc.ca>, Natural Resources Canada
+*  Paul Ramsey <pramsey@opengeo.org>, OpenGeo
+*
+******************************************************************************/
+
+/*
+ * Bottom-up tree writer for nodes arriving in hash order.
+ *
+ * Sorted input only ever changes the path from the root to the last
+ * node, so only that path is kept as nodes. Once a node can take no more
+ * children it is compacted, and its children are written out. The output
+ * is what ght_tree_write gives for a tree built from the same nodes in
+ * the same order.
+ *
+ * With GHT_FORMAT_GROUPED the children go straight to the writer as a
+ * group, so memory stays the same whatever the number of points. The
+ * original layout needs each node's child count ahead of its subtree,
+ * so there the children are serialized into their parent's buffer, and
+ * buffers that grow large move out to temporary files.
+ */
+
+#include "ght_internal.h"
+
+char machine_endian(void); /* from ght_util.c */
+
+/* Level buffers larger than this go to a temporary file */
+#define GHT_STREAM_SPILL_SIZE (1 << 20)
+#define GHT_STREAM_COPY_SIZE 16384
+
+/* Start of the hash part held by the top level */
+static int
+ght_stream_top_start(const GhtStreamWriter *stream)
+{
+    return stream->num_levels > 1 ? stream->levels[stream->num_levels-2].end : 0;
+}
+
+/* Move a memory buffer that has outgrown the spill size into a temporary file */
+static GhtErr
+ght_stream_spill(GhtWriter *body)
+{
+    FILE *file;
+    size_t size;
+
+    if ( body->type != GHT_IO_MEM )
+        return GHT_OK;
+    size = bytebuffer_getsize(body->bytebuffer);
+    if ( size < GHT_STREAM_SPILL_SIZE )
+        return GHT_OK;
+
+    file = tmpfile();
+    if ( ! file )
+    {
+        ght_error("%s: unable to open a temporary file", __func__);
+        return GHT_ERROR;
+    }
+    if ( fwrite(bytebuffer_getbytes(body->bytebuffer), 1, size, file) != size )
+    {
+        ght_error("%s: unable to write to a temporary file", __func__);
+        fclose(file);
+        return GHT_ERROR;
+    }
+    bytebuffer_destroy(body->bytebuffer);
+    body->bytebuffer = NULL;
+    body->type = GHT_IO_FILE;
+    body->file = file;
+    body->filesize = size;
+    return GHT_OK;
+}
+
+/* Copy everything written to src onto the end of dst */
+static GhtErr
+ght_stream_append(GhtWriter *dst, GhtWriter *src)
+{
+    uint8_t buf[GHT_STREAM_COPY_SIZE];
+    size_t n;
+
+    if ( src->type == GHT_IO_MEM )
+        return ght_write(dst, bytebuffer_getbytes(src->bytebuffer), bytebuffer_getsize(src->bytebuffer));
+
+    if ( fflush(src->file) || fseek(src->file, 0, SEEK_SET) )
+    {
+        ght_error("%s: unable to rewind a temporary file", __func__);
+        return GHT_ERROR;
+    }
+    while ( (n = fread(buf, 1, sizeof(buf), src->file)) > 0 )
+        GHT_TRY(ght_write(dst, buf, n));
+    if ( ferror(src->file) )
+    {
+        ght_error("%s: unable to read a temporary file", __func__);
+        return GHT_ERROR;
+    }
+    return GHT_OK;
+}
+
+/* Free a level and whatever it still holds */
+static void
+ght_stream_level_free(GhtStreamLevel *level)
+{
+    int i;
+    if ( level->node && level->node->children )
+    {
+        for ( i = 0; i < level->node->children->num_nodes; i++ )
+        {
+            if ( level->closed[i].body )
+                ght_writer_free(level->closed[i].body);
+        }
+    }
+    if ( level->node )
+        ght_node_free(level->node);
+    if ( level->closed )
+        ght_free(level->closed);
+    memset(level, 0, sizeof(GhtStreamLevel));
+}
+
+/* Hang a closed node off the level */
+static GhtErr
+ght_stream_level_add(GhtStreamLevel *level, GhtNode *node, const GhtStreamClosed *closed)
+{
+    int n = level->node->children ? level->node->children->num_nodes : 0;
+    if ( n == level->max_closed )
+    {
+        level->max_closed = level->max_closed ? 2 * level->max_closed : 8;
+        level->closed = ght_realloc(level->closed, level->max_closed * sizeof(GhtStreamClosed));
+    }
+    level->closed[n] = *closed;
+    return ght_node_add_child(level->node, node);
+}
+
+/*
+ * Finish a level: compact its children, then write them out, straight
+ * to the writer as a group or else with their subtrees into one buffer.
+ * The level's node comes back with only its hash and attributes, the
+ * rest goes in closed.
+ */
+static GhtErr
+ght_stream_level_close(const GhtStreamWriter *stream, GhtStreamLevel *level, GhtStreamClosed *closed)
+{
+    GhtNode *node = level->node;
+    uint64_t candidates = stream->dimmask;
+    int i, j, n;
+
+    memset(closed, 0, sizeof(GhtStreamClosed));
+    if ( ! node->children || ! node->children->num_nodes )
+        return GHT_OK;
+
+    /* Same pass as ght_node_compact_attributes, the children are already done */
+    n = node->children->num_nodes;
+    for ( i = 0; i < n; i++ )
+    {
+        GhtNode *child = node->children->nodes[i];
+        candidates &= child->attributes ? child->attributes->mask : 0;
+        for ( j = 0; j < GHT_MAX_DIMENSIONS && (candidates >> j); j++ )
+            closed->err[j] = GHT_MAX(closed->err[j], level->closed[i].err[j]);
+    }
+    if ( stream->dimmask )
+        GHT_TRY(ght_node_compact_attributes_level(node, candidates, closed->err, NULL));
+
+    closed->childcount = n;
+    if ( stream->config.format & GHT_FORMAT_GROUPED )
+    {
+        /* Groups below the children went out as they closed */
+        GHT_TRY(ght_write_varint(stream->writer, n));
+        for ( i = 0; i < n; i++ )
+            GHT_TRY(ght_node_write_grouped_header(node->children->nodes[i], level->closed[i].childcount, stream->writer));
+    }
+    else
+    {
+        GHT_TRY(ght_writer_new_mem(&(closed->body)));
+        for ( i = 0; i < n; i++ )
+        {
+            GhtNode *child = node->children->nodes[i];
+            GhtStreamClosed *c = &(level->closed[i]);
+            GHT_TRY(ght_node_write_header(child, c->childcount, closed->body));
+            if ( c->body )
+            {
+                GHT_TRY(ght_stream_append(closed->body, c->body));
+                ght_writer_free(c->body);
+                c->body = NULL;
+            }
+            GHT_TRY(ght_stream_spill(closed->body));
+        }
+    }
+
+    ght_nodelist_free_deep(node->children);
+    node->children = NULL;
+    ght_free(level->closed);
+    level->closed = NULL;
+    level->max_closed = 0;
+    return GHT_OK;
+}
+
+/* Close the top level into the one above it */
+static GhtErr
+ght_stream_pop(GhtStreamWriter *stream)
+{
+    GhtStreamLevel *top = &(stream->levels[stream->num_levels-1]);
+    GhtStreamClosed closed;
+    GhtNode *node = top->node;
+
+    GHT_TRY(ght_stream_level_close(stream, top, &closed));
+    top->node = NULL;
+    ght_stream_level_free(top);
+    stream->num_levels--;
+    return ght_stream_level_add(&(stream->levels[stream->num_levels-1]), node, &closed);
+}
+
+static void
+ght_stream_push(GhtStreamWriter *stream, GhtNode *node, int end)
+{
+    GhtStreamLevel *level = &(stream->levels[stream->num_levels++]);
+    memset(level, 0, sizeof(GhtStreamLevel));
+    level->node = node;
+    level->end = end;
+}
+
+GhtErr
+ght_stream_writer_new(const GhtSchema *schema, const GhtConfig *config, int compact,
+                      GhtWriter *writer, GhtStreamWriter **stream)
+{
+    GhtStreamWriter *s;
+    uint8_t format, version;
+    char endian = machine_endian();
+
+    assert(schema);
+    assert(writer);
+
+    s = ght_malloc(sizeof(GhtStreamWriter));
+    memset(s, 0, sizeof(GhtStreamWriter));
+    if ( config )
+        s->config = *config;
+    else
+        ght_config_init(&(s->config));
+    s->schema = schema;
+    s->writer = writer;
+
+    format = s->config.format & ~(GHT_FORMAT_FRAME | GHT_FORMAT_VERTICAL);
+    if ( format & ~(GHT_FORMAT_SCHEMA | GHT_FORMAT_GROUPED) )
+    {
+        ght_error("%s: format options 0x%02x are not supported when streaming", __func__, format & ~(GHT_FORMAT_SCHEMA | GHT_FORMAT_GROUPED));
+        ght_free(s);
+        return GHT_ERROR;
+    }
+    if ( ! ght_frame_is_global(&(s->config.frame)) )
+        format |= GHT_FORMAT_FRAME;
+    if ( ght_vertical_is_set(&(s->config.vertical)) )
+        format |= GHT_FORMAT_VERTICAL;
+
+    /* Same dimensions ght_tree_compact_attributes works on */
+    if ( compact && schema->num_dims > 2 )
+    {
+        s->dimmask = (schema->num_dims < 64) ? (UINT64_C(1) << schema->num_dims) - 1 : ~UINT64_C(0);
+        s->dimmask &= ~UINT64_C(3);
+    }
+
+    /* Same header as ght_tree_write, ahead of any nodes */
+    version = (format || schema->packmask) ? GHT_FORMAT_VERSION : GHT_FORMAT_VERSION_BASIC;
+    GHT_TRY(ght_write(writer, &endian, 1));
+    GHT_TRY(ght_write(writer, &version, 1));
+    GHT_TRY(ght_write(writer, &(s->config.max_hash_length), 1));
+    if ( version != GHT_FORMAT_VERSION_BASIC )
+        GHT_TRY(ght_write(writer, &format, 1));
+    if ( format & GHT_FORMAT_SCHEMA )
+        GHT_TRY(ght_schema_write(schema, writer));
+    if ( format & GHT_FORMAT_FRAME )
+        GHT_TRY(ght_frame_write(&(s->config.frame), writer));
+    if ( format & GHT_FORMAT_VERTICAL )
+        GHT_TRY(ght_vertical_write(&(s->config.vertical), writer));
+
+    *stream = s;
+    return GHT_OK;
+}
+
+GhtErr
+ght_stream_writer_add_node(GhtStreamWriter *stream, GhtNode *node)
+{
+    GhtStreamLevel *top;
+    GhtStreamClosed leaf;
+    int len, common = 0, start;
+
+    if ( ! node->hash || node->children )
+    {
+        ght_error("%s: only leaf nodes with a hash can be streamed", __func__);
+        return GHT_ERROR;
+    }
+    len = strlen(node->hash);
+    if ( len == 0 || len > GHT_MAX_HASH_LENGTH )
+    {
+        ght_error("%s: hash '%s' has no valid length", __func__, node->hash);
+        return GHT_ERROR;
+    }
+
+    /* First node is the root */
+    if ( ! stream->num_levels )
+    {
+        strcpy(stream->last, node->hash);
+        ght_stream_push(stream, node, len);
+        stream->num_points++;
+        return GHT_OK;
+    }
+
+    if ( strcmp(node->hash, stream->last) < 0 )
+    {
+        ght_error("%s: hash '%s' comes before '%s'", __func__, node->hash, stream->last);
+        return GHT_ERROR;
+    }
+    /* Nothing in common splits the root down to the empty hash */
+    while ( common < len && node->hash[common] == stream->last[common] )
+        common++;
+    strcpy(stream->last, node->hash);
+    memset(&leaf, 0, sizeof(GhtStreamClosed));
+
+    /* Nothing can join the nodes below the shared part any more */
+    while ( stream->num_levels > 1 && ght_stream_top_start(stream) >= common )
+        GHT_TRY(ght_stream_pop(stream));
+
+    top = &(stream->levels[stream->num_levels-1]);
+    start = ght_stream_top_start(stream);
+
+    /* GHT_SPLIT, the unshared part of the top node moves down with its attributes and children */
+    if ( common < top->end )
+    {
+        GhtStreamLevel rest;
+        GhtStreamClosed closed;
+
+        memset(&rest, 0, sizeof(GhtStreamLevel));
+        GHT_TRY(ght_node_new_from_hash(top->node->hash + (common - start), &(rest.node)));
+        rest.node->attributes = top->node->attributes;
+        rest.node->children = top->node->children;
+        rest.closed = top->closed;
+        rest.max_closed = top->max_closed;
+        rest.end = top->end;
+        top->node->attributes = NULL;
+        top->node->children = NULL;
+        top->closed = NULL;
+        top->max_closed = 0;
+        top->node->hash[common - start] = '\0';
+        top->end = common;
+
+        GHT_TRY(ght_stream_level_close(stream, &rest, &closed));
+        GHT_TRY(ght_stream_level_add(top, rest.node, &closed));
+        rest.node = NULL;
+        ght_stream_level_free(&rest);
+    }
+
+    /* GHT_SAME, duplicates hang off the node with no hash */
+    if ( common == len )
+    {
+        if ( ! stream->config.allow_duplicates )
+        {
+            ght_node_free(node);
+            return GHT_OK;
+        }
+        /* The first duplicate gets a proxy leaf for the original values */
+        if ( ! top->node->children || ! top->node->children->num_nodes )
+        {
+            GhtNode *proxy;
+            GHT_TRY(ght_node_new(&proxy));
+            proxy->attributes = top->node->attributes;
+            top->node->attributes = NULL;
+            GHT_TRY(ght_stream_level_add(top, proxy, &leaf));
+        }
+        ght_free(node->hash);
+        node->hash = NULL;
+        GHT_TRY(ght_stream_level_add(top, node, &leaf));
+        stream->num_points++;
+        return GHT_OK;
+    }
+
+    /* GHT_CHILD, the rest of the hash starts a new level */
+    memmove(node->hash, node->hash + common, len - common + 1);
+    ght_stream_push(stream, node, len);
+    stream->num_points++;
+    return GHT_OK;
+}
+
+GhtErr
+ght_stream_writer_finish(GhtStreamWriter *stream)
+{
+    GhtStreamLevel *root;
+    GhtStreamClosed closed;
+
+    if ( ! stream->num_levels )
+    {
+        ght_error("%s: no nodes were added", __func__);
+        return GHT_ERROR;
+    }
+
+    while ( stream->num_levels > 1 )
+        GHT_TRY(ght_stream_pop(stream));
+
+    root = &(stream->levels[0]);
+    GHT_TRY(ght_stream_level_close(stream, root, &closed));
+    if ( stream->config.format & GHT_FORMAT_GROUPED )
+    {
+        /* A group of one for the root, then the end */
+        GHT_TRY(ght_write_varint(stream->writer, 1));
+        GHT_TRY(ght_node_write_grouped_header(root->node, closed.childcount, stream->writer));
+        GHT_TRY(ght_write_varint(stream->writer, 0));
+    }
+    else
+    {
+        GHT_TRY(ght_node_write_header(root->node, closed.childcount, stream->writer));
+    }
+    if ( closed.body )
+    {
+        GHT_TRY(ght_stream_append(stream->writer, closed.body));
+        ght_writer_free(closed.body);
+    }
+    ght_stream_level_free(root);
+    stream->num_levels = 0;
+    return GHT_OK;
+}
+
+GhtErr
+ght_stream_writer_get_numpoints(const GhtStreamWriter *stream, uint64_t *numpoints)
+{
+    *numpoints = stream->num_points;
+    return GHT_OK;
+}
+
+GhtErr
+ght_stream_writer_free(GhtStreamWriter *stream)
+{
+    assert(stream);
+    while ( stream->num_levels > 0 )
+        ght_stream_level_free(&(stream->levels[--stream->num_levels]));
+    ght_free(stream);
+    return GHT_OK;
+}
@@ -21,6 +21,7 @@ ght_tree_new(const GhtSchema *schema, GhtTree **tree)
     memset(t, 0, sizeof(GhtTree));
     t->config.allow_duplicates = GHT_DUPES_YES;
     t->config.max_hash_length  = GHT_MAX_HASH_LENGTH;
+    ght_frame_set_global(&(t->config.frame));
     t->schema = schema;
     *tree = t;
     return GHT_OK;
@@ -47,42 +48,148 @@ ght_tree_get_hash(const GhtTree *tree, GhtHash **hash)
 }
 
 GhtErr
-ght_tree_compact_attributes(GhtTree *tree)
+ght_tree_compact_attributes_with_stats(GhtTree *tree, GhtCompactStats *stats)
 {
-    int i;
-    GhtAttribute attr;
+    uint64_t dimmask;
+
+    if ( stats )
+        memset(stats, 0, tree->schema->num_dims * sizeof(GhtCompactStats));
+
+    if ( ! tree->root || tree->schema->num_dims <= 2 )
+        return GHT_OK;
 
     /* for 'Z 'and all other attributes... */
-    for ( i = 2; i < tree->schema->num_dims; i++ )
+    dimmask = (tree->schema->num_dims < 64) ? (UINT64_C(1) << tree->schema->num_dims) - 1 : ~UINT64_C(0);
+    dimmask &= ~UINT64_C(3);
+    GHT_TRY(ght_node_compact_attributes(tree->root, dimmask, stats));
+
+    /* Values moved up the tree, and may have been merged within tolerance */
+    if ( tree->presence_dim )
+        GHT_TRY(ght_node_build_presence(tree->root, tree->presence_dim));
+    return GHT_OK;
+}
+
+GhtErr
+ght_tree_compact_attributes(GhtTree *tree)
+{
+    return ght_tree_compact_attributes_with_stats(tree, NULL);
+}
+
+
+
+GhtErr
+ght_tree_build_presence(GhtTree *tree, const char *dimname)
+{
+    GhtDimension *dim;
+
+    GHT_TRY(ght_schema_get_dimension_by_name(tree->schema, dimname, &dim));
+    if ( dim->type == GHT_DOUBLE || dim->type == GHT_FLOAT )
     {
-        ght_node_compact_attribute(tree->root, tree->schema->dims[i], &attr);
+        ght_warn("%s: dimension '%s' does not have integer storage", __func__, dimname);
+        return GHT_ERROR;
     }
+    tree->presence_dim = dim;
+    if ( tree->root )
+        GHT_TRY(ght_node_build_presence(tree->root, dim));
     return GHT_OK;
 }
 
+/*
+ * Hashes with nothing in common go under a root with the empty hash,
+ * as they do with a frame fitted to the points. The old root keeps its
+ * hash, attributes and children, just as a split would leave them.
+ */
+static GhtErr
+ght_tree_insert_under_root(GhtNode **root, GhtNode *node, GhtDuplicates duplicates)
+{
+    if ( (*root)->hash && (*root)->hash[0] && node->hash && node->hash[0] != (*root)->hash[0] )
+    {
+        GhtNode *global;
+        GHT_TRY(ght_node_new_from_hash("", &global));
+        global->presence = (*root)->presence;
+        GHT_TRY(ght_node_add_child(global, *root));
+        *root = global;
+    }
+    return ght_node_insert_node(*root, node, duplicates);
+}
 
+/* The empty root hash reads back as no hash */
+static void
+ght_tree_read_root_hash(GhtTree *t)
+{
+    if ( t->root && ! t->root->hash && t->root->children )
+        t->root->hash = ght_strdup("");
+}
 
 GhtErr
 ght_tree_insert_node(GhtTree *tree, GhtNode *node)
 {
+    /* Bits of the new leaf get added on the way down */
+    if ( tree->presence_dim )
+        GHT_TRY(ght_node_build_presence(node, tree->presence_dim));
+
     if ( ! tree->root )
     {
         tree->root = node;
     }
     else
     {
-        GHT_TRY(ght_node_insert_node(tree->root, node, tree->config.allow_duplicates));
+        GHT_TRY(ght_tree_insert_under_root(&(tree->root), node, tree->config.allow_duplicates));
     }
     tree->num_nodes++;
     return GHT_OK;
 }
 
+/** Node tree in the layout given by the format options */
+static GhtErr
+ght_tree_write_body(const GhtTree *tree, uint8_t format, GhtWriter *writer)
+{
+    uint64_t resmask = 0;
+
+    /* Children after their subtrees, as the stream writer puts them */
+    if ( format & GHT_FORMAT_GROUPED )
+    {
+        if ( format & (GHT_FORMAT_COLUMNAR | GHT_FORMAT_RESIDUAL) )
+        {
+            ght_error("%s: the grouped layout does not go with columnar or residual values", __func__);
+            return GHT_ERROR;
+        }
+        return ght_node_write_grouped(tree->root, writer);
+    }
+
+    /* Separate streams, residuals are applied per column */
+    if ( format & GHT_FORMAT_COLUMNAR )
+        return ght_node_write_columnar(tree->root, tree->schema, format, writer);
+
+    if ( format & GHT_FORMAT_RESIDUAL )
+    {
+        /* Dimensions stored as residuals */
+        GHT_TRY(ght_node_get_residual_mask(tree->root, tree->schema, &resmask));
+        GHT_TRY(ght_write_varint(writer, resmask));
+        return ght_node_write_residual(tree->root, tree->schema, resmask, writer);
+    }
+
+    return ght_node_write(tree->root, writer);
+}
+
 GhtErr
 ght_tree_write(const GhtTree *tree, GhtWriter *writer)
 {
-    uint8_t version = GHT_FORMAT_VERSION;
+    uint8_t format = tree->config.format & ~(GHT_FORMAT_PRESENCE | GHT_FORMAT_FRAME | GHT_FORMAT_VERTICAL);
+    uint8_t version;
     char endian = machine_endian();
 
+    /* The bitmaps are rebuilt on read, only the dimension is written */
+    if ( tree->presence_dim )
+        format |= GHT_FORMAT_PRESENCE;
+    /* Global trees stay readable by older code */
+    if ( ! ght_frame_is_global(&(tree->config.frame)) )
+        format |= GHT_FORMAT_FRAME;
+    if ( ght_vertical_is_set(&(tree->config.vertical)) )
+        format |= GHT_FORMAT_VERTICAL;
+    /* Packed dimensions need a reader that knows about them */
+    version = (format || tree->schema->packmask) ? GHT_FORMAT_VERSION : GHT_FORMAT_VERSION_BASIC;
+
     assert(writer);
     assert(tree);
     
@@ -98,7 +205,112 @@ ght_tree_write(const GhtTree *tree, GhtWriter *writer)
     /* Maximum hash length in this tree */
     GHT_TRY(ght_write(writer, &(tree->config.max_hash_length), 1));
     
-    return ght_node_write(tree->root, writer);
+    /* No options, original layout */
+    if ( version == GHT_FORMAT_VERSION_BASIC )
+        return ght_node_write(tree->root, writer);
+
+    /* Format options */
+    GHT_TRY(ght_write(writer, &format, 1));
+
+    /* Schema, kept outside any compression so it is cheap to get at */
+    if ( format & GHT_FORMAT_SCHEMA )
+        GHT_TRY(ght_schema_write(tree->schema, writer));
+
+    /* Extent the hashes subdivide */
+    if ( format & GHT_FORMAT_FRAME )
+        GHT_TRY(ght_frame_write(&(tree->config.frame), writer));
+
+    /* Range z is hashed over */
+    if ( format & GHT_FORMAT_VERTICAL )
+        GHT_TRY(ght_vertical_write(&(tree->config.vertical), writer));
+
+    /* Dimension with presence bitmaps */
+    if ( format & GHT_FORMAT_PRESENCE )
+    {
+        uint8_t position = tree->presence_dim->position;
+        GHT_TRY(ght_write(writer, &position, 1));
+    }
+
+    /* Build the body in memory, then write it out in compressed blocks */
+    if ( format & GHT_FORMAT_COMPRESSED )
+    {
+        GhtWriter *body;
+        GhtErr err;
+        GHT_TRY(ght_writer_new_mem(&body));
+        err = ght_tree_write_body(tree, format, body);
+        if ( err == GHT_OK )
+            err = ght_write_compressed(writer, bytebuffer_getbytes(body->bytebuffer), bytebuffer_getsize(body->bytebuffer));
+        ght_writer_free(body);
+        return err;
+    }
+
+    return ght_tree_write_body(tree, format, writer);
+}
+
+static GhtErr
+ght_tree_read_nodes(GhtReader *reader, GhtTree *t)
+{
+    uint64_t resmask;
+
+    if ( t->config.format & GHT_FORMAT_GROUPED )
+        return ght_node_read_grouped(reader, &(t->root));
+
+    if ( t->config.format & GHT_FORMAT_COLUMNAR )
+        return ght_node_read_columnar(reader, &(t->root));
+
+    if ( t->config.format & GHT_FORMAT_RESIDUAL )
+    {
+        GHT_TRY(ght_read_varint(reader, &resmask));
+        return ght_node_read_residual(reader, resmask, &(t->root));
+    }
+    return ght_node_read(reader, &(t->root));
+}
+
+static GhtErr
+ght_tree_read_body(GhtReader *reader, GhtTree *t)
+{
+    GhtReader *body;
+    GhtErr err;
+    uint64_t alldims;
+    int lazy;
+
+    if ( ! (t->config.format & GHT_FORMAT_COMPRESSED) )
+        return ght_tree_read_nodes(reader, t);
+
+    /* Columnar bodies step over unwanted columns, so when some dimensions
+     * are left out only inflate the blocks that actually get read */
+    alldims = (t->schema->num_dims < 64) ? (UINT64_C(1) << t->schema->num_dims) - 1 : ~UINT64_C(0);
+    lazy = (t->config.format & GHT_FORMAT_COLUMNAR) && (alldims & ~(reader->dimmask));
+
+    GHT_TRY(ght_reader_new_compressed(reader, lazy, &body));
+    err = ght_tree_read_nodes(body, t);
+    ght_reader_free(body);
+    return err;
+}
+
+/*
+ * Embedded schema. A reader without a schema adopts it, interned in the
+ * schema registry so files with the same schema share one copy and it
+ * outlives the tree. A reader with a schema keeps its own, which must match.
+ */
+static GhtErr
+ght_tree_read_schema(GhtReader *reader, GhtTree *t)
+{
+    GhtSchema *schema;
+    int same;
+
+    GHT_TRY(ght_schema_read(reader, &schema));
+    if ( ! reader->schema )
+        return ght_schema_registry_add(schema, &(t->schema));
+
+    ght_schema_same(schema, reader->schema, &same);
+    ght_schema_free(schema);
+    if ( ! same )
+    {
+        ght_error("%s: embedded schema does not match the reader schema", __func__);
+        return GHT_ERROR;
+    }
+    return GHT_OK;
 }
 
 GhtErr 
@@ -114,11 +326,75 @@ ght_tree_read(GhtReader *reader, GhtTree **tree)
     /* File format version */
     GHT_TRY(ght_read(reader, &(t->config.version), 1));
     
-    if ( GHT_FORMAT_VERSION == t->config.version )
+    if ( GHT_FORMAT_VERSION_BASIC == t->config.version )
+    {
+        if ( ! reader->schema )
+        {
+            ght_error("%s: version %d files need a schema to read", __func__, t->config.version);
+            return GHT_ERROR;
+        }
+        /* Maximum hash length in this tree */
+        GHT_TRY(ght_read(reader, &(t->config.max_hash_length), 1));
+        GHT_TRY(ght_node_read(reader, &(t->root)));
+        ght_tree_read_root_hash(t);
+        return GHT_OK;
+    }
+    else if ( GHT_FORMAT_VERSION == t->config.version )
     {
+        GhtErr err;
+        const GhtSchema *readerschema = reader->schema;
+        uint8_t presence = 0;
+
         /* Maximum hash length in this tree */
         GHT_TRY(ght_read(reader, &(t->config.max_hash_length), 1));
-        return ght_node_read(reader, &(t->root));
+        /* Format options */
+        GHT_TRY(ght_read(reader, &(t->config.format), 1));
+        if ( t->config.format & ~(GHT_FORMAT_RESIDUAL | GHT_FORMAT_COLUMNAR | GHT_FORMAT_COMPRESSED | GHT_FORMAT_SCHEMA | GHT_FORMAT_PRESENCE | GHT_FORMAT_GROUPED | GHT_FORMAT_FRAME | GHT_FORMAT_VERTICAL) )
+        {
+            ght_error("%s: unsupported GHT format options 0x%02x", __func__, t->config.format);
+            return GHT_ERROR;
+        }
+
+        if ( t->config.format & GHT_FORMAT_SCHEMA )
+        {
+            GHT_TRY(ght_tree_read_schema(reader, t));
+        }
+        else if ( ! reader->schema )
+        {
+            ght_error("%s: file has no embedded schema and the reader has none", __func__);
+            return GHT_ERROR;
+        }
+
+        if ( t->config.format & GHT_FORMAT_FRAME )
+            GHT_TRY(ght_frame_read(reader, &(t->config.frame)));
+
+        if ( t->config.format & GHT_FORMAT_VERTICAL )
+            GHT_TRY(ght_vertical_read(reader, &(t->config.vertical)));
+
+        if ( t->config.format & GHT_FORMAT_PRESENCE )
+        {
+            GHT_TRY(ght_read(reader, &presence, 1));
+            if ( presence >= t->schema->num_dims )
+            {
+                ght_error("%s: presence dimension %d is not in the schema", __func__, presence);
+                return GHT_ERROR;
+            }
+        }
+
+        /* Nodes are read against the tree schema, embedded or not */
+        reader->schema = t->schema;
+        err = ght_tree_read_body(reader, t);
+        reader->schema = readerschema;
+        GHT_TRY(err);
+        ght_tree_read_root_hash(t);
+
+        /* Rebuild the bitmaps, unless the dimension was left out */
+        if ( (t->config.format & GHT_FORMAT_PRESENCE) && (reader->dimmask & (UINT64_C(1) << presence)) )
+        {
+            t->presence_dim = t->schema->dims[presence];
+            GHT_TRY(ght_node_build_presence(t->root, t->presence_dim));
+        }
+        return GHT_OK;
     }
     else
     {
@@ -127,6 +403,18 @@ ght_tree_read(GhtReader *reader, GhtTree **tree)
     }
 }
 
+GhtErr
+ght_tree_read_dimensions(GhtReader *reader, uint64_t dimmask, GhtTree **tree)
+{
+    GhtErr err;
+    uint64_t oldmask = reader->dimmask;
+
+    reader->dimmask = dimmask;
+    err = ght_tree_read(reader, tree);
+    reader->dimmask = oldmask;
+    return err;
+}
+
 GhtErr
 ght_tree_from_nodelist(const GhtSchema *schema, GhtNodeList *nlist, GhtConfig *config, GhtTree **tree)
 {
@@ -150,7 +438,7 @@ ght_tree_from_nodelist(const GhtSchema *schema, GhtNodeList *nlist, GhtConfig *c
         }
         else
         {
-            err = ght_node_insert_node(root, node, config->allow_duplicates);
+            err = ght_tree_insert_under_root(&root, node, config->allow_duplicates);
             /* If we have an error, that's a big problem. The nodes underneath */
             /* the GhtNodeList have now been mutated during the insertion */
             /* process, and there are also new interior nodes lying around too */
@@ -175,6 +463,112 @@ ght_tree_from_nodelist(const GhtSchema *schema, GhtNodeList *nlist, GhtConfig *c
     return GHT_OK;
 }
 
+/*
+ * Hang the roots of the parts under one node holding their common hash
+ * prefix. Parts built from points that differ after a shared prefix
+ * (one per next hash character, say) come out the same as a tree built
+ * by inserting all the points, apart from the order of the children.
+ * Parts whose roots go on with the same character after the prefix
+ * overlap and are refused.
+ */
+GhtErr
+ght_tree_join(const GhtSchema *schema, GhtTree **parts, int num_parts, GhtTree **tree)
+{
+    int i, k, prefix = -1, num_roots = 0;
+    const GhtHash *first = NULL;
+    const GhtConfig *hashing = NULL;
+    char buf[GHT_MAX_HASH_LENGTH + 1];
+    unsigned char seen[256];
+    GhtTree *t;
+    GhtNode *root = NULL;
+
+    /* Hash prefix shared by every root */
+    for ( i = 0; i < num_parts; i++ )
+    {
+        const GhtHash *hash;
+        if ( ! parts[i] || ! parts[i]->root ) continue;
+        hash = parts[i]->root->hash;
+        if ( ! hash || parts[i]->schema != schema )
+        {
+            ght_error("%s: part %d has no root hash or another schema", __func__, i);
+            return GHT_ERROR;
+        }
+        if ( first && ! (ght_frame_same(&(parts[i]->config.frame), &(hashing->frame)) &&
+                         ! memcmp(&(parts[i]->config.vertical), &(hashing->vertical), sizeof(GhtRange))) )
+        {
+            ght_error("%s: part %d is hashed in another frame", __func__, i);
+            return GHT_ERROR;
+        }
+        if ( ! first )
+        {
+            hashing = &(parts[i]->config);
+            first = hash;
+            prefix = strlen(hash);
+        }
+        for ( k = 0; k < prefix && hash[k] == first[k]; k++ );
+        prefix = k;
+        num_roots++;
+    }
+
+    /* A root that is the whole prefix would have the others below it, */
+    /* and two roots going on with the same character would be siblings */
+    /* that should have been one child */
+    memset(seen, 0, sizeof(seen));
+    for ( i = 0; num_roots > 1 && i < num_parts; i++ )
+    {
+        unsigned char c;
+        if ( ! (parts[i] && parts[i]->root) ) continue;
+        c = (unsigned char)(parts[i]->root->hash[prefix]);
+        if ( ! c )
+        {
+            ght_error("%s: part %d contains the others, the parts overlap", __func__, i);
+            return GHT_ERROR;
+        }
+        if ( seen[c] )
+        {
+            ght_error("%s: part %d shares '%c' after the prefix with another part, the parts overlap", __func__, i, c);
+            return GHT_ERROR;
+        }
+        seen[c] = 1;
+    }
+
+    GHT_TRY(ght_tree_new(schema, &t));
+    if ( num_roots > 1 )
+    {
+        strncpy(buf, first, prefix);
+        buf[prefix] = '\0';
+        GHT_TRY(ght_node_new_from_hash(buf, &root));
+    }
+
+    /* Take over the roots, freeing the emptied parts */
+    for ( i = 0; i < num_parts; i++ )
+    {
+        GhtNode *node;
+        if ( ! parts[i] ) continue;
+        node = parts[i]->root;
+        parts[i]->root = NULL;
+        if ( node )
+        {
+            t->num_nodes += parts[i]->num_nodes;
+            t->config = parts[i]->config;
+            if ( root )
+            {
+                memmove(node->hash, node->hash + prefix, strlen(node->hash + prefix) + 1);
+                GHT_TRY(ght_node_add_child(root, node));
+            }
+            else
+            {
+                root = node;
+            }
+        }
+        ght_tree_free(parts[i]);
+        parts[i] = NULL;
+    }
+    t->root = root;
+    *tree = t;
+    return GHT_OK;
+}
+
 GhtErr
 ght_tree_to_nodelist(const GhtTree *tree, GhtNodeList *nodelist)
 {
@@ -199,7 +593,60 @@ ght_tree_get_extent(const GhtTree *tree, GhtArea *area)
     
     if ( ! tree->root ) return GHT_ERROR;
     
-    return ght_node_get_extent(tree->root, h, area);
+    return ght_node_get_extent(tree->root, h, &(tree->config.frame),
+                               ght_vertical_is_set(&(tree->config.vertical)) ? &(tree->config.vertical) : NULL, area);
+}
+
+GhtErr
+ght_tree_set_frame(GhtTree *tree, const GhtArea *frame)
+{
+    if ( ! (frame->x.min < frame->x.max && frame->y.min < frame->y.max) )
+    {
+        ght_warn("%s: frame (%g %g, %g %g) has no area", __func__,
+                 frame->x.min, frame->y.min, frame->x.max, frame->y.max);
+        return GHT_ERROR;
+    }
+    if ( tree->root )
+    {
+        ght_warn("%s: tree already holds nodes hashed in another frame", __func__);
+        return GHT_ERROR;
+    }
+    tree->config.frame = *frame;
+    return GHT_OK;
+}
+
+GhtErr
+ght_tree_get_frame(const GhtTree *tree, GhtArea *frame)
+{
+    if ( ght_frame_is_global(&(tree->config.frame)) )
+        ght_frame_set_global(frame);
+    else
+        *frame = tree->config.frame;
+    return GHT_OK;
+}
+
+GhtErr
+ght_tree_set_vertical(GhtTree *tree, const GhtRange *vertical)
+{
+    if ( ! ght_vertical_is_set(vertical) )
+    {
+        ght_warn("%s: vertical range (%g %g) is empty", __func__, vertical->min, vertical->max);
+        return GHT_ERROR;
+    }
+    if ( tree->root )
+    {
+        ght_warn("%s: tree already holds nodes hashed without it", __func__);
+        return GHT_ERROR;
+    }
+    tree->config.vertical = *vertical;
+    return GHT_OK;
+}
+
+GhtErr
+ght_tree_get_vertical(const GhtTree *tree, GhtRange *vertical)
+{
+    *vertical = tree->config.vertical;
+    return GHT_OK;
 }
 
 GhtErr
@@ -215,8 +662,8 @@ ght_tree_get_schema(const GhtTree *tree, const GhtSchema **schema)
 static GhtErr
 ght_tree_filter(const GhtTree *tree, const GhtFilter *filter, GhtTree **tree_filtered)
 {
-    GhtSchema *schema_filtered = NULL;
     GhtNode *root_filtered = NULL;
+    GhtFilter compiled;
     GhtErr err;
     int num_leaves = 0;
     
@@ -224,15 +671,32 @@ ght_tree_filter(const GhtTree *tree, const GhtFilter *filter, GhtTree **tree_fil
     if ( ! tree || ! tree_filtered )
         return GHT_ERROR;
     
-    /* Filter */
-    err = ght_node_filter_by_attribute(tree->root, filter, &root_filtered);
+    /* Filter, with the thresholds in the storage domain */
+    compiled = *filter;
+    GHT_TRY(ght_filter_compile(&compiled));
+    compiled.presence = 0;
+    if ( tree->presence_dim && tree->presence_dim->position == filter->dim->position )
+        compiled.presence = ght_filter_presence_mask(&compiled);
+    /* Z filters on 3D hashes skip the cells they miss, trusting Z is the hashed z */
+    compiled.vertical = NULL;
+    if ( ght_vertical_is_set(&(tree->config.vertical)) )
+    {
+        GhtDimension *zdim;
+        if ( ght_schema_get_dimension_by_name(tree->schema, "Z", &zdim) == GHT_OK && zdim->position == filter->dim->position )
+        {
+            compiled.frame = &(tree->config.frame);
+            compiled.vertical = &(tree->config.vertical);
+        }
+    }
+    err = ght_node_filter_by_attribute(tree->root, &compiled, &root_filtered);
     if ( err == GHT_ERROR )
         ght_error("%s: attribute filter failed", __func__);
         
-    /* Got a valid response, so build a new tree around it */
+    /* Got a valid response, so build a new tree around it, */
+    /* the filtered attributes still refer to the input schema, */
+    /* which for a tree read with an embedded schema is interned */
     GHT_TRY(ght_node_count_leaves(root_filtered, &num_leaves));
-    GHT_TRY(ght_schema_clone(tree->schema, &schema_filtered));
-    GHT_TRY(ght_tree_new(schema_filtered, tree_filtered));
+    GHT_TRY(ght_tree_new(tree->schema, tree_filtered));
     (*tree_filtered)->num_nodes = num_leaves;
     (*tree_filtered)->config = tree->config;
     (*tree_filtered)->root = root_filtered;
@@ -241,70 +705,97 @@ ght_tree_filter(const GhtTree *tree, const GhtFilter *filter, GhtTree **tree_fil
 }
 
 GhtErr
-ght_tree_filter_greater_than(const GhtTree *tree, const char *dimname, double value, GhtTree **tree_filtered)
+ght_tree_filter_by_dimension(const GhtTree *tree, const GhtDimension *dim, GhtFilterMode mode, double value1, double value2, GhtTree **tree_filtered)
 {
     GhtFilter filter;
-    GhtDimension *dim;
+    int same = 0;
+
+    /* Handles from an equivalent schema are fine, the position is what counts */
+    if ( dim && dim->schema != tree->schema && dim->position < tree->schema->num_dims )
+        ght_dimension_same(dim, tree->schema->dims[dim->position], &same);
+    else if ( dim )
+        same = (dim->schema == tree->schema);
+
+    if ( ! same )
+    {
+        ght_warn("%s: dimension does not belong to the tree schema", __func__);
+        return GHT_ERROR;
+    }
+
+    if ( mode == GHT_IN )
+    {
+        ght_warn("%s: GHT_IN takes a list of values, use ght_tree_filter_in", __func__);
+        return GHT_ERROR;
+    }
+
+    if ( mode == GHT_BETWEEN && value1 > value2 )
+    {   
+        double tmp = value1;
+        value1 = value2;
+        value2 = tmp;
+    }
     
     /* Set up filter */
-    filter.mode = GHT_GREATER_THAN;
-    filter.range.min = filter.range.max = value;
-    GHT_TRY(ght_schema_get_dimension_by_name(tree->schema, dimname, &dim));
+    memset(&filter, 0, sizeof(GhtFilter));
+    filter.mode = mode;
+    filter.range.min = value1;
+    filter.range.max = mode == GHT_BETWEEN ? value2 : value1;
     filter.dim = dim;
     
     return ght_tree_filter(tree, &filter, tree_filtered);
+}
+
+GhtErr
+ght_tree_filter_greater_than(const GhtTree *tree, const char *dimname, double value, GhtTree **tree_filtered)
+{
+    GhtDimension *dim;
+    GHT_TRY(ght_schema_get_dimension_by_name(tree->schema, dimname, &dim));
+    return ght_tree_filter_by_dimension(tree, dim, GHT_GREATER_THAN, value, value, tree_filtered);
 }    
 
 GhtErr
 ght_tree_filter_less_than(const GhtTree *tree, const char *dimname, double value, GhtTree **tree_filtered)
 {
-    GhtFilter filter;
     GhtDimension *dim;
-    
-    /* Set up filter */
-    filter.mode = GHT_LESS_THAN;
-    filter.range.min = filter.range.max = value;
     GHT_TRY(ght_schema_get_dimension_by_name(tree->schema, dimname, &dim));
-    filter.dim = dim;
-    
-    return ght_tree_filter(tree, &filter, tree_filtered);
+    return ght_tree_filter_by_dimension(tree, dim, GHT_LESS_THAN, value, value, tree_filtered);
 }    
 
 GhtErr
 ght_tree_filter_between(const GhtTree *tree, const char *dimname, double value1, double value2, GhtTree **tree_filtered)
 {
-    GhtFilter filter;
     GhtDimension *dim;
-
-    if ( value1 > value2 )
-    {   
-        double tmp = value1;
-        value1 = value2;
-        value2 = tmp;
-    }
-    
-    /* Set up filter */
-    filter.mode = GHT_BETWEEN;
-    filter.range.min = value1;
-    filter.range.max = value2;
     GHT_TRY(ght_schema_get_dimension_by_name(tree->schema, dimname, &dim));
-    filter.dim = dim;
-    
-    return ght_tree_filter(tree, &filter, tree_filtered);
+    return ght_tree_filter_by_dimension(tree, dim, GHT_BETWEEN, value1, value2, tree_filtered);
 }    
 
 GhtErr
 ght_tree_filter_equal(const GhtTree *tree, const char *dimname, double value, GhtTree **tree_filtered)
+{
+    GhtDimension *dim;
+    GHT_TRY(ght_schema_get_dimension_by_name(tree->schema, dimname, &dim));
+    return ght_tree_filter_by_dimension(tree, dim, GHT_EQUAL, value, value, tree_filtered);
+}
+
+GhtErr
+ght_tree_filter_in(const GhtTree *tree, const char *dimname, const double *values, int num_values, GhtTree **tree_filtered)
 {
     GhtFilter filter;
     GhtDimension *dim;
-    
-    /* Set up filter */
-    filter.mode = GHT_EQUAL;
-    filter.range.min = filter.range.max = value;
+
     GHT_TRY(ght_schema_get_dimension_by_name(tree->schema, dimname, &dim));
+    if ( num_values < 1 || num_values > GHT_FILTER_MAX_IN || ! values )
+    {
+        ght_warn("%s: need 1 to %d values, got %d", __func__, GHT_FILTER_MAX_IN, num_values);
+        return GHT_ERROR;
+    }
+
+    memset(&filter, 0, sizeof(GhtFilter));
+    filter.mode = GHT_IN;
     filter.dim = dim;
-    
+    filter.values = values;
+    filter.num_values = num_values;
+
     return ght_tree_filter(tree, &filter, tree_filtered);
 }
     
@@ -328,12 +819,13 @@ ght_tree_get_numpoints(const GhtTree *tree, int *numpoints)
 GhtErr
 ght_tree_calculate_z_average(const GhtTree *tree)
 {
-    GhtSchema *schema;
-    GHT_TRY( ght_tree_get_schema(tree, &schema) );
+    GhtDimension *zdim;
 
     if ( ! tree->root )
     	return GHT_ERROR;
-    return ght_node_calculate_z(tree->root, NULL, schema);
+    /* Resolve Z once rather than at every leaf */
+    GHT_TRY( ght_schema_get_dimension_by_name(tree->schema, "Z", &zdim) );
+    return ght_node_calculate_z(tree->root, NULL, zdim);
 }
 
 // TODO Get root from tree
@@ -159,12 +159,16 @@ ght_config_init(GhtConfig *config)
     //     unsigned char  max_hash_length;
     //     unsigned char  version;
     //     unsigned char  endian;
+    //     unsigned char  format;
+    //     GhtArea        frame;
+    //     GhtRange       vertical;
     // } GhtConfig;
     memset(config, 0, sizeof(GhtConfig));
     config->allow_duplicates = GHT_DUPES_YES;
     config->max_hash_length = GHT_MAX_HASH_LENGTH;
     config->version = GHT_FORMAT_VERSION;
     config->endian = machine_endian();
+    ght_frame_set_global(&(config->frame));
     return GHT_OK;
 }
 
@@ -120,6 +120,54 @@ test_ght_build_node_with_attributes(void)
     ght_node_free(node);
 }
 
+static void
+test_ght_node_packed_attributes(void)
+{
+    GhtAttribute *a, found;
+    GhtCoordinate coord;
+    GhtNode *node;
+    uint8_t count;
+    double d;
+
+    coord.x = -127;
+    coord.y = 45;
+    ght_node_new_from_coordinate(&coord, 16, &node);
+
+    /* Out of dimension order, the set keeps them sorted */
+    ght_attribute_new_from_double(simpleschema->dims[3], 7, &a);
+    CU_ASSERT_EQUAL(ght_node_add_attribute(node, a), GHT_OK);
+    ght_attribute_new_from_double(simpleschema->dims[2], 99.5, &a);
+    CU_ASSERT_EQUAL(ght_node_add_attribute(node, a), GHT_OK);
+    ght_node_count_attributes(node, &count);
+    CU_ASSERT_EQUAL(count, 2);
+    CU_ASSERT_EQUAL(node->attributes->size, 6);
+
+    /* Replacing a value does not grow the set */
+    ght_attribute_new_from_double(simpleschema->dims[2], 101.25, &a);
+    CU_ASSERT_EQUAL(ght_node_add_attribute(node, a), GHT_OK);
+    ght_node_count_attributes(node, &count);
+    CU_ASSERT_EQUAL(count, 2);
+    CU_ASSERT_EQUAL(ght_node_get_attribute(node, simpleschema->dims[2], &found), GHT_OK);
+    ght_attribute_get_value(&found, &d);
+    CU_ASSERT_DOUBLE_EQUAL(d, 101.25, 0.00000001);
+    CU_ASSERT_EQUAL(ght_node_get_attribute(node, simpleschema->dims[3], &found), GHT_OK);
+    ght_attribute_get_value(&found, &d);
+    CU_ASSERT_DOUBLE_EQUAL(d, 7, 0.00000001);
+
+    /* Deleting the lower dimension shifts the higher one down */
+    CU_ASSERT_EQUAL(ght_node_delete_attribute(node, simpleschema->dims[2]), GHT_OK);
+    CU_ASSERT_EQUAL(ght_node_get_attribute(node, simpleschema->dims[2], &found), GHT_ERROR);
+    CU_ASSERT_EQUAL(ght_node_get_attribute(node, simpleschema->dims[3], &found), GHT_OK);
+    ght_attribute_get_value(&found, &d);
+    CU_ASSERT_DOUBLE_EQUAL(d, 7, 0.00000001);
+
+    /* Deleting the last one drops the storage */
+    CU_ASSERT_EQUAL(ght_node_delete_attribute(node, simpleschema->dims[3]), GHT_OK);
+    CU_ASSERT_EQUAL(node->attributes, NULL);
+
+    ght_node_free(node);
+}
+
 static void
 test_ght_build_tree_with_attributes(void)
 {
@@ -186,29 +234,133 @@ test_ght_build_tree_with_attributes(void)
     ght_stringbuffer_destroy(sb);
     
     /* Check that Intensity=5 has migrated all the way to the top of the tree */
-    CU_ASSERT_STRING_EQUAL(root->attributes->dim->name, "Intensity");
-    ght_attribute_get_value(root->attributes, &d);
+    err = ght_node_get_attribute(root, simpleschema->dims[3], &attr);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    CU_ASSERT_STRING_EQUAL(attr.dim->name, "Intensity");
+    ght_attribute_get_value(&attr, &d);
     CU_ASSERT_DOUBLE_EQUAL(d, 5, 0.00000001);
+    /* And nothing else came with it */
+    err = ght_node_get_attribute(root, simpleschema->dims[2], &attr);
+    CU_ASSERT_EQUAL(err, GHT_ERROR);
 
     /* Free the root after the next test */
     // ght_node_free(root);
     ght_nodelist_free_shallow(nodelist);
 }
 
+static void
+test_ght_compact_attributes_single_pass(void)
+{
+    int i;
+    static const char *simpledata = "test/data/simple-data.tsv";
+    GhtNodeList *nodelist1, *nodelist2;
+    GhtNode *root1, *root2;
+    GhtAttribute attr;
+    stringbuffer_t *sb1, *sb2;
+
+    /* Two copies of the same tree */
+    nodelist1 = tsv_file_to_node_list(simpledata, simpleschema);
+    nodelist2 = tsv_file_to_node_list(simpledata, simpleschema);
+    root1 = nodelist1->nodes[0];
+    root2 = nodelist2->nodes[0];
+    for ( i = 1; i < nodelist1->num_nodes; i++ )
+    {
+        ght_node_insert_node(root1, nodelist1->nodes[i], GHT_DUPES_YES);
+        ght_node_insert_node(root2, nodelist2->nodes[i], GHT_DUPES_YES);
+    }
+
+    /* One dimension at a time vs. both dimensions in one pass */
+    ght_node_compact_attribute(root1, simpleschema->dims[2], &attr);
+    ght_node_compact_attribute(root1, simpleschema->dims[3], &attr);
+    CU_ASSERT_EQUAL(ght_node_compact_attributes(root2, 0x0C, NULL), GHT_OK);
+
+    sb1 = ght_stringbuffer_create();
+    sb2 = ght_stringbuffer_create();
+    ght_node_to_string(root1, sb1, 0);
+    ght_node_to_string(root2, sb2, 0);
+    CU_ASSERT_STRING_EQUAL(ght_stringbuffer_getstring(sb1), ght_stringbuffer_getstring(sb2));
+    ght_stringbuffer_destroy(sb1);
+    ght_stringbuffer_destroy(sb2);
+
+    /* Intensity is at the top, Z is not */
+    CU_ASSERT_EQUAL(ght_node_get_attribute(root2, simpleschema->dims[3], &attr), GHT_OK);
+    CU_ASSERT_EQUAL(ght_node_get_attribute(root2, simpleschema->dims[2], &attr), GHT_ERROR);
+
+    ght_nodelist_free_shallow(nodelist1);
+    ght_nodelist_free_shallow(nodelist2);
+    ght_node_free(root1);
+    ght_node_free(root2);
+}
+
+static void
+test_ght_compact_attributes_lossy(void)
+{
+    int i;
+    static const char *simpledata = "test/data/simple-data.tsv";
+    GhtSchema *schema;
+    GhtNodeList *nodelist;
+    GhtNode *lossyroot;
+    GhtAttribute attr;
+    GhtCompactStats stats[4];
+    double d;
+
+    /* Z may be off by 0.1, Intensity is still exact */
+    ght_schema_clone(simpleschema, &schema);
+    CU_ASSERT_EQUAL(ght_dimension_set_tolerance(schema->dims[2], 0.1), GHT_OK);
+
+    nodelist = tsv_file_to_node_list(simpledata, schema);
+    lossyroot = nodelist->nodes[0];
+    for ( i = 1; i < nodelist->num_nodes; i++ )
+        ght_node_insert_node(lossyroot, nodelist->nodes[i], GHT_DUPES_YES);
+
+    memset(stats, 0, sizeof(stats));
+    CU_ASSERT_EQUAL(ght_node_compact_attributes(lossyroot, 0x0C, stats), GHT_OK);
+
+    /* The 123.3 under 'q' is absorbed (123.35), then 'q' and 'r' meet at */
+    /* the root, where the 123.375 midpoint is stored to the 0.01 scale */
+    CU_ASSERT_EQUAL(ght_node_get_attribute(lossyroot, schema->dims[2], &attr), GHT_OK);
+    ght_attribute_get_value(&attr, &d);
+    CU_ASSERT_DOUBLE_EQUAL(d, 123.37, 0.00000001);
+    CU_ASSERT_EQUAL(ght_node_get_attribute(lossyroot, schema->dims[3], &attr), GHT_OK);
+
+    /* Error accumulates up the tree, rounding included, within tolerance */
+    CU_ASSERT_DOUBLE_EQUAL(stats[2].max_error, 0.08, 0.00000001);
+    CU_ASSERT(stats[2].max_error <= 0.1);
+    CU_ASSERT_DOUBLE_EQUAL(stats[3].max_error, 0.0, 0.00000001);
+    CU_ASSERT(stats[2].moved > 0);
+    CU_ASSERT(stats[3].removed >= stats[3].moved);
+    CU_ASSERT_EQUAL(stats[0].moved, 0);
+
+    ght_nodelist_free_shallow(nodelist);
+    ght_node_free(lossyroot);
+    ght_schema_free(schema);
+}
+
 static void
 test_ght_unbuild_tree_with_attributes(void)
 {
     int i;
     GhtNodeList *nodelist;
-    GhtHash h[GHT_MAX_HASH_LENGTH];
+    GhtHash h[GHT_MAX_HASH_LENGTH] = "";
+    GhtAttribute attr;
+    uint8_t count;
+    double d;
     
     ght_nodelist_new(32, &nodelist);
     ght_node_to_nodelist(root, nodelist, NULL, h);
     
     CU_ASSERT_EQUAL(8, nodelist->num_nodes);    
     CU_ASSERT_STRING_EQUAL("c0n0eq6myj870p99", nodelist->nodes[4]->hash);
-    CU_ASSERT_STRING_EQUAL("Z", nodelist->nodes[4]->attributes->dim->name);
-    CU_ASSERT_STRING_EQUAL("Z", nodelist->nodes[2]->attributes->dim->name);
+    CU_ASSERT_EQUAL(GHT_OK, ght_node_get_attribute(nodelist->nodes[4], simpleschema->dims[2], &attr));
+    CU_ASSERT_STRING_EQUAL("Z", attr.dim->name);
+    ght_attribute_get_value(&attr, &d);
+    CU_ASSERT_DOUBLE_EQUAL(d, 123.3, 0.00000001);
+    CU_ASSERT_EQUAL(GHT_OK, ght_node_get_attribute(nodelist->nodes[2], simpleschema->dims[2], &attr));
+    CU_ASSERT_STRING_EQUAL("Z", attr.dim->name);
+
+    /* Leaves get both their own and their inherited attributes back */
+    ght_node_count_attributes(nodelist->nodes[2], &count);
+    CU_ASSERT_EQUAL(count, 2);
     
     // stringbuffer_t *sb = ght_stringbuffer_create();
     // for ( i = 0 ; i < nodelist->num_nodes; i++ )
@@ -223,12 +375,79 @@ test_ght_unbuild_tree_with_attributes(void)
     ght_node_free(root);
 }
 
+/* Storage value k of a type, written out without the library */
+static void
+storage_value(GhtType type, int64_t k, uint8_t *out)
+{
+    int8_t i8 = (int8_t)k;
+    uint16_t u16 = (uint16_t)k;
+    int32_t i32 = (int32_t)k;
+    uint64_t u64 = (uint64_t)k;
+    double d = (double)k;
+    float f = (float)k;
+
+    switch ( type )
+    {
+        case GHT_INT8: memcpy(out, &i8, 1); break;
+        case GHT_UINT16: memcpy(out, &u16, 2); break;
+        case GHT_INT32: memcpy(out, &i32, 4); break;
+        case GHT_UINT64: memcpy(out, &u64, 8); break;
+        case GHT_DOUBLE: memcpy(out, &d, 8); break;
+        case GHT_FLOAT: memcpy(out, &f, 4); break;
+        default: CU_ASSERT(0); /* type not covered */
+    }
+}
+
+static void
+test_ght_attribute_batch_values(void)
+{
+    static const int n = 1000; /* spans several encode blocks */
+    GhtType types[] = { GHT_INT8, GHT_UINT16, GHT_INT32, GHT_UINT64, GHT_DOUBLE, GHT_FLOAT };
+    /* Powers of two and whole offsets, so every value is exact */
+    double scales[] = { 1.0, 1.0, 0.25, 1.0, 0.5, 0.125 };
+    double offsets[] = { -50.0, 0.0, 1000.0, 0.0, 3.0, 0.0 };
+    int bias[] = { 50, 0, 50, 0, 50, 50 }; /* negative storage for signed types */
+    double vals[1000], decoded[1000];
+    uint8_t bytes[1000 * 8], expected[1000 * 8];
+    int t, i;
+
+    for ( t = 0; t < 6; t++ )
+    {
+        GhtDimension *dim;
+        size_t size = GhtTypeSizes[types[t]];
+        int mismatches = 0;
+
+        ght_dimension_new_from_parameters("V", "", types[t], scales[t], offsets[t], &dim);
+        for ( i = 0; i < n; i++ )
+        {
+            int64_t k = (i % 100) - bias[t];
+            vals[i] = offsets[t] + k * scales[t];
+            storage_value(types[t], k, expected + i * size);
+        }
+
+        CU_ASSERT_EQUAL(ght_attribute_encode_values(dim, vals, n, bytes), GHT_OK);
+        CU_ASSERT_EQUAL(memcmp(bytes, expected, n * size), 0);
+        CU_ASSERT_EQUAL(ght_attribute_decode_values(dim, expected, n, decoded), GHT_OK);
+        for ( i = 0; i < n; i++ )
+        {
+            if ( decoded[i] != vals[i] )
+                mismatches++;
+        }
+        CU_ASSERT_EQUAL(mismatches, 0);
+        ght_dimension_free(dim);
+    }
+}
+
 /* REGISTER ***********************************************************/
 
 CU_TestInfo attribute_tests[] =
 {
     GHT_TEST(test_ght_build_node_with_attributes),
+    GHT_TEST(test_ght_node_packed_attributes),
     GHT_TEST(test_ght_build_tree_with_attributes),
+    GHT_TEST(test_ght_compact_attributes_single_pass),
+    GHT_TEST(test_ght_compact_attributes_lossy),
+    GHT_TEST(test_ght_attribute_batch_values),
     GHT_TEST(test_ght_unbuild_tree_with_attributes),
     CU_TEST_INFO_NULL
 };
@@ -132,6 +132,128 @@ test_geohash_inout()
     ght_hash_free(hash);
 }
 
+static void
+test_geohash_frame()
+{
+    GhtArea frame, global, area;
+    GhtHash *hash, *hash_global;
+    GhtCoordinate coord, coord_global, coord_out;
+    GhtErr err;
+
+    /* Hashing a frame is hashing the globe, scaled */
+    frame.x.min = 0;
+    frame.x.max = 1000;
+    frame.y.min = 0;
+    frame.y.max = 500;
+    coord.x = 123.456;
+    coord.y = 321.0;
+    coord_global.x = -180 + coord.x * 360 / 1000;
+    coord_global.y = -90 + coord.y * 180 / 500;
+    err = ght_hash_from_coordinate_frame(&coord, &frame, 12, &hash);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    ght_hash_from_coordinate(&coord_global, 12, &hash_global);
+    CU_ASSERT_STRING_EQUAL(hash, hash_global);
+    ght_hash_free(hash);
+    ght_hash_free(hash_global);
+
+    /* A couple of km in metres, 9 characters is a quarter millimetre */
+    frame.x.min = 500000;
+    frame.x.max = 502048;
+    frame.y.min = 5000000;
+    frame.y.max = 5001024;
+    coord.x = 501234.567;
+    coord.y = 5000987.654;
+    err = ght_hash_from_coordinate_frame(&coord, &frame, 9, &hash);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    err = ght_coordinate_from_hash_frame(hash, &frame, &coord_out);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    CU_ASSERT_DOUBLE_EQUAL(coord.x, coord_out.x, 0.001);
+    CU_ASSERT_DOUBLE_EQUAL(coord.y, coord_out.y, 0.001);
+    /* A frame twice as wide as high has square cells at odd lengths */
+    ght_area_from_hash_frame(hash, &frame, &area);
+    CU_ASSERT_DOUBLE_EQUAL(area.x.max - area.x.min, 0.000244140625, 1e-12);
+    CU_ASSERT_DOUBLE_EQUAL(area.y.max - area.y.min, 0.000244140625, 1e-12);
+    ght_hash_free(hash);
+
+    /* The corner is in */
+    coord.x = 502048;
+    coord.y = 5001024;
+    err = ght_hash_from_coordinate_frame(&coord, &frame, 4, &hash);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    CU_ASSERT_STRING_EQUAL(hash, "zzzz");
+    ght_hash_free(hash);
+
+    /* Unset frames and the global one hash longitude and latitude */
+    memset(&frame, 0, sizeof(GhtArea));
+    CU_ASSERT(ght_frame_is_global(&frame));
+    ght_frame_set_global(&global);
+    CU_ASSERT(ght_frame_is_global(&global));
+    CU_ASSERT(ght_frame_same(&frame, &global));
+    coord.x = 1.0;
+    coord.y = 1.0;
+    ght_hash_from_coordinate_frame(&coord, &frame, 20, &hash);
+    CU_ASSERT_STRING_EQUAL(hash, "s00twy01mtw037ms06g7");
+    ght_hash_free(hash);
+}
+
+static void
+test_geohash_3d()
+{
+    GhtArea frame, area;
+    GhtRange vertical, zrange;
+    GhtHash *hash, *hash2;
+    GhtCoordinate coord, coord_out;
+    double z;
+    GhtErr err;
+
+    frame.x.min = 0;
+    frame.x.max = 1024;
+    frame.y.min = 0;
+    frame.y.max = 1024;
+    vertical.min = 0;
+    vertical.max = 64;
+    CU_ASSERT(ght_vertical_is_set(&vertical));
+
+    /* Bits go x, y, z round and round: 00100 then 10010 */
+    coord.x = 0;
+    coord.y = 0;
+    err = ght_hash_from_coordinate_3d(&coord, 63.99, &frame, &vertical, 2, &hash);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    CU_ASSERT_STRING_EQUAL(hash, "4k");
+    ght_hash_free(hash);
+
+    /* 12 characters is 20 bits a dimension */
+    coord.x = 123.456;
+    coord.y = 987.654;
+    err = ght_hash_from_coordinate_3d(&coord, 12.345, &frame, &vertical, 12, &hash);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    err = ght_coordinate_from_hash_3d(hash, &frame, &vertical, &coord_out, &z);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    CU_ASSERT_DOUBLE_EQUAL(coord.x, coord_out.x, 1024.0 / (1 << 20));
+    CU_ASSERT_DOUBLE_EQUAL(coord.y, coord_out.y, 1024.0 / (1 << 20));
+    CU_ASSERT_DOUBLE_EQUAL(12.345, z, 64.0 / (1 << 20));
+    ght_volume_from_hash(hash, &frame, &vertical, &area, &zrange);
+    CU_ASSERT_DOUBLE_EQUAL(zrange.max - zrange.min, 64.0 / (1 << 20), 1e-12);
+    CU_ASSERT(zrange.min <= 12.345 && 12.345 <= zrange.max);
+
+    /* Points stacked a few centimetres apart get hashes of their own */
+    ght_hash_from_coordinate_3d(&coord, 12.4, &frame, &vertical, 12, &hash2);
+    CU_ASSERT(strcmp(hash, hash2) != 0);
+    ght_hash_free(hash2);
+    ght_hash_free(hash);
+
+    /* The top corner is in */
+    coord.x = 1024;
+    coord.y = 1024;
+    err = ght_hash_from_coordinate_3d(&coord, 64, &frame, &vertical, 3, &hash);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    CU_ASSERT_STRING_EQUAL(hash, "zzz");
+    ght_hash_free(hash);
+
+    vertical.max = vertical.min;
+    CU_ASSERT(! ght_vertical_is_set(&vertical));
+}
+
 static void
 test_ght_hash_common_length(void)
 {
@@ -315,7 +437,7 @@ test_ght_node_unbuild_tree(void)
 {
     int i;
     GhtNodeList *nodelist;
-    GhtHash h[GHT_MAX_HASH_LENGTH];
+    GhtHash h[GHT_MAX_HASH_LENGTH] = "";
     
     ght_nodelist_new(32, &nodelist);
     ght_node_to_nodelist(root, nodelist, NULL, h);
@@ -436,7 +558,7 @@ test_ght_node_serialization(void)
     bytes_size = bytebuffer_getsize(writer->bytebuffer);
 
     err = hexbytes_from_bytes(bytes, bytes_size, &hex);
-    CU_ASSERT_STRING_EQUAL("086330763268646D3100020A77707A7079347674763400000A6374643463637839796200030001035800000000000001020F27000000", hex);
+    CU_ASSERT_STRING_EQUAL("086330763268646D310000020A77707A707934767476340000000A6374643463637839796200000300010358000000000000000001020F2700000000", hex);
     // printf("\n\n%s\n", hex);
     
     err = ght_reader_new_mem(bytes, bytes_size, schema, &reader);
@@ -529,6 +651,8 @@ test_ght_node_file_serialization(void)
 CU_TestInfo core_tests[] =
 {
     GHT_TEST(test_geohash_inout),
+    GHT_TEST(test_geohash_frame),
+    GHT_TEST(test_geohash_3d),
     GHT_TEST(test_ght_hash_common_length),
     GHT_TEST(test_ght_hash_leaf_parts),
     GHT_TEST(test_ght_node_build_tree),
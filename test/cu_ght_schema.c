@@ -65,6 +65,123 @@ test_schema_xml()
 }
 
 
+static void
+test_schema_tolerance_xml()
+{
+    char *str;
+    GhtSchema *myschema = NULL, *copy = NULL;
+    double tolerance;
+    size_t schema_size;
+
+    ght_schema_from_xml_str(xmlstr, &myschema);
+    ght_dimension_get_tolerance(myschema->dims[3], &tolerance);
+    CU_ASSERT_DOUBLE_EQUAL(tolerance, 0.0, 0.0);
+
+    /* The compaction tolerance survives the XML round trip */
+    CU_ASSERT_EQUAL(ght_dimension_set_tolerance(myschema->dims[3], 0.25), GHT_OK);
+    CU_ASSERT_EQUAL(ght_schema_to_xml_str(myschema, &str, &schema_size), GHT_OK);
+    CU_ASSERT_PTR_NOT_NULL(strstr(str, "<pc:tolerance>0.25</pc:tolerance>"));
+    CU_ASSERT_EQUAL(ght_schema_from_xml_str(str, &copy), GHT_OK);
+    ght_dimension_get_tolerance(copy->dims[3], &tolerance);
+    CU_ASSERT_DOUBLE_EQUAL(tolerance, 0.25, 0.0);
+    ght_dimension_get_tolerance(copy->dims[2], &tolerance);
+    CU_ASSERT_DOUBLE_EQUAL(tolerance, 0.0, 0.0);
+
+    ght_free(str);
+    ght_schema_free(copy);
+    ght_schema_free(myschema);
+}
+
+static void
+test_schema_dimension_by_name()
+{
+    GhtDimension *dim;
+    int i;
+
+    /* Every dimension of a wide schema resolves through the name index */
+    for ( i = 0; i < schema->num_dims; i++ )
+    {
+        CU_ASSERT_EQUAL(ght_schema_get_dimension_by_name(schema, schema->dims[i]->name, &dim), GHT_OK);
+        CU_ASSERT_PTR_EQUAL(dim, schema->dims[i]);
+    }
+
+    /* Lookups ignore case, as before */
+    CU_ASSERT_EQUAL(ght_schema_get_dimension_by_name(schema, "intensity", &dim), GHT_OK);
+    CU_ASSERT_STRING_EQUAL(dim->name, "Intensity");
+
+    CU_ASSERT_EQUAL(ght_schema_get_dimension_by_name(schema, "NoSuchDimension", &dim), GHT_ERROR);
+    CU_ASSERT_PTR_NULL(dim);
+}
+
+static void
+test_schema_binary()
+{
+    GhtWriter *writer;
+    GhtReader *reader;
+    GhtSchema *myschema = NULL;
+    uint8_t *bytes;
+    size_t bytes_size;
+    int same = 0;
+
+    ght_writer_new_mem(&writer);
+    CU_ASSERT_EQUAL(ght_schema_write(schema, writer), GHT_OK);
+    ght_writer_get_size(writer, &bytes_size);
+    bytes = ght_malloc(bytes_size);
+    ght_writer_get_bytes(writer, bytes);
+    ght_writer_free(writer);
+
+    ght_reader_new_mem(bytes, bytes_size, NULL, &reader);
+    CU_ASSERT_EQUAL(ght_schema_read(reader, &myschema), GHT_OK);
+    ght_reader_free(reader);
+
+    /* Same dimensions, and the descriptions come through too */
+    ght_schema_same(schema, myschema, &same);
+    CU_ASSERT_EQUAL(same, 1);
+    CU_ASSERT_STRING_EQUAL(schema->dims[0]->description, myschema->dims[0]->description);
+    CU_ASSERT_EQUAL(myschema->dims[3]->schema, myschema);
+
+    ght_schema_free(myschema);
+    ght_free(bytes);
+}
+
+static void
+test_schema_registry()
+{
+    const GhtSchema *s1, *s2, *s3;
+    GhtWriter *writer;
+    uint8_t *bytes;
+    size_t bytes_size;
+    int same = 0;
+
+    /* Repeated lookups of one document share one schema */
+    CU_ASSERT_EQUAL(ght_schema_registry_get_xml(xmlstr, &s1), GHT_OK);
+    CU_ASSERT_EQUAL(ght_schema_registry_get_xml(xmlstr, &s2), GHT_OK);
+    CU_ASSERT_PTR_EQUAL(s1, s2);
+    CU_ASSERT_EQUAL(s1->num_dims, schema->num_dims);
+    ght_schema_same(s1, schema, &same);
+    CU_ASSERT_EQUAL(same, 1);
+
+    /* Freeing a shared schema leaves it alone */
+    ght_schema_free((GhtSchema*)s1);
+    CU_ASSERT_STRING_EQUAL(s2->dims[0]->name, schema->dims[0]->name);
+
+    /* The binary form is its own key */
+    ght_writer_new_mem(&writer);
+    ght_schema_write(schema, writer);
+    ght_writer_get_size(writer, &bytes_size);
+    bytes = ght_malloc(bytes_size);
+    ght_writer_get_bytes(writer, bytes);
+    ght_writer_free(writer);
+    CU_ASSERT_EQUAL(ght_schema_registry_get_binary(bytes, bytes_size, &s3), GHT_OK);
+    CU_ASSERT_NOT_EQUAL(s3, s1);
+    ght_schema_same(s3, s1, &same);
+    CU_ASSERT_EQUAL(same, 1);
+    CU_ASSERT_EQUAL(ght_schema_registry_get_binary(bytes, bytes_size, &s2), GHT_OK);
+    CU_ASSERT_PTR_EQUAL(s2, s3);
+    ght_free(bytes);
+
+    ght_schema_registry_clear();
+}
 
 static void
 test_schema_size()
@@ -80,6 +197,10 @@ test_schema_size()
 CU_TestInfo schema_tests[] =
 {
     GHT_TEST(test_schema_xml),
+    GHT_TEST(test_schema_tolerance_xml),
+    GHT_TEST(test_schema_dimension_by_name),
+    GHT_TEST(test_schema_binary),
+    GHT_TEST(test_schema_registry),
     CU_TEST_INFO_NULL
 };
 
@@ -151,6 +151,7 @@ test_ght_tree_filter(void)
 {
     static const char *simpledata = "test/data/simple-data.tsv";   
     GhtTree *tree1, *tree2;
+    GhtDimension *dim;
     GhtErr err;
     
     /* Read a nodelist from a TSV file */
@@ -171,18 +172,1372 @@ test_ght_tree_filter(void)
     CU_ASSERT_EQUAL(err, GHT_OK);
     CU_ASSERT_EQUAL(tree2->num_nodes, 0);   
     ght_tree_free(tree2);
+
+    /* Resolve the dimension once and filter by handle */
+    ght_schema_get_dimension_by_name(simpleschema, "z", &dim);
+    err = ght_tree_filter_by_dimension(tree1, dim, GHT_BETWEEN, 123.4, 123.3, &tree2);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    CU_ASSERT_EQUAL(tree2->num_nodes, 8);
+    ght_tree_free(tree2);
+
+    err = ght_tree_filter_by_dimension(tree1, dim, GHT_GREATER_THAN, 123.35, 0, &tree2);
+    CU_ASSERT_EQUAL(err, GHT_OK);
+    CU_ASSERT_EQUAL(tree2->num_nodes, 7);
+    ght_tree_free(tree2);
     
     ght_tree_free(tree1);
 }
 
 
+static int
+filter_decoded_keep(const GhtFilter *filter, double val)
+{
+    switch ( filter->mode )
+    {
+        case GHT_GREATER_THAN: return val > filter->range.min;
+        case GHT_LESS_THAN: return val < filter->range.max;
+        case GHT_BETWEEN: return val >= filter->range.min && val <= filter->range.max;
+        default: return val == filter->range.min;
+    }
+}
+
+static void
+test_ght_filter_compile(void)
+{
+    GhtType types[] = { GHT_INT8, GHT_UINT16, GHT_INT32, GHT_INT64, GHT_FLOAT };
+    double scales[] = { 0.5, 1.0, 0.01, 0.001, 1.0 };
+    double offsets[] = { -3.0, 0.0, 0.0, 100.0, 0.0 };
+    double thresholds[] = { -1000.0, -3.0, -2.75, 0.0, 0.5, 1.23, 7.0, 11.5, 1e30 };
+    GhtFilterMode modes[] = { GHT_GREATER_THAN, GHT_LESS_THAN, GHT_BETWEEN };
+    int t, m, i, j;
+
+    /* Storage domain comparisons agree with comparing decoded doubles */
+    for ( t = 0; t < 5; t++ )
+    {
+        GhtDimension *dim;
+        int mismatches = 0;
+        ght_dimension_new_from_parameters("V", "", types[t], scales[t], offsets[t], &dim);
+
+        for ( m = 0; m < 3; m++ )
+        {
+            for ( i = 0; i < 9; i++ )
+            {
+                GhtFilter filter;
+                memset(&filter, 0, sizeof(GhtFilter));
+                filter.dim = dim;
+                filter.mode = modes[m];
+                filter.range.min = thresholds[i];
+                filter.range.max = modes[m] == GHT_BETWEEN ? thresholds[i] + 4.0 : thresholds[i];
+                CU_ASSERT_EQUAL(ght_filter_compile(&filter), GHT_OK);
+
+                for ( j = -100; j < 100; j++ )
+                {
+                    GhtAttribute *attr;
+                    double val;
+                    ght_attribute_new_from_double(dim, offsets[t] + j * scales[t] * 0.7, &attr);
+                    ght_attribute_get_value(attr, &val);
+                    if ( filter.match(&filter, (uint8_t*)attr->val) != filter_decoded_keep(&filter, val) )
+                        mismatches++;
+                    ght_attribute_free(attr);
+                }
+            }
+        }
+        CU_ASSERT_EQUAL(mismatches, 0);
+        ght_dimension_free(dim);
+    }
+}
+
+static void
+test_ght_tree_filter_equal(void)
+{
+    static const char *simpledata = "test/data/simple-data.tsv";
+    GhtTree *tree1, *tree2;
+
+    /* 123.3 in a 0.01 scaled dimension does not decode back to 123.3 */
+    tree1 = tsv_file_to_tree(simpledata, simpleschema);
+    CU_ASSERT_EQUAL(ght_tree_filter_equal(tree1, "Z", 123.3, &tree2), GHT_OK);
+    CU_ASSERT_EQUAL(tree2->num_nodes, 1);
+    ght_tree_free(tree2);
+
+    CU_ASSERT_EQUAL(ght_tree_filter_equal(tree1, "Z", 123.4, &tree2), GHT_OK);
+    CU_ASSERT_EQUAL(tree2->num_nodes, 7);
+    ght_tree_free(tree2);
+
+    CU_ASSERT_EQUAL(ght_tree_filter_equal(tree1, "Z", 123.35, &tree2), GHT_OK);
+    CU_ASSERT_EQUAL(tree2->num_nodes, 0);
+    ght_tree_free(tree2);
+    ght_tree_free(tree1);
+}
+
+static GhtTree *
+tree_round_trip(const GhtTree *tree, size_t *bytes_size)
+{
+    GhtWriter *writer;
+    GhtReader *reader;
+    GhtTree *treeread = NULL;
+    uint8_t *bytes;
+
+    ght_writer_new_mem(&writer);
+    CU_ASSERT_EQUAL(ght_tree_write(tree, writer), GHT_OK);
+    ght_writer_get_size(writer, bytes_size);
+    bytes = malloc(*bytes_size);
+    ght_writer_get_bytes(writer, bytes);
+    ght_writer_free(writer);
+
+    ght_reader_new_mem(bytes, *bytes_size, tree->schema, &reader);
+    CU_ASSERT_EQUAL(ght_tree_read(reader, &treeread), GHT_OK);
+    ght_reader_free(reader);
+    free(bytes);
+    return treeread;
+}
+
+static void
+test_ght_tree_join(void)
+{
+    static const char *base32 = "0123456789bcdefghjkmnpqrstuvwxyz";
+    static char overlapping[][5] = { "9qcx", "9qcy", "9qd" };
+    GhtTree *whole, *joined, *parts[32];
+    GhtNodeList *nodelist;
+    GhtConfig config;
+    GhtArea a1, a2;
+    size_t size1, size2;
+    char prefix[GHT_MAX_HASH_LENGTH + 1];
+    int i, depth;
+
+    /* Reference tree, built point by point */
+    ght_nodelist_new(200, &nodelist);
+    for ( i = 0; i < 200; i++ )
+    {
+        GhtCoordinate coord;
+        GhtNode *node;
+        coord.x = -126.4 + (i % 20) * 0.003;
+        coord.y = 45.12 + (i / 20) * 0.002;
+        ght_node_new_from_coordinate(&coord, 16, &node);
+        ght_nodelist_add_node(nodelist, node);
+    }
+    ght_config_init(&config);
+    ght_tree_from_nodelist(simpleschema, nodelist, &config, &whole);
+    ght_nodelist_free_shallow(nodelist);
+    strcpy(prefix, whole->root->hash);
+    depth = strlen(prefix);
+    CU_ASSERT(whole->root->children->num_nodes > 1);
+
+    /* Same points, one part per hash character after the shared prefix */
+    memset(parts, 0, sizeof(parts));
+    for ( i = 0; i < 200; i++ )
+    {
+        GhtCoordinate coord;
+        GhtNode *node;
+        int part;
+        coord.x = -126.4 + (i % 20) * 0.003;
+        coord.y = 45.12 + (i / 20) * 0.002;
+        ght_node_new_from_coordinate(&coord, 16, &node);
+        CU_ASSERT_EQUAL(strncmp(node->hash, prefix, depth), 0);
+        part = strchr(base32, node->hash[depth]) - base32;
+        if ( ! parts[part] )
+            ght_tree_new(simpleschema, &parts[part]);
+        CU_ASSERT_EQUAL(ght_tree_insert_node(parts[part], node), GHT_OK);
+    }
+    CU_ASSERT_EQUAL(ght_tree_join(simpleschema, parts, 32, &joined), GHT_OK);
+    CU_ASSERT_PTR_NULL(parts[0]);
+
+    CU_ASSERT_STRING_EQUAL(joined->root->hash, prefix);
+    CU_ASSERT_EQUAL(joined->num_nodes, 200);
+    CU_ASSERT_EQUAL(joined->root->children->num_nodes, whole->root->children->num_nodes);
+    ght_tree_get_extent(whole, &a1);
+    ght_tree_get_extent(joined, &a2);
+    CU_ASSERT_DOUBLE_EQUAL(a1.x.min, a2.x.min, 1e-12);
+    CU_ASSERT_DOUBLE_EQUAL(a1.y.max, a2.y.max, 1e-12);
+    ght_tree_free(tree_round_trip(whole, &size1));
+    ght_tree_free(tree_round_trip(joined, &size2));
+    CU_ASSERT_EQUAL(size1, size2);
+
+    ght_tree_free(whole);
+    ght_tree_free(joined);
+
+    /* Roots going on with the same character after the prefix overlap */
+    for ( i = 0; i < 3; i++ )
+    {
+        GhtNode *node;
+        ght_tree_new(simpleschema, &parts[i]);
+        ght_node_new_from_hash(overlapping[i], &node);
+        CU_ASSERT_EQUAL(ght_tree_insert_node(parts[i], node), GHT_OK);
+    }
+    cu_quiet_errors(1);
+    CU_ASSERT_EQUAL(ght_tree_join(simpleschema, parts, 3, &joined), GHT_ERROR);
+    cu_quiet_errors(0);
+    for ( i = 0; i < 3; i++ )
+        ght_tree_free(parts[i]);
+}
+
+/* Write and read back with the format options, the tree must not change */
+static size_t
+check_format_round_trip(GhtTree *tree, uint8_t format)
+{
+    GhtTree *treeread;
+    size_t size;
+    stringbuffer_t *sb1, *sb2;
+
+    tree->config.format = format;
+    treeread = tree_round_trip(tree, &size);
+    CU_ASSERT_EQUAL(treeread->config.version, (format || tree->schema->packmask) ? GHT_FORMAT_VERSION : GHT_FORMAT_VERSION_BASIC);
+    CU_ASSERT_EQUAL(treeread->config.format, format);
+
+    sb1 = ght_stringbuffer_create();
+    sb2 = ght_stringbuffer_create();
+    ght_node_to_string(tree->root, sb1, 0);
+    ght_node_to_string(treeread->root, sb2, 0);
+    CU_ASSERT_STRING_EQUAL(ght_stringbuffer_getstring(sb1), ght_stringbuffer_getstring(sb2));
+    ght_stringbuffer_destroy(sb1);
+    ght_stringbuffer_destroy(sb2);
+
+    ght_tree_free(treeread);
+    tree->config.format = 0;
+    return size;
+}
+
+/* LAS-like schema, with the narrow dimensions bit packed when asked */
+static GhtSchema *
+packed_test_schema(int packed)
+{
+    GhtSchema *schema;
+    GhtDimension *dim;
+
+    ght_schema_new(&schema);
+    ght_dimension_new_from_parameters("X", NULL, GHT_INT32, 0.01, 0, &dim);
+    ght_schema_add_dimension(schema, dim);
+    ght_dimension_new_from_parameters("Y", NULL, GHT_INT32, 0.01, 0, &dim);
+    ght_schema_add_dimension(schema, dim);
+    ght_dimension_new_from_parameters("Z", NULL, GHT_INT32, 0.01, 0, &dim);
+    ght_schema_add_dimension(schema, dim);
+    ght_dimension_new_from_parameters("ReturnNumber", NULL, GHT_UINT8, 1, 0, &dim);
+    if ( packed ) ght_dimension_set_bits(dim, 3);
+    ght_schema_add_dimension(schema, dim);
+    ght_dimension_new_from_parameters("ScanAngleSign", NULL, GHT_INT8, 1, 0, &dim);
+    if ( packed ) ght_dimension_set_bits(dim, 2);
+    ght_schema_add_dimension(schema, dim);
+    ght_dimension_new_from_parameters("EdgeOfFlightLine", NULL, GHT_UINT8, 1, 0, &dim);
+    if ( packed ) ght_dimension_set_bits(dim, 1);
+    ght_schema_add_dimension(schema, dim);
+    ght_dimension_new_from_parameters("Intensity", NULL, GHT_UINT16, 1, 0, &dim);
+    ght_schema_add_dimension(schema, dim);
+    return schema;
+}
+
+static GhtTree *
+packed_test_tree(const GhtSchema *schema, int npoints)
+{
+    GhtNodeList *nodelist;
+    GhtConfig config;
+    GhtTree *tree;
+    int i, j;
+
+    ght_nodelist_new(npoints, &nodelist);
+    for ( i = 0; i < npoints; i++ )
+    {
+        GhtCoordinate coord;
+        GhtNode *node;
+        double vals[5];
+
+        coord.x = -126.4 + (i % 16) * 0.0007;
+        coord.y = 45.12 + (i / 16) * 0.0005 + (i / 256) * 0.0002;
+        vals[0] = 100 + (i % 7) * 0.25;
+        vals[1] = 1 + i % 5;
+        vals[2] = (i % 4) - 2;
+        vals[3] = (i % 16) == 0;
+        vals[4] = i * 13;
+        ght_node_new_from_coordinate(&coord, 16, &node);
+        for ( j = 0; j < 5; j++ )
+        {
+            GhtAttribute *a;
+            ght_attribute_new_from_double(schema->dims[j + 2], vals[j], &a);
+            ght_node_add_attribute(node, a);
+        }
+        ght_nodelist_add_node(nodelist, node);
+    }
+    ght_config_init(&config);
+    ght_tree_from_nodelist(schema, nodelist, &config, &tree);
+    ght_tree_compact_attributes(tree);
+    ght_nodelist_free_shallow(nodelist);
+    return tree;
+}
+
+/* Cell of point i on a w by h grid, scattered by two primes, in 64 bits so large i can't overflow */
+static void
+scatter_test_cell(int i, int w, int h, int *xi, int *yi)
+{
+    *xi = (int)(((uint64_t)i * 7919) % w);
+    *yi = (int)(((uint64_t)i * 104729) % h);
+}
+
+/* Makes point i of a test set afresh, the same every time */
+typedef GhtNode * (*stream_test_factory)(const void *data, int i);
+
+/* Scattered points at mixed resolutions, with duplicates and values shared by area */
+static GhtNode *
+stream_test_node(const void *data, int i)
+{
+    const GhtSchema *schema = data;
+    GhtCoordinate coord;
+    GhtNode *node;
+    GhtAttribute *attr;
+    int xi, yi;
+
+    scatter_test_cell(i, 400, 300, &xi, &yi);
+
+    coord.x = -126.4 + xi * 0.00004;
+    coord.y = 45.1 + yi * 0.00004;
+    ght_node_new_from_coordinate(&coord, 8 + i % 3, &node);
+    ght_attribute_new_from_double(schema->dims[2], 100 + xi / 50 + yi / 100, &attr);
+    ght_node_add_attribute(node, attr);
+    ght_attribute_new_from_double(schema->dims[3], (i / 3) % 5, &attr);
+    ght_node_add_attribute(node, attr);
+    return node;
+}
+
+typedef struct
+{
+    GhtNode *node;
+    int i;
+} stream_test_entry;
+
+/* Hash order, keeping duplicates in their original order */
+static int
+stream_test_cmp(const void *a, const void *b)
+{
+    const stream_test_entry *ea = a;
+    const stream_test_entry *eb = b;
+    int c = strcmp(ea->node->hash, eb->node->hash);
+    return c ? c : ea->i - eb->i;
+}
+
+/* The n points in the order a stream writer wants them */
+static stream_test_entry *
+stream_test_entries_new(stream_test_factory factory, const void *data, int n)
+{
+    stream_test_entry *entries = malloc(n * sizeof(stream_test_entry));
+    int i;
+
+    for ( i = 0; i < n; i++ )
+    {
+        entries[i].node = factory(data, i);
+        entries[i].i = i;
+    }
+    qsort(entries, n, sizeof(stream_test_entry), stream_test_cmp);
+    return entries;
+}
+
+static void
+stream_test_entries_free(stream_test_entry *entries, int n)
+{
+    int i;
+    for ( i = 0; i < n; i++ )
+        ght_node_free(entries[i].node);
+    free(entries);
+}
+
+/* Reference tree, in memory from fresh copies of the sorted nodes */
+static GhtTree *
+stream_test_tree(GhtConfig *config, stream_test_factory factory, const void *data,
+                 const stream_test_entry *entries, int n)
+{
+    GhtNodeList *nodelist;
+    GhtTree *tree;
+    int i;
+
+    ght_nodelist_new(n, &nodelist);
+    for ( i = 0; i < n; i++ )
+        ght_nodelist_add_node(nodelist, factory(data, entries[i].i));
+    CU_ASSERT_EQUAL(ght_tree_from_nodelist(simpleschema, nodelist, config, &tree), GHT_OK);
+    ght_nodelist_free_shallow(nodelist);
+    return tree;
+}
+
+/*
+ * Stream fresh copies of the sorted nodes with the config and check the
+ * bytes match the tree written whole. Hands back the streamed bytes if
+ * asked, for the caller to free, and returns their size.
+ */
+static size_t
+check_stream_matches_tree(const GhtTree *tree, const GhtConfig *config, int compact,
+                          stream_test_factory factory, const void *data,
+                          const stream_test_entry *entries, int n, uint8_t **streamed)
+{
+    GhtWriter *w1, *w2;
+    GhtStreamWriter *stream;
+    size_t size1, size2;
+    uint8_t *bytes1, *bytes2;
+    uint64_t numpoints;
+    int i;
+
+    ght_writer_new_mem(&w1);
+    CU_ASSERT_EQUAL(ght_tree_write(tree, w1), GHT_OK);
+
+    ght_writer_new_mem(&w2);
+    CU_ASSERT_EQUAL(ght_stream_writer_new(simpleschema, config, compact, w2, &stream), GHT_OK);
+    for ( i = 0; i < n; i++ )
+    {
+        if ( ght_stream_writer_add_node(stream, factory(data, entries[i].i)) != GHT_OK )
+            break;
+    }
+    CU_ASSERT_EQUAL(i, n);
+    CU_ASSERT_EQUAL(ght_stream_writer_finish(stream), GHT_OK);
+    CU_ASSERT_EQUAL(ght_stream_writer_get_numpoints(stream, &numpoints), GHT_OK);
+    CU_ASSERT_EQUAL(numpoints, (uint64_t)n);
+    ght_stream_writer_free(stream);
+
+    ght_writer_get_size(w1, &size1);
+    ght_writer_get_size(w2, &size2);
+    CU_ASSERT_EQUAL(size1, size2);
+    bytes1 = malloc(size1);
+    bytes2 = malloc(size2);
+    ght_writer_get_bytes(w1, bytes1);
+    ght_writer_get_bytes(w2, bytes2);
+    CU_ASSERT(size1 == size2 && memcmp(bytes1, bytes2, size1) == 0);
+    free(bytes1);
+    if ( streamed )
+        *streamed = bytes2;
+    else
+        free(bytes2);
+    ght_writer_free(w1);
+    ght_writer_free(w2);
+    return size2;
+}
+
+static void
+test_ght_tree_stream(void)
+{
+    static const int npoints = 100000;
+    static const uint8_t formats[] = { 0, GHT_FORMAT_SCHEMA, GHT_FORMAT_GROUPED };
+    stream_test_entry *entries = stream_test_entries_new(stream_test_node, simpleschema, npoints);
+    int f;
+
+    for ( f = 0; f < 3; f++ )
+    {
+        int compact = formats[f] != 0;
+        GhtTree *tree;
+        GhtConfig config;
+        GhtReader *reader;
+        GhtTree *treeread;
+        size_t size;
+        uint8_t *bytes;
+
+        ght_config_init(&config);
+        config.format = formats[f];
+
+        tree = stream_test_tree(&config, stream_test_node, simpleschema, entries, npoints);
+        if ( compact )
+            ght_tree_compact_attributes(tree);
+        size = check_stream_matches_tree(tree, &config, compact, stream_test_node, simpleschema,
+                                         entries, npoints, &bytes);
+        ght_tree_free(tree);
+
+        /* Big enough to go through a temporary file uncompacted */
+        if ( ! compact )
+            CU_ASSERT(size > (1 << 20));
+        ght_reader_new_mem(bytes, size, simpleschema, &reader);
+        CU_ASSERT_EQUAL(ght_tree_read(reader, &treeread), GHT_OK);
+        CU_ASSERT_EQUAL(treeread->config.format, formats[f]);
+        ght_reader_free(reader);
+        ght_tree_free(treeread);
+        free(bytes);
+    }
+
+    stream_test_entries_free(entries, npoints);
+}
+
+/* Points a few hundred metres apart, hashed in a local frame */
+static GhtNode *
+frame_test_node(const void *data, int i)
+{
+    const GhtArea *frame = data;
+    GhtCoordinate coord;
+    GhtNode *node;
+    GhtAttribute *attr;
+    int xi, yi;
+
+    scatter_test_cell(i, 2000, 1000, &xi, &yi);
+    coord.x = 500000 + xi + 0.25 * (i % 4);
+    coord.y = 5000000 + yi + 0.5 * (i % 2);
+    ght_node_new_from_coordinate_frame(&coord, frame, 9, &node);
+    ght_attribute_new_from_double(simpleschema->dims[2], 100 + i % 7, &attr);
+    ght_node_add_attribute(node, attr);
+    return node;
+}
+
+static void
+test_ght_tree_frame(void)
+{
+    static const int npoints = 1000;
+    static const uint8_t formats[] = { 0, GHT_FORMAT_GROUPED | GHT_FORMAT_SCHEMA };
+    stream_test_entry *entries;
+    GhtArea frame, frame_read, area, global;
+    GhtConfig config;
+    GhtTree *tree, *treeread;
+    size_t size;
+    int i, f;
+
+    frame.x.min = 500000;
+    frame.x.max = 502048;
+    frame.y.min = 5000000;
+    frame.y.max = 5001024;
+    entries = stream_test_entries_new(frame_test_node, &frame, npoints);
+
+    ght_config_init(&config);
+    config.frame = frame;
+    tree = stream_test_tree(&config, frame_test_node, &frame, entries, npoints);
+    CU_ASSERT_EQUAL(tree->num_nodes, npoints);
+    /* The points cover the frame, so share no prefix */
+    CU_ASSERT_STRING_EQUAL(tree->root->hash, "");
+
+    /* Extent in frame units, to the quarter millimetre cells */
+    ght_tree_get_extent(tree, &area);
+    CU_ASSERT_DOUBLE_EQUAL(area.x.min, 500000, 0.001);
+    CU_ASSERT_DOUBLE_EQUAL(area.x.max, 501999.25, 0.001);
+    CU_ASSERT_DOUBLE_EQUAL(area.y.min, 5000000, 0.001);
+    CU_ASSERT_DOUBLE_EQUAL(area.y.max, 5000999.5, 0.001);
+
+    for ( f = 0; f < 2; f++ )
+    {
+        /* The frame goes in the header, and the flag with it */
+        tree->config.format = formats[f];
+        treeread = tree_round_trip(tree, &size);
+        CU_ASSERT_EQUAL(treeread->config.format, formats[f] | GHT_FORMAT_FRAME);
+        ght_tree_get_frame(treeread, &frame_read);
+        CU_ASSERT(memcmp(&frame, &frame_read, sizeof(GhtArea)) == 0);
+        ght_tree_get_extent(treeread, &area);
+        CU_ASSERT_DOUBLE_EQUAL(area.x.max, 501999.25, 0.001);
+        CU_ASSERT_STRING_EQUAL(treeread->root->hash, "");
+        ght_tree_free(treeread);
+
+        /* Streamed the same */
+        config.format = formats[f];
+        check_stream_matches_tree(tree, &config, 0, frame_test_node, &frame, entries, npoints, NULL);
+    }
+
+    /* Hashes already made in the frame can't move to another one */
+    ght_frame_set_global(&global);
+    CU_ASSERT_EQUAL(ght_tree_set_frame(tree, &global), GHT_ERROR);
+    ght_tree_get_frame(tree, &frame_read);
+    CU_ASSERT(memcmp(&frame, &frame_read, sizeof(GhtArea)) == 0);
+    ght_tree_free(tree);
+
+    /* An empty tree can go back to the globe, the original layout and no frame */
+    ght_tree_new(simpleschema, &tree);
+    CU_ASSERT_EQUAL(ght_tree_set_frame(tree, &frame), GHT_OK);
+    CU_ASSERT_EQUAL(ght_tree_set_frame(tree, &global), GHT_OK);
+    for ( i = 0; i < 10; i++ )
+    {
+        GhtCoordinate coord;
+        GhtNode *node;
+        coord.x = -126.4 + i * 0.001;
+        coord.y = 45.1 + i * 0.002;
+        ght_node_new_from_coordinate(&coord, 16, &node);
+        CU_ASSERT_EQUAL(ght_tree_insert_node(tree, node), GHT_OK);
+    }
+    check_format_round_trip(tree, 0);
+    ght_tree_free(tree);
+    stream_test_entries_free(entries, npoints);
+}
+
+typedef struct
+{
+    const GhtArea *frame;
+    const GhtRange *vertical;  /* NULL to hash in 2D */
+    const double *stored_z;    /* Z to store instead of the hashed z, NULL for the hashed one */
+} vertical_test_space;
+
+/* 20 spots with 50 points stacked on each, like a stand of trees */
+static GhtNode *
+vertical_test_node(const void *data, int i)
+{
+    const vertical_test_space *space = data;
+    GhtCoordinate coord;
+    GhtNode *node;
+    GhtAttribute *attr;
+    int spot = i % 20;
+    double z = 0.37 * (i / 20) + 0.01 * spot;
+
+    coord.x = 500000.25 + spot * 97.5;
+    coord.y = 5000000.5 + spot * 41.0;
+    if ( space->vertical )
+        ght_node_new_from_coordinate_3d(&coord, z, space->frame, space->vertical, 15, &node);
+    else
+        ght_node_new_from_coordinate_frame(&coord, space->frame, 15, &node);
+    ght_attribute_new_from_double(simpleschema->dims[2], space->stored_z ? *(space->stored_z) : z, &attr);
+    ght_node_add_attribute(node, attr);
+    return node;
+}
+
+static int
+count_hashless(const GhtNode *node)
+{
+    int i, n = node->hash ? 0 : 1;
+    for ( i = 0; node->children && i < node->children->num_nodes; i++ )
+        n += count_hashless(node->children->nodes[i]);
+    return n;
+}
+
+static void
+test_ght_tree_vertical(void)
+{
+    static const int npoints = 1000;
+    static const uint8_t formats[] = { 0, GHT_FORMAT_GROUPED | GHT_FORMAT_SCHEMA };
+    static const double misfiled_z = 11;
+    stream_test_entry *entries;
+    vertical_test_space space, space2d, misfiled;
+    GhtArea frame, area;
+    GhtRange vertical, vertical_read;
+    GhtConfig config;
+    GhtTree *tree, *tree2d, *treeread, *filtered;
+    size_t size;
+    int i, f, expected = 0, expected_above = 0, numpoints;
+
+    frame.x.min = 500000;
+    frame.x.max = 502048;
+    frame.y.min = 5000000;
+    frame.y.max = 5001024;
+    vertical.min = 0;
+    vertical.max = 64;
+    space.frame = space2d.frame = misfiled.frame = &frame;
+    space.vertical = misfiled.vertical = &vertical;
+    space2d.vertical = NULL;
+    space.stored_z = space2d.stored_z = NULL;
+    misfiled.stored_z = &misfiled_z;
+    entries = stream_test_entries_new(vertical_test_node, &space, npoints);
+
+    ght_config_init(&config);
+    config.frame = frame;
+    config.vertical = vertical;
+    tree = stream_test_tree(&config, vertical_test_node, &space, entries, npoints);
+    CU_ASSERT_EQUAL(tree->num_nodes, npoints);
+
+    /* Hashed in 2D, every point is a hash-less duplicate under its spot */
+    ght_tree_new(simpleschema, &tree2d);
+    ght_tree_set_frame(tree2d, &frame);
+    for ( i = 0; i < npoints; i++ )
+        ght_tree_insert_node(tree2d, vertical_test_node(&space2d, i));
+    CU_ASSERT_EQUAL(count_hashless(tree2d->root), npoints);
+    CU_ASSERT_EQUAL(count_hashless(tree->root), 0);
+
+    /* Only empty trees can start hashing z */
+    CU_ASSERT_EQUAL(ght_tree_set_vertical(tree2d, &vertical), GHT_ERROR);
+
+    ght_tree_get_extent(tree, &area);
+    CU_ASSERT_DOUBLE_EQUAL(area.x.min, 500000.25, 0.001);
+    CU_ASSERT_DOUBLE_EQUAL(area.x.max, 500000.25 + 19 * 97.5, 0.001);
+    CU_ASSERT_DOUBLE_EQUAL(area.y.max, 5000000.5 + 19 * 41.0, 0.001);
+
+    /* Z filters skip the cells they miss, and keep what the 2D tree keeps */
+    for ( i = 0; i < npoints; i++ )
+    {
+        double z = 0.37 * (i / 20) + 0.01 * (i % 20);
+        if ( z >= 10 && z <= 12 )
+            expected++;
+        if ( z > 17.5 )
+            expected_above++;
+    }
+    ght_tree_filter_between(tree, "Z", 10, 12, &filtered);
+    ght_tree_get_numpoints(filtered, &numpoints);
+    CU_ASSERT_EQUAL(numpoints, expected);
+    ght_tree_free(filtered);
+    ght_tree_filter_between(tree2d, "Z", 10, 12, &filtered);
+    ght_tree_get_numpoints(filtered, &numpoints);
+    CU_ASSERT_EQUAL(numpoints, expected);
+    ght_tree_free(filtered);
+    ght_tree_filter_greater_than(tree, "Z", 17.5, &filtered);
+    ght_tree_get_numpoints(filtered, &numpoints);
+    CU_ASSERT_EQUAL(numpoints, expected_above);
+    ght_tree_free(filtered);
+
+    /* The cells really are skipped: with every point storing a Z in the */
+    /* filter but hashed at its own z, only the cells around the filter */
+    /* are looked at, which is why the stored Z must be the hashed one */
+    treeread = stream_test_tree(&config, vertical_test_node, &misfiled, entries, npoints);
+    ght_tree_filter_between(treeread, "Z", 10, 12, &filtered);
+    ght_tree_get_numpoints(filtered, &numpoints);
+    CU_ASSERT(numpoints >= expected && numpoints < npoints);
+    ght_tree_free(filtered);
+    ght_tree_free(treeread);
+
+    for ( f = 0; f < 2; f++ )
+    {
+        /* The range goes in the header after the frame */
+        tree->config.format = formats[f];
+        treeread = tree_round_trip(tree, &size);
+        CU_ASSERT_EQUAL(treeread->config.format, formats[f] | GHT_FORMAT_FRAME | GHT_FORMAT_VERTICAL);
+        ght_tree_get_vertical(treeread, &vertical_read);
+        CU_ASSERT(memcmp(&vertical, &vertical_read, sizeof(GhtRange)) == 0);
+        CU_ASSERT_EQUAL(count_hashless(treeread->root), 0);
+        ght_tree_free(treeread);
+
+        /* Streamed the same */
+        config.format = formats[f];
+        check_stream_matches_tree(tree, &config, 0, vertical_test_node, &space, entries, npoints, NULL);
+    }
+
+    ght_tree_free(tree2d);
+    ght_tree_free(tree);
+    stream_test_entries_free(entries, npoints);
+}
+
+static void
+test_ght_tree_packed_serialization(void)
+{
+    GhtSchema *schema = packed_test_schema(1);
+    GhtSchema *wide = packed_test_schema(0);
+    GhtTree *tree = packed_test_tree(schema, 256);
+    GhtTree *widetree = packed_test_tree(wide, 256);
+    uint8_t formats[] = { 0, GHT_FORMAT_RESIDUAL, GHT_FORMAT_COLUMNAR,
+                          GHT_FORMAT_COLUMNAR | GHT_FORMAT_RESIDUAL, GHT_FORMAT_SCHEMA };
+    char *xml;
+    size_t xmlsize;
+    GhtSchema *xmlschema;
+    int same = 0;
+    int i;
+
+    CU_ASSERT_EQUAL(schema->packmask, UINT64_C(0x38));
+
+    /* Every layout carries the packed values through */
+    for ( i = 0; i < 5; i++ )
+    {
+        size_t size = check_format_round_trip(tree, formats[i]);
+        size_t widesize = check_format_round_trip(widetree, formats[i]);
+        CU_ASSERT(size < widesize);
+    }
+
+    /* The XML form keeps the widths */
+    ght_schema_to_xml_str(schema, &xml, &xmlsize);
+    ght_schema_from_xml_str(xml, &xmlschema);
+    ght_schema_same(schema, xmlschema, &same);
+    CU_ASSERT_EQUAL(same, 1);
+    CU_ASSERT_EQUAL(xmlschema->dims[4]->bits, 2);
+    ght_schema_same(schema, wide, &same);
+    CU_ASSERT_EQUAL(same, 0);
+    ght_free(xml);
+    ght_schema_free(xmlschema);
+
+    ght_tree_free(tree);
+    ght_tree_free(widetree);
+    ght_schema_free(schema);
+    ght_schema_free(wide);
+}
+
+static void
+test_ght_tree_filter_in(void)
+{
+    static const char *simpledata = "test/data/simple-data.tsv";
+    double zs[] = { 123.3, 123.4, 123.35, 999 };
+    double returns[] = { 2, 1, 7.5 };
+    GhtSchema *schema;
+    GhtTree *tree1, *tree2;
+
+    /* Same matches as a run of equal filters */
+    tree1 = tsv_file_to_tree(simpledata, simpleschema);
+    CU_ASSERT_EQUAL(ght_tree_filter_in(tree1, "Z", zs, 4, &tree2), GHT_OK);
+    CU_ASSERT_EQUAL(tree2->num_nodes, 8);
+    ght_tree_free(tree2);
+    CU_ASSERT_EQUAL(ght_tree_filter_in(tree1, "Z", zs + 2, 2, &tree2), GHT_OK);
+    CU_ASSERT_EQUAL(tree2->num_nodes, 0);
+    ght_tree_free(tree2);
+    CU_ASSERT_EQUAL(ght_tree_filter_in(tree1, "Z", zs, 0, &tree2), GHT_ERROR);
+    ght_tree_free(tree1);
+
+    /* Integer codes, 7.5 can never be stored */
+    schema = packed_test_schema(1);
+    tree1 = packed_test_tree(schema, 600);
+    CU_ASSERT_EQUAL(ght_tree_filter_in(tree1, "ReturnNumber", returns, 3, &tree2), GHT_OK);
+    CU_ASSERT_EQUAL(tree2->num_nodes, 240);
+    ght_tree_free(tree2);
+    ght_tree_free(tree1);
+    ght_schema_free(schema);
+}
+
+static void
+test_ght_tree_dictionary_serialization(void)
+{
+    GhtSchema *schema = packed_test_schema(0);
+    GhtTree *tree = packed_test_tree(schema, 600);
+    size_t size_basic, size_columnar;
+
+    /* Few distinct values in most columns, too many for a table in Intensity,
+     * the hashes keep the columnar form from shrinking much further */
+    size_basic = check_format_round_trip(tree, 0);
+    size_columnar = check_format_round_trip(tree, GHT_FORMAT_COLUMNAR);
+    CU_ASSERT(size_columnar < size_basic * 3 / 4);
+    CU_ASSERT(check_format_round_trip(tree, GHT_FORMAT_COLUMNAR | GHT_FORMAT_RESIDUAL) <= size_columnar);
+
+    ght_tree_free(tree);
+    ght_schema_free(schema);
+}
+
+/* Leaves kept by an equal filter */
+static int
+filter_equal_count(GhtTree *tree, const char *dimname, double value)
+{
+    GhtTree *filtered;
+    int n;
+    CU_ASSERT_EQUAL(ght_tree_filter_equal(tree, dimname, value, &filtered), GHT_OK);
+    n = filtered->num_nodes;
+    ght_tree_free(filtered);
+    return n;
+}
+
+static void
+test_ght_tree_presence(void)
+{
+    GhtSchema *schema = packed_test_schema(0);
+    GhtTree *plain = packed_test_tree(schema, 600);
+    GhtTree *tree = packed_test_tree(schema, 600);
+    GhtTree *treeread, *filtered;
+    GhtCoordinate coord;
+    GhtAttribute *attr;
+    GhtNode *node;
+    double returns[] = { 2, 4 };
+    size_t size;
+    int v;
+
+    CU_ASSERT_EQUAL(ght_tree_build_presence(tree, "Z"), GHT_OK);
+    CU_ASSERT_EQUAL(tree->root->presence, GHT_PRESENCE_OTHER);
+    CU_ASSERT_EQUAL(ght_tree_build_presence(tree, "ReturnNumber"), GHT_OK);
+    CU_ASSERT_EQUAL(tree->root->presence, UINT64_C(0x3E));
+
+    /* Pruning never changes the answer */
+    for ( v = 0; v < 8; v++ )
+        CU_ASSERT_EQUAL(filter_equal_count(tree, "ReturnNumber", v), filter_equal_count(plain, "ReturnNumber", v));
+    CU_ASSERT_EQUAL(filter_equal_count(tree, "Intensity", 13), 1);
+    CU_ASSERT_EQUAL(ght_tree_filter_in(tree, "ReturnNumber", returns, 2, &filtered), GHT_OK);
+    CU_ASSERT_EQUAL(filtered->num_nodes, 240);
+    ght_tree_free(filtered);
+
+    /* Only the dimension is stored, the maps come back on read */
+    tree->config.format = GHT_FORMAT_COLUMNAR;
+    treeread = tree_round_trip(tree, &size);
+    CU_ASSERT_EQUAL(treeread->config.format, GHT_FORMAT_COLUMNAR | GHT_FORMAT_PRESENCE);
+    CU_ASSERT_PTR_EQUAL(treeread->presence_dim, schema->dims[3]);
+    CU_ASSERT_EQUAL(treeread->root->presence, UINT64_C(0x3E));
+    CU_ASSERT_EQUAL(filter_equal_count(treeread, "ReturnNumber", 3), 120);
+    ght_tree_free(treeread);
+
+    /* Inserts add their bits on the way down */
+    coord.x = -126.4 + 0.0003;
+    coord.y = 45.12 + 0.0001;
+    ght_node_new_from_coordinate(&coord, 16, &node);
+    ght_attribute_new_from_double(schema->dims[3], 9, &attr);
+    ght_node_add_attribute(node, attr);
+    CU_ASSERT_EQUAL(ght_tree_insert_node(tree, node), GHT_OK);
+    CU_ASSERT_EQUAL(tree->root->presence, UINT64_C(0x23E));
+    CU_ASSERT_EQUAL(filter_equal_count(tree, "ReturnNumber", 9), 1);
+    CU_ASSERT_EQUAL(filter_equal_count(tree, "ReturnNumber", 3), 120);
+
+    /* Compaction recomputes them */
+    CU_ASSERT_EQUAL(ght_tree_compact_attributes(tree), GHT_OK);
+    CU_ASSERT_EQUAL(filter_equal_count(tree, "ReturnNumber", 9), 1);
+    CU_ASSERT_EQUAL(ght_tree_build_presence(tree, "Nothing"), GHT_ERROR);
+
+    ght_tree_free(tree);
+    ght_tree_free(plain);
+    ght_schema_free(schema);
+}
+
+static void
+test_ght_tree_residual_serialization(void)
+{
+    static const char *simpledata = "test/data/simple-data.tsv";
+    GhtTree *tree;
+    size_t size_basic, size_residual;
+
+    tree = tsv_file_to_tree(simpledata, simpleschema);
+    size_basic = check_format_round_trip(tree, 0);
+    size_residual = check_format_round_trip(tree, GHT_FORMAT_RESIDUAL);
+    CU_ASSERT(size_residual < size_basic);
+    ght_tree_free(tree);
+}
+
+static void
+test_ght_tree_grouped_serialization(void)
+{
+    static const char *simpledata = "test/data/simple-data.tsv";
+    GhtTree *tree;
+    GhtNodeList *nodelist;
+    GhtConfig config;
+    int i;
+
+    tree = tsv_file_to_tree(simpledata, simpleschema);
+    check_format_round_trip(tree, GHT_FORMAT_GROUPED);
+    check_format_round_trip(tree, GHT_FORMAT_GROUPED | GHT_FORMAT_SCHEMA);
+    ght_tree_free(tree);
+
+    /* A lone root, and a root with a run of duplicates */
+    ght_nodelist_new(8, &nodelist);
+    for ( i = 0; i < 300; i++ )
+    {
+        GhtCoordinate coord;
+        GhtNode *node;
+        GhtAttribute *attr;
+        coord.x = -126.4;
+        coord.y = 45.1;
+        ght_node_new_from_coordinate(&coord, 12, &node);
+        ght_attribute_new_from_double(simpleschema->dims[2], i, &attr);
+        ght_node_add_attribute(node, attr);
+        ght_nodelist_add_node(nodelist, node);
+        if ( i == 0 )
+        {
+            ght_config_init(&config);
+            ght_tree_from_nodelist(simpleschema, nodelist, &config, &tree);
+            ght_nodelist_free_shallow(nodelist);
+            check_format_round_trip(tree, GHT_FORMAT_GROUPED);
+            ght_tree_free(tree);
+            ght_nodelist_new(8, &nodelist);
+        }
+    }
+    ght_tree_from_nodelist(simpleschema, nodelist, &config, &tree);
+    ght_nodelist_free_shallow(nodelist);
+    check_format_round_trip(tree, GHT_FORMAT_GROUPED);
+    ght_tree_free(tree);
+}
+
+static void
+test_ght_tree_columnar_serialization(void)
+{
+    static const char *simpledata = "test/data/simple-data.tsv";
+    GhtTree *tree;
+    GhtNode *dupe;
+    GhtCoordinate coord;
+    GhtAttribute *attr;
+    size_t size_basic, size_columnar;
+
+    tree = tsv_file_to_tree(simpledata, simpleschema);
+
+    /* A duplicate point gives a hash-less node */
+    coord.x = -126.41231;
+    coord.y = 45.12314;
+    ght_node_new_from_coordinate(&coord, 16, &dupe);
+    ght_attribute_new_from_double(simpleschema->dims[2], 99.9, &attr);
+    ght_node_add_attribute(dupe, attr);
+    CU_ASSERT_EQUAL(ght_node_insert_node(tree->root, dupe, GHT_DUPES_YES), GHT_OK);
+
+    size_basic = check_format_round_trip(tree, 0);
+    size_columnar = check_format_round_trip(tree, GHT_FORMAT_COLUMNAR);
+    CU_ASSERT(check_format_round_trip(tree, GHT_FORMAT_COLUMNAR | GHT_FORMAT_RESIDUAL) < size_columnar);
+    CU_ASSERT(size_columnar > 0 && size_basic > 0);
+    ght_tree_free(tree);
+}
+
+/* Read a hand built columnar node tree against the simple schema */
+static GhtErr
+read_columnar_bytes(const uint8_t *bytes, size_t size, GhtNode **node)
+{
+    GhtReader *reader;
+    GhtErr err;
+    ght_reader_new_mem(bytes, size, simpleschema, &reader);
+    err = ght_node_read_columnar(reader, node);
+    ght_reader_free(reader);
+    return err;
+}
+
+static void
+test_ght_tree_columnar_corrupt(void)
+{
+    /* One hash-less node with a raw Z column */
+    uint8_t good[] = {
+        0x01,                   /* nodes */
+        0x01, 0x00,             /* topology */
+        0x01, 0x00,             /* hashes */
+        0x01, 0x00,             /* flags */
+        0x01, 0x04,             /* masks */
+        0x01,                   /* columns */
+        0x02, 0x00, 0x04, 0x2A, 0x00, 0x00, 0x00
+    };
+    /* The same Z column twice */
+    uint8_t dupe[] = {
+        0x01, 0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0x01, 0x04,
+        0x02,
+        0x02, 0x00, 0x04, 0x2A, 0x00, 0x00, 0x00,
+        0x02, 0x00, 0x04, 0x2B, 0x00, 0x00, 0x00
+    };
+    uint8_t bad[sizeof(good)];
+    GhtNode *node = NULL;
+    GhtAttribute found;
+    double z;
+
+    CU_ASSERT_EQUAL(read_columnar_bytes(good, sizeof(good), &node), GHT_OK);
+    CU_ASSERT_EQUAL(ght_node_get_attribute(node, simpleschema->dims[2], &found), GHT_OK);
+    ght_attribute_get_value(&found, &z);
+    CU_ASSERT_DOUBLE_EQUAL(z, 42 * simpleschema->dims[2]->scale + simpleschema->dims[2]->offset, 0.0000001);
+    ght_node_free(node);
+
+    cu_quiet_errors(1);
+
+    CU_ASSERT_EQUAL(read_columnar_bytes(dupe, sizeof(dupe), &node), GHT_ERROR);
+
+    /* More nodes than the input could describe */
+    memcpy(bad, good, sizeof(good));
+    bad[0] = 0x7F;
+    CU_ASSERT_EQUAL(read_columnar_bytes(bad, sizeof(bad), &node), GHT_ERROR);
+
+    /* A child count beyond the node count */
+    memcpy(bad, good, sizeof(good));
+    bad[2] = 0x7F;
+    CU_ASSERT_EQUAL(read_columnar_bytes(bad, sizeof(bad), &node), GHT_ERROR);
+
+    /* A stream longer than what is left */
+    memcpy(bad, good, sizeof(good));
+    bad[12] = 0x7F;
+    CU_ASSERT_EQUAL(read_columnar_bytes(bad, sizeof(bad), &node), GHT_ERROR);
+
+    cu_quiet_errors(0);
+}
+
+/* Union of the attribute masks of all nodes in the tree */
+static uint64_t
+node_attribute_mask(const GhtNode *node)
+{
+    int i;
+    uint64_t mask = node->attributes ? node->attributes->mask : 0;
+    for ( i = 0; node->children && i < node->children->num_nodes; i++ )
+        mask |= node_attribute_mask(node->children->nodes[i]);
+    return mask;
+}
+
+static void
+test_ght_tree_read_dimensions(void)
+{
+    static const char *simpledata = "test/data/simple-data.tsv";
+    static const uint8_t formats[] = { 0, GHT_FORMAT_RESIDUAL, GHT_FORMAT_COLUMNAR, GHT_FORMAT_COLUMNAR | GHT_FORMAT_RESIDUAL
+#ifdef HAVE_ZLIB
+        , GHT_FORMAT_COMPRESSED | GHT_FORMAT_COLUMNAR
+#endif
+    };
+    GhtTree *tree, *treeread;
+    GhtWriter *writer;
+    GhtReader *reader;
+    GhtAttribute attr;
+    uint8_t *bytes;
+    size_t bytes_size;
+    int i;
+
+    tree = tsv_file_to_tree(simpledata, simpleschema);
+    CU_ASSERT_EQUAL(node_attribute_mask(tree->root), 0x0C);
+
+    for ( i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++ )
+    {
+        tree->config.format = formats[i];
+        ght_writer_new_mem(&writer);
+        ght_tree_write(tree, writer);
+        ght_writer_get_size(writer, &bytes_size);
+        bytes = malloc(bytes_size);
+        ght_writer_get_bytes(writer, bytes);
+        ght_writer_free(writer);
+
+        /* Intensity only, Z is skipped */
+        ght_reader_new_mem(bytes, bytes_size, simpleschema, &reader);
+        CU_ASSERT_EQUAL(ght_tree_read_dimensions(reader, 0x08, &treeread), GHT_OK);
+        CU_ASSERT_EQUAL(node_attribute_mask(treeread->root), 0x08);
+        CU_ASSERT_EQUAL(ght_node_get_attribute(treeread->root, simpleschema->dims[3], &attr), GHT_OK);
+        ght_tree_free(treeread);
+
+        /* The reader goes back to all dimensions afterwards */
+        CU_ASSERT_EQUAL(reader->dimmask, ~UINT64_C(0));
+        ght_reader_free(reader);
+        free(bytes);
+    }
+    ght_tree_free(tree);
+}
+
+#ifdef HAVE_ZLIB
+static void
+test_ght_tree_compressed_serialization(void)
+{
+    static const char *simpledata = "test/data/simple-data.tsv";
+    GhtTree *tree;
+    GhtNodeList *nodelist;
+    GhtConfig config;
+    size_t size_basic, size_compressed;
+    int i;
+
+    /* Small tree, a single block */
+    tree = tsv_file_to_tree(simpledata, simpleschema);
+    check_format_round_trip(tree, GHT_FORMAT_COMPRESSED);
+    check_format_round_trip(tree, GHT_FORMAT_COMPRESSED | GHT_FORMAT_COLUMNAR | GHT_FORMAT_RESIDUAL);
+    check_format_round_trip(tree, GHT_FORMAT_COMPRESSED | GHT_FORMAT_GROUPED);
+    ght_tree_free(tree);
+
+    /* Enough points for several blocks */
+    ght_nodelist_new(16, &nodelist);
+    for ( i = 0; i < 20000; i++ )
+    {
+        GhtCoordinate coord;
+        GhtNode *node;
+        GhtAttribute *attr;
+        coord.x = -126.4 + (i % 200) * 0.0001;
+        coord.y = 45.1 + (i / 200) * 0.0001;
+        ght_node_new_from_coordinate(&coord, 16, &node);
+        ght_attribute_new_from_double(simpleschema->dims[2], 100 + (i % 37) * 0.01, &attr);
+        ght_node_add_attribute(node, attr);
+        ght_attribute_new_from_double(simpleschema->dims[3], i % 7, &attr);
+        ght_node_add_attribute(node, attr);
+        ght_nodelist_add_node(nodelist, node);
+    }
+    ght_config_init(&config);
+    ght_tree_from_nodelist(simpleschema, nodelist, &config, &tree);
+    ght_nodelist_free_shallow(nodelist);
+
+    size_basic = check_format_round_trip(tree, 0);
+    CU_ASSERT(size_basic > 2 * GHT_BLOCK_SIZE);
+    size_compressed = check_format_round_trip(tree, GHT_FORMAT_COMPRESSED);
+    CU_ASSERT(size_compressed < size_basic);
+    ght_tree_free(tree);
+}
+
+static void
+test_ght_compressed_blocks(void)
+{
+    size_t i, size = 5 * GHT_BLOCK_SIZE + 100;
+    uint8_t *raw = ght_malloc(size);
+    uint8_t *bytes, got[16];
+    size_t bytes_size;
+    GhtWriter *writer;
+    GhtReader *reader, *body;
+
+    for ( i = 0; i < size; i++ )
+        raw[i] = (uint8_t)((i * 7) ^ (i >> 9));
+
+    ght_writer_new_mem(&writer);
+    CU_ASSERT_EQUAL(ght_write_compressed(writer, raw, size), GHT_OK);
+    ght_writer_get_size(writer, &bytes_size);
+    bytes = ght_malloc(bytes_size);
+    ght_writer_get_bytes(writer, bytes);
+    ght_writer_free(writer);
+
+    /* Up front, every block comes back */
+    ght_reader_new_mem(bytes, bytes_size, NULL, &reader);
+    CU_ASSERT_EQUAL(ght_reader_new_compressed(reader, 0, &body), GHT_OK);
+    CU_ASSERT_EQUAL(body->blocks->num_blocks, 6);
+    for ( i = 0; i < 6; i++ )
+        CU_ASSERT_EQUAL(body->blocks->inflated[i], 1);
+    CU_ASSERT_EQUAL(memcmp(body->bytes_start, raw, size), 0);
+    ght_reader_free(body);
+    ght_reader_free(reader);
+
+    /* Lazily, skipped blocks are never inflated */
+    ght_reader_new_mem(bytes, bytes_size, NULL, &reader);
+    CU_ASSERT_EQUAL(ght_reader_new_compressed(reader, 1, &body), GHT_OK);
+    CU_ASSERT_EQUAL(ght_reader_skip(body, 3 * GHT_BLOCK_SIZE + 10), GHT_OK);
+    CU_ASSERT_EQUAL(ght_read(body, got, sizeof(got)), GHT_OK);
+    CU_ASSERT_EQUAL(memcmp(got, raw + 3 * GHT_BLOCK_SIZE + 10, sizeof(got)), 0);
+    for ( i = 0; i < 6; i++ )
+        CU_ASSERT_EQUAL(body->blocks->inflated[i], i == 3);
+    /* A read across a boundary inflates both sides */
+    CU_ASSERT_EQUAL(ght_reader_skip(body, GHT_BLOCK_SIZE - 34), GHT_OK);
+    CU_ASSERT_EQUAL(ght_read(body, got, sizeof(got)), GHT_OK);
+    CU_ASSERT_EQUAL(memcmp(got, raw + 4 * GHT_BLOCK_SIZE - 8, sizeof(got)), 0);
+    CU_ASSERT_EQUAL(body->blocks->inflated[4], 1);
+    CU_ASSERT_EQUAL(body->blocks->inflated[5], 0);
+    ght_reader_free(body);
+    ght_reader_free(reader);
+
+    /* Damage at the end of the data hits the last block only */
+    cu_quiet_errors(1);
+    bytes[bytes_size - 2] ^= 0xFF;
+    ght_reader_new_mem(bytes, bytes_size, NULL, &reader);
+    CU_ASSERT_EQUAL(ght_reader_new_compressed(reader, 0, &body), GHT_ERROR);
+    ght_reader_free(reader);
+    ght_reader_new_mem(bytes, bytes_size, NULL, &reader);
+    CU_ASSERT_EQUAL(ght_reader_new_compressed(reader, 1, &body), GHT_OK);
+    CU_ASSERT_EQUAL(ght_read(body, got, sizeof(got)), GHT_OK);
+    CU_ASSERT_EQUAL(ght_reader_skip(body, 5 * GHT_BLOCK_SIZE), GHT_OK);
+    CU_ASSERT_EQUAL(ght_read(body, got, sizeof(got)), GHT_ERROR);
+    ght_reader_free(body);
+    ght_reader_free(reader);
+    cu_quiet_errors(0);
+
+    ght_free(bytes);
+    ght_free(raw);
+}
+#endif
+
+static void
+test_ght_tree_embedded_schema(void)
+{
+    static const char *simpledata = "test/data/simple-data.tsv";
+    GhtTree *tree, *treeread, *filtered;
+    GhtWriter *writer;
+    GhtReader *reader;
+    const GhtSchema *schema;
+    GhtDimension *dim;
+    uint8_t *bytes, *filtered_bytes;
+    size_t bytes_size, filtered_size;
+    stringbuffer_t *sb1, *sb2;
+    GhtSchema *lossy;
+    double tolerance;
+    int same = 0;
+
+    tree = tsv_file_to_tree(simpledata, simpleschema);
+    tree->config.format = GHT_FORMAT_SCHEMA | GHT_FORMAT_COLUMNAR;
+    ght_writer_new_mem(&writer);
+    ght_tree_write(tree, writer);
+    ght_writer_get_size(writer, &bytes_size);
+    bytes = malloc(bytes_size);
+    ght_writer_get_bytes(writer, bytes);
+    ght_writer_free(writer);
+
+    /* No schema up front, the tree brings its own */
+    ght_reader_new_mem(bytes, bytes_size, NULL, &reader);
+    CU_ASSERT_EQUAL(ght_tree_read(reader, &treeread), GHT_OK);
+    CU_ASSERT_PTR_NULL(reader->schema);
+    ght_reader_free(reader);
+    CU_ASSERT_EQUAL(ght_tree_get_schema(treeread, &schema), GHT_OK);
+    CU_ASSERT_NOT_EQUAL(schema, simpleschema);
+    ght_schema_same(schema, simpleschema, &same);
+    CU_ASSERT_EQUAL(same, 1);
+
+    sb1 = ght_stringbuffer_create();
+    sb2 = ght_stringbuffer_create();
+    ght_node_to_string(tree->root, sb1, 0);
+    ght_node_to_string(treeread->root, sb2, 0);
+    CU_ASSERT_STRING_EQUAL(ght_stringbuffer_getstring(sb1), ght_stringbuffer_getstring(sb2));
+    ght_stringbuffer_destroy(sb1);
+    ght_stringbuffer_destroy(sb2);
+    ght_tree_free(treeread);
+
+    /* The embedded schema is interned, a second read shares it and it
+     * stays valid after the trees are gone */
+    ght_reader_new_mem(bytes, bytes_size, NULL, &reader);
+    CU_ASSERT_EQUAL(ght_tree_read(reader, &treeread), GHT_OK);
+    ght_reader_free(reader);
+    CU_ASSERT_PTR_EQUAL(treeread->schema, schema);
+    CU_ASSERT_EQUAL(schema->interned, 1);
+    ght_tree_free(treeread);
+    CU_ASSERT_STRING_EQUAL(schema->dims[3]->name, simpleschema->dims[3]->name);
+
+    /* A filtered tree outlives the tree it came from */
+    ght_reader_new_mem(bytes, bytes_size, NULL, &reader);
+    CU_ASSERT_EQUAL(ght_tree_read(reader, &treeread), GHT_OK);
+    ght_reader_free(reader);
+    ght_schema_get_dimension_by_name(treeread->schema, "Intensity", &dim);
+    CU_ASSERT_EQUAL(ght_tree_filter_by_dimension(treeread, dim, GHT_GREATER_THAN, 0, 0, &filtered), GHT_OK);
+    ght_tree_free(treeread);
+    filtered->config.format = GHT_FORMAT_SCHEMA | GHT_FORMAT_COLUMNAR;
+    ght_writer_new_mem(&writer);
+    CU_ASSERT_EQUAL(ght_tree_write(filtered, writer), GHT_OK);
+    ght_writer_get_size(writer, &filtered_size);
+    filtered_bytes = malloc(filtered_size);
+    ght_writer_get_bytes(writer, filtered_bytes);
+    ght_writer_free(writer);
+    ght_reader_new_mem(filtered_bytes, filtered_size, NULL, &reader);
+    CU_ASSERT_EQUAL(ght_tree_read(reader, &treeread), GHT_OK);
+    ght_reader_free(reader);
+    CU_ASSERT_EQUAL(node_attribute_mask(treeread->root), node_attribute_mask(filtered->root));
+    ght_tree_free(treeread);
+    ght_tree_free(filtered);
+    free(filtered_bytes);
+
+    /* A matching reader schema is used as is */
+    ght_reader_new_mem(bytes, bytes_size, simpleschema, &reader);
+    CU_ASSERT_EQUAL(ght_tree_read(reader, &treeread), GHT_OK);
+    CU_ASSERT_PTR_EQUAL(treeread->schema, simpleschema);
+    ght_reader_free(reader);
+    ght_tree_free(treeread);
+
+    free(bytes);
+    ght_tree_free(tree);
+
+    /* The compaction tolerance comes along with the embedded schema, */
+    /* and keeps it apart from the exact one in the registry */
+    ght_schema_clone(simpleschema, &lossy);
+    ght_dimension_set_tolerance(lossy->dims[3], 0.25);
+    tree = tsv_file_to_tree(simpledata, lossy);
+    tree->config.format = GHT_FORMAT_SCHEMA;
+    ght_writer_new_mem(&writer);
+    CU_ASSERT_EQUAL(ght_tree_write(tree, writer), GHT_OK);
+    ght_writer_get_size(writer, &bytes_size);
+    bytes = malloc(bytes_size);
+    ght_writer_get_bytes(writer, bytes);
+    ght_writer_free(writer);
+    ght_reader_new_mem(bytes, bytes_size, NULL, &reader);
+    CU_ASSERT_EQUAL(ght_tree_read(reader, &treeread), GHT_OK);
+    ght_reader_free(reader);
+    CU_ASSERT_NOT_EQUAL(treeread->schema, schema);
+    ght_dimension_get_tolerance(treeread->schema->dims[3], &tolerance);
+    CU_ASSERT_DOUBLE_EQUAL(tolerance, 0.25, 0.0);
+    ght_dimension_get_tolerance(treeread->schema->dims[2], &tolerance);
+    CU_ASSERT_DOUBLE_EQUAL(tolerance, 0.0, 0.0);
+    ght_schema_same(treeread->schema, lossy, &same);
+    CU_ASSERT_EQUAL(same, 1);
+    ght_tree_free(treeread);
+
+    /* An exact reader schema no longer matches */
+    cu_quiet_errors(1);
+    ght_reader_new_mem(bytes, bytes_size, simpleschema, &reader);
+    CU_ASSERT_EQUAL(ght_tree_read(reader, &treeread), GHT_ERROR);
+    ght_reader_free(reader);
+    cu_quiet_errors(0);
+
+    free(bytes);
+    ght_tree_free(tree);
+    ght_schema_free(lossy);
+}
+
+static void
+test_ght_residual_quantize(void)
+{
+    GhtDimension *dim;
+    uint64_t q;
+    double d;
+    int32_t i32;
+    uint8_t buf[8];
+
+    /* Signed integers round trip through the zig-zag residual */
+    ght_dimension_new_from_parameters("I", "", GHT_INT32, 1.0, 0.0, &dim);
+    i32 = -12345;
+    CU_ASSERT_EQUAL(ght_attribute_quantize(dim, &i32, &q), GHT_OK);
+    CU_ASSERT_EQUAL(ght_zigzag_decode(ght_zigzag_encode(q - 7)) + 7, q);
+    CU_ASSERT_EQUAL(ght_zigzag_encode((uint64_t)-1), 1);
+    ght_attribute_dequantize(dim, q, buf);
+    CU_ASSERT_EQUAL(memcmp(buf, &i32, sizeof(i32)), 0);
+    ght_dimension_free(dim);
+
+    /* Doubles only when integral */
+    ght_dimension_new_from_parameters("D", "", GHT_DOUBLE, 1.0, 0.0, &dim);
+    d = 12340.0;
+    CU_ASSERT_EQUAL(ght_attribute_quantize(dim, &d, &q), GHT_OK);
+    CU_ASSERT_EQUAL((int64_t)q, 12340);
+    d = 123.4;
+    CU_ASSERT_EQUAL(ght_attribute_quantize(dim, &d, &q), GHT_ERROR);
+    d = -0.0;
+    CU_ASSERT_EQUAL(ght_attribute_quantize(dim, &d, &q), GHT_ERROR);
+    ght_dimension_free(dim);
+}
+
 /* REGISTER ***********************************************************/
 
 CU_TestInfo tree_tests[] =
 {
     GHT_TEST(test_ght_tree_extent),
     GHT_TEST(test_ght_tree_empty),
+    GHT_TEST(test_ght_tree_join),
+    GHT_TEST(test_ght_tree_stream),
+    GHT_TEST(test_ght_tree_frame),
+    GHT_TEST(test_ght_tree_vertical),
     GHT_TEST(test_ght_tree_filter),
+    GHT_TEST(test_ght_filter_compile),
+    GHT_TEST(test_ght_tree_filter_equal),
+    GHT_TEST(test_ght_tree_filter_in),
+    GHT_TEST(test_ght_tree_presence),
+    GHT_TEST(test_ght_tree_residual_serialization),
+    GHT_TEST(test_ght_tree_columnar_serialization),
+    GHT_TEST(test_ght_tree_columnar_corrupt),
+    GHT_TEST(test_ght_tree_grouped_serialization),
+    GHT_TEST(test_ght_tree_dictionary_serialization),
+    GHT_TEST(test_ght_tree_read_dimensions),
+    GHT_TEST(test_ght_tree_embedded_schema),
+    GHT_TEST(test_ght_tree_packed_serialization),
+#ifdef HAVE_ZLIB
+    GHT_TEST(test_ght_tree_compressed_serialization),
+    GHT_TEST(test_ght_compressed_blocks),
+#endif
+    GHT_TEST(test_ght_residual_quantize),
     CU_TEST_INFO_NULL
 };
 
@@ -12,3 +12,6 @@
 /* Read a file (XML) into a cstring */
 char* file_to_str(const char *fname);
 
+/* Make ght_error() report and return instead of exiting, so a test can
+ * feed in bad input; call with 0 to restore the default handlers */
+void cu_quiet_errors(int quiet);
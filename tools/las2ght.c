@@ -11,13 +11,26 @@
 #include "proj_api.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 #include <assert.h>
+#include <limits.h>
+#include "ght_config.h"
 #include "ght.h" /* We use the public GHT API to promote good practices */
+#include "lasfile.h"
+#include "lasproj.h"
+
+/* Threads need a proj4 context each, which came in with 4.8 */
+#if defined(HAVE_PTHREAD) && defined(PJ_VERSION) && PJ_VERSION >= 480
+#define L2G_THREADS
+#include <pthread.h>
+#endif
 
 #define EXENAME "las2ght"
 #define MAXPOINTS 2000000
 #define STRSIZE 1024
 #define LOG_NUM_POINTS 100000
+#define BATCH_POINTS 4096  /* points handed between pipeline stages at a time */
 
 #ifdef HAVE_GETOPT_H
 /* System implementation */
@@ -31,20 +44,9 @@
 static char *ght_file_template = "%s-%d-%s.ght";
 static char *xml_file_template = "%s-%d-%s.ght.xml";
 
-typedef enum
-{
-    LL_INTENSITY = 0,
-    LL_RETURN_NUMBER,
-    LL_NUMBER_OF_RETURNS,
-    LL_SCAN_DIRECTION,
-    LL_FLIGHT_LINE_EDGE,
-    LL_CLASSIFICATION,
-    LL_SCAN_ANGLE,
-    LL_POINT_SOURCE_ID,
-    LL_RED,
-    LL_GREEN,
-    LL_BLUE
-} LasAttribute;
+/* "username-hash.ght" for tiles, the hash is the cell */
+static char *ght_tile_template = "%s-%s.ght";
+static char *xml_tile_template = "%s-%s.ght.xml";
 
 typedef struct  
 {
@@ -84,18 +86,114 @@ typedef struct
     int validpoints;  /* Should we only convert valid points? */
     int resolution;   /* How many digits of the GeoHash to build? */
     int maxpoints;    /* How many points to save in each GHT file? */
+    size_t memory;    /* Flush when the trees hold this many bytes, 0 for no limit */
+    int threads;      /* Worker threads, 0 or 1 to do everything in order */
+    int tiles;        /* Write one file per geohash cell instead of per chunk */
+    int liblas;       /* Read points through libLAS even if we could map the file */
+    int outofcore;    /* Sort on disk and write everything into one tree */
+    int frame;        /* Hash the LAS coordinates within frame_area, 2 to fit it to the header extent */
+    GhtArea frame_area;
+    int vertical;     /* Interleave Z over vertical_range into the hashes, 2 for the header Z range */
+    GhtRange vertical_range;
 } Las2GhtConfig;
 
 typedef struct 
 {
     LASReaderH reader;
     LASHeaderH header;
+    LasFile *lasfile;       /* native point reader, NULL to read through libLAS */
+    uint64_t next_record;   /* where the next tree starts reading */
+    uint64_t position;      /* where the libLAS reader is */
     int fileno;
     projPJ pj_input;
     projPJ pj_output;
+    char *proj4_input;  /* kept so worker threads can set up their own projections */
+    LasProj *lasproj;   /* native inverse for common projections, NULL to go through proj4 */
+    char prefix[GHT_MAX_HASH_LENGTH + 1];  /* hash prefix of the whole LAS extent */
+    const GhtArea *frame;  /* hash unprojected coordinates within this, NULL for longitude/latitude */
+    const GhtRange *vertical;  /* hash Z over this too, NULL for 2D hashes */
     GhtSchemaPtr schema;
 } Las2GhtState;
 
+/* One LAS point, as read from the file */
+typedef struct
+{
+    double x, y, z;
+    double attrs[NUM_LAS_ATTRIBUTES];
+} Las2GhtPoint;
+
+/* Points are read, reprojected and turned into nodes a batch at a time */
+typedef struct
+{
+    int num_points;
+    Las2GhtPoint points[BATCH_POINTS];
+    GhtCoordinate coords[BATCH_POINTS];  /* reprojected, x is HUGE_VAL for failures */
+} Las2GhtPointBatch;
+
+static const char *proj4_output = "+proj=longlat +datum=WGS84 +no_defs";
+static const char *l2g_base32 = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+/*
+* With a memory budget, libght allocates through these, which keep the
+* size of each block in front of it and a running total of the bytes
+* in use. Worker threads allocate too, so the total is atomic.
+*/
+#define MEM_HEADER 16  /* keeps the returned blocks aligned */
+static size_t l2g_memory_total = 0;
+
+static void *
+l2g_counting_alloc(size_t size)
+{
+    char *mem = malloc(size + MEM_HEADER);
+    if ( ! mem )
+        return NULL;
+    *((size_t*)mem) = size;
+    __sync_add_and_fetch(&l2g_memory_total, size + MEM_HEADER);
+    return mem + MEM_HEADER;
+}
+
+static void
+l2g_counting_free(void *mem)
+{
+    char *block;
+    if ( ! mem )
+        return;
+    block = (char*)mem - MEM_HEADER;
+    __sync_sub_and_fetch(&l2g_memory_total, *((size_t*)block) + MEM_HEADER);
+    free(block);
+}
+
+static void *
+l2g_counting_realloc(void *mem, size_t size)
+{
+    char *block;
+    size_t oldsize;
+
+    if ( ! mem )
+        return l2g_counting_alloc(size);
+    block = (char*)mem - MEM_HEADER;
+    oldsize = *((size_t*)block);
+    block = realloc(block, size + MEM_HEADER);
+    if ( ! block )
+        return NULL;
+    *((size_t*)block) = size;
+    __sync_add_and_fetch(&l2g_memory_total, size);
+    __sync_sub_and_fetch(&l2g_memory_total, oldsize);
+    return block + MEM_HEADER;
+}
+
+static size_t
+l2g_memory_used(void)
+{
+    return __sync_add_and_fetch(&l2g_memory_total, 0);
+}
+
+static int
+l2g_over_budget(const Las2GhtConfig *config)
+{
+    return config->memory && l2g_memory_used() >= config->memory;
+}
+
 static void
 l2g_config_printf(const Las2GhtConfig *config)
 {
@@ -105,6 +203,13 @@ l2g_config_printf(const Las2GhtConfig *config)
     ght_info("    num_attrs: %d", config->num_attrs);
     ght_info("  validpoints: %d", config->validpoints);
     ght_info("   resolution: %d", config->resolution);
+    ght_info("    maxpoints: %d", config->maxpoints);
+    ght_info("       memory: %zu MB", config->memory >> 20);
+    ght_info("      threads: %d", config->threads);
+    ght_info("        tiles: %d", config->tiles);
+    ght_info("    outofcore: %d", config->outofcore);
+    ght_info("        frame: %d", config->frame);
+    ght_info("     vertical: %d", config->vertical);
 }
 
 static void
@@ -116,6 +221,26 @@ l2g_usage()
     printf("  --lasfile FILENAME            Read file as input.\n");
     printf("  --ghtfile FILENAME            Write file as output.\n");
     printf("  --validpoints                 Only convert valid points.\n");
+    printf("  --resolution N                Hash points to N characters, at most %d.\n", GHT_MAX_HASH_LENGTH);
+    printf("  --maxpoints N                 Write at most N points to a file [%d].\n", MAXPOINTS);
+    printf("  --memory MB                   Write files out whenever the trees\n");
+    printf("                                take up this much memory.\n");
+    printf("  --threads N                   Reproject, hash and build in N threads.\n");
+    printf("  --liblas                      Read points through libLAS, not directly.\n");
+    printf("  --tiles                       Write one file for each geohash cell,\n");
+    printf("                                splitting cells that get too big.\n");
+    printf("  --outofcore                   Sort points by hash on disk and write\n");
+    printf("                                them all into one file, only sorting\n");
+    printf("                                maxpoints or MB of them in memory.\n");
+    printf("                                Writes the grouped layout.\n");
+    printf("  --frame XMIN,YMIN,XMAX,YMAX   Hash the LAS coordinates within this\n");
+    printf("                                extent instead of reprojecting them to\n");
+    printf("                                longitude/latitude, 'auto' for one twice\n");
+    printf("                                as wide as high around the LAS extent.\n");
+    printf("  --vertical ZMIN,ZMAX          Hash Z over this range along with X and Y,\n");
+    printf("                                so stacked points get leaves of their own\n");
+    printf("                                and Z filters prune, 'auto' for the LAS\n");
+    printf("                                Z range.\n");
     printf("  --attrs [irndecapRGB]         Convert selected attributes.\n");
     printf("                                X,Y,Z are always converted.\n");
     printf("      i - intensity\n");
@@ -180,6 +305,7 @@ l2g_config_free(Las2GhtConfig *config)
     }
 }
 
+static void
 l2g_state_free(Las2GhtState *state)
 {
     if ( state->header )
@@ -192,6 +318,11 @@ l2g_state_free(Las2GhtState *state)
         LASReader_Destroy(state->reader);
         state->reader = NULL;
     }
+    if ( state->lasfile )
+    {
+        las_file_close(state->lasfile);
+        state->lasfile = NULL;
+    }
     if ( state->pj_input )
     {
         pj_free(state->pj_input);
@@ -202,6 +333,16 @@ l2g_state_free(Las2GhtState *state)
         pj_free(state->pj_output);
         state->pj_output = NULL;
     }
+    if ( state->proj4_input )
+    {
+        free(state->proj4_input);
+        state->proj4_input = NULL;
+    }
+    if ( state->lasproj )
+    {
+        las_proj_free(state->lasproj);
+        state->lasproj = NULL;
+    }
     if ( state->schema )
     {
         ght_schema_free(state->schema);
@@ -243,12 +384,22 @@ l2g_getopts(int argc, char **argv, Las2GhtConfig *config)
         { "ghtfile", required_argument, NULL, 'g' },
         { "attrs", required_argument, NULL, 'a' },
         { "validpoints", no_argument, NULL, 'p' },
+        { "threads", required_argument, NULL, 't' },
+        { "tiles", no_argument, NULL, 'T' },
+        { "liblas", no_argument, NULL, 'L' },
+        { "outofcore", no_argument, NULL, 'o' },
+        { "resolution", required_argument, NULL, 'r' },
+        { "maxpoints", required_argument, NULL, 'm' },
+        { "memory", required_argument, NULL, 'M' },
+        { "frame", required_argument, NULL, 'F' },
+        { "vertical", required_argument, NULL, 'V' },
         { NULL, 0, NULL, 0 }
     };
 
     memset(config, 0, sizeof(Las2GhtConfig));
+    config->resolution = GHT_MAX_HASH_LENGTH;
 
-    while ( (ch = getopt_long(argc, argv, "g:l:a:p", longopts, NULL)) != -1)
+    while ( (ch = getopt_long(argc, argv, "g:l:a:pt:TLor:m:M:F:V:", longopts, NULL)) != -1)
     {
         switch (ch) 
         {
@@ -272,6 +423,64 @@ l2g_getopts(int argc, char **argv, Las2GhtConfig *config)
                 config->validpoints = 1;
                 break;
             }
+            case 't':
+            {
+                config->threads = atoi(optarg);
+                break;
+            }
+            case 'T':
+            {
+                config->tiles = 1;
+                break;
+            }
+            case 'L':
+            {
+                config->liblas = 1;
+                break;
+            }
+            case 'o':
+            {
+                config->outofcore = 1;
+                break;
+            }
+            case 'r':
+            {
+                config->resolution = atoi(optarg);
+                break;
+            }
+            case 'm':
+            {
+                config->maxpoints = atoi(optarg);
+                break;
+            }
+            case 'M':
+            {
+                config->memory = (size_t)atol(optarg) << 20;
+                break;
+            }
+            case 'F':
+            {
+                GhtArea *a = &(config->frame_area);
+                if ( ! strcmp(optarg, "auto") )
+                    config->frame = 2;
+                else if ( sscanf(optarg, "%lf,%lf,%lf,%lf", &(a->x.min), &(a->y.min), &(a->x.max), &(a->y.max)) == 4 &&
+                          a->x.min < a->x.max && a->y.min < a->y.max )
+                    config->frame = 1;
+                else
+                    config->frame = -1;
+                break;
+            }
+            case 'V':
+            {
+                GhtRange *r = &(config->vertical_range);
+                if ( ! strcmp(optarg, "auto") )
+                    config->vertical = 2;
+                else if ( sscanf(optarg, "%lf,%lf", &(r->min), &(r->max)) == 2 && r->min < r->max )
+                    config->vertical = 1;
+                else
+                    config->vertical = -1;
+                break;
+            }
             default:
             {
                 l2g_config_free(config);
@@ -285,6 +494,17 @@ l2g_getopts(int argc, char **argv, Las2GhtConfig *config)
         l2g_config_free(config);
         return 0;
     }
+
+    if ( config->resolution < 1 || config->resolution > GHT_MAX_HASH_LENGTH || config->maxpoints < 0 ||
+         (config->tiles && config->outofcore) || config->frame < 0 || config->vertical < 0 )
+    {
+        l2g_config_free(config);
+        return 0;
+    }
+
+    /* With a memory budget the point count only limits if asked to */
+    if ( ! config->maxpoints )
+        config->maxpoints = config->memory ? INT_MAX : MAXPOINTS;
     return 1;
 }
 
@@ -395,10 +615,10 @@ l2g_attribute_value(const LASPointH laspoint, LasAttribute lasdim)
             val = LASColor_GetRed(LASPoint_GetColor(laspoint));
             break;
         case LL_GREEN:
-            val = LASColor_GetRed(LASPoint_GetColor(laspoint));
+            val = LASColor_GetGreen(LASPoint_GetColor(laspoint));
             break;
         case LL_BLUE:
-            val = LASColor_GetRed(LASPoint_GetColor(laspoint));
+            val = LASColor_GetBlue(LASPoint_GetColor(laspoint));
             break;
     }
     return val;
@@ -422,30 +642,44 @@ static GhtErr
 l2g_coordinate_reproject(const Las2GhtState *state, GhtCoordinate *coord)
 {
 
-    int *pj_errno_ref;
+    int pj_err;
     GhtCoordinate origcoord;
 
+    /* Hashed as they are */
+    if ( state->frame )
+        return GHT_OK;
+
     /* Make a copy of the input point so we can report the original should an error occur */
     origcoord = *coord;
 
+    if ( state->lasproj )
+    {
+        las_proj_inverse(state->lasproj, &(coord->x), &(coord->y), 1, 1);
+        if ( coord->x == HUGE_VAL )
+        {
+            ght_error("%s: could not project point (%g %g): outside the valid area of %s",
+                      __func__, origcoord.x, origcoord.y, las_proj_name(state->lasproj));
+            return GHT_ERROR;
+        }
+        return GHT_OK;
+    }
+
     if (pj_is_latlong(state->pj_input)) l2g_coordinate_to_rad(coord);
 
-    /* Perform the transform */
-    pj_transform(state->pj_input, state->pj_output, 1, 0, &(coord->x), &(coord->y), NULL);
+    /* Perform the transform, the error comes back from the handle's own context */
+    pj_err = pj_transform(state->pj_input, state->pj_output, 1, 0, &(coord->x), &(coord->y), NULL);
 
     /* For NAD grid-shift errors, display an error message with an additional hint */
-    pj_errno_ref = pj_get_errno_ref();
-
-    if (*pj_errno_ref != 0)
+    if (pj_err != 0)
     {
-        if (*pj_errno_ref == -38)
+        if (pj_err == -38)
         {
             ght_warn("No no grid shift files were found, or point out of range.");
         }
         ght_error("%s: could not project point (%g %g): %s (%d)", 
                   __func__, 
                   origcoord.x, origcoord.y,
-                  pj_strerrno(*pj_errno_ref), *pj_errno_ref
+                  pj_strerrno(pj_err), pj_err
                   );
         return GHT_ERROR;
     }
@@ -454,37 +688,245 @@ l2g_coordinate_reproject(const Las2GhtState *state, GhtCoordinate *coord)
     return GHT_OK;
 }
 
+/**
+* Reproject a whole batch with one pj_transform call. Points that fail
+* are run again on their own so each one gets reported with its
+* original coordinates, and are flagged with HUGE_VAL.
+*/
+static int
+l2g_batch_reproject(const Las2GhtState *state, Las2GhtPointBatch *batch)
+{
+    int i, pj_err, num_failed = 0;
+    int n = batch->num_points;
+    GhtCoordinate *coords = batch->coords;
+    const Las2GhtPoint *points = batch->points;
+    double to_input = pj_is_latlong(state->pj_input) ? M_PI/180.0 : 1.0;
+    double to_output = pj_is_latlong(state->pj_output) ? 180.0/M_PI : 1.0;
+
+    if ( ! n )
+        return 0;
+
+    /* Native projections and frames skip proj4, and in a frame there is nothing to do */
+    if ( state->lasproj || state->frame )
+    {
+        for ( i = 0; i < n; i++ )
+        {
+            coords[i].x = points[i].x;
+            coords[i].y = points[i].y;
+        }
+        if ( state->frame )
+            return 0;
+        /* The native projections flag points outside their valid area, report them one by one */
+        las_proj_inverse(state->lasproj, &(coords[0].x), &(coords[0].y), n, 2);
+        for ( i = 0; i < n; i++ )
+        {
+            if ( coords[i].x != HUGE_VAL )
+                continue;
+            coords[i].x = points[i].x;
+            coords[i].y = points[i].y;
+            if ( l2g_coordinate_reproject(state, &coords[i]) != GHT_OK )
+            {
+                coords[i].x = HUGE_VAL;
+                num_failed++;
+            }
+        }
+        return num_failed;
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        coords[i].x = points[i].x * to_input;
+        coords[i].y = points[i].y * to_input;
+    }
+
+    /* Coordinates are interleaved, hence the point offset of 2 */
+    pj_err = pj_transform(state->pj_input, state->pj_output, n, 2, &(coords[0].x), &(coords[0].y), NULL);
+
+    /* Some errors abandon the whole batch, so find the culprits one by one */
+    if ( pj_err != 0 )
+    {
+        for ( i = 0; i < n; i++ )
+        {
+            coords[i].x = points[i].x;
+            coords[i].y = points[i].y;
+            if ( l2g_coordinate_reproject(state, &coords[i]) != GHT_OK )
+            {
+                coords[i].x = HUGE_VAL;
+                num_failed++;
+            }
+        }
+        return num_failed;
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        coords[i].x *= to_output;
+        coords[i].y *= to_output;
+    }
+
+    /* Others only mark the failed points */
+    for ( i = 0; i < n; i++ )
+    {
+        if ( coords[i].x != HUGE_VAL && coords[i].y != HUGE_VAL )
+            continue;
+        coords[i].x = points[i].x;
+        coords[i].y = points[i].y;
+        if ( l2g_coordinate_reproject(state, &coords[i]) != GHT_OK )
+        {
+            coords[i].x = HUGE_VAL;
+            num_failed++;
+        }
+    }
+    return num_failed;
+}
+
+/** Copy what we need out of the libLAS point, returns 0 for points to skip */
+static int
+l2g_read_point(const Las2GhtConfig *config, LASPointH laspoint, Las2GhtPoint *pt)
+{
+    int i;
+
+    /* Skip invalid points, if so configured */
+    if ( config->validpoints && ! LASPoint_IsValid(laspoint) )
+        return 0;
+
+    pt->x = LASPoint_GetX(laspoint);
+    pt->y = LASPoint_GetY(laspoint);
+    pt->z = LASPoint_GetZ(laspoint);
+    for ( i = 0; i < config->num_attrs; i++ )
+        pt->attrs[i] = l2g_attribute_value(laspoint, config->attrs[i]);
+    return 1;
+}
+
+/**
+* Append the points in records [start, start+count) to the batch, which
+* must have room for count more. Returns the number of records read,
+* fewer than count at the end of the file. The record number of each
+* point appended goes in where[], if given.
+*/
+static int
+l2g_read_records(const Las2GhtConfig *config, Las2GhtState *state, uint64_t start, int count,
+                 Las2GhtPointBatch *batch, uint64_t *where)
+{
+    Las2GhtPoint *pts = batch->points + batch->num_points;
+    int i, j, n;
+
+    assert(batch->num_points + count <= BATCH_POINTS);
+
+    if ( state->lasfile )
+    {
+        const size_t stride = sizeof(Las2GhtPoint) / sizeof(double);
+        unsigned char valid[BATCH_POINTS];
+
+        n = las_file_read_xyz(state->lasfile, start, count, &pts->x, &pts->y, &pts->z, stride);
+        for ( i = 0; i < config->num_attrs; i++ )
+            las_file_read_attribute(state->lasfile, start, n, config->attrs[i], &pts->attrs[i], stride);
+
+        if ( ! config->validpoints )
+        {
+            if ( where )
+                for ( i = 0; i < n; i++ )
+                    where[batch->num_points + i] = start + i;
+            batch->num_points += n;
+            return n;
+        }
+
+        las_file_read_valid(state->lasfile, start, n, valid);
+        for ( i = 0, j = 0; i < n; i++ )
+        {
+            if ( ! valid[i] )
+                continue;
+            if ( where )
+                where[batch->num_points + j] = start + i;
+            if ( i != j )
+                pts[j] = pts[i];
+            j++;
+        }
+        batch->num_points += j;
+        return n;
+    }
+
+    /* libLAS reads in order, so jump only when asked for somewhere else */
+    if ( state->position != start )
+    {
+        if ( LASReader_Seek(state->reader, start) != LE_None )
+            return 0;
+        state->position = start;
+    }
+    for ( n = 0; n < count; n++ )
+    {
+        LASPointH laspoint = LASReader_GetNextPoint(state->reader);
+        if ( ! laspoint )
+            break;
+        state->position++;
+        if ( ! l2g_read_point(config, laspoint, &batch->points[batch->num_points]) )
+            continue;
+        if ( where )
+            where[batch->num_points] = start + n;
+        batch->num_points++;
+    }
+    return n;
+}
+
+/** Hash a reprojected coordinate, or a raw one within the frame, skipping points outside it */
+static GhtErr
+l2g_node_from_coordinate(const Las2GhtConfig *config, const Las2GhtState *state, const GhtCoordinate *coord, double z, GhtNodePtr *node)
+{
+    static const GhtArea global = { { 0, 0 }, { 0, 0 } };
+    const GhtArea *f = state->frame;
+    const GhtRange *v = state->vertical;
+
+    if ( f && ! (coord->x >= f->x.min && coord->x <= f->x.max && coord->y >= f->y.min && coord->y <= f->y.max) )
+    {
+        ght_warn("point (%g %g) is outside the frame, skipping it", coord->x, coord->y);
+        return GHT_ERROR;
+    }
+    if ( v && ! (z >= v->min && z <= v->max) )
+    {
+        ght_warn("point (%g %g %g) is outside the vertical range, skipping it", coord->x, coord->y, z);
+        return GHT_ERROR;
+    }
+
+    if ( v )
+        return ght_node_new_from_coordinate_3d(coord, z, f ? f : &global, v, config->resolution, node);
+    if ( f )
+        return ght_node_new_from_coordinate_frame(coord, f, config->resolution, node);
+    return ght_node_new_from_coordinate(coord, config->resolution, node);
+}
+
+/** New tree that hashes the way the nodes going into it were hashed */
+static GhtErr
+l2g_tree_new(const Las2GhtState *state, GhtTreePtr *tree)
+{
+    GHT_TRY(ght_tree_new(state->schema, tree));
+    if ( state->frame )
+        GHT_TRY(ght_tree_set_frame(*tree, state->frame));
+    if ( state->vertical )
+        GHT_TRY(ght_tree_set_vertical(*tree, state->vertical));
+    return GHT_OK;
+}
+
 static GhtErr
-l2g_build_node(const Las2GhtConfig *config, const Las2GhtState *state, LASPointH laspoint, GhtNodePtr *node)
+l2g_build_node(const Las2GhtConfig *config, const Las2GhtState *state, const Las2GhtPoint *pt, const GhtCoordinate *coord, GhtNodePtr *node)
 {
     int i;
-    double z;
     GhtDimensionPtr ghtdim;
     GhtAttributePtr attribute;
-    GhtCoordinate coord;
-    GhtErr err;
     
     assert(config);
     assert(state->schema);
-    
-    /* Skip invalid points, if so configured */
-    if ( config->validpoints && ! LASPoint_IsValid(laspoint) )
-        return GHT_ERROR;
 
-    coord.x = LASPoint_GetX(laspoint);
-    coord.y = LASPoint_GetY(laspoint);
-    
-    if ( l2g_coordinate_reproject(state, &coord) != GHT_OK )
+    /* Point failed reprojection, already reported */
+    if ( coord->x == HUGE_VAL )
         return GHT_ERROR;
     
-    if ( ght_node_new_from_coordinate(&coord, config->resolution, node) != GHT_OK )
+    if ( l2g_node_from_coordinate(config, state, coord, pt->z, node) != GHT_OK )
         return GHT_ERROR;
 
     /* We know that 'Z' is always dimension 2 */
-    z = LASPoint_GetZ(laspoint);
     GHT_TRY(ght_schema_get_dimension_by_index(state->schema, 2, &ghtdim));
     
-    if ( ght_attribute_new_from_double(ghtdim, z, &attribute) != GHT_OK )
+    if ( ght_attribute_new_from_double(ghtdim, pt->z, &attribute) != GHT_OK )
         return GHT_ERROR;
 
     if ( ght_node_add_attribute(*node, attribute) != GHT_OK )
@@ -492,13 +934,10 @@ l2g_build_node(const Las2GhtConfig *config, const Las2GhtState *state, LASPointH
     
     for ( i = 0; i < config->num_attrs; i++ )
     {
-        LasAttribute lasattr = config->attrs[i];
-        double val = l2g_attribute_value(laspoint, lasattr);
-
         /* Magic number 3: X,Y,Z are first three dimensions */
         GHT_TRY(ght_schema_get_dimension_by_index(state->schema, 3+i, &ghtdim));
         
-        if ( ght_attribute_new_from_double(ghtdim, val, &attribute) != GHT_OK )
+        if ( ght_attribute_new_from_double(ghtdim, pt->attrs[i], &attribute) != GHT_OK )
             return GHT_ERROR;
 
         if ( ght_node_add_attribute(*node, attribute) != GHT_OK )
@@ -509,91 +948,530 @@ l2g_build_node(const Las2GhtConfig *config, const Las2GhtState *state, LASPointH
 }
 
 static int
-l2g_build_tree(const Las2GhtConfig *config, Las2GhtState *state, GhtTreePtr *tree)
+l2g_build_tree_serial(const Las2GhtConfig *config, Las2GhtState *state, GhtTreePtr tree)
 {
-    int num_points = 0;
-    int i;
-    LASPointH laspoint;
+    int num_read = 0, num_points = 0;
+    int i, n, want, more = 1;
+    Las2GhtPointBatch *batch;
     GhtNodePtr node;
-    GhtErr err;
 
-    ght_info("starting a new tree");
-    ght_tree_new(state->schema, tree);
-
-    while( (laspoint = LASReader_GetNextPoint(state->reader)) && num_points <= config->maxpoints )
+    batch = malloc(sizeof(Las2GhtPointBatch));
+    while ( more )
     {
-        err = l2g_build_node(config, state, laspoint, &node);
-        // LASPoint_Destroy(laspoint); /* Don't need this, it's not allocated on the heap? */
-        err = ght_tree_insert_node(*tree, node);
-        num_points++;
-        if ( ! (num_points % LOG_NUM_POINTS) )
-            ght_info("inserted point %d into the tree...", num_points);
+        /* Skipped records count against maxpoints, that's what keeps it a bound */
+        want = config->maxpoints - num_read < BATCH_POINTS ? config->maxpoints - num_read : BATCH_POINTS;
+        batch->num_points = 0;
+        n = l2g_read_records(config, state, state->next_record, want, batch, NULL);
+        state->next_record += n;
+        num_read += n;
+        if ( n < want || num_read >= config->maxpoints )
+            more = 0;
+
+        l2g_batch_reproject(state, batch);
+        for ( i = 0; i < batch->num_points; i++ )
+        {
+            if ( l2g_build_node(config, state, &batch->points[i], &batch->coords[i], &node) != GHT_OK )
+                continue;
+            if ( ght_tree_insert_node(tree, node) != GHT_OK )
+                continue;
+            num_points++;
+            if ( ! (num_points % LOG_NUM_POINTS) )
+                ght_info("inserted point %d into the tree...", num_points);
+        }
+        if ( l2g_over_budget(config) )
+        {
+            ght_info("tree is using %zu bytes, writing it out", l2g_memory_used());
+            more = 0;
+        }
     }
+    free(batch);
 
     return num_points;
 }
 
-static void
-l2g_ght_file(const Las2GhtConfig *config, Las2GhtState *state, GhtHash *hash, char *str)
+#ifdef L2G_THREADS
+
+/*
+ * Pipelined build. This thread reads points out of libLAS into batches,
+ * worker threads reproject, hash and make nodes, and builder threads
+ * insert them. Every builder owns a set of subtrees, one for each hash
+ * character that follows the prefix of the whole LAS extent, so the
+ * builders never touch the same nodes and the subtrees join up at the
+ * end. The queues between the stages are bounded, so a slow stage
+ * holds the earlier ones back instead of letting batches pile up.
+ */
+
+typedef struct
 {
-    char *ptr;
-    char basename[STRSIZE];
-    strncpy(basename, config->ghtfile, STRSIZE);
-    /* Null out ".ght" extension if it already exists, */
-    /* because the filename template already includes it. */
-    ptr = strcasestr(basename, ".ght");
-    if ( ptr )
-        *ptr = 0;
+    int num_nodes;
+    GhtNodePtr nodes[BATCH_POINTS];
+} Las2GhtNodeBatch;
 
-    snprintf(str, STRSIZE, ght_file_template, basename, state->fileno, hash);
-    return;
+/* Bounded blocking queue of batches */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void **items;
+    int head;
+    int count;
+    int capacity;
+    int producers;  /* popping returns NULL once these are done and it is empty */
+} Las2GhtQueue;
+
+typedef struct
+{
+    pthread_t thread;
+    Las2GhtQueue queue;   /* node batches for this builder */
+    GhtTreePtr trees[32]; /* one per hash character after the prefix */
+    GhtNodeListPtr strays; /* nodes outside the prefix, inserted after the join */
+    const Las2GhtState *state;
+} Las2GhtBuilder;
+
+typedef struct
+{
+    const Las2GhtConfig *config;
+    const Las2GhtState *state;
+    Las2GhtQueue points;
+    Las2GhtBuilder *builders;
+    int num_builders;
+    int num_workers;
+    pthread_mutex_t claim;  /* workers reading the mapped file claim records under this */
+    uint64_t next_record;
+    int num_claimed;
+} Las2GhtPipeline;
+
+static void
+l2g_queue_init(Las2GhtQueue *q, int capacity, int producers)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->items = malloc(capacity * sizeof(void*));
+    q->head = q->count = 0;
+    q->capacity = capacity;
+    q->producers = producers;
 }
 
 static void
-l2g_xml_file(const Las2GhtConfig *config, Las2GhtState *state, GhtHash *hash, char *str)
+l2g_queue_destroy(Las2GhtQueue *q)
 {
-    char *ptr;
-    char basename[STRSIZE];
-    strncpy(basename, config->ghtfile, STRSIZE);
-    /* Null out ".ght" extension from basename if it already exists, */
-    /* because the filename template already includes it. */
-    ptr = strcasestr(basename, ".ght");
-    if ( ptr )
-        *ptr = 0;
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+}
 
-    snprintf(str, STRSIZE, xml_file_template, basename, state->fileno, hash);
-    return;
+static void
+l2g_queue_push(Las2GhtQueue *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while ( q->count == q->capacity )
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
 }
 
-static GhtErr
-l2g_save_tree(const Las2GhtConfig *config, Las2GhtState *state, const GhtTreePtr tree)
+static void *
+l2g_queue_pop(Las2GhtQueue *q)
 {
-    char ght_filename[STRSIZE];
-    char xml_filename[STRSIZE];
-    GhtWriterPtr writer;
-    GhtSchemaPtr schema;
-    GhtHash *hash = NULL;
+    void *item = NULL;
+    pthread_mutex_lock(&q->lock);
+    while ( q->count == 0 && q->producers > 0 )
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    if ( q->count )
+    {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
 
-    assert(config);
-    assert(state);
-    assert(tree);
+/** One producer has finished, wake the consumers once all have */
+static void
+l2g_queue_done(Las2GhtQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->producers--;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
 
-    ght_tree_get_hash(tree, &hash);
+/** Subtree for the node, by the hash character after the extent prefix, -1 if it does not fit one */
+static int
+l2g_node_bucket(const Las2GhtState *state, GhtNodePtr node)
+{
+    GhtHash *hash;
+    const char *c;
+    size_t len = strlen(state->prefix);
+
+    if ( ght_node_get_hash(node, &hash) != GHT_OK || ! hash )
+        return -1;
+    if ( strncmp(hash, state->prefix, len) || ! hash[len] )
+        return -1;
+    c = strchr(l2g_base32, hash[len]);
+    return c ? c - l2g_base32 : -1;
+}
 
-    l2g_ght_file(config, state, hash, ght_filename);
-    l2g_xml_file(config, state, hash, xml_filename);
+/** Next batch for a worker, read straight from the mapped file or handed over by the reader */
+static Las2GhtPointBatch *
+l2g_worker_batch(Las2GhtPipeline *p, Las2GhtState *state)
+{
+    Las2GhtPointBatch *batch;
+    uint64_t start, num_records;
+    int want;
+
+    if ( ! state->lasfile )
+        return l2g_queue_pop(&p->points);
+
+    num_records = las_file_num_points(state->lasfile);
+    pthread_mutex_lock(&p->claim);
+    want = p->config->maxpoints - p->num_claimed < BATCH_POINTS ? p->config->maxpoints - p->num_claimed : BATCH_POINTS;
+    if ( (uint64_t)want > num_records - p->next_record )
+        want = num_records - p->next_record;
+    if ( want <= 0 || l2g_over_budget(p->config) )
+    {
+        pthread_mutex_unlock(&p->claim);
+        return NULL;
+    }
+    start = p->next_record;
+    p->next_record += want;
+    p->num_claimed += want;
+    pthread_mutex_unlock(&p->claim);
+
+    batch = malloc(sizeof(Las2GhtPointBatch));
+    batch->num_points = 0;
+    l2g_read_records(p->config, state, start, want, batch, NULL);
+    return batch;
+}
 
-    ght_info("writing tree to file %s", ght_filename);
+static void *
+l2g_worker_thread(void *arg)
+{
+    Las2GhtPipeline *p = arg;
+    Las2GhtState state = *(p->state);
+    Las2GhtNodeBatch **out;
+    Las2GhtPointBatch *batch;
+    projCtx ctx;
+    int i, b;
+
+    /* proj4 handles and their error state are not safe to share between threads */
+    ctx = pj_ctx_alloc();
+    state.pj_input = pj_init_plus_ctx(ctx, p->state->proj4_input);
+    state.pj_output = pj_init_plus_ctx(ctx, proj4_output);
+
+    out = calloc(p->num_builders, sizeof(Las2GhtNodeBatch*));
+    while ( (batch = l2g_worker_batch(p, &state)) )
+    {
+        l2g_batch_reproject(&state, batch);
+        for ( i = 0; i < batch->num_points; i++ )
+        {
+            GhtNodePtr node;
+            if ( l2g_build_node(p->config, &state, &batch->points[i], &batch->coords[i], &node) != GHT_OK )
+                continue;
+
+            /* Subtrees are dealt out to the builders, strays go to the first */
+            b = l2g_node_bucket(&state, node);
+            b = b < 0 ? 0 : b % p->num_builders;
+            if ( ! out[b] )
+            {
+                out[b] = malloc(sizeof(Las2GhtNodeBatch));
+                out[b]->num_nodes = 0;
+            }
+            out[b]->nodes[out[b]->num_nodes++] = node;
+            if ( out[b]->num_nodes == BATCH_POINTS )
+            {
+                l2g_queue_push(&p->builders[b].queue, out[b]);
+                out[b] = NULL;
+            }
+        }
+        free(batch);
+    }
 
-    if ( ! l2g_writable(ght_filename) )
+    for ( b = 0; b < p->num_builders; b++ )
     {
-        ght_error("unable to write to '%s'", ght_filename);
-        return GHT_ERROR;
+        if ( out[b] )
+            l2g_queue_push(&p->builders[b].queue, out[b]);
+        l2g_queue_done(&p->builders[b].queue);
     }
-    if ( ! l2g_writable(xml_filename) )
+    free(out);
+    pj_free(state.pj_input);
+    pj_free(state.pj_output);
+    pj_ctx_free(ctx);
+    return NULL;
+}
+
+static void *
+l2g_builder_thread(void *arg)
+{
+    Las2GhtBuilder *builder = arg;
+    Las2GhtNodeBatch *batch;
+    int i;
+
+    while ( (batch = l2g_queue_pop(&builder->queue)) )
     {
-        ght_error("unable to write to '%s'", xml_filename);
-        return GHT_ERROR;
+        for ( i = 0; i < batch->num_nodes; i++ )
+        {
+            GhtNodePtr node = batch->nodes[i];
+            int bucket = l2g_node_bucket(builder->state, node);
+            if ( bucket < 0 )
+            {
+                ght_nodelist_add_node(builder->strays, node);
+                continue;
+            }
+            if ( ! builder->trees[bucket] )
+                l2g_tree_new(builder->state, &(builder->trees[bucket]));
+            ght_tree_insert_node(builder->trees[bucket], node);
+        }
+        free(batch);
+    }
+    return NULL;
+}
+
+static int
+l2g_build_tree_threaded(const Las2GhtConfig *config, Las2GhtState *state, GhtTreePtr *tree)
+{
+    Las2GhtPipeline p;
+    Las2GhtState shared = *state;  /* what the threads see, this thread moves on */
+    pthread_t *workers;
+    GhtTreePtr parts[32];
+    Las2GhtPointBatch *batch;
+    int num_read = 0, num_points = 0;
+    int i, j, n, want, num_strays, num_joined;
+
+    p.config = config;
+    p.state = &shared;
+    pthread_mutex_init(&p.claim, NULL);
+    p.next_record = state->next_record;
+    p.num_claimed = 0;
+    p.num_workers = config->threads;
+    p.num_builders = (config->threads + 3) / 4;
+    l2g_queue_init(&p.points, 2 * p.num_workers, 1);
+    p.builders = calloc(p.num_builders, sizeof(Las2GhtBuilder));
+    workers = calloc(p.num_workers, sizeof(pthread_t));
+
+    for ( i = 0; i < p.num_builders; i++ )
+    {
+        l2g_queue_init(&p.builders[i].queue, 4, p.num_workers);
+        ght_nodelist_new(16, &(p.builders[i].strays));
+        p.builders[i].state = &shared;
+        pthread_create(&(p.builders[i].thread), NULL, l2g_builder_thread, &p.builders[i]);
+    }
+    for ( i = 0; i < p.num_workers; i++ )
+        pthread_create(&workers[i], NULL, l2g_worker_thread, &p);
+
+    /* libLAS hands back one point at a time, so reading it stays on this thread */
+    while ( ! state->lasfile && num_read < config->maxpoints )
+    {
+        want = config->maxpoints - num_read < BATCH_POINTS ? config->maxpoints - num_read : BATCH_POINTS;
+        batch = malloc(sizeof(Las2GhtPointBatch));
+        batch->num_points = 0;
+        n = l2g_read_records(config, state, state->next_record, want, batch, NULL);
+        state->next_record += n;
+        num_read += n;
+        if ( batch->num_points )
+            l2g_queue_push(&p.points, batch);
+        else
+            free(batch);
+        if ( n < want )
+            break;
+        /* Lags the builders by the batches in flight, which the queues bound */
+        if ( l2g_over_budget(config) )
+            break;
+    }
+    l2g_queue_done(&p.points);
+
+    for ( i = 0; i < p.num_workers; i++ )
+        pthread_join(workers[i], NULL);
+    for ( i = 0; i < p.num_builders; i++ )
+        pthread_join(p.builders[i].thread, NULL);
+
+    if ( state->lasfile )
+        state->next_record = p.next_record;
+    if ( l2g_over_budget(config) )
+        ght_info("trees are using %zu bytes, writing them out", l2g_memory_used());
+
+    /* Subtrees have no hashes in common, hang them under the shared prefix */
+    for ( i = 0; i < 32; i++ )
+        parts[i] = p.builders[i % p.num_builders].trees[i];
+    if ( ght_tree_join(state->schema, parts, 32, tree) != GHT_OK )
+        ght_error("%s: unable to join the subtrees", __func__);
+    /* Nothing to join takes its hashing from no part, so start over */
+    ght_tree_get_numpoints(*tree, &num_joined);
+    if ( ! num_joined )
+    {
+        ght_tree_free(*tree);
+        l2g_tree_new(state, tree);
+    }
+
+    /* Anything outside the extent prefix goes in one at a time */
+    for ( i = 0; i < p.num_builders; i++ )
+    {
+        ght_nodelist_get_num_nodes(p.builders[i].strays, &num_strays);
+        for ( j = 0; j < num_strays; j++ )
+        {
+            GhtNodePtr node;
+            ght_nodelist_get_node(p.builders[i].strays, j, &node);
+            ght_tree_insert_node(*tree, node);
+        }
+        ght_nodelist_free_shallow(p.builders[i].strays);
+        l2g_queue_destroy(&p.builders[i].queue);
+    }
+
+    l2g_queue_destroy(&p.points);
+    pthread_mutex_destroy(&p.claim);
+    free(p.builders);
+    free(workers);
+
+    /* Points read can still be dropped on the way in, count what landed */
+    ght_tree_get_numpoints(*tree, &num_points);
+    return num_points;
+}
+
+#endif /* L2G_THREADS */
+
+/** Are there records past the ones already read? */
+static int
+l2g_records_left(const Las2GhtState *state)
+{
+    uint64_t num_records;
+    if ( state->lasfile )
+        num_records = las_file_num_points(state->lasfile);
+    else
+        num_records = LASHeader_GetPointRecordsCount(state->header);
+    return state->next_record < num_records;
+}
+
+static int
+l2g_build_tree(const Las2GhtConfig *config, Las2GhtState *state, GhtTreePtr *tree)
+{
+    ght_info("starting a new tree");
+
+#ifdef L2G_THREADS
+    if ( config->threads > 1 )
+        return l2g_build_tree_threaded(config, state, tree);
+#endif
+
+    l2g_tree_new(state, tree);
+    return l2g_build_tree_serial(config, state, *tree);
+}
+
+/** Hash prefix shared by the corners of the LAS extent, and so by every point in it */
+static GhtErr
+l2g_read_prefix(const Las2GhtConfig *config, Las2GhtState *state)
+{
+    GhtNodeListPtr corners;
+    GhtCoordinate coord;
+    GhtHash *hash;
+    GhtNodePtr node;
+    size_t len = 0;
+    double z;
+    int i;
+
+    state->prefix[0] = '\0';
+    GHT_TRY(ght_nodelist_new(8, &corners));
+    /* With Z in the hashes the extent is a box */
+    for ( i = 0; i < (state->vertical ? 8 : 4); i++ )
+    {
+        coord.x = (i & 1) ? LASHeader_GetMaxX(state->header) : LASHeader_GetMinX(state->header);
+        coord.y = (i & 2) ? LASHeader_GetMaxY(state->header) : LASHeader_GetMinY(state->header);
+        z = (i & 4) ? LASHeader_GetMaxZ(state->header) : LASHeader_GetMinZ(state->header);
+        if ( l2g_coordinate_reproject(state, &coord) != GHT_OK ||
+             l2g_node_from_coordinate(config, state, &coord, z, &node) != GHT_OK )
+        {
+            ght_nodelist_free_deep(corners);
+            return GHT_ERROR;
+        }
+        ght_nodelist_add_node(corners, node);
+        ght_node_get_hash(node, &hash);
+        if ( i == 0 )
+        {
+            strncpy(state->prefix, hash, GHT_MAX_HASH_LENGTH);
+            state->prefix[GHT_MAX_HASH_LENGTH] = '\0';
+            len = strlen(state->prefix);
+        }
+        while ( len && strncmp(state->prefix, hash, len) )
+            len--;
+        state->prefix[len] = '\0';
+    }
+    ght_nodelist_free_deep(corners);
+    return GHT_OK;
+}
+
+static void
+l2g_ght_file(const Las2GhtConfig *config, Las2GhtState *state, GhtHash *hash, char *str)
+{
+    char *ptr;
+    char basename[STRSIZE];
+    strncpy(basename, config->ghtfile, STRSIZE);
+    /* Null out ".ght" extension if it already exists, */
+    /* because the filename template already includes it. */
+    ptr = strcasestr(basename, ".ght");
+    if ( ptr )
+        *ptr = 0;
+
+    if ( config->tiles )
+        snprintf(str, STRSIZE, ght_tile_template, basename, hash);
+    else
+        snprintf(str, STRSIZE, ght_file_template, basename, state->fileno, hash);
+    return;
+}
+
+static void
+l2g_xml_file(const Las2GhtConfig *config, Las2GhtState *state, GhtHash *hash, char *str)
+{
+    char *ptr;
+    char basename[STRSIZE];
+    strncpy(basename, config->ghtfile, STRSIZE);
+    /* Null out ".ght" extension from basename if it already exists, */
+    /* because the filename template already includes it. */
+    ptr = strcasestr(basename, ".ght");
+    if ( ptr )
+        *ptr = 0;
+
+    if ( config->tiles )
+        snprintf(str, STRSIZE, xml_tile_template, basename, hash);
+    else
+        snprintf(str, STRSIZE, xml_file_template, basename, state->fileno, hash);
+    return;
+}
+
+static GhtErr
+l2g_save_tree(const Las2GhtConfig *config, Las2GhtState *state, const GhtTreePtr tree, GhtHash *hash)
+{
+    char ght_filename[STRSIZE];
+    char xml_filename[STRSIZE];
+    GhtWriterPtr writer;
+    GhtSchemaPtr schema;
+
+    assert(config);
+    assert(state);
+    assert(tree);
+
+    /* Name the file after the tree unless told otherwise */
+    if ( ! hash )
+        ght_tree_get_hash(tree, &hash);
+
+    l2g_ght_file(config, state, hash, ght_filename);
+    l2g_xml_file(config, state, hash, xml_filename);
+
+    ght_info("writing tree to file %s", ght_filename);
+
+    if ( ! l2g_writable(ght_filename) )
+    {
+        ght_error("unable to write to '%s'", ght_filename);
+        return GHT_ERROR;
+    }
+    if ( ! l2g_writable(xml_filename) )
+    {
+        ght_error("unable to write to '%s'", xml_filename);
+        return GHT_ERROR;
     }
 
     GHT_TRY(ght_tree_get_schema(tree, &schema));
@@ -608,6 +1486,793 @@ l2g_save_tree(const Las2GhtConfig *config, Las2GhtState *state, const GhtTreePtr
     return GHT_OK;
 }
 
+/*
+* Tiled output. A first pass hashes every point and keeps the top
+* TILE_DEPTH characters of each hash, packed five bits to a character
+* so the codes sort the way the hashes do. Cells holding more than
+* maxpoints are split, each cell that is left becomes one file named
+* after its hash, and later passes build as many whole cells as fit
+* in maxpoints at a time. Under a memory budget, a sample tree built
+* during the first pass turns the budget into a point count as well.
+*/
+#define TILE_DEPTH 12
+#define TILE_SAMPLE 65536  /* points in the sample tree */
+#define TILE_NONE UINT64_MAX  /* skipped points */
+
+typedef struct
+{
+    uint64_t code;   /* packed cell hash, left aligned */
+    int depth;       /* characters in the cell hash */
+    int num_points;
+} Las2GhtTile;
+
+typedef struct
+{
+    uint64_t *codes;    /* packed point hashes, in file order */
+    size_t num_codes;
+    size_t max_codes;
+    Las2GhtTile *tiles; /* in hash order */
+    int num_tiles;
+    int max_tiles;
+    int depth;          /* characters packed into the codes */
+    int tile_points;    /* most points to build at once */
+    double bytes_per_point;  /* tree memory, measured under a budget */
+} Las2GhtTiling;
+
+static void
+l2g_tiling_free(Las2GhtTiling *tiling)
+{
+    free(tiling->codes);
+    free(tiling->tiles);
+}
+
+static int
+l2g_tile_digit_shift(int depth)
+{
+    return 5 * (TILE_DEPTH - depth - 1);
+}
+
+static uint64_t
+l2g_tile_code(const GhtHash *hash, int depth)
+{
+    uint64_t code = 0;
+    const char *c;
+    int i;
+
+    for ( i = 0; i < depth && hash[i]; i++ )
+    {
+        c = strchr(l2g_base32, hash[i]);
+        if ( ! c )
+            return TILE_NONE;
+        code |= (uint64_t)(c - l2g_base32) << l2g_tile_digit_shift(i);
+    }
+    return code;
+}
+
+static void
+l2g_tile_hash(const Las2GhtTile *tile, GhtHash *hash)
+{
+    int i;
+    for ( i = 0; i < tile->depth; i++ )
+        hash[i] = l2g_base32[(tile->code >> l2g_tile_digit_shift(i)) & 0x1F];
+    hash[tile->depth] = '\0';
+}
+
+static void
+l2g_tiling_add_code(Las2GhtTiling *tiling, uint64_t code)
+{
+    if ( tiling->num_codes == tiling->max_codes )
+    {
+        tiling->max_codes = tiling->max_codes ? 2 * tiling->max_codes : BATCH_POINTS;
+        tiling->codes = realloc(tiling->codes, tiling->max_codes * sizeof(uint64_t));
+    }
+    tiling->codes[tiling->num_codes++] = code;
+}
+
+/** Hash every point in the file and keep its packed code */
+static GhtErr
+l2g_tiling_read(const Las2GhtConfig *config, Las2GhtState *state, Las2GhtTiling *tiling)
+{
+    Las2GhtPointBatch *batch;
+    uint64_t where[BATCH_POINTS];
+    GhtNodePtr node;
+    GhtHash *hash;
+    GhtTreePtr sample = NULL;
+    int num_sample = 0;
+    size_t base = l2g_memory_used();
+    int i, n, more = 1;
+
+    memset(tiling, 0, sizeof(Las2GhtTiling));
+    tiling->depth = config->resolution < TILE_DEPTH ? config->resolution : TILE_DEPTH;
+    tiling->tile_points = config->maxpoints;
+    if ( config->memory )
+        l2g_tree_new(state, &sample);
+
+    batch = malloc(sizeof(Las2GhtPointBatch));
+    while ( more )
+    {
+        batch->num_points = 0;
+        n = l2g_read_records(config, state, tiling->num_codes, BATCH_POINTS, batch, where);
+        if ( n < BATCH_POINTS )
+            more = 0;
+        /* Skipped points keep their place, so later passes can line up */
+        for ( i = 0; i < n; i++ )
+            l2g_tiling_add_code(tiling, TILE_NONE);
+
+        l2g_batch_reproject(state, batch);
+        for ( i = 0; i < batch->num_points; i++ )
+        {
+            if ( sample && num_sample < TILE_SAMPLE )
+            {
+                if ( l2g_build_node(config, state, &batch->points[i], &batch->coords[i], &node) != GHT_OK )
+                    continue;
+                ght_node_get_hash(node, &hash);
+                tiling->codes[where[i]] = l2g_tile_code(hash, tiling->depth);
+                ght_tree_insert_node(sample, node);
+                num_sample++;
+                continue;
+            }
+            if ( batch->coords[i].x == HUGE_VAL )
+                continue;
+            if ( l2g_node_from_coordinate(config, state, &batch->coords[i], batch->points[i].z, &node) != GHT_OK )
+                continue;
+            ght_node_get_hash(node, &hash);
+            tiling->codes[where[i]] = l2g_tile_code(hash, tiling->depth);
+            ght_node_free(node);
+        }
+        if ( sample && (num_sample == TILE_SAMPLE || ! more) )
+        {
+            ght_tree_compact_attributes(sample);
+            if ( num_sample )
+                tiling->bytes_per_point = (double)(l2g_memory_used() - base) / num_sample;
+            ght_tree_free(sample);
+            sample = NULL;
+            if ( tiling->bytes_per_point > 0 && config->memory / tiling->bytes_per_point < tiling->tile_points )
+                tiling->tile_points = config->memory / tiling->bytes_per_point;
+            ght_info("sample tree takes %.0f bytes a point, building %d points at a time",
+                     tiling->bytes_per_point, tiling->tile_points);
+        }
+        if ( n && (tiling->num_codes - n) / (LOG_NUM_POINTS * 10) != tiling->num_codes / (LOG_NUM_POINTS * 10) )
+            ght_info("hashed point %zu...", tiling->num_codes);
+    }
+    free(batch);
+    return GHT_OK;
+}
+
+static int
+l2g_code_cmp(const void *a, const void *b)
+{
+    uint64_t ca = *((const uint64_t*)a);
+    uint64_t cb = *((const uint64_t*)b);
+    return ca < cb ? -1 : ca > cb;
+}
+
+static void
+l2g_tiling_add_tile(Las2GhtTiling *tiling, uint64_t code, int depth, int num_points)
+{
+    if ( tiling->num_tiles == tiling->max_tiles )
+    {
+        tiling->max_tiles = tiling->max_tiles ? 2 * tiling->max_tiles : 64;
+        tiling->tiles = realloc(tiling->tiles, tiling->max_tiles * sizeof(Las2GhtTile));
+    }
+    tiling->tiles[tiling->num_tiles].code = code;
+    tiling->tiles[tiling->num_tiles].depth = depth;
+    tiling->tiles[tiling->num_tiles].num_points = num_points;
+    tiling->num_tiles++;
+}
+
+/** Split the cell covering sorted[lo,hi) until its parts fit in maxpoints */
+static void
+l2g_tiling_split(const Las2GhtConfig *config, Las2GhtTiling *tiling, const uint64_t *sorted,
+                 size_t lo, size_t hi, uint64_t code, int depth)
+{
+    size_t mid;
+    uint64_t child, end;
+    int d, shift;
+
+    if ( hi - lo <= (size_t)tiling->tile_points || depth == tiling->depth )
+    {
+        if ( hi - lo > (size_t)tiling->tile_points )
+            ght_warn("cell at depth %d holds %zu points, more than %d", depth, hi - lo, tiling->tile_points);
+        l2g_tiling_add_tile(tiling, code, depth, hi - lo);
+        return;
+    }
+
+    shift = l2g_tile_digit_shift(depth);
+    for ( d = 0; d < 32 && lo < hi; d++ )
+    {
+        child = code | ((uint64_t)d << shift);
+        end = child + ((uint64_t)1 << shift);
+        for ( mid = lo; mid < hi && sorted[mid] < end; mid++ );
+        if ( mid > lo )
+            l2g_tiling_split(config, tiling, sorted, lo, mid, child, depth + 1);
+        lo = mid;
+    }
+}
+
+/** Pick the cells, starting from the one that holds every point */
+static GhtErr
+l2g_tiling_plan(const Las2GhtConfig *config, Las2GhtTiling *tiling)
+{
+    uint64_t *sorted, code;
+    size_t num_valid;
+    int depth;
+
+    sorted = malloc(tiling->num_codes * sizeof(uint64_t));
+    memcpy(sorted, tiling->codes, tiling->num_codes * sizeof(uint64_t));
+    qsort(sorted, tiling->num_codes, sizeof(uint64_t), l2g_code_cmp);
+
+    /* Skipped points sort to the end */
+    for ( num_valid = tiling->num_codes; num_valid && sorted[num_valid-1] == TILE_NONE; num_valid-- );
+    if ( ! num_valid )
+    {
+        free(sorted);
+        return GHT_ERROR;
+    }
+
+    for ( depth = 0; depth < tiling->depth; depth++ )
+    {
+        int shift = l2g_tile_digit_shift(depth);
+        if ( ((sorted[0] >> shift) & 0x1F) != ((sorted[num_valid-1] >> shift) & 0x1F) )
+            break;
+    }
+    code = depth ? sorted[0] & ~(((uint64_t)1 << (l2g_tile_digit_shift(depth-1))) - 1) : 0;
+
+    l2g_tiling_split(config, tiling, sorted, 0, num_valid, code, depth);
+    free(sorted);
+    ght_info("%zu points go into %d tiles", num_valid, tiling->num_tiles);
+    return GHT_OK;
+}
+
+/** Tile holding the code, the last one starting at or before it */
+static int
+l2g_tiling_find(const Las2GhtTiling *tiling, uint64_t code)
+{
+    int lo = 0, hi = tiling->num_tiles - 1;
+    while ( lo < hi )
+    {
+        int mid = (lo + hi + 1) / 2;
+        if ( tiling->tiles[mid].code <= code )
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/** Tile of a record, -1 for skipped ones */
+static int
+l2g_tiling_tile_of(const Las2GhtTiling *tiling, uint64_t record)
+{
+    if ( tiling->codes[record] == TILE_NONE )
+        return -1;
+    return l2g_tiling_find(tiling, tiling->codes[record]);
+}
+
+static void
+l2g_tiling_insert(const Las2GhtConfig *config, const Las2GhtState *state, Las2GhtPointBatch *batch,
+                  const int *tile, GhtTreePtr *trees)
+{
+    GhtNodePtr node;
+    int i;
+
+    l2g_batch_reproject(state, batch);
+    for ( i = 0; i < batch->num_points; i++ )
+    {
+        if ( l2g_build_node(config, state, &batch->points[i], &batch->coords[i], &node) != GHT_OK )
+            continue;
+        if ( ! trees[tile[i]] )
+            l2g_tree_new(state, &trees[tile[i]]);
+        ght_tree_insert_node(trees[tile[i]], node);
+    }
+    batch->num_points = 0;
+}
+
+/** Build and save a run of tiles at a time, rereading the file for each run */
+static GhtErr
+l2g_tiling_build(const Las2GhtConfig *config, Las2GhtState *state, Las2GhtTiling *tiling)
+{
+    GhtHash hash[TILE_DEPTH + 1];
+    Las2GhtPointBatch *batch;
+    GhtTreePtr *trees;
+    int tile[BATCH_POINTS];
+    uint64_t where[BATCH_POINTS];
+    int first, last, t, total, i, j, n;
+    size_t pos, end, base;
+    GhtErr err = GHT_OK;
+
+    batch = malloc(sizeof(Las2GhtPointBatch));
+    trees = calloc(tiling->num_tiles, sizeof(GhtTreePtr));
+    base = l2g_memory_used();
+
+    for ( first = 0; first < tiling->num_tiles && err == GHT_OK; first = last )
+    {
+        total = tiling->tiles[first].num_points;
+        for ( last = first + 1; last < tiling->num_tiles; last++ )
+        {
+            if ( total + tiling->tiles[last].num_points > tiling->tile_points )
+                break;
+            total += tiling->tiles[last].num_points;
+        }
+        ght_info("building tiles %d to %d of %d", first + 1, last, tiling->num_tiles);
+
+        batch->num_points = 0;
+        pos = 0;
+        while ( pos < tiling->num_codes )
+        {
+            /* Records outside the run are not even read */
+            t = l2g_tiling_tile_of(tiling, pos);
+            if ( t < first || t >= last )
+            {
+                pos++;
+                continue;
+            }
+
+            end = pos + (BATCH_POINTS - batch->num_points);
+            if ( end > tiling->num_codes )
+                end = tiling->num_codes;
+            j = batch->num_points;
+            n = l2g_read_records(config, state, pos, end - pos, batch, where);
+
+            /* Keep just the points of this run */
+            for ( i = j; i < batch->num_points; i++ )
+            {
+                t = l2g_tiling_tile_of(tiling, where[i]);
+                if ( t < first || t >= last )
+                    continue;
+                batch->points[j] = batch->points[i];
+                tile[j++] = t - first;
+            }
+            batch->num_points = j;
+            if ( batch->num_points == BATCH_POINTS )
+                l2g_tiling_insert(config, state, batch, tile, trees);
+            if ( n < (int)(end - pos) )
+                break;
+            pos = end;
+        }
+        l2g_tiling_insert(config, state, batch, tile, trees);
+
+        /* The sample can guess low, size the next runs on what this one took */
+        if ( config->memory && total )
+        {
+            double bytes_per_point = (double)(l2g_memory_used() - base) / total;
+            if ( bytes_per_point > tiling->bytes_per_point )
+            {
+                tiling->bytes_per_point = bytes_per_point;
+                if ( config->memory / bytes_per_point < tiling->tile_points )
+                    tiling->tile_points = config->memory / bytes_per_point;
+            }
+        }
+
+        for ( t = first; t < last; t++ )
+        {
+            GhtTreePtr tree = trees[t - first];
+            if ( ! tree )
+                continue;
+            l2g_tile_hash(&tiling->tiles[t], hash);
+            ght_tree_compact_attributes(tree);
+            if ( err == GHT_OK )
+                err = l2g_save_tree(config, state, tree, hash);
+            ght_tree_free(tree);
+            trees[t - first] = NULL;
+        }
+    }
+
+    free(trees);
+    free(batch);
+    return err;
+}
+
+/*
+* Out-of-core build. Every point is hashed and encoded into a fixed width
+* record: the hash, padded with nulls so records sort with memcmp, then
+* the record number, big endian so duplicates keep their file order,
+* then the packed values of the other dimensions. Runs of maxpoints
+* records, or as many as fit in the memory budget, are sorted and
+* spilled to temporary files, and a k-way merge of the runs feeds a
+* stream writer, which writes the tree out bottom-up without ever
+* holding it all.
+*/
+#define SORT_MERGE_WAYS 64  /* runs merged at once, each keeps a file open */
+
+typedef struct
+{
+    int hash_len;         /* hash characters in a record */
+    size_t key_size;      /* hash and record number */
+    size_t record_size;
+    size_t value_sizes[NUM_LAS_ATTRIBUTES + 1];  /* Z, then the attributes */
+    unsigned char *records;
+    size_t num_records;
+    size_t max_records;   /* records sorted in memory at a time */
+    FILE **runs;
+    int num_runs;
+    int max_runs;
+    uint64_t num_points;
+    GhtHash first[GHT_MAX_HASH_LENGTH + 1];  /* lowest and highest hash, the tree is named after */
+    GhtHash last[GHT_MAX_HASH_LENGTH + 1];   /* what they have in common */
+} Las2GhtSort;
+
+/* qsort has no argument to carry it */
+static size_t l2g_sort_key_size = 0;
+
+static int
+l2g_record_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, l2g_sort_key_size);
+}
+
+static size_t
+l2g_type_size(GhtType type)
+{
+    switch ( type )
+    {
+        case GHT_INT8:
+        case GHT_UINT8:
+            return 1;
+        case GHT_INT16:
+        case GHT_UINT16:
+            return 2;
+        case GHT_INT32:
+        case GHT_UINT32:
+        case GHT_FLOAT:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+static GhtErr
+l2g_sort_init(const Las2GhtConfig *config, const Las2GhtState *state, Las2GhtSort *sort)
+{
+    GhtDimensionPtr dim;
+    GhtType type;
+    int i;
+
+    memset(sort, 0, sizeof(Las2GhtSort));
+    sort->hash_len = config->resolution;
+    sort->key_size = sort->hash_len + sizeof(uint64_t);
+    sort->record_size = sort->key_size;
+    for ( i = 0; i <= config->num_attrs; i++ )
+    {
+        GHT_TRY(ght_schema_get_dimension_by_index(state->schema, 2+i, &dim));
+        GHT_TRY(ght_dimension_get_type(dim, &type));
+        sort->value_sizes[i] = l2g_type_size(type);
+        sort->record_size += sort->value_sizes[i];
+    }
+    l2g_sort_key_size = sort->key_size;
+
+    sort->max_records = config->maxpoints;
+    if ( config->memory && config->memory / sort->record_size < sort->max_records )
+        sort->max_records = config->memory / sort->record_size;
+    if ( sort->max_records < BATCH_POINTS )
+        sort->max_records = BATCH_POINTS;
+    sort->records = malloc(sort->max_records * sort->record_size);
+    if ( ! sort->records )
+    {
+        ght_error("unable to allocate %zu records to sort", sort->max_records);
+        return GHT_ERROR;
+    }
+    ght_info("sorting %zu records of %zu bytes at a time", sort->max_records, sort->record_size);
+    return GHT_OK;
+}
+
+static void
+l2g_sort_free(Las2GhtSort *sort)
+{
+    int i;
+    for ( i = 0; i < sort->num_runs; i++ )
+        fclose(sort->runs[i]);
+    free(sort->runs);
+    free(sort->records);
+}
+
+static GhtErr
+l2g_sort_encode(const Las2GhtConfig *config, const Las2GhtState *state, const Las2GhtSort *sort,
+                const GhtHash *hash, uint64_t record, const Las2GhtPoint *pt, unsigned char *rec)
+{
+    GhtDimensionPtr dim;
+    unsigned char *p;
+    int i;
+
+    memset(rec, 0, sort->hash_len);
+    memcpy(rec, hash, strlen(hash));
+    for ( i = 0; i < 8; i++ )
+        rec[sort->hash_len + i] = (record >> (56 - 8 * i)) & 0xFF;
+
+    p = rec + sort->key_size;
+    for ( i = 0; i <= config->num_attrs; i++ )
+    {
+        GHT_TRY(ght_schema_get_dimension_by_index(state->schema, 2+i, &dim));
+        GHT_TRY(ght_attribute_encode_values(dim, i ? &pt->attrs[i-1] : &pt->z, 1, p));
+        p += sort->value_sizes[i];
+    }
+    return GHT_OK;
+}
+
+/* Turn a record back into a node, attributes in the order l2g_build_node adds them */
+static GhtErr
+l2g_sort_decode(const Las2GhtConfig *config, const Las2GhtState *state, const Las2GhtSort *sort,
+                const unsigned char *rec, GhtNodePtr *node)
+{
+    GhtHash hash[GHT_MAX_HASH_LENGTH + 1];
+    GhtDimensionPtr dim;
+    GhtAttributePtr attribute;
+    const unsigned char *p;
+    double val;
+    int i;
+
+    memcpy(hash, rec, sort->hash_len);
+    hash[sort->hash_len] = '\0';
+    GHT_TRY(ght_node_new_from_hash(hash, node));
+
+    p = rec + sort->key_size;
+    for ( i = 0; i <= config->num_attrs; i++ )
+    {
+        GHT_TRY(ght_schema_get_dimension_by_index(state->schema, 2+i, &dim));
+        GHT_TRY(ght_attribute_decode_values(dim, p, 1, &val));
+        GHT_TRY(ght_attribute_new_from_double(dim, val, &attribute));
+        GHT_TRY(ght_node_add_attribute(*node, attribute));
+        p += sort->value_sizes[i];
+    }
+    return GHT_OK;
+}
+
+/** Sort the records in memory and write them out as a run */
+static GhtErr
+l2g_sort_spill(Las2GhtSort *sort)
+{
+    FILE *run;
+
+    if ( ! sort->num_records )
+        return GHT_OK;
+
+    qsort(sort->records, sort->num_records, sort->record_size, l2g_record_cmp);
+    run = tmpfile();
+    if ( ! run )
+    {
+        ght_error("unable to open a temporary file for a sorted run");
+        return GHT_ERROR;
+    }
+    if ( fwrite(sort->records, sort->record_size, sort->num_records, run) != sort->num_records )
+    {
+        ght_error("unable to write a sorted run of %zu records", sort->num_records);
+        fclose(run);
+        return GHT_ERROR;
+    }
+    if ( sort->num_runs == sort->max_runs )
+    {
+        sort->max_runs = sort->max_runs ? 2 * sort->max_runs : SORT_MERGE_WAYS;
+        sort->runs = realloc(sort->runs, sort->max_runs * sizeof(FILE*));
+    }
+    sort->runs[sort->num_runs++] = run;
+    ght_info("wrote sorted run %d of %zu points", sort->num_runs, sort->num_records);
+    sort->num_records = 0;
+    return GHT_OK;
+}
+
+/** Hash and encode every point in the file, spilling runs as the buffer fills */
+static GhtErr
+l2g_sort_read(const Las2GhtConfig *config, Las2GhtState *state, Las2GhtSort *sort)
+{
+    Las2GhtPointBatch *batch;
+    uint64_t where[BATCH_POINTS];
+    uint64_t pos = 0;
+    GhtNodePtr node;
+    GhtHash *hash;
+    GhtErr err = GHT_OK;
+    int i, n, more = 1;
+
+    batch = malloc(sizeof(Las2GhtPointBatch));
+    while ( more && err == GHT_OK )
+    {
+        batch->num_points = 0;
+        n = l2g_read_records(config, state, pos, BATCH_POINTS, batch, where);
+        pos += n;
+        if ( n < BATCH_POINTS )
+            more = 0;
+
+        l2g_batch_reproject(state, batch);
+        for ( i = 0; i < batch->num_points && err == GHT_OK; i++ )
+        {
+            if ( batch->coords[i].x == HUGE_VAL )
+                continue;
+            if ( l2g_node_from_coordinate(config, state, &batch->coords[i], batch->points[i].z, &node) != GHT_OK )
+                continue;
+            if ( sort->num_records == sort->max_records )
+                err = l2g_sort_spill(sort);
+            ght_node_get_hash(node, &hash);
+            if ( err == GHT_OK )
+                err = l2g_sort_encode(config, state, sort, hash, where[i], &batch->points[i],
+                                      sort->records + sort->num_records * sort->record_size);
+            if ( err == GHT_OK )
+            {
+                if ( ! sort->num_points || strcmp(hash, sort->first) < 0 )
+                    strcpy(sort->first, hash);
+                if ( ! sort->num_points || strcmp(hash, sort->last) > 0 )
+                    strcpy(sort->last, hash);
+                sort->num_records++;
+                sort->num_points++;
+            }
+            ght_node_free(node);
+        }
+        if ( n && (pos - n) / (LOG_NUM_POINTS * 10) != pos / (LOG_NUM_POINTS * 10) )
+            ght_info("hashed point %llu...", (unsigned long long)pos);
+    }
+    free(batch);
+    return err;
+}
+
+/* Restore the heap below position k, ordered by each run's current record */
+static void
+l2g_sort_heap_down(int *heap, int n, int k, const unsigned char *recs, size_t record_size)
+{
+    for ( ;; )
+    {
+        int c = 2 * k + 1, tmp;
+        if ( c >= n )
+            return;
+        if ( c + 1 < n && l2g_record_cmp(recs + heap[c+1] * record_size, recs + heap[c] * record_size) < 0 )
+            c++;
+        if ( l2g_record_cmp(recs + heap[c] * record_size, recs + heap[k] * record_size) >= 0 )
+            return;
+        tmp = heap[c];
+        heap[c] = heap[k];
+        heap[k] = tmp;
+        k = c;
+    }
+}
+
+/** Merge runs in record order into another run, or else into the stream */
+static GhtErr
+l2g_sort_merge(const Las2GhtConfig *config, const Las2GhtState *state, const Las2GhtSort *sort,
+               FILE **runs, int num_runs, FILE *out, GhtStreamWriterPtr stream)
+{
+    const size_t rs = sort->record_size;
+    unsigned char *recs = malloc(num_runs * rs);
+    int *heap = malloc(num_runs * sizeof(int));
+    GhtNodePtr node;
+    GhtErr err = GHT_OK;
+    int i, n = 0;
+
+    for ( i = 0; i < num_runs; i++ )
+    {
+        rewind(runs[i]);
+        if ( fread(recs + i * rs, rs, 1, runs[i]) == 1 )
+            heap[n++] = i;
+    }
+    for ( i = n / 2 - 1; i >= 0; i-- )
+        l2g_sort_heap_down(heap, n, i, recs, rs);
+
+    while ( n && err == GHT_OK )
+    {
+        const unsigned char *rec = recs + heap[0] * rs;
+        if ( out )
+        {
+            if ( fwrite(rec, rs, 1, out) != 1 )
+            {
+                ght_error("unable to write a merged run");
+                err = GHT_ERROR;
+            }
+        }
+        else
+        {
+            err = l2g_sort_decode(config, state, sort, rec, &node);
+            if ( err == GHT_OK )
+                err = ght_stream_writer_add_node(stream, node);
+        }
+        /* Next record of the same run, or the run is done */
+        if ( fread(recs + heap[0] * rs, rs, 1, runs[heap[0]]) != 1 )
+            heap[0] = heap[--n];
+        l2g_sort_heap_down(heap, n, 0, recs, rs);
+    }
+
+    free(heap);
+    free(recs);
+    return err;
+}
+
+/** Stream every sorted point into one tree file */
+static GhtErr
+l2g_sort_write(const Las2GhtConfig *config, Las2GhtState *state, Las2GhtSort *sort)
+{
+    char ght_filename[STRSIZE];
+    char xml_filename[STRSIZE];
+    GhtHash hash[GHT_MAX_HASH_LENGTH + 1];
+    GhtConfig ght_config;
+    GhtWriterPtr writer;
+    GhtStreamWriterPtr stream;
+    GhtNodePtr node;
+    GhtErr err = GHT_OK;
+    size_t i;
+    int len = 0;
+
+    if ( ! sort->num_points )
+    {
+        ght_error("no points to write");
+        return GHT_ERROR;
+    }
+
+    /* Fewer runs than we can merge at once, each merge adds one */
+    if ( sort->num_runs )
+        GHT_TRY(l2g_sort_spill(sort));
+    while ( sort->num_runs > SORT_MERGE_WAYS )
+    {
+        FILE *out = tmpfile();
+        if ( ! out )
+        {
+            ght_error("unable to open a temporary file for a merged run");
+            return GHT_ERROR;
+        }
+        ght_info("merging %d of %d sorted runs", SORT_MERGE_WAYS, sort->num_runs);
+        GHT_TRY(l2g_sort_merge(config, state, sort, sort->runs, SORT_MERGE_WAYS, out, NULL));
+        for ( i = 0; i < SORT_MERGE_WAYS; i++ )
+            fclose(sort->runs[i]);
+        sort->num_runs -= SORT_MERGE_WAYS;
+        memmove(sort->runs, sort->runs + SORT_MERGE_WAYS, sort->num_runs * sizeof(FILE*));
+        sort->runs[sort->num_runs++] = out;
+    }
+
+    /* The root of the tree is what the lowest and highest hash share */
+    while ( sort->first[len] && sort->first[len] == sort->last[len] )
+        len++;
+    memcpy(hash, sort->first, len);
+    hash[len] = '\0';
+
+    l2g_ght_file(config, state, hash, ght_filename);
+    l2g_xml_file(config, state, hash, xml_filename);
+    ght_info("writing %llu points to file %s", (unsigned long long)sort->num_points, ght_filename);
+
+    if ( ! l2g_writable(ght_filename) )
+    {
+        ght_error("unable to write to '%s'", ght_filename);
+        return GHT_ERROR;
+    }
+    if ( ! l2g_writable(xml_filename) )
+    {
+        ght_error("unable to write to '%s'", xml_filename);
+        return GHT_ERROR;
+    }
+
+    GHT_TRY(ght_schema_to_xml_file(state->schema, xml_filename));
+    /* Grouped, so nodes go out as soon as they close and memory stays flat */
+    GHT_TRY(ght_config_init(&ght_config));
+    ght_config.format = GHT_FORMAT_GROUPED;
+    if ( state->frame )
+        ght_config.frame = *(state->frame);
+    if ( state->vertical )
+        ght_config.vertical = *(state->vertical);
+    GHT_TRY(ght_writer_new_file(ght_filename, &writer));
+    err = ght_stream_writer_new(state->schema, &ght_config, 1, writer, &stream);
+    if ( err != GHT_OK )
+    {
+        ght_writer_free(writer);
+        return err;
+    }
+
+    if ( sort->num_runs )
+    {
+        err = l2g_sort_merge(config, state, sort, sort->runs, sort->num_runs, NULL, stream);
+    }
+    else
+    {
+        /* Everything fit in one run, no need for the disk */
+        qsort(sort->records, sort->num_records, sort->record_size, l2g_record_cmp);
+        for ( i = 0; i < sort->num_records && err == GHT_OK; i++ )
+        {
+            err = l2g_sort_decode(config, state, sort, sort->records + i * sort->record_size, &node);
+            if ( err == GHT_OK )
+                err = ght_stream_writer_add_node(stream, node);
+        }
+    }
+    if ( err == GHT_OK )
+        err = ght_stream_writer_finish(stream);
+
+    ght_stream_writer_free(stream);
+    ght_writer_free(writer);
+    state->fileno++;
+    return err;
+}
+
 static projPJ
 l2g_proj_from_string(const char *str1)
 {
@@ -652,7 +2317,6 @@ l2g_read_projection(const Las2GhtConfig *config, Las2GhtState *state)
 {
     LASSRSH lassrs;    
     char *proj4_input = NULL;
-    static char *proj4_output = "+proj=longlat +datum=WGS84 +no_defs";
 
     assert(state);
     assert(state->header);
@@ -676,11 +2340,19 @@ l2g_read_projection(const Las2GhtConfig *config, Las2GhtState *state)
     ght_info("Got LAS file projection information '%s'", proj4_input);
 
     state->pj_input = l2g_proj_from_string(proj4_input);
+    state->proj4_input = strdup(proj4_input);
     LASString_Free(proj4_input);
+
+    /* proj4 stays set up, but only gets used for what we can't do ourselves */
+    state->lasproj = las_proj_new(state->proj4_input);
+    if ( state->lasproj )
+        ght_info("Using native %s inverse projection", las_proj_name(state->lasproj));
+    else
+        ght_info("Reprojecting through proj4");
     
     if ( ! state->pj_input )
     {
-        ght_error("%s: unable to parse proj4 string '%s'", __func__, proj4_input);
+        ght_error("%s: unable to parse proj4 string '%s'", __func__, state->proj4_input);
         return GHT_ERROR;
     }
 
@@ -729,10 +2401,10 @@ main (int argc, char **argv)
         return 1;
     }
      
-    /* Hard code resolution for now */
-    config.resolution = GHT_MAX_HASH_LENGTH;
-    config.maxpoints = 2000000;
-    
+    /* Count what libght allocates, before it allocates anything */
+    if ( config.memory )
+        ght_set_memory_handlers(l2g_counting_alloc, l2g_counting_realloc, l2g_counting_free);
+
     /* Temporary info printout */
     l2g_config_printf(&config);
 
@@ -769,6 +2441,14 @@ main (int argc, char **argv)
         return 1;
     }
     
+    /* Read the points straight from the file where we can, libLAS still reads the SRS */
+    if ( ! config.liblas )
+        state.lasfile = las_file_open(config.lasfile);
+    if ( state.lasfile )
+        ght_info("Reading point format %d records directly", las_file_point_format(state.lasfile));
+    else
+        ght_info("Reading points through libLAS");
+
     /* Schema is needed to create nodes/attributes */
     if ( GHT_OK != l2g_build_schema(&config, &state) )
     {
@@ -785,29 +2465,123 @@ main (int argc, char **argv)
         return 1;
     }
 
+    /* Square cells at odd hash lengths, like longitude/latitude, with the extent in the middle */
+    if ( config.frame == 2 )
+    {
+        GhtArea *a = &(config.frame_area);
+        double w = LASHeader_GetMaxX(state.header) - LASHeader_GetMinX(state.header);
+        double h = LASHeader_GetMaxY(state.header) - LASHeader_GetMinY(state.header);
+        double side = w > 2 * h ? w : 2 * h;
+        if ( side <= 0 )
+            side = 2.0;
+        a->x.min = (LASHeader_GetMinX(state.header) + LASHeader_GetMaxX(state.header) - side) / 2;
+        a->x.max = a->x.min + side;
+        a->y.min = (LASHeader_GetMinY(state.header) + LASHeader_GetMaxY(state.header) - side / 2) / 2;
+        a->y.max = a->y.min + side / 2;
+    }
+    if ( config.frame )
+    {
+        state.frame = &(config.frame_area);
+        ght_info("Hashing LAS coordinates within (%g %g, %g %g)", state.frame->x.min, state.frame->y.min,
+                 state.frame->x.max, state.frame->y.max);
+    }
+
+    if ( config.vertical == 2 )
+    {
+        config.vertical_range.min = LASHeader_GetMinZ(state.header);
+        config.vertical_range.max = LASHeader_GetMaxZ(state.header);
+        /* Flat files still need a range to split */
+        if ( ! (config.vertical_range.min < config.vertical_range.max) )
+            config.vertical_range.max = config.vertical_range.min + 1;
+    }
+    if ( config.vertical )
+    {
+        state.vertical = &(config.vertical_range);
+        ght_info("Hashing Z within (%g %g)", state.vertical->min, state.vertical->max);
+    }
+
+    /* Threaded builds split the tree up below the prefix of the extent */
+    if ( config.threads > 1 && GHT_OK != l2g_read_prefix(&config, &state) )
+    {
+        l2g_state_free(&state);
+        ght_error("%s: unable to hash the LAS extent", EXENAME);
+        return 1;
+    }
+
     // char *xmlstr;
     // size_t xmlsize;
     // ght_schema_to_xml_str(schema, &xmlstr, &xmlsize);
     // printf("\n%s\n\n", xmlstr);
 
 
+    /* Tiles replace the chunks below with one file per cell */
+    if ( config.tiles )
+    {
+        Las2GhtTiling tiling;
+        GhtErr err = l2g_tiling_read(&config, &state, &tiling);
+        if ( err == GHT_OK )
+            err = l2g_tiling_plan(&config, &tiling);
+        if ( err == GHT_OK )
+            err = l2g_tiling_build(&config, &state, &tiling);
+        l2g_tiling_free(&tiling);
+        l2g_state_free(&state);
+        l2g_config_free(&config);
+        if ( err != GHT_OK )
+        {
+            ght_error("%s: unable to write tiles", EXENAME);
+            return 1;
+        }
+        ght_info("conversion complete");
+        return 0;
+    }
+
+    /* Out of core, everything goes into one tree */
+    if ( config.outofcore )
+    {
+        Las2GhtSort sort;
+        GhtErr err = l2g_sort_init(&config, &state, &sort);
+        if ( err == GHT_OK )
+            err = l2g_sort_read(&config, &state, &sort);
+        if ( err == GHT_OK )
+            err = l2g_sort_write(&config, &state, &sort);
+        l2g_sort_free(&sort);
+        l2g_state_free(&state);
+        l2g_config_free(&config);
+        if ( err != GHT_OK )
+        {
+            ght_error("%s: unable to write the sorted tree", EXENAME);
+            return 1;
+        }
+        ght_info("conversion complete");
+        return 0;
+    }
+
     /* Break the problem into chunks. We might get a really really */
     /* big LAS file, and we don't want to blow out memory, so we need to */
-    /* do this a few million records at a file */
+    /* do this a few million records at a file. A chunk can come out */
+    /* empty when none of its records pass the filters, so keep going */
+    /* until the records run out, not the points */
     do 
     {
+        uint64_t start = state.next_record;
         num_points = l2g_build_tree(&config, &state, &tree);
         if ( num_points )
         {
             GhtErr err;
             ght_tree_compact_attributes(tree);
-            err = l2g_save_tree(&config, &state, tree);
+            err = l2g_save_tree(&config, &state, tree, NULL);
             ght_tree_free(tree);
             if ( err != GHT_OK )
                 return 1;
         }
+        else
+        {
+            ght_tree_free(tree);
+        }
+        if ( state.next_record == start )
+            break;
     } 
-    while ( num_points > 0 );
+    while ( l2g_records_left(&state) );
 
     l2g_state_free(&state);
     l2g_config_free(&config);
@@ -0,0 +1,294 @@
+/***********************************************************************
+* lasfile.c
+*
+*   read LAS point records straight out of a memory mapped file
+*
+*   Only the point records are decoded here, the SRS and the rest of
+*   the VLRs are still read through libLAS.
+*
+***********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ght_config.h"
+#include "lasfile.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Public header block offsets */
+#define LAS_VERSION_MAJOR 24
+#define LAS_VERSION_MINOR 25
+#define LAS_HEADER_SIZE 94
+#define LAS_POINT_OFFSET 96
+#define LAS_POINT_FORMAT 104
+#define LAS_RECORD_LENGTH 105
+#define LAS_LEGACY_NUM_POINTS 107
+#define LAS_SCALE 131
+#define LAS_OFFSET 155
+#define LAS_NUM_POINTS 247      /* 1.4 only */
+#define LAS_HEADER_SIZE_10 227
+#define LAS_HEADER_SIZE_14 375
+
+#define LAS_NUM_FORMATS 11
+
+/* Smallest record for each point format, and where RGB sits in it */
+static const size_t las_record_sizes[LAS_NUM_FORMATS] = { 20, 28, 26, 34, 57, 63, 30, 36, 38, 59, 67 };
+static const size_t las_rgb_offsets[LAS_NUM_FORMATS] = { 0, 0, 20, 28, 0, 28, 0, 30, 30, 0, 30 };
+
+struct LasFile_t
+{
+    const unsigned char *map;
+    size_t map_size;
+    const unsigned char *points;  /* first point record */
+    uint64_t num_points;
+    size_t record_length;
+    int format;
+    double scale[3];
+    double offset[3];
+};
+
+/* LAS is little endian whatever the host is */
+static uint16_t
+las_u16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t
+las_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+las_u64(const unsigned char *p)
+{
+    return (uint64_t)las_u32(p) | ((uint64_t)las_u32(p + 4) << 32);
+}
+
+static double
+las_f64(const unsigned char *p)
+{
+    uint64_t u = las_u64(p);
+    double d;
+    memcpy(&d, &u, sizeof(double));
+    return d;
+}
+
+LasFile *
+las_file_open(const char *filename)
+{
+#ifdef HAVE_SYS_MMAN_H
+    LasFile *file;
+    struct stat st;
+    const unsigned char *map;
+    uint64_t point_offset, num_points;
+    size_t header_size, record_length;
+    int fd, format, i;
+
+    fd = open(filename, O_RDONLY);
+    if ( fd < 0 )
+        return NULL;
+    if ( fstat(fd, &st) || (size_t)st.st_size < LAS_HEADER_SIZE_10 )
+    {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED )
+        return NULL;
+
+    header_size = las_u16(map + LAS_HEADER_SIZE);
+    point_offset = las_u32(map + LAS_POINT_OFFSET);
+    format = map[LAS_POINT_FORMAT];
+    record_length = las_u16(map + LAS_RECORD_LENGTH);
+    num_points = las_u32(map + LAS_LEGACY_NUM_POINTS);
+    if ( map[LAS_VERSION_MINOR] >= 4 && header_size >= LAS_HEADER_SIZE_14 && (size_t)st.st_size >= LAS_HEADER_SIZE_14 )
+        num_points = las_u64(map + LAS_NUM_POINTS);
+
+    /* Compressed (LAZ) formats have the high bits set, leave those to libLAS */
+    if ( memcmp(map, "LASF", 4) || map[LAS_VERSION_MAJOR] != 1 || map[LAS_VERSION_MINOR] > 4 ||
+         format >= LAS_NUM_FORMATS || record_length < las_record_sizes[format] ||
+         point_offset > (uint64_t)st.st_size ||
+         num_points > ((uint64_t)st.st_size - point_offset) / record_length )
+    {
+        munmap((void*)map, st.st_size);
+        return NULL;
+    }
+
+    file = calloc(1, sizeof(LasFile));
+    file->map = map;
+    file->map_size = st.st_size;
+    file->points = map + point_offset;
+    file->num_points = num_points;
+    file->record_length = record_length;
+    file->format = format;
+    for ( i = 0; i < 3; i++ )
+    {
+        file->scale[i] = las_f64(map + LAS_SCALE + 8 * i);
+        file->offset[i] = las_f64(map + LAS_OFFSET + 8 * i);
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+#endif
+    return file;
+#else
+    return NULL;
+#endif
+}
+
+void
+las_file_close(LasFile *file)
+{
+    if ( ! file )
+        return;
+#ifdef HAVE_SYS_MMAN_H
+    munmap((void*)file->map, file->map_size);
+#endif
+    free(file);
+}
+
+uint64_t
+las_file_num_points(const LasFile *file)
+{
+    return file->num_points;
+}
+
+int
+las_file_point_format(const LasFile *file)
+{
+    return file->format;
+}
+
+/* Clip the range to the file, and find its first record */
+static size_t
+las_file_range(const LasFile *file, uint64_t start, size_t count, const unsigned char **p)
+{
+    if ( start >= file->num_points )
+        return 0;
+    if ( count > file->num_points - start )
+        count = file->num_points - start;
+    *p = file->points + start * file->record_length;
+    return count;
+}
+
+size_t
+las_file_read_xyz(const LasFile *file, uint64_t start, size_t count,
+                  double *x, double *y, double *z, size_t stride)
+{
+    const unsigned char *p = NULL;
+    const size_t len = file->record_length;
+    size_t i, n = las_file_range(file, start, count, &p);
+
+    for ( i = 0; i < n; i++, p += len )
+    {
+        x[i * stride] = (int32_t)las_u32(p) * file->scale[0] + file->offset[0];
+        y[i * stride] = (int32_t)las_u32(p + 4) * file->scale[1] + file->offset[1];
+        z[i * stride] = (int32_t)las_u32(p + 8) * file->scale[2] + file->offset[2];
+    }
+    return n;
+}
+
+/* One loop for each field, so the switch stays out of the way */
+#define LAS_DECODE(expr) \
+    for ( i = 0; i < n; i++, p += len ) \
+        out[i * stride] = (expr);
+
+size_t
+las_file_read_attribute(const LasFile *file, uint64_t start, size_t count,
+                        LasAttribute attr, double *out, size_t stride)
+{
+    const unsigned char *p = NULL;
+    const size_t len = file->record_length;
+    size_t i, n = las_file_range(file, start, count, &p);
+    size_t rgb = las_rgb_offsets[file->format];
+    int legacy = file->format < 6;
+
+    switch ( attr )
+    {
+        case LL_INTENSITY:
+            LAS_DECODE(las_u16(p + 12));
+            break;
+        case LL_RETURN_NUMBER:
+            if ( legacy ) { LAS_DECODE(p[14] & 0x07); }
+            else { LAS_DECODE(p[14] & 0x0F); }
+            break;
+        case LL_NUMBER_OF_RETURNS:
+            if ( legacy ) { LAS_DECODE((p[14] >> 3) & 0x07); }
+            else { LAS_DECODE(p[14] >> 4); }
+            break;
+        case LL_SCAN_DIRECTION:
+            if ( legacy ) { LAS_DECODE((p[14] >> 6) & 0x01); }
+            else { LAS_DECODE((p[15] >> 6) & 0x01); }
+            break;
+        case LL_FLIGHT_LINE_EDGE:
+            if ( legacy ) { LAS_DECODE(p[14] >> 7); }
+            else { LAS_DECODE(p[15] >> 7); }
+            break;
+        case LL_CLASSIFICATION:
+            /* Older formats share the byte with the flags */
+            if ( legacy ) { LAS_DECODE(p[15] & 0x1F); }
+            else { LAS_DECODE(p[16]); }
+            break;
+        case LL_SCAN_ANGLE:
+            /* Newer formats count in 0.006 degree steps, whole degrees before */
+            if ( legacy ) { LAS_DECODE((signed char)p[16]); }
+            else { LAS_DECODE(floor((int16_t)las_u16(p + 18) * 0.006 + 0.5)); }
+            break;
+        case LL_POINT_SOURCE_ID:
+            if ( legacy ) { LAS_DECODE(las_u16(p + 18)); }
+            else { LAS_DECODE(las_u16(p + 20)); }
+            break;
+        case LL_RED:
+        case LL_GREEN:
+        case LL_BLUE:
+            if ( rgb )
+            {
+                rgb += 2 * (attr - LL_RED);
+                LAS_DECODE(las_u16(p + rgb));
+            }
+            else
+            {
+                LAS_DECODE(0);
+            }
+            break;
+    }
+    return n;
+}
+
+#undef LAS_DECODE
+
+size_t
+las_file_read_valid(const LasFile *file, uint64_t start, size_t count,
+                    unsigned char *valid)
+{
+    const unsigned char *p = NULL;
+    const size_t len = file->record_length;
+    size_t i, n = las_file_range(file, start, count, &p);
+
+    /* libLAS only checks the scan angle, the flags can't go out of range */
+    if ( file->format < 6 )
+    {
+        for ( i = 0; i < n; i++, p += len )
+        {
+            int angle = (signed char)p[16];
+            valid[i] = angle >= -90 && angle <= 90;
+        }
+    }
+    else
+    {
+        for ( i = 0; i < n; i++, p += len )
+        {
+            int angle = (int16_t)las_u16(p + 18);
+            valid[i] = angle >= -15000 && angle <= 15000;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,63 @@
+/***********************************************************************
+* lasfile.h
+*
+*   read LAS point records straight out of a memory mapped file
+*
+***********************************************************************/
+
+#ifndef _LASFILE_H
+#define _LASFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Point record fields, besides X/Y/Z */
+typedef enum
+{
+    LL_INTENSITY = 0,
+    LL_RETURN_NUMBER,
+    LL_NUMBER_OF_RETURNS,
+    LL_SCAN_DIRECTION,
+    LL_FLIGHT_LINE_EDGE,
+    LL_CLASSIFICATION,
+    LL_SCAN_ANGLE,
+    LL_POINT_SOURCE_ID,
+    LL_RED,
+    LL_GREEN,
+    LL_BLUE
+} LasAttribute;
+
+typedef struct LasFile_t LasFile;
+
+/** Map a LAS 1.0 to 1.4 file, NULL if it can't be mapped or its point format is not one we decode */
+LasFile * las_file_open(const char *filename);
+
+/** Unmap and free */
+void las_file_close(LasFile *file);
+
+/** Number of point records */
+uint64_t las_file_num_points(const LasFile *file);
+
+/** Point data record format, 0 to 10 */
+int las_file_point_format(const LasFile *file);
+
+/*
+* The readers decode records [start, start+count) into every stride'th
+* double of the output and return how many they decoded, fewer than
+* count at the end of the file. They only read the mapping, so threads
+* can share a file as long as each reads its own range.
+*/
+
+/** X, Y and Z, with the header scale and offset applied */
+size_t las_file_read_xyz(const LasFile *file, uint64_t start, size_t count,
+                         double *x, double *y, double *z, size_t stride);
+
+/** One field, zero for colours the format does not carry */
+size_t las_file_read_attribute(const LasFile *file, uint64_t start, size_t count,
+                               LasAttribute attr, double *out, size_t stride);
+
+/** 1 for the records libLAS calls valid, 0 for the others */
+size_t las_file_read_valid(const LasFile *file, uint64_t start, size_t count,
+                           unsigned char *valid);
+
+#endif /* _LASFILE_H */
@@ -0,0 +1,650 @@
+/***********************************************************************
+* lasproj.c
+*
+*   native inverse projections to WGS84 longitude/latitude
+*
+*   Transverse Mercator (and so UTM) uses the sixth order Krüger series
+*   of Karney (2011), good to a few nanometres within a UTM zone and
+*   to well under a millimetre a few thousand kilometres out. Lambert
+*   conformal conic is closed form. Both share the series that takes
+*   conformal latitude back to geodetic, so nothing iterates and each
+*   point costs a fixed handful of trig calls.
+*
+*   Anything needing a datum shift, or any parameter we don't know,
+*   is left to proj4.
+*
+***********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "lasproj.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define LAS_PROJ_ORDER 6
+#define LAS_PROJ_VALUE_SIZE 128
+#define LAS_PROJ_EPS 1e-10
+/* Furthest easting proj4's etmerc inverts, in rectifying radii, about 86 degrees out on the equator */
+#define LAS_PROJ_TMERC_MAX_ETA 2.623395162778
+
+typedef enum
+{
+    LAS_PROJ_LONGLAT,
+    LAS_PROJ_TMERC,
+    LAS_PROJ_LCC
+} LasProjType;
+
+struct LasProj_t
+{
+    LasProjType type;
+    double e;           /* eccentricity */
+    double lon0;        /* central meridian, radians */
+    double x0, y0;      /* false easting and northing, always metres */
+    double to_meter;
+    double scale;       /* metres for one unit of the projection's own plane */
+    double xi0;         /* TM, northing of the origin */
+    double n;           /* LCC, cone constant */
+    double c, rho0;     /* LCC, radius scale and radius of the origin */
+    double beta[LAS_PROJ_ORDER];   /* TM, Gauss-Krüger to conformal plane */
+    double delta[LAS_PROJ_ORDER];  /* conformal to geodetic latitude */
+};
+
+typedef struct
+{
+    const char *name;
+    double a;
+    double rf;  /* inverse flattening, 0 to use b */
+    double b;
+} LasEllipsoid;
+
+static const LasEllipsoid las_ellipsoids[] =
+{
+    { "WGS84", 6378137.0, 298.257223563, 0 },
+    { "GRS80", 6378137.0, 298.257222101, 0 },
+    { "clrk66", 6378206.4, 0, 6356583.8 },
+    { "intl", 6378388.0, 297.0, 0 },
+    { "bessel", 6377397.155, 299.1528128, 0 },
+    { "airy", 6377563.396, 0, 6356256.910 },
+    { NULL, 0, 0, 0 }
+};
+
+typedef struct
+{
+    const char *name;
+    double to_meter;
+} LasUnit;
+
+static const LasUnit las_units[] =
+{
+    { "m", 1.0 },
+    { "km", 1000.0 },
+    { "ft", 0.3048 },
+    { "us-ft", 1200.0 / 3937.0 },
+    { NULL, 0 }
+};
+
+/* Everything we understand, any other parameter sends the definition to proj4 */
+static const char *las_proj_keys[] =
+{
+    "proj", "zone", "south", "ellps", "datum", "a", "b", "rf", "f", "R", "towgs84",
+    "lat_0", "lon_0", "lat_1", "lat_2", "k_0", "k", "x_0", "y_0",
+    "units", "to_meter", "no_defs", "wktext", "type",
+    NULL
+};
+
+/*
+* Series coefficients, row j is the coefficient of sin(2(j+1)x) and
+* column k the factor of n^(k+1), n being the third flattening.
+*/
+static const double las_proj_alpha[LAS_PROJ_ORDER][LAS_PROJ_ORDER] =
+{
+    { 1/2.0, -2/3.0, 5/16.0, 41/180.0, -127/288.0, 7891/37800.0 },
+    { 0, 13/48.0, -3/5.0, 557/1440.0, 281/630.0, -1983433/1935360.0 },
+    { 0, 0, 61/240.0, -103/140.0, 15061/26880.0, 167603/181440.0 },
+    { 0, 0, 0, 49561/161280.0, -179/168.0, 6601661/7257600.0 },
+    { 0, 0, 0, 0, 34729/80640.0, -3418889/1995840.0 },
+    { 0, 0, 0, 0, 0, 212378941/319334400.0 }
+};
+
+static const double las_proj_beta[LAS_PROJ_ORDER][LAS_PROJ_ORDER] =
+{
+    { 1/2.0, -2/3.0, 37/96.0, -1/360.0, -81/512.0, 96199/604800.0 },
+    { 0, 1/48.0, 1/15.0, -437/1440.0, 46/105.0, -1118711/3870720.0 },
+    { 0, 0, 17/480.0, -37/840.0, -209/4480.0, 5569/90720.0 },
+    { 0, 0, 0, 4397/161280.0, -11/504.0, -830251/7257600.0 },
+    { 0, 0, 0, 0, 4583/161280.0, -108847/3991680.0 },
+    { 0, 0, 0, 0, 0, 20648693/638668800.0 }
+};
+
+static const double las_proj_delta[LAS_PROJ_ORDER][LAS_PROJ_ORDER] =
+{
+    { 2.0, -2/3.0, -2.0, 116/45.0, 26/45.0, -2854/675.0 },
+    { 0, 7/3.0, -8/5.0, -227/45.0, 2704/315.0, 2323/945.0 },
+    { 0, 0, 56/15.0, -136/35.0, -1262/105.0, 73814/2835.0 },
+    { 0, 0, 0, 4279/630.0, -332/35.0, -399572/14175.0 },
+    { 0, 0, 0, 0, 4174/315.0, -144838/6237.0 },
+    { 0, 0, 0, 0, 0, 601676/22275.0 }
+};
+
+static void
+las_proj_coefficients(const double table[LAS_PROJ_ORDER][LAS_PROJ_ORDER], double n, double *out)
+{
+    int j, k;
+    for ( j = 0; j < LAS_PROJ_ORDER; j++ )
+    {
+        double c = 0;
+        for ( k = LAS_PROJ_ORDER - 1; k >= 0; k-- )
+            c = (c + table[j][k]) * n;
+        out[j] = c;
+    }
+}
+
+/* Sum of coef[j] sin(2(j+1)x), by Clenshaw so it takes one sin and one cos */
+static double
+las_proj_sin_series(const double *coef, double x)
+{
+    double s = sin(2 * x), c2 = 2 * cos(2 * x);
+    double b1 = 0, b2 = 0;
+    int j;
+    for ( j = LAS_PROJ_ORDER - 1; j >= 0; j-- )
+    {
+        double b0 = coef[j] + c2 * b1 - b2;
+        b2 = b1;
+        b1 = b0;
+    }
+    return b1 * s;
+}
+
+/* Walk the +key=value tokens, returns where the next one starts or NULL at the end */
+static const char *
+las_proj_token(const char *p, const char **key, size_t *key_len, const char **value, size_t *value_len)
+{
+    size_t len;
+
+    p += strspn(p, " \t\r\n");
+    if ( ! *p )
+        return NULL;
+    len = strcspn(p, " \t\r\n");
+    *key = p;
+    *key_len = strcspn(p, "= \t\r\n");
+    *value = p + *key_len;
+    *value_len = len - *key_len;
+    if ( *value_len )
+    {
+        (*value)++;
+        (*value_len)--;
+    }
+    return p + len;
+}
+
+/* Copy out the value of +key, "" for a bare flag, 0 if the key is missing */
+static int
+las_proj_param(const char *proj4, const char *key, char *value)
+{
+    const char *k, *v;
+    size_t klen, vlen;
+
+    while ( (proj4 = las_proj_token(proj4, &k, &klen, &v, &vlen)) )
+    {
+        if ( *k != '+' || klen - 1 != strlen(key) || strncmp(k + 1, key, klen - 1) )
+            continue;
+        if ( vlen >= LAS_PROJ_VALUE_SIZE )
+            vlen = LAS_PROJ_VALUE_SIZE - 1;
+        memcpy(value, v, vlen);
+        value[vlen] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+/* Read a numeric parameter if it is there, 0 if it is there but not a plain number */
+static int
+las_proj_number(const char *proj4, const char *key, double *d)
+{
+    char value[LAS_PROJ_VALUE_SIZE];
+    char *end;
+
+    if ( ! las_proj_param(proj4, key, value) )
+        return 1;
+    *d = strtod(value, &end);
+    return end != value && *end == '\0';
+}
+
+/* Angles in degrees, proj4 also takes DMS but LAS SRSs never give it that */
+static int
+las_proj_angle(const char *proj4, const char *key, double *radians)
+{
+    double d = *radians * 180.0 / M_PI;
+    if ( ! las_proj_number(proj4, key, &d) )
+        return 0;
+    *radians = d * M_PI / 180.0;
+    return 1;
+}
+
+/* Only plain parameters we know */
+static int
+las_proj_known(const char *proj4)
+{
+    const char *k, *v;
+    size_t klen, vlen;
+    int i;
+
+    while ( (proj4 = las_proj_token(proj4, &k, &klen, &v, &vlen)) )
+    {
+        if ( *k != '+' )
+            return 0;
+        for ( i = 0; las_proj_keys[i]; i++ )
+        {
+            if ( klen - 1 == strlen(las_proj_keys[i]) && ! strncmp(k + 1, las_proj_keys[i], klen - 1) )
+                break;
+        }
+        if ( ! las_proj_keys[i] )
+            return 0;
+    }
+    return 1;
+}
+
+/* Semi-major axis and eccentricity squared, the way proj4 picks them */
+static int
+las_proj_ellipsoid(const char *proj4, double *a, double *es)
+{
+    char value[LAS_PROJ_VALUE_SIZE];
+    const char *name = NULL;
+    double rf = 0, f = 0, b = 0;
+    int i;
+
+    *a = 0;
+    *es = 0;
+    if ( las_proj_param(proj4, "R", value) )
+        return las_proj_number(proj4, "R", a) && *a > 0;
+
+    if ( las_proj_param(proj4, "ellps", value) ||
+         (las_proj_param(proj4, "datum", value) && ! strcmp(value, "WGS84")) )
+    {
+        name = value;
+    }
+    else if ( las_proj_param(proj4, "datum", value) && ! strcmp(value, "NAD83") )
+    {
+        name = "GRS80";
+    }
+    if ( name )
+    {
+        for ( i = 0; las_ellipsoids[i].name; i++ )
+        {
+            if ( ! strcmp(name, las_ellipsoids[i].name) )
+                break;
+        }
+        if ( ! las_ellipsoids[i].name )
+            return 0;
+        *a = las_ellipsoids[i].a;
+        rf = las_ellipsoids[i].rf;
+        b = las_ellipsoids[i].b;
+    }
+
+    /* Explicit sizes win over the named ellipsoid */
+    if ( ! las_proj_number(proj4, "a", a) )
+        return 0;
+    if ( las_proj_param(proj4, "rf", value) || las_proj_param(proj4, "f", value) || las_proj_param(proj4, "b", value) )
+    {
+        rf = f = b = 0;
+        if ( ! las_proj_number(proj4, "rf", &rf) || ! las_proj_number(proj4, "f", &f) || ! las_proj_number(proj4, "b", &b) )
+            return 0;
+    }
+    if ( *a <= 0 )
+        return 0;
+
+    if ( rf > 0 )
+        f = 1 / rf;
+    else if ( b > 0 )
+        f = (*a - b) / *a;
+    if ( f < 0 || f >= 1 )
+        return 0;
+    *es = f * (2 - f);
+    return 1;
+}
+
+/*
+* proj4 only shifts datums when the definition names one, and leaves
+* WGS84 and NAD83 alone, so anything else needs proj4 itself.
+*/
+static int
+las_proj_datum(const char *proj4, double a, double es)
+{
+    char value[LAS_PROJ_VALUE_SIZE];
+    const double wgs84_es = 0.0066943799901413165;
+    int shift = 0;
+
+    if ( las_proj_param(proj4, "datum", value) )
+    {
+        if ( strcmp(value, "WGS84") && strcmp(value, "NAD83") )
+            return 0;
+        shift = 1;
+    }
+    if ( las_proj_param(proj4, "towgs84", value) )
+    {
+        char *p = value, *end;
+        while ( *p )
+        {
+            if ( strtod(p, &end) != 0 || end == p )
+                return 0;
+            p = (*end == ',') ? end + 1 : end;
+        }
+        shift = 1;
+    }
+
+    /* Same tolerance proj4 uses to skip the geocentric round trip */
+    return ! shift || (a == 6378137.0 && fabs(es - wgs84_es) < 0.000000000050);
+}
+
+static double
+las_proj_tsfn(double phi, double e)
+{
+    double s = e * sin(phi);
+    return tan(0.5 * (M_PI / 2 - phi)) / pow((1 - s) / (1 + s), 0.5 * e);
+}
+
+static double
+las_proj_msfn(double phi, double es)
+{
+    double s = sin(phi);
+    return cos(phi) / sqrt(1 - es * s * s);
+}
+
+static int
+las_proj_tmerc_init(LasProj *proj, const char *proj4, double a, double es, int utm)
+{
+    char value[LAS_PROJ_VALUE_SIZE];
+    double alpha[LAS_PROJ_ORDER];
+    double f = 1 - sqrt(1 - es);
+    double n = f / (2 - f), n2 = n * n;
+    double lat0 = 0, k0 = 1, chi0;
+
+    if ( utm )
+    {
+        double zone = 0;
+        if ( ! las_proj_param(proj4, "zone", value) || ! las_proj_number(proj4, "zone", &zone) ||
+             zone < 1 || zone > 60 || zone != floor(zone) )
+            return 0;
+        proj->lon0 = ((zone - 1) * 6 - 180 + 3) * M_PI / 180.0;
+        proj->x0 = 500000;
+        proj->y0 = las_proj_param(proj4, "south", value) ? 10000000 : 0;
+        k0 = 0.9996;
+    }
+    else
+    {
+        if ( ! las_proj_angle(proj4, "lat_0", &lat0) || ! las_proj_angle(proj4, "lon_0", &(proj->lon0)) )
+            return 0;
+        if ( las_proj_param(proj4, "k_0", value) )
+        {
+            if ( ! las_proj_number(proj4, "k_0", &k0) )
+                return 0;
+        }
+        else if ( ! las_proj_number(proj4, "k", &k0) )
+        {
+            return 0;
+        }
+    }
+
+    /* Rectifying radius, scaled */
+    proj->scale = k0 * a / (1 + n) * (1 + n2 / 4 + n2 * n2 / 64 + n2 * n2 * n2 / 256);
+    las_proj_coefficients(las_proj_alpha, n, alpha);
+    las_proj_coefficients(las_proj_beta, n, proj->beta);
+    las_proj_coefficients(las_proj_delta, n, proj->delta);
+
+    /* On the central meridian the conformal plane northing is just the conformal latitude */
+    chi0 = asin(tanh(atanh(sin(lat0)) - proj->e * atanh(proj->e * sin(lat0))));
+    proj->xi0 = chi0 + las_proj_sin_series(alpha, chi0);
+    return 1;
+}
+
+static int
+las_proj_lcc_init(LasProj *proj, const char *proj4, double a, double es)
+{
+    char value[LAS_PROJ_VALUE_SIZE];
+    double f = 1 - sqrt(1 - es);
+    double lat0 = 0, lat1 = 0, lat2, k0 = 1, m1, t1;
+
+    if ( ! las_proj_param(proj4, "lat_1", value) || ! las_proj_angle(proj4, "lat_1", &lat1) )
+        return 0;
+    lat2 = lat1;
+    if ( las_proj_param(proj4, "lat_2", value) )
+    {
+        if ( ! las_proj_angle(proj4, "lat_2", &lat2) || ! las_proj_angle(proj4, "lat_0", &lat0) )
+            return 0;
+    }
+    else
+    {
+        /* One standard parallel is also the origin, unless told otherwise */
+        lat0 = lat1;
+        if ( ! las_proj_angle(proj4, "lat_0", &lat0) )
+            return 0;
+    }
+    if ( ! las_proj_angle(proj4, "lon_0", &(proj->lon0)) )
+        return 0;
+    if ( las_proj_param(proj4, "k_0", value) )
+    {
+        if ( ! las_proj_number(proj4, "k_0", &k0) )
+            return 0;
+    }
+    else if ( ! las_proj_number(proj4, "k", &k0) )
+    {
+        return 0;
+    }
+    if ( fabs(lat1 + lat2) < LAS_PROJ_EPS )
+        return 0;
+
+    m1 = las_proj_msfn(lat1, es);
+    t1 = las_proj_tsfn(lat1, proj->e);
+    if ( fabs(lat1 - lat2) > LAS_PROJ_EPS )
+        proj->n = log(m1 / las_proj_msfn(lat2, es)) / log(t1 / las_proj_tsfn(lat2, proj->e));
+    else
+        proj->n = sin(lat1);
+    proj->c = m1 * pow(t1, -proj->n) / proj->n;
+    if ( fabs(fabs(lat0) - M_PI / 2) < LAS_PROJ_EPS )
+        proj->rho0 = 0;
+    else
+        proj->rho0 = proj->c * pow(las_proj_tsfn(lat0, proj->e), proj->n);
+    proj->scale = k0 * a;
+    las_proj_coefficients(las_proj_delta, f / (2 - f), proj->delta);
+    return 1;
+}
+
+LasProj *
+las_proj_new(const char *proj4)
+{
+    char name[LAS_PROJ_VALUE_SIZE];
+    char value[LAS_PROJ_VALUE_SIZE];
+    LasProj *proj;
+    double a, es;
+    int ok = 0;
+
+    if ( ! proj4 || ! las_proj_known(proj4) || ! las_proj_param(proj4, "proj", name) )
+        return NULL;
+    if ( ! las_proj_ellipsoid(proj4, &a, &es) || ! las_proj_datum(proj4, a, es) )
+        return NULL;
+
+    proj = calloc(1, sizeof(LasProj));
+    proj->e = sqrt(es);
+    proj->to_meter = 1;
+    if ( ! las_proj_number(proj4, "x_0", &(proj->x0)) || ! las_proj_number(proj4, "y_0", &(proj->y0)) )
+        goto done;
+
+    /* to_meter wins over units, as in proj4 */
+    if ( las_proj_param(proj4, "units", value) )
+    {
+        int i;
+        for ( i = 0; las_units[i].name; i++ )
+        {
+            if ( ! strcmp(value, las_units[i].name) )
+                break;
+        }
+        if ( ! las_units[i].name )
+            goto done;
+        proj->to_meter = las_units[i].to_meter;
+    }
+    if ( ! las_proj_number(proj4, "to_meter", &(proj->to_meter)) || proj->to_meter <= 0 )
+        goto done;
+
+    if ( ! strcmp(name, "longlat") || ! strcmp(name, "latlong") ||
+         ! strcmp(name, "lonlat") || ! strcmp(name, "latlon") )
+    {
+        proj->type = LAS_PROJ_LONGLAT;
+        ok = 1;
+    }
+    else if ( ! strcmp(name, "tmerc") || ! strcmp(name, "etmerc") || ! strcmp(name, "utm") )
+    {
+        proj->type = LAS_PROJ_TMERC;
+        ok = las_proj_tmerc_init(proj, proj4, a, es, ! strcmp(name, "utm"));
+    }
+    else if ( ! strcmp(name, "lcc") )
+    {
+        proj->type = LAS_PROJ_LCC;
+        ok = las_proj_lcc_init(proj, proj4, a, es);
+    }
+
+done:
+    if ( ! ok )
+    {
+        free(proj);
+        return NULL;
+    }
+    return proj;
+}
+
+void
+las_proj_free(LasProj *proj)
+{
+    free(proj);
+}
+
+const char *
+las_proj_name(const LasProj *proj)
+{
+    switch ( proj->type )
+    {
+        case LAS_PROJ_LONGLAT:
+            return "longlat";
+        case LAS_PROJ_TMERC:
+            return "tmerc";
+        case LAS_PROJ_LCC:
+            return "lcc";
+    }
+    return "unknown";
+}
+
+static double
+las_proj_adjlon(double lon)
+{
+    if ( lon > M_PI )
+        lon -= 2 * M_PI;
+    else if ( lon < -M_PI )
+        lon += 2 * M_PI;
+    return lon;
+}
+
+static void
+las_proj_tmerc_inverse(const LasProj *proj, double *x, double *y, size_t count, size_t stride)
+{
+    const double *beta = proj->beta;
+    size_t i;
+
+    for ( i = 0; i < count; i++, x += stride, y += stride )
+    {
+        double xi = (*y * proj->to_meter - proj->y0) / proj->scale + proj->xi0;
+        double eta = (*x * proj->to_meter - proj->x0) / proj->scale;
+        double s = sin(2 * xi), c = cos(2 * xi);
+        double ex = exp(2 * eta), sh = 0.5 * (ex - 1 / ex), ch = 0.5 * (ex + 1 / ex);
+        /* Clenshaw over the complex angle 2(xi + i eta), cos of it is (cr + i ci) */
+        double cr = 2 * c * ch, ci = -2 * s * sh;
+        double b1r = 0, b1i = 0, b2r = 0, b2i = 0;
+        double xip, etap, chi;
+        int j;
+
+        /* Past a pole, or too far off the central meridian, the series gives plausible nonsense */
+        if ( ! (fabs(xi) <= M_PI / 2 && fabs(eta) <= LAS_PROJ_TMERC_MAX_ETA) )
+        {
+            *x = *y = HUGE_VAL;
+            continue;
+        }
+
+        for ( j = LAS_PROJ_ORDER - 1; j >= 0; j-- )
+        {
+            double b0r = beta[j] + cr * b1r - ci * b1i - b2r;
+            double b0i = cr * b1i + ci * b1r - b2i;
+            b2r = b1r;
+            b2i = b1i;
+            b1r = b0r;
+            b1i = b0i;
+        }
+        /* times sin of the complex angle, (s ch + i c sh) */
+        xip = xi - (b1r * s * ch - b1i * c * sh);
+        etap = eta - (b1r * c * sh + b1i * s * ch);
+
+        ex = exp(etap);
+        sh = 0.5 * (ex - 1 / ex);
+        ch = 0.5 * (ex + 1 / ex);
+        chi = asin(sin(xip) / ch);
+        *x = las_proj_adjlon(proj->lon0 + atan2(sh, cos(xip))) * 180.0 / M_PI;
+        *y = (chi + las_proj_sin_series(proj->delta, chi)) * 180.0 / M_PI;
+    }
+}
+
+static void
+las_proj_lcc_inverse(const LasProj *proj, double *x, double *y, size_t count, size_t stride)
+{
+    size_t i;
+
+    for ( i = 0; i < count; i++, x += stride, y += stride )
+    {
+        double px = (*x * proj->to_meter - proj->x0) / proj->scale;
+        double py = proj->rho0 - (*y * proj->to_meter - proj->y0) / proj->scale;
+        double rho = hypot(px, py);
+        double lon, lat;
+
+        if ( rho != 0 )
+        {
+            double chi;
+            if ( proj->n < 0 )
+            {
+                rho = -rho;
+                px = -px;
+                py = -py;
+            }
+            lon = atan2(px, py) / proj->n;
+            /* The unrolled cone leaves a wedge no longitude maps to */
+            if ( ! (fabs(lon) <= M_PI) )
+            {
+                *x = *y = HUGE_VAL;
+                continue;
+            }
+            chi = M_PI / 2 - 2 * atan(pow(rho / proj->c, 1 / proj->n));
+            lat = chi + las_proj_sin_series(proj->delta, chi);
+        }
+        else
+        {
+            lat = proj->n > 0 ? M_PI / 2 : -M_PI / 2;
+            lon = 0;
+        }
+        *x = las_proj_adjlon(proj->lon0 + lon) * 180.0 / M_PI;
+        *y = lat * 180.0 / M_PI;
+    }
+}
+
+void
+las_proj_inverse(const LasProj *proj, double *x, double *y, size_t count, size_t stride)
+{
+    switch ( proj->type )
+    {
+        case LAS_PROJ_LONGLAT:
+            break;
+        case LAS_PROJ_TMERC:
+            las_proj_tmerc_inverse(proj, x, y, count, stride);
+            break;
+        case LAS_PROJ_LCC:
+            las_proj_lcc_inverse(proj, x, y, count, stride);
+            break;
+    }
+}
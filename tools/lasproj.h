@@ -0,0 +1,33 @@
+/***********************************************************************
+* lasproj.h
+*
+*   native inverse projections to WGS84 longitude/latitude for the
+*   coordinate systems most LiDAR comes in
+*
+***********************************************************************/
+
+#ifndef _LASPROJ_H
+#define _LASPROJ_H
+
+#include <stddef.h>
+
+typedef struct LasProj_t LasProj;
+
+/** Set up the inverse of a proj4 definition, NULL unless it is one we handle without a datum shift */
+LasProj * las_proj_new(const char *proj4);
+
+/** Free */
+void las_proj_free(LasProj *proj);
+
+/** Short name of the projection, for reporting */
+const char * las_proj_name(const LasProj *proj);
+
+/**
+* Turn count projected coordinates, every stride'th double of x and y,
+* into degrees of longitude and latitude in place. Points outside the
+* projection's valid area come back as HUGE_VAL. Only reads the
+* projection, so threads can share one.
+*/
+void las_proj_inverse(const LasProj *proj, double *x, double *y, size_t count, size_t stride);
+
+#endif /* _LASPROJ_H */